@@ -0,0 +1,79 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Throughput of `HashingReader`, inline and on a dedicated thread.
+//!
+//! Run with `cargo bench --bench hash_stream`: criterion reports GiB/s for
+//! every read chunk size, so regressions in the hashing path are visible.
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use embuer::hash_stream::{HashingReader, DEFAULT_HASH_QUEUE_DEPTH};
+use tokio::io::AsyncReadExt;
+
+/// Size of the stream hashed on every iteration
+const STREAM_SIZE: usize = 64 * 1024 * 1024;
+
+/// Read chunk sizes, from small network reads to large decoder buffers
+const CHUNK_SIZES: [usize; 4] = [4 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024];
+
+async fn hash_stream(mut reader: HashingReader<&[u8]>, chunk_size: usize) -> Option<String> {
+    let mut buffer = vec![0u8; chunk_size];
+    while reader.read(&mut buffer).await.unwrap() > 0 {}
+    reader.get_hash().await
+}
+
+fn bench_hashing_reader(c: &mut Criterion) {
+    let runtime = tokio::runtime::Builder::new_multi_thread()
+        .enable_all()
+        .build()
+        .unwrap();
+    let data: Vec<u8> = (0..STREAM_SIZE).map(|i| (i % 251) as u8).collect();
+
+    let mut group = c.benchmark_group("hashing_reader");
+    group.throughput(Throughput::Bytes(STREAM_SIZE as u64));
+    group.sample_size(10);
+
+    for chunk_size in CHUNK_SIZES {
+        group.bench_with_input(
+            BenchmarkId::new("inline", chunk_size),
+            &chunk_size,
+            |b, &chunk_size| {
+                b.iter(|| runtime.block_on(hash_stream(HashingReader::new(&data[..]), chunk_size)))
+            },
+        );
+
+        group.bench_with_input(
+            BenchmarkId::new("thread", chunk_size),
+            &chunk_size,
+            |b, &chunk_size| {
+                b.iter(|| {
+                    runtime.block_on(hash_stream(
+                        HashingReader::with_hash_thread(&data[..], DEFAULT_HASH_QUEUE_DEPTH),
+                        chunk_size,
+                    ))
+                })
+            },
+        );
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, bench_hashing_reader);
+criterion_main!(benches);
@@ -0,0 +1,499 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! End-to-end time of the update pipeline, from an update package to a deployment.
+//!
+//! Run as root with `cargo bench --bench update_pipeline`: a synthetic
+//! deployment is written to a loopback btrfs image, packaged by
+//! `embuer-genupdate` and installed with `core::install_update` in every
+//! pipeline configuration. `mkfs.btrfs`, `btrfs`, `xz` (or `zstd`), `tar`
+//! and `openssl` must be available. The sparse image is created in `TMPDIR`.
+//!
+//! The report is a JSON document on stdout (or in `EMBUER_BENCH_OUTPUT`):
+//! host details, parameters, then the total time and the metrics of every
+//! pipeline stage for each install, so that runs on different hardware or
+//! revisions can be compared by scripts.
+//!
+//! Parameters are read from the environment:
+//! - `EMBUER_BENCH_SIZE_MIB`: size of the synthetic deployment (default 256)
+//! - `EMBUER_BENCH_COMPRESSIBILITY`: percentage of every block filled with
+//!   text instead of random bytes (default 50)
+//! - `EMBUER_BENCH_COMPRESSION`: `xz` or `zstd` (default `xz`)
+//! - `EMBUER_BENCH_ITERATIONS`: installs per configuration (default 3)
+
+use embuer::btrfs::Btrfs;
+use embuer::chunked_hash::ChunkVerifyingReader;
+use embuer::core::{install_update, verify_chunk_table, Decompressor, ReceiveOptions, Receiver};
+use embuer::metrics::{MeteredReader, PipelineMetrics, PipelineStage, PIPELINE_STAGES};
+use embuer::splice::DEFAULT_PIPE_BUFFER_SIZE;
+use rand::{rngs::StdRng, Rng, SeedableRng};
+use rsa::pkcs1::EncodeRsaPrivateKey;
+use rsa::{RsaPrivateKey, RsaPublicKey};
+use serde_json::{json, Value};
+use std::collections::HashMap;
+use std::io::{BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::process::Command;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tokio::io::AsyncReadExt;
+use tokio_stream::StreamExt;
+use tokio_tar::Archive;
+
+/// Size of the files of the synthetic deployment
+const FILE_SIZE: u64 = 8 * 1024 * 1024;
+
+/// Unit of the compressibility of the synthetic data
+const BLOCK_SIZE: usize = 64 * 1024;
+
+/// Seed of the random data, so that every run installs the same deployment
+const SEED: u64 = 0x656d_6275_6572;
+
+/// Subvolume ID of the top level of a btrfs filesystem
+const FS_TREE_OBJECTID: u64 = 5;
+
+/// Parameters of the synthetic update
+struct Params {
+    size: u64,
+    compressibility: usize,
+    compression: String,
+    iterations: usize,
+}
+
+impl Params {
+    fn from_env() -> Self {
+        let compression = std::env::var("EMBUER_BENCH_COMPRESSION").unwrap_or("xz".into());
+        assert!(
+            compression == "xz" || compression == "zstd",
+            "EMBUER_BENCH_COMPRESSION must be xz or zstd"
+        );
+
+        Self {
+            size: env_or("EMBUER_BENCH_SIZE_MIB", 256u64) * 1024 * 1024,
+            compressibility: env_or("EMBUER_BENCH_COMPRESSIBILITY", 50usize).min(100),
+            compression,
+            iterations: env_or("EMBUER_BENCH_ITERATIONS", 3usize).max(1),
+        }
+    }
+}
+
+fn env_or<T: std::str::FromStr>(name: &str, default: T) -> T {
+    match std::env::var(name) {
+        Ok(value) => value
+            .parse()
+            .unwrap_or_else(|_| panic!("Invalid value of {name}: {value}")),
+        Err(_) => default,
+    }
+}
+
+/// A pipeline configuration installed on every iteration
+struct Configuration {
+    name: &'static str,
+    external_xz: bool,
+    receiver: Receiver,
+    hash_thread: bool,
+}
+
+const CONFIGURATIONS: [Configuration; 4] = [
+    Configuration {
+        name: "native",
+        external_xz: false,
+        receiver: Receiver::Native,
+        hash_thread: false,
+    },
+    Configuration {
+        name: "hash_thread",
+        external_xz: false,
+        receiver: Receiver::Native,
+        hash_thread: true,
+    },
+    Configuration {
+        name: "btrfs_cli",
+        external_xz: false,
+        receiver: Receiver::BtrfsCli,
+        hash_thread: false,
+    },
+    Configuration {
+        name: "external_xz",
+        external_xz: true,
+        receiver: Receiver::BtrfsCli,
+        hash_thread: false,
+    },
+];
+
+fn run(cmd: &mut Command) {
+    let output = cmd
+        .output()
+        .unwrap_or_else(|e| panic!("Failed to run {cmd:?}: {e}"));
+    assert!(
+        output.status.success(),
+        "{cmd:?} failed: {}",
+        String::from_utf8_lossy(&output.stderr).trim()
+    );
+}
+
+/// A btrfs filesystem on a sparse image, unmounted on drop
+struct LoopbackBtrfs {
+    mountpoint: PathBuf,
+    _dir: tempfile::TempDir,
+}
+
+impl LoopbackBtrfs {
+    fn new(size: u64) -> Self {
+        let dir = tempfile::tempdir().unwrap();
+
+        let image = dir.path().join("btrfs.img");
+        std::fs::File::create(&image)
+            .unwrap()
+            .set_len(size)
+            .unwrap();
+        run(Command::new("mkfs.btrfs").arg("-q").arg(&image));
+
+        let mountpoint = dir.path().join("mnt");
+        std::fs::create_dir(&mountpoint).unwrap();
+        run(Command::new("mount")
+            .arg("-o")
+            .arg("loop")
+            .arg(&image)
+            .arg(&mountpoint));
+
+        Self {
+            mountpoint,
+            _dir: dir,
+        }
+    }
+}
+
+impl Drop for LoopbackBtrfs {
+    fn drop(&mut self) {
+        let _ = Command::new("umount").arg(&self.mountpoint).status();
+    }
+}
+
+/// Fill `root` with a deployment of `params.size` bytes: a manifest and
+/// files whose blocks start with text and end with random bytes
+fn write_deployment(root: &Path, params: &Params) {
+    let manifest_dir = root.join("usr/share/embuer");
+    std::fs::create_dir_all(&manifest_dir).unwrap();
+    std::fs::write(
+        manifest_dir.join("manifest.json"),
+        r#"{"version":"bench","readonly":true,"install_script":null,"uninstall_script":null}"#,
+    )
+    .unwrap();
+
+    let data_dir = root.join("usr/lib/embuer-bench");
+    std::fs::create_dir_all(&data_dir).unwrap();
+
+    let text: Vec<u8> = b"embuer synthetic deployment "
+        .iter()
+        .cycle()
+        .take(BLOCK_SIZE)
+        .copied()
+        .collect();
+    let compressible = BLOCK_SIZE * params.compressibility / 100;
+    let mut rng = StdRng::seed_from_u64(SEED);
+    let mut block = vec![0u8; BLOCK_SIZE];
+
+    let mut remaining = params.size;
+    let mut index = 0;
+    while remaining > 0 {
+        let file_size = remaining.min(FILE_SIZE) as usize;
+        let file = std::fs::File::create(data_dir.join(format!("{index:05}.bin"))).unwrap();
+        let mut file = BufWriter::new(file);
+        for start in (0..file_size).step_by(BLOCK_SIZE) {
+            block[..compressible].copy_from_slice(&text[..compressible]);
+            rng.fill(&mut block[compressible..]);
+            file.write_all(&block[..BLOCK_SIZE.min(file_size - start)])
+                .unwrap();
+        }
+        file.flush().unwrap();
+
+        remaining -= file_size as u64;
+        index += 1;
+    }
+}
+
+/// Send a synthetic deployment and package it with `embuer-genupdate`
+///
+/// Returns the path of the update package and the key it is signed with.
+fn build_package(fs: &LoopbackBtrfs, params: &Params) -> (PathBuf, RsaPublicKey) {
+    let source = fs.mountpoint.join("source");
+    run(Command::new("btrfs")
+        .args(["subvolume", "create"])
+        .arg(&source));
+    write_deployment(&source, params);
+    run(Command::new("btrfs")
+        .args(["property", "set", "-ts"])
+        .arg(&source)
+        .args(["ro", "true"]));
+
+    let package_dir = fs.mountpoint.join("package");
+    std::fs::create_dir(&package_dir).unwrap();
+    std::fs::write(package_dir.join("CHANGELOG"), "Version bench\n").unwrap();
+
+    let send_stream = package_dir.join("update.btrfs");
+    run(Command::new("btrfs")
+        .args(["send", "-q", "-f"])
+        .arg(&send_stream)
+        .arg(&source));
+
+    let private_key = RsaPrivateKey::new(&mut rand::thread_rng(), 2048).unwrap();
+    let private_key_pem = package_dir.join("private.pem");
+    private_key
+        .write_pkcs1_pem_file(&private_key_pem, Default::default())
+        .unwrap();
+
+    let mut genupdate = Command::new(env!("CARGO_BIN_EXE_embuer-genupdate"));
+    genupdate
+        .arg("-p")
+        .arg(&package_dir)
+        .arg("-k")
+        .arg(&private_key_pem)
+        .arg("--clean");
+    match params.compression.as_str() {
+        "zstd" => {
+            genupdate.arg("--zstd");
+        }
+        _ => run(Command::new("xz").arg("-T0").arg(&send_stream)),
+    }
+    run(&mut genupdate);
+
+    (
+        package_dir.join("update_package.tar"),
+        RsaPublicKey::from(&private_key),
+    )
+}
+
+/// Install the update package like the service does: the payload entry is
+/// streamed through chunk verification into `core::install_update`
+///
+/// Returns the name of the installed deployment.
+async fn install_package(
+    btrfs: &Arc<Btrfs>,
+    pubkey: &RsaPublicKey,
+    package: &Path,
+    rootfs: &Path,
+    configuration: &Configuration,
+    metrics: &Arc<PipelineMetrics>,
+) -> String {
+    let file = tokio::fs::File::open(package).await.unwrap();
+    let mut archive = Archive::new(file);
+    let mut entries = archive.entries().unwrap();
+    let mut signed_files: HashMap<String, Vec<u8>> = HashMap::new();
+
+    while let Some(entry) = entries.next().await {
+        let mut entry = entry.unwrap();
+        let name = entry.path().unwrap().display().to_string();
+
+        let Some(decompressor) = Decompressor::for_entry(&name, configuration.external_xz, None)
+        else {
+            let mut content = Vec::new();
+            entry.read_to_end(&mut content).await.unwrap();
+            signed_files.insert(name, content);
+            continue;
+        };
+
+        let table = verify_chunk_table(
+            pubkey,
+            &signed_files["update.chunks"],
+            &signed_files["update.chunks.signature"],
+        )
+        .unwrap();
+        let signature = signed_files["update.signature"].clone();
+
+        let stream = MeteredReader::new(
+            ChunkVerifyingReader::new(entry, table),
+            metrics.clone(),
+            PipelineStage::Source,
+        );
+        let options = ReceiveOptions {
+            decompressor,
+            receiver: configuration.receiver,
+            hash_thread: configuration.hash_thread,
+            progress: None,
+            metrics: Some(metrics.clone()),
+            pipe_size: DEFAULT_PIPE_BUFFER_SIZE,
+            priority: Default::default(),
+        };
+
+        return install_update(
+            Some((pubkey, &signature)),
+            rootfs.to_path_buf(),
+            rootfs.join("deployments"),
+            String::new(),
+            btrfs,
+            options,
+            stream,
+        )
+        .await
+        .unwrap()
+        .expect("No deployment installed");
+    }
+
+    panic!("No payload found in {}", package.display());
+}
+
+/// First value of `key` in a `key: value` file of procfs
+fn proc_field(path: &str, key: &str) -> Option<String> {
+    std::fs::read_to_string(path)
+        .ok()?
+        .lines()
+        .find_map(|line| {
+            let (name, value) = line.split_once(':')?;
+            (name.trim() == key).then(|| value.trim().to_string())
+        })
+}
+
+fn host_info() -> Value {
+    json!({
+        "arch": std::env::consts::ARCH,
+        "cpu": proc_field("/proc/cpuinfo", "model name"),
+        "cpus": std::thread::available_parallelism().map(|n| n.get()).ok(),
+        "memory": proc_field("/proc/meminfo", "MemTotal"),
+        "kernel": std::fs::read_to_string("/proc/sys/kernel/osrelease")
+            .ok()
+            .map(|release| release.trim().to_string()),
+    })
+}
+
+fn install_report(elapsed: Duration, metrics: &PipelineMetrics, size: u64) -> Value {
+    let stages: serde_json::Map<String, Value> = PIPELINE_STAGES
+        .iter()
+        .zip(metrics.snapshot())
+        .map(|(stage, snapshot)| {
+            (
+                stage.as_str().to_string(),
+                json!({
+                    "bytes": snapshot.bytes,
+                    "wall_us": snapshot.wall_us,
+                    "read_blocked_us": snapshot.read_blocked_us,
+                    "write_blocked_us": snapshot.write_blocked_us,
+                    "peak_buffer": snapshot.peak_buffer,
+                }),
+            )
+        })
+        .collect();
+
+    json!({
+        "total_us": elapsed.as_micros() as u64,
+        "mib_per_s": size as f64 / (1024.0 * 1024.0) / elapsed.as_secs_f64(),
+        "stages": stages,
+    })
+}
+
+fn main() {
+    if unsafe { libc::geteuid() } != 0 {
+        eprintln!("update_pipeline: skipped, mounting a loopback btrfs needs root");
+        return;
+    }
+
+    let params = Params::from_env();
+    let runtime = tokio::runtime::Builder::new_multi_thread()
+        .enable_all()
+        .build()
+        .unwrap();
+
+    // Room for the source subvolume, the send stream, the package and one deployment
+    let fs = LoopbackBtrfs::new(params.size * 4 + 1024 * 1024 * 1024);
+    let rootfs = fs.mountpoint.clone();
+    std::fs::create_dir(rootfs.join("deployments")).unwrap();
+
+    eprintln!(
+        "update_pipeline: packaging a {} MiB deployment",
+        params.size / 1024 / 1024
+    );
+    let (package, pubkey) = build_package(&fs, &params);
+    let package_size = std::fs::metadata(&package).unwrap().len();
+
+    let btrfs = Arc::new(Btrfs::new().unwrap());
+    let metrics = Arc::new(PipelineMetrics::default());
+
+    let mut results = Vec::new();
+    for configuration in &CONFIGURATIONS {
+        if configuration.external_xz && params.compression != "xz" {
+            continue;
+        }
+
+        let mut installs = Vec::new();
+        let mut totals = Vec::new();
+        for _ in 0..params.iterations {
+            metrics.reset();
+            let start = Instant::now();
+            let name = runtime.block_on(install_package(
+                &btrfs,
+                &pubkey,
+                &package,
+                &rootfs,
+                configuration,
+                &metrics,
+            ));
+            let elapsed = start.elapsed();
+
+            installs.push(install_report(elapsed, &metrics, params.size));
+            totals.push(elapsed);
+
+            // The deployment was made the default subvolume: restore the top
+            // level before deleting it, and let the deletion reach the disk
+            btrfs
+                .subvolume_set_default(FS_TREE_OBJECTID, &rootfs)
+                .unwrap();
+            btrfs
+                .subvolume_delete(rootfs.join("deployments").join(&name))
+                .unwrap();
+            run(Command::new("btrfs")
+                .args(["filesystem", "sync"])
+                .arg(&rootfs));
+        }
+
+        totals.sort();
+        let median = totals[totals.len() / 2];
+        eprintln!(
+            "update_pipeline: {:<12} median {:>8.2?} ({:.1} MiB/s)",
+            configuration.name,
+            median,
+            params.size as f64 / (1024.0 * 1024.0) / median.as_secs_f64()
+        );
+
+        results.push(json!({
+            "configuration": configuration.name,
+            "median_us": median.as_micros() as u64,
+            "min_us": totals[0].as_micros() as u64,
+            "max_us": totals[totals.len() - 1].as_micros() as u64,
+            "installs": installs,
+        }));
+    }
+
+    let report = json!({
+        "host": host_info(),
+        "parameters": {
+            "size": params.size,
+            "compressibility": params.compressibility,
+            "compression": params.compression,
+            "iterations": params.iterations,
+        },
+        "package_size": package_size,
+        "results": results,
+    });
+
+    let report = serde_json::to_string_pretty(&report).unwrap();
+    match std::env::var("EMBUER_BENCH_OUTPUT") {
+        Ok(path) => std::fs::write(path, report).unwrap(),
+        Err(_) => println!("{report}"),
+    }
+}
@@ -36,12 +36,18 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 /**
  * Opaque handle to the Embuer client
  */
 typedef struct embuer_client_t embuer_client_t;
 
+/**
+ * Opaque handle to an install started with embuer_install_async
+ */
+typedef struct embuer_op_t embuer_op_t;
+
 /**
  * Status callback function type
  * 
@@ -63,6 +69,65 @@ typedef struct embuer_client_t embuer_client_t;
  */
 typedef void (*StatusCallback)(const char* status, const char* details, int progress, void* user_data);
 
+/**
+ * Stages of the update pipeline reported in embuer_progress_t
+ */
+#define EMBUER_STAGE_IDLE           0   /* No update in progress */
+#define EMBUER_STAGE_CHECKING       1   /* Fetching the update archive and its metadata */
+#define EMBUER_STAGE_DOWNLOADING    2   /* Streaming the payload from the network */
+#define EMBUER_STAGE_READING        3   /* Streaming the payload from a local file */
+#define EMBUER_STAGE_DECOMPRESSING  EMBUER_STAGE_READING   /* Former name of EMBUER_STAGE_READING */
+#define EMBUER_STAGE_RECEIVING      4   /* Payload read, the receiver is applying what is left */
+#define EMBUER_STAGE_VERIFYING      5   /* Checking and committing the received deployment */
+
+/**
+ * Byte-accurate progress of the update pipeline
+ */
+typedef struct embuer_progress_t {
+    int stage;              /* One of EMBUER_STAGE_* */
+    uint64_t bytes_done;    /* Bytes of the payload read so far */
+    uint64_t bytes_total;   /* Size of the payload, 0 if unknown */
+    uint64_t rate;          /* Throughput over the last sampling interval, in bytes per second */
+    uint64_t average_rate;  /* Throughput since the payload started streaming, in bytes per second */
+    int64_t eta_seconds;    /* Estimated seconds until the payload is read, -1 if unknown */
+    uint32_t queue_depth;   /* Update requests waiting for the one in progress */
+} embuer_progress_t;
+
+/**
+ * Metrics of one stage of the update pipeline
+ * 
+ * Blocked times are measured at the boundary after each stage, so the read
+ * time of a stage includes the stalls of every stage before it: walking from
+ * the receive stage backwards, the bottleneck is the first stage that spends
+ * little time blocked on reads.
+ */
+typedef struct embuer_stage_metrics_t {
+    uint64_t bytes;             /* Bytes out of the stage (applied, for the receive stage) */
+    uint64_t read_blocked_us;   /* Microseconds waiting for input */
+    uint64_t write_blocked_us;  /* Microseconds waiting for the next stage (applying, for receive) */
+    uint64_t wall_us;           /* Microseconds from the first read to the end of the stage */
+    uint64_t peak_buffer;       /* Peak bytes queued to the next stage, 0 if not measured */
+} embuer_stage_metrics_t;
+
+/**
+ * Metrics of the stages of the last update pipeline
+ */
+typedef struct embuer_metrics_t {
+    embuer_stage_metrics_t source;      /* Archive payload from the network or file */
+    embuer_stage_metrics_t hash;        /* Payload after SHA512 hashing */
+    embuer_stage_metrics_t decompress;  /* Decompressed send stream */
+    embuer_stage_metrics_t receive;     /* Receiver applying the send stream */
+} embuer_metrics_t;
+
+/**
+ * Progress callback function type
+ * 
+ * Parameters:
+ * - progress: Current progress, valid only during the call
+ * - user_data: User-provided data pointer
+ */
+typedef void (*ProgressCallback)(const embuer_progress_t* progress, void* user_data);
+
 /**
  * Error codes
  */
@@ -73,16 +138,83 @@ typedef void (*StatusCallback)(const char* status, const char* details, int prog
 #define EMBUER_ERR_INVALID_STRING   -4   /* Invalid string encoding */
 #define EMBUER_ERR_RUNTIME          -5   /* Runtime error */
 #define EMBUER_ERR_NO_PENDING_UPDATE -6   /* No pending update awaiting confirmation */
+#define EMBUER_ERR_WATCH_ACTIVE     -7   /* A status watch is already active on this client */
+#define EMBUER_ERR_NOT_WATCHING     -8   /* No status watch is active on this client */
+
+/**
+ * Threading models for embuer_client_options_t
+ */
+#define EMBUER_THREADING_SHARED        0   /* Current-thread runtime shared by all clients of the process */
+#define EMBUER_THREADING_MULTI_THREAD  1   /* Multi-threaded runtime owned by the client */
+
+/**
+ * Options for embuer_client_new_with_options
+ */
+typedef struct embuer_client_options_t {
+    int threading;                 /* One of EMBUER_THREADING_* */
+    unsigned int worker_threads;   /* Workers of an EMBUER_THREADING_MULTI_THREAD runtime, 0 for one per core */
+} embuer_client_options_t;
+
+/**
+ * Update status codes reported in embuer_snapshot_t
+ */
+#define EMBUER_STATUS_UNKNOWN               -1   /* Status not recognized by this library */
+#define EMBUER_STATUS_IDLE                   0   /* No update in progress */
+#define EMBUER_STATUS_CHECKING               1   /* Checking for updates */
+#define EMBUER_STATUS_CLEARING               2   /* Clearing old deployments */
+#define EMBUER_STATUS_INSTALLING             3   /* Installing an update */
+#define EMBUER_STATUS_AWAITING_CONFIRMATION  4   /* Update awaiting user confirmation */
+#define EMBUER_STATUS_COMPLETED              5   /* Update completed successfully */
+#define EMBUER_STATUS_FAILED                 6   /* Update failed */
+
+/**
+ * Daemon state filled by embuer_get_snapshot
+ * 
+ * The caller provides the buffers for details and version, and their sizes.
+ * Like snprintf, at most size - 1 bytes are copied, the buffer is always
+ * NUL-terminated when size is not 0, and the *_len field receives the full
+ * length of the string: a value >= size means the string was truncated.
+ * A buffer may be NULL when its size is 0.
+ */
+typedef struct embuer_snapshot_t {
+    int status;            /* One of EMBUER_STATUS_* */
+    int progress;          /* Progress value (0-100, or -1 if N/A) */
+    uint64_t bytes_done;   /* Bytes of the update stream read so far */
+    uint64_t bytes_total;  /* Size of the update stream, 0 if unknown */
+    uint64_t boot_id;      /* Subvolume ID of the running deployment */
+    char* details;         /* Caller buffer receiving the status details */
+    size_t details_size;   /* Size of the details buffer */
+    size_t details_len;    /* Out: full length of the status details */
+    char* version;         /* Caller buffer receiving the pending update version */
+    size_t version_size;   /* Size of the version buffer */
+    size_t version_len;    /* Out: full length of the version, 0 if none is pending */
+} embuer_snapshot_t;
 
 /**
  * Initialize a new Embuer client
  * 
+ * The client runs on the current-thread runtime shared by the process
+ * (EMBUER_THREADING_SHARED): the runtime is created by the first client and
+ * uses a single background thread, however many clients are opened.
+ * 
  * Returns:
  * - Pointer to client on success
  * - NULL on error
  */
 embuer_client_t* embuer_client_new(void);
 
+/**
+ * Initialize a new Embuer client with the given options
+ * 
+ * Parameters:
+ * - options: Client options, or NULL for the defaults of embuer_client_new
+ * 
+ * Returns:
+ * - Pointer to client on success
+ * - NULL on error, or if options->threading is not a known EMBUER_THREADING_* value
+ */
+embuer_client_t* embuer_client_new_with_options(const embuer_client_options_t* options);
+
 /**
  * Free an Embuer client
  * 
@@ -132,6 +264,25 @@ int embuer_get_status(
     int* progress_out
 );
 
+/**
+ * Get the update status, transfer progress and boot deployment at once
+ * 
+ * Everything is fetched with a single D-Bus call and no memory is allocated:
+ * set the buffer pointers and sizes in out before calling.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - out: Snapshot to fill
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - Error code on failure
+ */
+int embuer_get_snapshot(
+    embuer_client_t* client,
+    embuer_snapshot_t* out
+);
+
 /**
  * Install an update from a file
  * 
@@ -176,6 +327,125 @@ int embuer_install_from_url(
  */
 void embuer_free_string(char* s);
 
+/**
+ * Get the structured progress of the update pipeline
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - out: Progress to fill
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - Error code on failure
+ */
+int embuer_get_progress(
+    embuer_client_t* client,
+    embuer_progress_t* out
+);
+
+/**
+ * Get the metrics of the stages of the last update pipeline
+ * 
+ * The metrics are reset when an update request starts, and are updated while
+ * the payload streams.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - out: Metrics to fill
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - Error code on failure
+ */
+int embuer_get_metrics(
+    embuer_client_t* client,
+    embuer_metrics_t* out
+);
+
+/**
+ * Watch for progress updates (blocking call)
+ * 
+ * Calls the callback with the current progress, then whenever it is sampled
+ * (at most every 100ms while data flows), its stage changes or the update
+ * queue depth changes.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - callback: Function to call on progress updates
+ * - user_data: User data to pass to the callback
+ * 
+ * Returns:
+ * - EMBUER_OK when the signal stream ends
+ * - Error code on failure
+ */
+int embuer_watch_progress(
+    embuer_client_t* client,
+    ProgressCallback callback,
+    void* user_data
+);
+
+/**
+ * Start installing an update without blocking
+ * 
+ * The update request is queued before this returns. The callback is then
+ * invoked from a library thread for every status change of this request,
+ * the last one being the status it ended with: "Completed", "Failed" or
+ * "Idle" (no update available). Library functions must not be called from
+ * within the callback.
+ * 
+ * Requests are processed one at a time: while another install is in
+ * progress, its status changes are not reported. A request for the source
+ * already queued or in progress is merged with it and shares its status.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - source: http(s) URL to download the update from, or path of the update file
+ * - callback: Function to call on status updates
+ * - user_data: User data to pass to the callback
+ * - op_out: Pointer to receive the operation handle (must be freed with embuer_op_free,
+ *   before the client)
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - Error code on failure
+ */
+int embuer_install_async(
+    embuer_client_t* client,
+    const char* source,
+    StatusCallback callback,
+    void* user_data,
+    embuer_op_t** op_out
+);
+
+/**
+ * Cancel an install started with embuer_install_async
+ * 
+ * A request still queued is dropped. For the request being processed, the
+ * daemon stops downloading, decompressing and receiving the update and
+ * deletes the partially received deployment; an update awaiting confirmation
+ * is rejected. Other requests are left alone. The callback then reports a
+ * "Failed" status.
+ * 
+ * Parameters:
+ * - op: Operation handle
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - EMBUER_ERR_DBUS if the request already ended
+ * - Error code on failure
+ */
+int embuer_op_cancel(embuer_op_t* op);
+
+/**
+ * Free an operation handle
+ * 
+ * Stops the callbacks of the operation, but not the install itself.
+ * 
+ * Parameters:
+ * - op: Operation handle to free
+ */
+void embuer_op_free(embuer_op_t* op);
+
 /**
  * Get the pending update awaiting confirmation
  * 
@@ -215,6 +485,63 @@ int embuer_confirm_update(
     char** result_out
 );
 
+/**
+ * Pause the update in progress
+ * 
+ * The update source is no longer read, which stops every stage of the
+ * update, until embuer_resume_update() is called or the update is cancelled.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * 
+ * Returns:
+ * - EMBUER_OK on success, also if the update was already paused
+ * - EMBUER_ERR_DBUS if no update is in progress
+ */
+int embuer_pause_update(embuer_client_t* client);
+
+/**
+ * Resume the paused update
+ * 
+ * Parameters:
+ * - client: Client handle
+ * 
+ * Returns:
+ * - EMBUER_OK on success, also if the update was not paused
+ * - Error code on failure
+ */
+int embuer_resume_update(embuer_client_t* client);
+
+/**
+ * Check whether the update in progress is paused
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - paused_out: Pointer to receive 1 if the update is paused, 0 otherwise
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - Error code on failure
+ */
+int embuer_is_update_paused(embuer_client_t* client, int* paused_out);
+
+/**
+ * Get the number of update requests waiting for the one in progress
+ * 
+ * Requests for a source already queued or in progress are merged with it
+ * and not counted. The depth is also reported in embuer_progress_t, whenever
+ * it changes, by embuer_watch_progress.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - depth_out: Pointer to receive the number of waiting requests
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - Error code on failure
+ */
+int embuer_get_update_queue_depth(embuer_client_t* client, unsigned int* depth_out);
+
 /**
  * Watch for status updates (blocking call)
  * 
@@ -235,6 +562,61 @@ int embuer_watch_status(
     void* user_data
 );
 
+/**
+ * Start watching for status updates (non-blocking)
+ * 
+ * Subscribes to status changes and returns a file descriptor that becomes
+ * readable whenever updates are queued. Add it to poll/epoll/select and call
+ * embuer_dispatch() when it is readable. The current status is queued
+ * immediately. The descriptor is owned by the library: do not close it.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * - callback: Function to call on status updates (invoked from embuer_dispatch)
+ * - user_data: User data to pass to the callback (can be NULL)
+ * 
+ * Returns:
+ * - A pollable file descriptor (>= 0) on success
+ * - EMBUER_ERR_WATCH_ACTIVE if a watch is already active
+ * - Other error code on failure
+ */
+int embuer_watch_start(
+    embuer_client_t* client,
+    StatusCallback callback,
+    void* user_data
+);
+
+/**
+ * Dispatch queued status updates (non-blocking)
+ * 
+ * Invokes the callback registered with embuer_watch_start() once for each
+ * queued status change, on the calling thread, then returns.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * 
+ * Returns:
+ * - Number of dispatched updates (>= 0) on success
+ * - EMBUER_ERR_DBUS if the signal stream ended (e.g. the service went away)
+ * - EMBUER_ERR_NOT_WATCHING if no watch is active
+ */
+int embuer_dispatch(embuer_client_t* client);
+
+/**
+ * Stop watching for status updates
+ * 
+ * Closes the descriptor returned by embuer_watch_start() and discards
+ * any queued updates.
+ * 
+ * Parameters:
+ * - client: Client handle
+ * 
+ * Returns:
+ * - EMBUER_OK on success
+ * - EMBUER_ERR_NOT_WATCHING if no watch is active
+ */
+int embuer_watch_stop(embuer_client_t* client);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,285 @@
+/**
+ * Embuer Status Latency Benchmark
+ *
+ * This example measures the latency distribution of the status API of the
+ * Embuer C library:
+ * - get_status:  round trip of embuer_get_status() to the service
+ * - watch_start: from embuer_watch_start() to the first status callback
+ * - dispatch:    with --watch, from the watch descriptor becoming readable
+ *                to the callback invoked by embuer_dispatch(), for every
+ *                status change in that time (start an update meanwhile)
+ *
+ * Every measurement is printed on stdout as one JSON object per line, so that
+ * results of different devices can be collected and compared by scripts.
+ *
+ * Compile with:
+ *   gcc -O2 -o status_latency status_latency.c -L../target/release -lembuer -lpthread -ldl -lm
+ *
+ * Run with:
+ *   LD_LIBRARY_PATH=../target/release ./status_latency [--iterations N] [--watch SECONDS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include "../embuer.h"
+
+// Number of watches started to measure the latency of the first callback
+#define WATCH_START_ITERATIONS 100
+
+/**
+ * Monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Latency samples of one measurement
+ */
+typedef struct {
+    uint64_t* values;
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+static int samples_push(samples_t* samples, uint64_t value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 256;
+        uint64_t* values = realloc(samples->values, capacity * sizeof(uint64_t));
+        if (!values) {
+            return -1;
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+
+    samples->values[samples->count++] = value;
+    return 0;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Nearest-rank percentile of sorted samples, in microseconds
+ */
+static double percentile_us(const samples_t* samples, unsigned int percent) {
+    size_t rank = (samples->count * percent + 99) / 100;
+    size_t index = rank ? rank - 1 : 0;
+    return samples->values[index] / 1000.0;
+}
+
+/**
+ * Print the distribution of a measurement as a JSON line
+ */
+static void report(const char* measurement, samples_t* samples) {
+    if (samples->count == 0) {
+        printf("{\"measurement\":\"%s\",\"samples\":0}\n", measurement);
+        return;
+    }
+
+    qsort(samples->values, samples->count, sizeof(uint64_t), compare_u64);
+
+    printf("{\"measurement\":\"%s\",\"samples\":%zu,"
+           "\"min_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+           measurement,
+           samples->count,
+           samples->values[0] / 1000.0,
+           percentile_us(samples, 50),
+           percentile_us(samples, 90),
+           percentile_us(samples, 99),
+           samples->values[samples->count - 1] / 1000.0);
+    fflush(stdout);
+}
+
+/**
+ * Time of the first callback since the context was reset
+ */
+typedef struct {
+    uint64_t first_call_ns;
+    int calls;
+} callback_ctx_t;
+
+static void on_status_changed(
+    const char* status,
+    const char* details,
+    int progress,
+    void* user_data
+) {
+    (void)status;
+    (void)details;
+    (void)progress;
+
+    callback_ctx_t* ctx = (callback_ctx_t*)user_data;
+    if (ctx->calls++ == 0) {
+        ctx->first_call_ns = now_ns();
+    }
+}
+
+static int bench_get_status(embuer_client_t* client, int iterations, samples_t* samples) {
+    for (int i = 0; i < iterations; i++) {
+        char* status = NULL;
+        char* details = NULL;
+        int progress = 0;
+
+        uint64_t start = now_ns();
+        int result = embuer_get_status(client, &status, &details, &progress);
+        uint64_t end = now_ns();
+
+        if (result != EMBUER_OK) {
+            fprintf(stderr, "embuer_get_status failed with error code: %d\n", result);
+            return result;
+        }
+
+        embuer_free_string(status);
+        embuer_free_string(details);
+        samples_push(samples, end - start);
+    }
+
+    return EMBUER_OK;
+}
+
+static int bench_watch_start(embuer_client_t* client, samples_t* samples) {
+    for (int i = 0; i < WATCH_START_ITERATIONS; i++) {
+        callback_ctx_t ctx = { 0 };
+
+        uint64_t start = now_ns();
+        int watch_fd = embuer_watch_start(client, on_status_changed, &ctx);
+        if (watch_fd < 0) {
+            fprintf(stderr, "embuer_watch_start failed with error code: %d\n", watch_fd);
+            return watch_fd;
+        }
+
+        // The current status is queued right away
+        struct pollfd pfd = { .fd = watch_fd, .events = POLLIN };
+        while (ctx.calls == 0 && poll(&pfd, 1, 1000) > 0) {
+            if (embuer_dispatch(client) < 0) {
+                break;
+            }
+        }
+
+        embuer_watch_stop(client);
+
+        if (ctx.calls == 0) {
+            fprintf(stderr, "No status received after embuer_watch_start\n");
+            return EMBUER_ERR_DBUS;
+        }
+        samples_push(samples, ctx.first_call_ns - start);
+    }
+
+    return EMBUER_OK;
+}
+
+static int bench_dispatch(embuer_client_t* client, int seconds, samples_t* samples) {
+    callback_ctx_t ctx = { 0 };
+
+    int watch_fd = embuer_watch_start(client, on_status_changed, &ctx);
+    if (watch_fd < 0) {
+        fprintf(stderr, "embuer_watch_start failed with error code: %d\n", watch_fd);
+        return watch_fd;
+    }
+
+    fprintf(stderr, "Collecting status changes for %d seconds...\n", seconds);
+
+    struct pollfd pfd = { .fd = watch_fd, .events = POLLIN };
+    uint64_t deadline = now_ns() + (uint64_t)seconds * 1000000000ull;
+    while (now_ns() < deadline) {
+        int ready = poll(&pfd, 1, 100);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (ready == 0) {
+            continue;
+        }
+
+        uint64_t readable = now_ns();
+        ctx.calls = 0;
+        int result = embuer_dispatch(client);
+        if (result < 0) {
+            fprintf(stderr, "embuer_dispatch failed with error code: %d\n", result);
+            embuer_watch_stop(client);
+            return result;
+        }
+
+        if (ctx.calls > 0) {
+            samples_push(samples, ctx.first_call_ns - readable);
+        }
+    }
+
+    embuer_watch_stop(client);
+    return EMBUER_OK;
+}
+
+void print_usage(const char* prog_name) {
+    printf("Usage: %s [OPTIONS]\n", prog_name);
+    printf("\n");
+    printf("Options:\n");
+    printf("  --iterations N     Number of embuer_get_status() calls (default: 1000)\n");
+    printf("  --watch SECONDS    Also measure the dispatch of status changes for SECONDS\n");
+    printf("  --help             Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = 1000;
+    int watch_seconds = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            watch_seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    embuer_client_t* client = embuer_client_new();
+    if (!client) {
+        fprintf(stderr, "Failed to create Embuer client. Is the service running?\n");
+        return 1;
+    }
+
+    samples_t get_status = { 0 };
+    samples_t watch_start = { 0 };
+    samples_t dispatch = { 0 };
+    int result = bench_get_status(client, iterations, &get_status);
+    if (result == EMBUER_OK) {
+        report("get_status", &get_status);
+        result = bench_watch_start(client, &watch_start);
+    }
+    if (result == EMBUER_OK) {
+        report("watch_start", &watch_start);
+        if (watch_seconds > 0) {
+            result = bench_dispatch(client, watch_seconds, &dispatch);
+        }
+    }
+    if (result == EMBUER_OK && watch_seconds > 0) {
+        report("dispatch", &dispatch);
+    }
+
+    free(get_status.values);
+    free(watch_start.values);
+    free(dispatch.values);
+    embuer_client_free(client);
+
+    return result == EMBUER_OK ? 0 : 1;
+}
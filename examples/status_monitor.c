@@ -14,6 +14,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <string.h>
 #include <time.h>
@@ -229,18 +231,42 @@ int main(int argc, char* argv[]) {
     }
     
     // Start watching for status changes
-    // NOTE: embuer_watch_status() is a blocking call that will run until interrupted
-    // The callback will be invoked whenever the status changes
-    int result = embuer_watch_status(client, on_status_changed, &update_count);
-    
-    // This code is reached when embuer_watch_status() returns
-    // (typically after the service stops or connection is lost)
-    if (result != EMBUER_OK) {
-        fprintf(stderr, "\nMonitoring stopped with error code: %d\n", result);
-        if (result == EMBUER_ERR_DBUS) {
-            fprintf(stderr, "The service may have stopped or the connection was lost.\n");
+    // embuer_watch_start() returns a file descriptor that can be polled together
+    // with any other descriptor; embuer_dispatch() invokes the callback for
+    // every queued status change without blocking.
+    int watch_fd = embuer_watch_start(client, on_status_changed, &update_count);
+    if (watch_fd < 0) {
+        fprintf(stderr, "\nFailed to start monitoring, error code: %d\n", watch_fd);
+        embuer_client_free(client);
+        return 1;
+    }
+
+    struct pollfd pfd = { .fd = watch_fd, .events = POLLIN };
+    while (keep_running) {
+        int ready = poll(&pfd, 1, 1000);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (ready == 0) {
+            continue;
+        }
+
+        int result = embuer_dispatch(client);
+        if (result < 0) {
+            fprintf(stderr, "\nMonitoring stopped with error code: %d\n", result);
+            if (result == EMBUER_ERR_DBUS) {
+                fprintf(stderr, "The service may have stopped or the connection was lost.\n");
+            }
+            break;
         }
     }
+
+    embuer_watch_stop(client);
     
     // Print session statistics
     print_statistics(update_count, start_time);
@@ -42,6 +42,9 @@ enum SubCommand {
     PendingUpdate(PendingUpdateCmd),
     Accept(AcceptCmd),
     Reject(RejectCmd),
+    Cancel(CancelCmd),
+    Pause(PauseCmd),
+    Resume(ResumeCmd),
 }
 
 /// Get the current update status
@@ -92,6 +95,21 @@ struct AcceptCmd {}
 #[argh(subcommand, name = "reject")]
 struct RejectCmd {}
 
+/// Cancel the update in progress
+#[derive(FromArgs)]
+#[argh(subcommand, name = "cancel")]
+struct CancelCmd {}
+
+/// Pause the update in progress
+#[derive(FromArgs)]
+#[argh(subcommand, name = "pause")]
+struct PauseCmd {}
+
+/// Resume the paused update
+#[derive(FromArgs)]
+#[argh(subcommand, name = "resume")]
+struct ResumeCmd {}
+
 #[tokio::main]
 async fn main() {
     env_logger::Builder::from_default_env()
@@ -109,6 +127,9 @@ async fn main() {
         SubCommand::PendingUpdate(_) => get_pending_update().await,
         SubCommand::Accept(_) => confirm_update(true).await,
         SubCommand::Reject(_) => confirm_update(false).await,
+        SubCommand::Cancel(_) => cancel_update().await,
+        SubCommand::Pause(_) => pause_update(true).await,
+        SubCommand::Resume(_) => pause_update(false).await,
     };
 
     if let Err(e) = result {
@@ -162,6 +183,16 @@ async fn get_status() -> Result<(), Box<dyn std::error::Error>> {
         );
     }
 
+    let queued = proxy.get_update_queue_depth().await?;
+    if queued > 0 {
+        println!(
+            "  {} {} {}",
+            "Queued:".bright_white(),
+            queued.to_string().bright_yellow(),
+            "more update requests".dimmed()
+        );
+    }
+
     Ok(())
 }
 
@@ -402,3 +433,34 @@ async fn confirm_update(accepted: bool) -> Result<(), Box<dyn std::error::Error>
 
     Ok(())
 }
+
+async fn cancel_update() -> Result<(), Box<dyn std::error::Error>> {
+    let connection = get_connection().await?;
+    let proxy = EmbuerDBusProxy::new(&connection).await?;
+
+    let result = proxy.cancel_update().await?;
+
+    println!("{} {}", "🛑".bright_red(), result.bright_red().bold());
+
+    Ok(())
+}
+
+async fn pause_update(pause: bool) -> Result<(), Box<dyn std::error::Error>> {
+    let connection = get_connection().await?;
+    let proxy = EmbuerDBusProxy::new(&connection).await?;
+
+    let changed = match pause {
+        true => proxy.pause_update().await?,
+        false => proxy.resume_update().await?,
+    };
+
+    let message = match (pause, changed) {
+        (true, true) => "Update paused",
+        (true, false) => "Update was already paused",
+        (false, true) => "Update resumed",
+        (false, false) => "Update was not paused",
+    };
+    println!("{} {}", "⏯".bright_yellow(), message.bright_white().bold());
+
+    Ok(())
+}
@@ -17,18 +17,48 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
-use std::path::PathBuf;
+use std::collections::HashMap;
+use std::io::Read;
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::pin::Pin;
+use std::process::Stdio;
+use std::time::{SystemTime, UNIX_EPOCH};
 
 use argh::FromArgs;
+use async_compression::tokio::bufread::{XzDecoder, ZstdDecoder};
+use embuer::chunked_hash::{ChunkTable, DEFAULT_CHUNK_SIZE};
+use embuer::core::SHA512_DIGEST_INFO;
+use embuer::hash_stream::{HashingReader, DEFAULT_HASH_QUEUE_DEPTH};
+use embuer::package::{tar_header, PackageIndex, INDEX_ENTRY, INDEX_HEAD_SIZE, INDEX_SIZE, PADDING_ENTRY, TAR_BLOCK_SIZE};
 use log::{error, info, warn};
+use rsa::pkcs1::{DecodeRsaPrivateKey, DecodeRsaPublicKey};
+use rsa::pkcs8::DecodePrivateKey;
+use rsa::traits::PublicKeyParts;
+use rsa::{Pkcs1v15Sign, RsaPrivateKey, RsaPublicKey};
+use sha2::{Digest, Sha256, Sha512};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWriteExt, BufReader};
 use tokio::process::Command;
 
+/// Payload size covered by the head reserved by --stdin for the entries preceding
+/// the payload: the payload of a larger stream is moved once to make room for its chunk table
+const STREAM_RESERVED_PAYLOAD_SIZE: u64 = 16 << 30;
+
+/// Blocks of compressed payload handed to the writer thread, one chunk each
+const STREAM_BLOCK_SIZE: usize = DEFAULT_CHUNK_SIZE as usize;
+
+/// Blocks queued for the writer thread
+const STREAM_QUEUE_DEPTH: usize = 4;
+
+/// Bytes of the stream read on stdin to find its first command
+const STREAM_PEEK_SIZE: usize = 64 * 1024;
+
 /// Embuer GenUpdate - Generate an installable deployment
 #[derive(FromArgs)]
 struct EmbuerGenupdateCli {
     #[argh(
         option,
-        description = "path containing update.btrfs.xz and CHANGELOG files",
+        description = "path containing update.btrfs.xz (or update.btrfs.zst) and CHANGELOG files, and optionally an incremental update.delta.btrfs.xz (or .zst)",
         short = 'p'
     )]
     pub path: PathBuf,
@@ -47,11 +77,29 @@ struct EmbuerGenupdateCli {
     )]
     pub public_key_pem: Option<PathBuf>,
 
+    #[argh(
+        switch,
+        description = "compress the uncompressed update.btrfs (and update.delta.btrfs) send streams with zstd"
+    )]
+    pub zstd: bool,
+
+    #[argh(
+        option,
+        description = "zstd dictionary used to compress the update, shipped in the update package"
+    )]
+    pub zstd_dict: Option<PathBuf>,
+
     #[argh(
         switch,
         description = "remove intermediate files after generating the update package"
     )]
     pub clean: bool,
+
+    #[argh(
+        switch,
+        description = "build the package in a single pass from the full btrfs send stream read on stdin, compressed with a multi-threaded xz (or zstd with --zstd)"
+    )]
+    pub stdin: bool,
 }
 
 #[tokio::main]
@@ -70,15 +118,6 @@ async fn main() -> Result<(), Box<dyn std::error::Error>> {
         return Err(format!("Path {} is not a directory", cli.path.display()).into());
     }
 
-    let update_btrfs_xz = cli.path.join("update.btrfs.xz");
-    if !update_btrfs_xz.exists() {
-        error!("File {} does not exist", update_btrfs_xz.display());
-        return Err(format!("File {} does not exist", update_btrfs_xz.display()).into());
-    } else if !update_btrfs_xz.is_file() {
-        error!("File {} is not a file", update_btrfs_xz.display());
-        return Err(format!("File {} is not a file", update_btrfs_xz.display()).into());
-    }
-
     let private_key_pem = cli.private_key_pem.clone();
     if !private_key_pem.exists() {
         error!("Private key file {} does not exist", private_key_pem.display());
@@ -88,7 +127,204 @@ async fn main() -> Result<(), Box<dyn std::error::Error>> {
         return Err(format!("Private key file {} is not a file", private_key_pem.display()).into());
     }
 
+    if cli.stdin {
+        return build_from_stdin(&cli).await;
+    }
+
+    // Files to be removed with --clean
+    let mut intermediate_files = vec![];
+
+    // The zstd dictionary is signed too: it determines the decompressed deployment
+    if let Some(zstd_dict) = &cli.zstd_dict {
+        let update_zstd_dict = cli.path.join("update.zstd.dict");
+        std::fs::copy(zstd_dict, &update_zstd_dict)
+            .inspect_err(|e| error!("Error copying the zstd dictionary {}: {e}", zstd_dict.display()))?;
+
+        let update_zstd_dict_signature = cli.path.join("update.zstd.dict.signature");
+        sign_payload(&cli, &update_zstd_dict, &update_zstd_dict_signature).await?;
+        intermediate_files.extend([update_zstd_dict, update_zstd_dict_signature]);
+    }
+
+    let Some(update_payload) = resolve_payload(&cli, "update.btrfs").await? else {
+        let update_btrfs_xz = cli.path.join("update.btrfs.xz");
+        error!("File {} does not exist", update_btrfs_xz.display());
+        return Err(format!("File {} does not exist", update_btrfs_xz.display()).into());
+    };
+
+    // Digests of the payloads for the package index, computed while hashing their chunks
+    let mut payload_digests = HashMap::new();
+
     let update_signature_path = cli.path.join("update.signature");
+    sign_payload(&cli, &update_payload, &update_signature_path).await?;
+    let (update_chunk_files, update_digest) = write_chunk_table(&cli, &update_payload, "update").await?;
+    payload_digests.insert(file_name(&update_payload), update_digest);
+
+    // An incremental stream (btrfs send -p) is shipped before the full image,
+    // together with the UUID of the deployment it must be applied on
+    let update_delta_payload = resolve_payload(&cli, "update.delta.btrfs").await?;
+    let update_parent_path = cli.path.join("update.parent");
+    let update_delta_signature_path = cli.path.join("update.delta.signature");
+    if let Some(update_delta_payload) = &update_delta_payload {
+        let mut reader = decompress(&cli, update_delta_payload).await?;
+        let parent_uuid = embuer::btrfs::read_parent_uuid(&mut reader)
+            .await
+            .inspect_err(|e| error!("Error reading {}: {e}", update_delta_payload.display()))?
+            .ok_or_else(|| {
+                error!("File {} is not an incremental stream", update_delta_payload.display());
+                format!("File {} is not an incremental stream", update_delta_payload.display())
+            })?;
+
+        std::fs::write(&update_parent_path, format!("{parent_uuid}\n"))?;
+        info!("Incremental update applies on top of deployment {parent_uuid}");
+
+        sign_payload(&cli, update_delta_payload, &update_delta_signature_path).await?;
+        let (update_delta_chunk_files, update_delta_digest) = write_chunk_table(&cli, update_delta_payload, "update.delta").await?;
+        payload_digests.insert(file_name(update_delta_payload), update_delta_digest);
+
+        intermediate_files.extend([update_parent_path.clone(), update_delta_signature_path.clone()]);
+        intermediate_files.extend(update_delta_chunk_files);
+        intermediate_files.push(update_delta_payload.clone());
+    }
+
+    // tar cf "${BINARIES_DIR}/update_package.tar" -C "${BINARIES_DIR}" "update.index" "CHANGELOG" "update.signature" "update.btrfs.xz"
+    // Streams are read in order: every metadata entry comes before the payloads,
+    // and the incremental update must come before the full image
+    let mut entries: Vec<PathBuf> = vec!["CHANGELOG".into()];
+    if cli.zstd_dict.is_some() {
+        entries.extend(["update.zstd.dict".into(), "update.zstd.dict.signature".into()]);
+    }
+    if update_delta_payload.is_some() {
+        entries.extend(["update.parent".into(), "update.delta.chunks".into(), "update.delta.chunks.signature".into()]);
+        entries.push("update.delta.signature".into());
+    }
+    entries.extend(["update.chunks".into(), "update.chunks.signature".into(), "update.signature".into()]);
+    if let Some(update_delta_payload) = &update_delta_payload {
+        entries.push(file_name(update_delta_payload));
+    }
+    entries.push(file_name(&update_payload));
+
+    let update_index_path = cli.path.join(INDEX_ENTRY);
+    write_package_index(&cli, &entries, &payload_digests, &update_index_path)?;
+    intermediate_files.push(update_index_path);
+
+    // The GNU format keeps one header per entry, as laid out by the index
+    let update_package_path = cli.path.join("update_package.tar");
+    let output = Command::new("tar")
+        .arg("--format=gnu")
+        .arg("-cf")
+        .arg(update_package_path.to_str().unwrap())
+        .arg("-C")
+        .arg(cli.path.to_str().unwrap())
+        .arg(INDEX_ENTRY)
+        .args(entries)
+        .output()
+        .await
+        .inspect_err(|e| error!("Error creating the update package: {e}"))
+        .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+
+    if !output.status.success() {
+        error!("tar failed: {}", String::from_utf8_lossy(&output.stderr).trim());
+        return Err("Error creating the update package".into());
+    }
+
+    // Readers trust the offsets of the index: refuse a package that does not match them
+    let update_package = std::fs::File::open(&update_package_path)?;
+    PackageIndex::read(&update_package)?
+        .ok_or("The update package does not start with its index")?
+        .check(&update_package)
+        .inspect_err(|e| error!("Error checking the update package: {e}"))?;
+
+    info!("Generated update package at {}", update_package_path.display());
+
+    if cli.clean {
+        std::fs::remove_file(update_signature_path.clone())
+            .inspect_err(|e| error!("Error removing update dsignature file {}: {e}", update_signature_path.display()))
+            .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+
+        info!("Removed update signature file {}", update_signature_path.display());
+
+        std::fs::remove_file(update_payload.clone())
+            .inspect_err(|e| error!("Error removing deployment file {}: {e}", update_payload.display()))
+            .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+
+        info!("Removed deployment file {}", update_payload.display());
+
+        for path in update_chunk_files.iter().chain(&intermediate_files) {
+            std::fs::remove_file(path)
+                .inspect_err(|e| error!("Error removing intermediate file {}: {e}", path.display()))
+                .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+
+            info!("Removed intermediate file {}", path.display());
+        }
+    }
+
+    Ok(())
+}
+
+fn file_name(path: &Path) -> PathBuf {
+    path.file_name().map(PathBuf::from).unwrap_or_default()
+}
+
+/// Locate the compressed send stream `<stem>.zst` or `<stem>.xz` in the update
+/// directory, compressing `<stem>` with zstd first when requested
+async fn resolve_payload(
+    cli: &EmbuerGenupdateCli,
+    stem: &str,
+) -> Result<Option<PathBuf>, Box<dyn std::error::Error>> {
+    let uncompressed = cli.path.join(stem);
+    let zst = cli.path.join(format!("{stem}.zst"));
+    let xz = cli.path.join(format!("{stem}.xz"));
+
+    if cli.zstd && uncompressed.is_file() {
+        let mut cmd = Command::new("zstd");
+        cmd.arg("-19").arg("-T0").arg("-f");
+        if let Some(zstd_dict) = &cli.zstd_dict {
+            cmd.arg("-D").arg(zstd_dict);
+        }
+
+        let output = cmd
+            .arg("-o")
+            .arg(&zst)
+            .arg(&uncompressed)
+            .output()
+            .await
+            .inspect_err(|e| error!("Error compressing {}: {e}", uncompressed.display()))?;
+
+        if !output.status.success() {
+            error!("zstd failed: {}", String::from_utf8_lossy(&output.stderr).trim());
+            return Err(format!("Error compressing {}", uncompressed.display()).into());
+        }
+
+        info!("Compressed {} into {}", uncompressed.display(), zst.display());
+    }
+
+    Ok([zst, xz].into_iter().find(|path| path.is_file()))
+}
+
+/// Open the compressed send stream `payload` for reading
+async fn decompress(
+    cli: &EmbuerGenupdateCli,
+    payload: &Path,
+) -> Result<Pin<Box<dyn AsyncRead + Send + Unpin>>, Box<dyn std::error::Error>> {
+    let file = BufReader::new(tokio::fs::File::open(payload).await?);
+
+    if payload.extension().is_some_and(|ext| ext == "zst") {
+        return Ok(match &cli.zstd_dict {
+            Some(zstd_dict) => Box::pin(ZstdDecoder::with_dict(file, &std::fs::read(zstd_dict)?)?),
+            None => Box::pin(ZstdDecoder::new(file)),
+        });
+    }
+
+    Ok(Box::pin(XzDecoder::new(file)))
+}
+
+/// Sign `payload` into `signature_path`, then check the signature if a public key was given
+async fn sign_payload(
+    cli: &EmbuerGenupdateCli,
+    payload: &Path,
+    signature_path: &Path,
+) -> Result<(), Box<dyn std::error::Error>> {
+    let private_key_pem = cli.private_key_pem.clone();
 
     Command::new("openssl")
         .arg("dgst")
@@ -96,14 +332,14 @@ async fn main() -> Result<(), Box<dyn std::error::Error>> {
         .arg("-sign")
         .arg(private_key_pem.to_str().unwrap())
         .arg("-out")
-        .arg(update_signature_path.to_str().unwrap())
-        .arg(update_btrfs_xz.to_str().unwrap())
+        .arg(signature_path.to_str().unwrap())
+        .arg(payload.to_str().unwrap())
         .output()
         .await
         .inspect_err(|e| error!("Error signing the update: {e}"))
         .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
 
-    info!("Generated update signature at {}", update_signature_path.display());
+    info!("Generated update signature at {}", signature_path.display());
 
     match cli.public_key_pem.clone() {
         Some(pubkey_path) => {
@@ -118,8 +354,8 @@ async fn main() -> Result<(), Box<dyn std::error::Error>> {
                 .arg("-verify")
                 .arg(pubkey_path.to_str().unwrap())
                 .arg("-signature")
-                .arg(update_signature_path.to_str().unwrap())
-                .arg(update_btrfs_xz.to_str().unwrap())
+                .arg(signature_path.to_str().unwrap())
+                .arg(payload.to_str().unwrap())
                 .output()
                 .await
                 .inspect_err(|e| error!("Error verifying the update signature: {e}"))
@@ -137,35 +373,340 @@ async fn main() -> Result<(), Box<dyn std::error::Error>> {
         }
     }
 
-    // tar cf "${BINARIES_DIR}/update_package.tar" -C "${BINARIES_DIR}" "CHANGELOG" "update.signature" "update.btrfs.xz"
-    Command::new("tar")
-        .arg("cf")
-        .arg(cli.path.join("update_package.tar").to_str().unwrap())
-        .arg("-C")
-        .arg(cli.path.to_str().unwrap())
-        .arg("CHANGELOG")
-        .arg("update.signature")
-        .arg("update.btrfs.xz")
-        .output()
-        .await
-        .inspect_err(|e| error!("Error creating the update package: {e}"))
-        .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+    Ok(())
+}
 
-    info!("Generated update package at {}", cli.path.join("update_package.tar").display());
+/// Reader computing the SHA-256 digest of the data read through it
+struct DigestReader<R> {
+    inner: R,
+    digest: Sha256,
+}
 
-    if cli.clean {
-        std::fs::remove_file(update_signature_path.clone())
-            .inspect_err(|e| error!("Error removing update dsignature file {}: {e}", update_signature_path.display()))
-            .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+impl<R: Read> Read for DigestReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        let len = self.inner.read(buf)?;
+        self.digest.update(&buf[..len]);
+        Ok(len)
+    }
+}
 
-        info!("Removed update signature file {}", update_signature_path.display());
+/// Write and sign the per-chunk digests of `payload` into `<prefix>.chunks` and
+/// `<prefix>.chunks.signature`, returning the paths of both files and the
+/// SHA-256 digest of the whole payload
+async fn write_chunk_table(
+    cli: &EmbuerGenupdateCli,
+    payload: &Path,
+    prefix: &str,
+) -> Result<(Vec<PathBuf>, String), Box<dyn std::error::Error>> {
+    let table_path = cli.path.join(format!("{prefix}.chunks"));
+    let signature_path = cli.path.join(format!("{prefix}.chunks.signature"));
 
-        std::fs::remove_file(update_btrfs_xz.clone())
-            .inspect_err(|e| error!("Error removing deployment file {}: {e}", update_btrfs_xz.display()))
-            .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+    let mut file = DigestReader { inner: std::io::BufReader::new(std::fs::File::open(payload)?), digest: Sha256::new() };
+    let table = ChunkTable::compute(&mut file, DEFAULT_CHUNK_SIZE)
+        .inspect_err(|e| error!("Error hashing {}: {e}", payload.display()))?;
+    std::fs::write(&table_path, table.to_bytes())?;
+
+    info!("Generated chunk table at {}", table_path.display());
+
+    sign_payload(cli, &table_path, &signature_path).await?;
+
+    Ok((vec![table_path, signature_path], hex::encode(file.digest.finalize())))
+}
+
+/// Write the index of the package made of `entries`, in this order, into `index_path`
+fn write_package_index(
+    cli: &EmbuerGenupdateCli,
+    entries: &[PathBuf],
+    payload_digests: &HashMap<PathBuf, String>,
+    index_path: &Path,
+) -> Result<(), Box<dyn std::error::Error>> {
+    let mut files = vec![];
+    for entry in entries {
+        let path = cli.path.join(entry);
+        let size = std::fs::metadata(&path)
+            .inspect_err(|e| error!("Error reading {}: {e}", path.display()))?
+            .len();
+        let digest = match payload_digests.get(entry) {
+            Some(digest) => digest.clone(),
+            None => hex::encode(Sha256::digest(std::fs::read(&path)?)),
+        };
+        files.push((entry.display().to_string(), size, digest));
+    }
+
+    let index = PackageIndex::layout(files);
+    std::fs::write(index_path, index.to_bytes()?)?;
+
+    info!("Generated package index at {}", index_path.display());
+
+    Ok(())
+}
+
+
+/// Build `update_package.tar` from the full btrfs send stream read on stdin, in a single pass.
+///
+/// The stream is compressed by a multi-threaded xz (or zstd) process. Its output is hashed
+/// while the payload is written at its final offset, past a head reserved for the entries
+/// that precede it. The head is written last, once the signatures are known.
+async fn build_from_stdin(cli: &EmbuerGenupdateCli) -> Result<(), Box<dyn std::error::Error>> {
+    let private_key = read_private_key(&cli.private_key_pem)?;
+    let public_key = match &cli.public_key_pem {
+        Some(path) => RsaPublicKey::from_pkcs1_pem(&std::fs::read_to_string(path)?)
+            .inspect_err(|e| error!("Error reading the public key {}: {e}", path.display()))?,
+        None => {
+            warn!("Public key file not provided, checking signatures against the private key");
+            private_key.to_public_key()
+        }
+    };
+
+    let changelog_path = cli.path.join("CHANGELOG");
+    let changelog = std::fs::read(&changelog_path)
+        .inspect_err(|e| error!("Error reading {}: {e}", changelog_path.display()))?;
+
+    // Entries preceding the payload, in order
+    let mut entries: Vec<(String, Vec<u8>)> = vec![("CHANGELOG".to_string(), changelog)];
+    if let Some(zstd_dict) = &cli.zstd_dict {
+        let dict = std::fs::read(zstd_dict)
+            .inspect_err(|e| error!("Error reading the zstd dictionary {}: {e}", zstd_dict.display()))?;
+        let signature = sign_digest(&private_key, &public_key, &hex::encode(Sha512::digest(&dict)))?;
+        entries.push(("update.zstd.dict".to_string(), dict));
+        entries.push(("update.zstd.dict.signature".to_string(), signature));
+    }
+
+    // Room for the chunk table of the largest expected payload, its signature,
+    // the payload signature and the header of the padding entry
+    let signature_size = private_key.size() as u64;
+    let reserved = entries
+        .iter()
+        .map(|(name, data)| (name.clone(), data.len() as u64, String::new()))
+        .chain([
+            ("update.chunks".to_string(), ChunkTable::encoded_len(STREAM_RESERVED_PAYLOAD_SIZE, DEFAULT_CHUNK_SIZE), String::new()),
+            ("update.chunks.signature".to_string(), signature_size, String::new()),
+            ("update.signature".to_string(), signature_size, String::new()),
+        ]);
+    let reserved_header_offset = layout_end(&PackageIndex::layout(reserved)) + TAR_BLOCK_SIZE as u64;
+
+    let (payload_name, mut cmd) = match cli.zstd {
+        true => {
+            let mut cmd = Command::new("zstd");
+            cmd.arg("-19").arg("-T0").arg("-c");
+            if let Some(zstd_dict) = &cli.zstd_dict {
+                cmd.arg("-D").arg(zstd_dict);
+            }
+            ("update.btrfs.zst", cmd)
+        }
+        false => {
+            let mut cmd = Command::new("xz");
+            cmd.arg("-T0").arg("-c");
+            ("update.btrfs.xz", cmd)
+        }
+    };
+    let mut compressor = cmd
+        .stdin(Stdio::piped())
+        .stdout(Stdio::piped())
+        .kill_on_drop(true)
+        .spawn()
+        .inspect_err(|e| error!("Error starting the compressor: {e}"))?;
+    let mut compressor_stdin = compressor.stdin.take().ok_or("The compressor has no stdin")?;
+    let compressor_stdout = compressor.stdout.take().ok_or("The compressor has no stdout")?;
+
+    // An incremental stream needs a full image beside it: only full streams are accepted
+    let feeder = tokio::spawn(async move {
+        let mut stdin = tokio::io::stdin();
+        let mut head = Vec::with_capacity(STREAM_PEEK_SIZE);
+        (&mut stdin).take(STREAM_PEEK_SIZE as u64).read_to_end(&mut head).await?;
+        if let Some(parent_uuid) = embuer::btrfs::read_parent_uuid(&mut head.as_slice()).await? {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::InvalidInput,
+                format!("The stream on stdin is incremental against {parent_uuid}, --stdin needs a full stream"),
+            ));
+        }
+
+        compressor_stdin.write_all(&head).await?;
+        let mut stdin = BufReader::with_capacity(STREAM_BLOCK_SIZE, stdin);
+        tokio::io::copy_buf(&mut stdin, &mut compressor_stdin).await?;
+        Ok::<(), std::io::Error>(())
+    });
+
+    let package_path = cli.path.join("update_package.tar");
+    let package = std::fs::OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(&package_path)
+        .inspect_err(|e| error!("Error creating the update package {}: {e}", package_path.display()))?;
+
+    // The writer thread hashes the chunks and the whole payload for the index while writing it,
+    // the signed SHA512 digest is computed on the hashing thread of the reader
+    let (block_tx, block_rx) = tokio::sync::mpsc::channel::<Vec<u8>>(STREAM_QUEUE_DEPTH);
+    let block_writer = BlockWriter { blocks: block_rx, file: package.try_clone()?, offset: reserved_header_offset + TAR_BLOCK_SIZE as u64, block: vec![], position: 0 };
+    let writer = std::thread::Builder::new()
+        .name("embuer-writer".to_string())
+        .spawn(move || {
+            let mut payload = DigestReader { inner: block_writer, digest: Sha256::new() };
+            let table = ChunkTable::compute(&mut payload, DEFAULT_CHUNK_SIZE)?;
+            Ok::<_, std::io::Error>((table, hex::encode(payload.digest.finalize())))
+        })?;
+
+    let mut payload = HashingReader::with_hash_thread(compressor_stdout, DEFAULT_HASH_QUEUE_DEPTH);
+    loop {
+        let mut block = Vec::with_capacity(STREAM_BLOCK_SIZE);
+        (&mut payload).take(STREAM_BLOCK_SIZE as u64).read_to_end(&mut block).await?;
+        // A closed queue means that the writer failed: its error is reported below
+        if block.is_empty() || block_tx.send(block).await.is_err() {
+            break;
+        }
+    }
+    drop(block_tx);
+    let payload_sha512 = payload.get_hash().await.ok_or("Error hashing the payload")?;
+    drop(payload);
+
+    let (table, payload_sha256) = tokio::task::spawn_blocking(move || writer.join())
+        .await?
+        .map_err(|_| "The payload writer panicked")?
+        .inspect_err(|e| error!("Error writing the payload: {e}"))?;
+    feeder.await?.inspect_err(|e| error!("Error reading the stream on stdin: {e}"))?;
+    let status = compressor.wait().await?;
+    if !status.success() {
+        error!("The compressor failed: {status}");
+        return Err("Error compressing the stream on stdin".into());
+    }
+
+    let payload_size = table.total_size();
+    info!("Compressed the stream on stdin into {payload_size} bytes of {payload_name}");
+
+    let table_bytes = table.to_bytes();
+    let table_signature = sign_digest(&private_key, &public_key, &hex::encode(Sha512::digest(&table_bytes)))?;
+    let signature = sign_digest(&private_key, &public_key, &payload_sha512)?;
+    entries.push(("update.chunks".to_string(), table_bytes));
+    entries.push(("update.chunks.signature".to_string(), table_signature));
+    entries.push(("update.signature".to_string(), signature));
+
+    // The padding entry fills the head up to the payload header
+    let block = TAR_BLOCK_SIZE as u64;
+    let head_end = layout_end(&PackageIndex::layout(entries.iter().map(|(name, data)| (name.clone(), data.len() as u64, String::new()))));
+    let payload_header_offset = if head_end == reserved_header_offset {
+        head_end
+    } else if head_end + block <= reserved_header_offset {
+        entries.push((PADDING_ENTRY.to_string(), vec![0u8; (reserved_header_offset - head_end - block) as usize]));
+        reserved_header_offset
+    } else {
+        warn!("The chunk table of {payload_size} bytes does not fit the head of the package: moving the payload");
+        move_payload(&package, reserved_header_offset + block, head_end + block, payload_size)?;
+        head_end
+    };
+
+    let mut files: Vec<(String, u64, String)> = entries
+        .iter()
+        .map(|(name, data)| (name.clone(), data.len() as u64, hex::encode(Sha256::digest(data))))
+        .collect();
+    files.push((payload_name.to_string(), payload_size, payload_sha256));
+    let index = PackageIndex::layout(files);
+
+    let mtime = SystemTime::now().duration_since(UNIX_EPOCH)?.as_secs();
+    let mut head = tar_header(INDEX_ENTRY, INDEX_SIZE as u64, mtime)?.to_vec();
+    head.extend(index.to_bytes()?);
+    for (name, data) in &entries {
+        head.extend(tar_header(name, data.len() as u64, mtime)?);
+        head.extend(data);
+        head.resize(head.len().next_multiple_of(TAR_BLOCK_SIZE), 0);
+    }
+    if head.len() as u64 != payload_header_offset {
+        return Err("The head of the update package does not match its index".into());
+    }
+    head.extend(tar_header(payload_name, payload_size, mtime)?);
+    package.write_all_at(&head, 0)?;
+
+    // The payload padded to a block, then two blocks of zeros end the archive
+    let payload_end = payload_header_offset + block + payload_size;
+    let trailer = payload_end.next_multiple_of(block) - payload_end + 2 * block;
+    package.write_all_at(&vec![0u8; trailer as usize], payload_end)?;
+
+    // Readers trust the offsets of the index: refuse a package that does not match them
+    PackageIndex::read(&package)?
+        .ok_or("The update package does not start with its index")?
+        .check(&package)
+        .inspect_err(|e| error!("Error checking the update package: {e}"))?;
 
-        info!("Removed deployment file {}", update_btrfs_xz.display());
+    info!("Generated update package at {}", package_path.display());
+
+    Ok(())
+}
+
+/// Offset following the data of the last entry of `index`, where the header of the next entry goes
+fn layout_end(index: &PackageIndex) -> u64 {
+    index.entries().last().map_or(INDEX_HEAD_SIZE as u64, |entry| {
+        entry.offset() + entry.size().next_multiple_of(TAR_BLOCK_SIZE as u64)
+    })
+}
+
+/// Move the `size` bytes at offset `from` of `file` to the larger offset `to`,
+/// starting from the end so that every byte is read before being overwritten
+fn move_payload(file: &std::fs::File, from: u64, to: u64, size: u64) -> std::io::Result<()> {
+    let mut buffer = vec![0u8; STREAM_BLOCK_SIZE];
+    let mut remaining = size;
+    while remaining > 0 {
+        let len = remaining.min(buffer.len() as u64);
+        remaining -= len;
+        let block = &mut buffer[..len as usize];
+        file.read_exact_at(block, from + remaining)?;
+        file.write_all_at(block, to + remaining)?;
     }
 
     Ok(())
-}
\ No newline at end of file
+}
+
+/// Read an RSA private key in PEM format, either PKCS#1 or PKCS#8 as written by `openssl genrsa`
+fn read_private_key(path: &Path) -> Result<RsaPrivateKey, Box<dyn std::error::Error>> {
+    let pem = std::fs::read_to_string(path)
+        .inspect_err(|e| error!("Error reading the private key {}: {e}", path.display()))?;
+    let private_key = RsaPrivateKey::from_pkcs1_pem(&pem)
+        .or_else(|_| RsaPrivateKey::from_pkcs8_pem(&pem))
+        .inspect_err(|e| error!("Error reading the private key {}: {e}", path.display()))?;
+
+    Ok(private_key)
+}
+
+/// Sign the hex SHA512 digest `sha512` as `openssl dgst -sha512 -sign` does (PKCS#1 v1.5),
+/// then check the signature the way the service does
+fn sign_digest(
+    private_key: &RsaPrivateKey,
+    public_key: &RsaPublicKey,
+    sha512: &str,
+) -> Result<Vec<u8>, Box<dyn std::error::Error>> {
+    let digest_info = [&SHA512_DIGEST_INFO[..], &hex::decode(sha512)?].concat();
+    let signature = private_key.sign_with_rng(&mut rand::thread_rng(), Pkcs1v15Sign::new_unprefixed(), &digest_info)?;
+
+    embuer::core::verify_signature(public_key, &signature, sha512)
+        .inspect_err(|e| error!("Update signature verification failed: {e}"))?;
+
+    Ok(signature)
+}
+
+/// Reader of the blocks received from `blocks`, writing each block into `file` from `offset` on
+struct BlockWriter {
+    blocks: tokio::sync::mpsc::Receiver<Vec<u8>>,
+    file: std::fs::File,
+    offset: u64,
+    block: Vec<u8>,
+    position: usize,
+}
+
+impl Read for BlockWriter {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        if self.position == self.block.len() {
+            let Some(block) = self.blocks.blocking_recv() else {
+                return Ok(0);
+            };
+            self.file.write_all_at(&block, self.offset)?;
+            self.offset += block.len() as u64;
+            self.block = block;
+            self.position = 0;
+        }
+
+        let len = buf.len().min(self.block.len() - self.position);
+        buf[..len].copy_from_slice(&self.block[self.position..self.position + len]);
+        self.position += len;
+        Ok(len)
+    }
+}
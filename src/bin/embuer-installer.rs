@@ -23,12 +23,14 @@ use std::{collections::VecDeque, path::PathBuf, sync::Arc};
 
 use argh::FromArgs;
 use embuer::manifest::Manifest;
+use embuer::package::{IndexEntry, PackageIndex, INDEX_HEAD_SIZE};
 use futures::TryStreamExt;
 use log::{debug, error, info, warn};
 use owo_colors::OwoColorize;
-use reqwest::Client;
+use reqwest::header::RANGE;
+use reqwest::{Client, StatusCode};
 use std::pin::Pin;
-use tokio::io::{AsyncRead, AsyncReadExt, BufReader};
+use tokio::io::{AsyncBufReadExt, AsyncRead, AsyncReadExt, AsyncSeekExt, BufReader};
 use tokio::process::Command;
 use tokio_tar::Archive;
 use tokio_util::io::StreamReader;
@@ -108,6 +110,24 @@ struct EmbuerInstallCli {
 
     #[argh(option, description = "the directory in which the deployment will be generated")]
     pub generate_deployment: Option<PathBuf>,
+
+    #[argh(
+        switch,
+        description = "decompress the deployment with an external xz process instead of in-process"
+    )]
+    pub external_xz: bool,
+
+    #[argh(
+        switch,
+        description = "apply the deployment in-process instead of with the btrfs receive tool"
+    )]
+    pub native_receiver: bool,
+
+    #[argh(
+        switch,
+        description = "hash the deployment on a dedicated thread, overlapping with decompression"
+    )]
+    pub hash_thread: bool,
 }
 
 enum Architecture {
@@ -207,11 +227,116 @@ fn render_changelog_tui(changelog: &str, source: &str) {
     println!("{}", border_bot.bright_cyan());
 }
 
+/// Full image entries of an update package
+const FULL_PAYLOAD_ENTRIES: [&str; 2] = ["update.btrfs.xz", "update.btrfs.zst"];
+
+/// Select the decoder of the payload entry `name` and show the changelog, if any
+fn prepare_payload(
+    name: &str,
+    changelog: Option<&str>,
+    zstd_dictionary: Option<Vec<u8>>,
+    external_xz: bool,
+) -> Result<embuer::core::Decompressor, Box<dyn std::error::Error>> {
+    info!("Found {name} inside update package");
+    let decompressor = embuer::core::Decompressor::for_entry(name, external_xz, zstd_dictionary.map(Into::into))
+        .ok_or_else(|| std::io::Error::other(format!("Unsupported compression of {name}")))?;
+    if let Some(cl) = changelog {
+        // Best-effort pretty changelog display; failures here should not abort install
+        let source_str = "update package";
+        render_changelog_tui(cl, source_str);
+    }
+
+    Ok(decompressor)
+}
+
+/// Read the full image of the indexed update package `path` from its offset,
+/// skipping the entries before it. Returns `None` for packages without an index.
+async fn extract_update_stream_from_indexed_file(
+    path: &std::path::Path,
+    external_xz: bool,
+) -> Result<Option<(Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>, embuer::core::Decompressor)>, Box<dyn std::error::Error>> {
+    let file = std::fs::File::open(path)?;
+    let Some(index) = PackageIndex::read(&file)? else {
+        return Ok(None);
+    };
+    index.check(&file)?;
+
+    let payload = FULL_PAYLOAD_ENTRIES
+        .iter()
+        .find_map(|name| index.entry(name))
+        .ok_or_else(|| std::io::Error::new(std::io::ErrorKind::NotFound, "update.btrfs.xz or update.btrfs.zst not found in update package"))?;
+    let changelog = index.entry("CHANGELOG").map(|entry| entry.read(&file)).transpose()?;
+    let zstd_dictionary = index.entry("update.zstd.dict").map(|entry| entry.read(&file)).transpose()?;
+    let changelog = changelog.map(|content| String::from_utf8_lossy(&content).into_owned());
+    let decompressor = prepare_payload(payload.name(), changelog.as_deref(), zstd_dictionary, external_xz)?;
+
+    let mut file = tokio::fs::File::from_std(file);
+    file.seek(std::io::SeekFrom::Start(payload.offset())).await?;
+    let update_stream = Box::pin(file.take(payload.size())) as Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>;
+    Ok(Some((update_stream, decompressor)))
+}
+
+/// Fetch `range` of `url`, or `None` if the server does not send that range
+async fn fetch_range(client: &Client, url: &str, range: String) -> Result<Option<reqwest::Response>, Box<dyn std::error::Error>> {
+    let resp = client.get(url).header(RANGE, range).send().await?;
+    Ok((resp.status() == StatusCode::PARTIAL_CONTENT).then_some(resp))
+}
+
+/// Download the full image of the indexed update package at `url` with range
+/// requests: the index, then the metadata entries in one request, then the
+/// payload, skipping the incremental stream the installer never applies.
+/// Returns `None` for packages without an index or servers without ranges.
+async fn extract_update_stream_from_indexed_url(
+    client: &Client,
+    url: &str,
+    external_xz: bool,
+) -> Result<Option<(Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>, embuer::core::Decompressor)>, Box<dyn std::error::Error>> {
+    let Some(resp) = fetch_range(client, url, format!("bytes=0-{}", INDEX_HEAD_SIZE - 1)).await? else {
+        return Ok(None);
+    };
+    let Some(index) = PackageIndex::from_head(&resp.bytes().await?)? else {
+        return Ok(None);
+    };
+    let Some(payload) = FULL_PAYLOAD_ENTRIES.iter().find_map(|name| index.entry(name)) else {
+        return Err(Box::new(std::io::Error::new(std::io::ErrorKind::NotFound, "update.btrfs.xz or update.btrfs.zst not found in update package")));
+    };
+
+    // The metadata entries lead the package: a single range covers all of them
+    let metadata: Vec<&IndexEntry> = ["CHANGELOG", "update.zstd.dict"].iter().filter_map(|name| index.entry(name)).collect();
+    let mut contents: Vec<Option<Vec<u8>>> = vec![None; metadata.len()];
+    if let (Some(first), Some(end)) = (metadata.iter().map(|entry| entry.offset()).min(), metadata.iter().map(|entry| entry.offset() + entry.size()).max()) {
+        let Some(resp) = fetch_range(client, url, format!("bytes={first}-{}", end - 1)).await? else {
+            return Ok(None);
+        };
+        let data = resp.bytes().await?;
+        for (entry, content) in metadata.iter().zip(contents.iter_mut()) {
+            let start = (entry.offset() - first) as usize;
+            let data = data.get(start..start + entry.size() as usize).unwrap_or_default();
+            entry.verify(data)?;
+            *content = Some(data.to_vec());
+        }
+    }
+
+    let mut contents = metadata.iter().map(|entry| entry.name()).zip(contents).collect::<std::collections::HashMap<_, _>>();
+    let changelog = contents.remove("CHANGELOG").flatten().map(|content| String::from_utf8_lossy(&content).into_owned());
+    let zstd_dictionary = contents.remove("update.zstd.dict").flatten();
+    let decompressor = prepare_payload(payload.name(), changelog.as_deref(), zstd_dictionary, external_xz)?;
+
+    let Some(resp) = fetch_range(client, url, payload.range()).await? else {
+        return Ok(None);
+    };
+    let stream_reader = StreamReader::new(resp.bytes_stream().map_err(std::io::Error::other));
+    let update_stream = Box::pin(stream_reader) as Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>;
+    Ok(Some((update_stream, decompressor)))
+}
+
 /// Given a streaming reader for an update package (tar archive),
-/// locate the `update.btrfs.xz` entry and return it as a streaming reader.
+/// locate the `update.btrfs.xz` (or `update.btrfs.zst`) entry and return it
+/// as a streaming reader, together with the decoder it needs.
 async fn extract_update_stream_from_package<R>(
     reader: R,
-) -> Result<Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>, Box<dyn std::error::Error>>
+    external_xz: bool,
+) -> Result<(Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>, embuer::core::Decompressor), Box<dyn std::error::Error>>
 where
     R: AsyncRead + Send + Unpin + 'static,
 {
@@ -219,6 +344,7 @@ where
     let mut entries = archive.entries()?;
 
     let mut changelog: Option<String> = None;
+    let mut zstd_dictionary: Option<Vec<u8>> = None;
 
     while let Some(entry) = entries.try_next().await? {
         let path = entry.path()?;
@@ -227,24 +353,96 @@ where
             let mut reader = BufReader::new(entry);
             reader.read_to_string(&mut content).await?;
             changelog = Some(content);
-        } else if path.as_os_str() == "update.btrfs.xz" {
-            info!("Found update.btrfs.xz inside update package");
-            if let Some(ref cl) = changelog {
-                // Best-effort pretty changelog display; failures here should not abort install
-                let source_str = "update package";
-                render_changelog_tui(cl, source_str);
-            }
+        } else if path.as_os_str() == "update.zstd.dict" {
+            let mut content = Vec::new();
+            let mut reader = BufReader::new(entry);
+            reader.read_to_end(&mut content).await?;
+            zstd_dictionary = Some(content);
+        } else if FULL_PAYLOAD_ENTRIES.contains(&path.display().to_string().as_str()) {
+            let name = path.display().to_string();
+            let decompressor = prepare_payload(&name, changelog.as_deref(), zstd_dictionary, external_xz)?;
             let update_stream = Box::pin(entry) as Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>;
-            return Ok(update_stream);
+            return Ok((update_stream, decompressor));
         }
     }
 
     Err(Box::new(std::io::Error::new(
         std::io::ErrorKind::NotFound,
-        "update.btrfs.xz not found in update package",
+        "update.btrfs.xz or update.btrfs.zst not found in update package",
     )))
 }
 
+/// Open the update stream of the deployment `source`, either a local update
+/// package or an HTTP(S) URL. Returns `None` for a manual installation.
+async fn open_deployment_source(
+    source: &str,
+    external_xz: bool,
+) -> Result<Option<(Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>, embuer::core::Decompressor)>, Box<dyn std::error::Error>> {
+    if source == "manual" {
+        return Ok(None);
+    }
+
+    // Determine source stream: prefer local file if it exists, otherwise try HTTP(S).
+    let local_path = std::path::PathBuf::from(source);
+    let source_stream: (Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>>, _) =
+        if local_path.exists() {
+            info!(
+                "Using local file as deployment source (update package): {}",
+                local_path.display()
+            );
+            match extract_update_stream_from_indexed_file(&local_path, external_xz).await? {
+                Some(indexed) => indexed,
+                None => {
+                    let file = tokio::fs::File::open(&local_path).await?;
+                    extract_update_stream_from_package(file, external_xz).await?
+                }
+            }
+        } else if source.starts_with("https://")
+            || source.starts_with("http://")
+        {
+            let url = source.to_string();
+            info!(
+                "Downloading deployment update package from URL: {}",
+                url
+            );
+
+            // Ranges of the indexed package count bytes of the archive: never gzip
+            let client = embuer::download::http_client()?;
+            if let Some(indexed) = extract_update_stream_from_indexed_url(&client, &url, external_xz).await? {
+                indexed
+            } else {
+                let resp = client
+                    .get(&url)
+                    .send()
+                    .await
+                    .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+
+                if !resp.status().is_success() {
+                    error!("Failed to download {}: HTTP {}", url, resp.status());
+                    return Err(Box::new(std::io::Error::other("Failed to download update"))
+                        as Box<dyn std::error::Error>);
+                }
+
+                let byte_stream = resp.bytes_stream().map_err(std::io::Error::other);
+                let stream_reader = StreamReader::new(byte_stream);
+
+                // The update package is a tar archive; extract the inner update.btrfs.xz
+                extract_update_stream_from_package(stream_reader, external_xz).await?
+            }
+        } else {
+            error!(
+                "Deployment source not found or unsupported: {}",
+                source
+            );
+            return Err(Box::new(std::io::Error::new(
+                std::io::ErrorKind::InvalidInput,
+                "Deployment source not found or unsupported",
+            )) as Box<dyn std::error::Error>);
+        };
+
+    Ok(Some(source_stream))
+}
+
 #[tokio::main]
 async fn main() -> Result<(), Box<dyn std::error::Error>> {
     env_logger::Builder::from_default_env()
@@ -586,335 +784,319 @@ async fn main() -> Result<(), Box<dyn std::error::Error>> {
         None => warn!("No bootloader specified: skipping bootloader installation"),
     }
 
-    match bootloader {
-        Some(Bootloader::Refind) => {
-            info!("Selected bootloader rEFInd requires an espo partition");
-
-            // Create a fat32 boot partition for EFI of 512MiB
-            debug!("EFI partition already created earlier; formatting/mounting only...");
-            let partition_esp = {
-                let mut result = format!("{}", device_partition.display());
-                if result.ends_with(char::is_numeric) {
-                    result = format!("{}p1", result);
-                } else {
-                    result = format!("{}1", result);
-                }
-
-                result
-            };
-
-            info!("Formatting EFI partition {} with FAT32...", partition_esp);
-            Command::new("mkfs.fat")
-                .arg("-F32")
-                .arg(&partition_esp)
-                .status()
-                .await?;
-
-            // Mount ESP partition
-            let esp_mount_dir = {
-                let esp_mount_point =
-                    std::path::PathBuf::from(format!("{}/esp", base_mount_path.display()));
-
-                std::fs::create_dir_all(&esp_mount_point)?;
-
-                info!(
-                    "Mounting ESP partition {} to {}...",
-                    partition_esp,
-                    esp_mount_point.display()
-                );
-
-                Command::new("mount")
-                    .arg(&partition_esp)
-                    .arg(&esp_mount_point)
-                    .status()
-                    .await
-                    .map_err(|e| e.to_string())?;
-
-                mounts.push_front(MountType::Device(std::path::PathBuf::from(&partition_esp)));
-
-                esp_mount_point
-            };
-
-            install_bootloader_refind(
-                &esp_mount_dir,
-                &architecture,
-                rootfs_partuuid.as_str(),
-                cli.cmdline.as_deref().unwrap_or(""),
-                name.as_str(),
-            )
-            .await?;
-        }
-        Some(Bootloader::IMX8(path)) => {
-            info!(
-                "Installing bootloader: IMX8 from file {}...",
-                path.display()
-            );
-
-            todo!()
-        }
-        None => {
-            info!("No bootloader specified: skipping...");
-        }
-    }
-
     // Prepare the rootfs structure
     let btrfs = Arc::new(
         embuer::btrfs::Btrfs::new().map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?,
     );
-    info!(
-        "Prepare the rootfs from source image {}...",
-        cli.deployment_source
-    );
-    let (deployments_dir, deployments_data_dir) =
-        prepare_rootfs_partition(btrfs.clone(), &rootfs_mount_dir).await?;
-
-    let deployment_name = cli.deployment_name.clone();
-    let (deployment_rootfs_dir, deployment_rootfs_data_dir) = match cli.deployment_source.as_str() {
-        "manual" => {
-            prepare_deployment_directories(
-                btrfs.clone(),
-                &deployments_dir,
-                &deployments_data_dir,
-                &deployment_name,
-            )
-            .await?
-        }
-        _ => {
-            // For non-manual installs, the actual deployment subvolume name is determined
-            // by the incoming btrfs stream (e.g. "chimeraos_50"). We cannot know it yet,
-            // so we only compute the paths here; the subvolumes themselves will be created
-            // after install using the real name.
-            let deployment_rootfs_dir = deployments_dir.join(&deployment_name);
-            let deployments_data_rootfs_dir = deployments_data_dir.join(&deployment_name);
-            (deployment_rootfs_dir, deployments_data_rootfs_dir)
-        }
-    };
 
-    // From here on let the core component take over
-    match cli.deployment_source.as_str() {
-        "manual" => {
-            // If a manual kernel source was specified, build and install it now
-            if let Some(kernel_src) = cli.manual_kernel.as_ref() {
-                info!(
-                    "Manual kernel specified: building and installing from {}",
-                    kernel_src
-                );
-                let kernel_path = std::path::Path::new(kernel_src);
-                manual_kernel(
-                    kernel_path,
-                    cli.arch.as_deref(),
-                    cli.manual_kernel_defconfig.as_deref(),
-                    &deployment_rootfs_dir,
-                )
-                .await?;
-            }
+    // The bootloader goes to the ESP and the deployment to the rootfs
+    // partition: the two stages share nothing and run concurrently
+    let bootloader_stage = async {
+        match bootloader {
+            Some(Bootloader::Refind) => {
+                info!("Selected bootloader rEFInd requires an espo partition");
+
+                // Create a fat32 boot partition for EFI of 512MiB
+                debug!("EFI partition already created earlier; formatting/mounting only...");
+                let partition_esp = {
+                    let mut result = format!("{}", device_partition.display());
+                    if result.ends_with(char::is_numeric) {
+                        result = format!("{}p1", result);
+                    } else {
+                        result = format!("{}1", result);
+                    }
 
-            match &cli.manual_script {
-                Some(script_path) => {
-                    info!("Executing manual installation script: {script_path} {} {} {}", cli.deployment_name, deployment_rootfs_dir.display(), deployment_rootfs_data_dir.display());
-                    let status = Command::new(script_path)
-                        .arg(&cli.deployment_name)
-                        .arg(&deployment_rootfs_dir)
-                        .arg(&deployment_rootfs_data_dir)
+                    result
+                };
+
+                // rEFInd is decompressed while the ESP is formatted and mounted
+                let (refind_dir, esp_mount_dir) = tokio::try_join!(extract_refind(), async {
+                    info!("Formatting EFI partition {} with FAT32...", partition_esp);
+                    Command::new("mkfs.fat")
+                        .arg("-F32")
+                        .arg(&partition_esp)
                         .status()
                         .await?;
 
-                    if !status.success() {
-                        error!(
-                            "Manual installation script failed with exit code: {}",
-                            status.code().unwrap_or(-1)
-                        );
-                        return Err(Box::new(std::io::Error::other(
-                            "Manual installation script failed",
-                        )) as Box<dyn std::error::Error>);
-                    }
-                }
-                None => {
-                    info!("No manual installation script specified: entering full manual mode.");
+                    // Mount ESP partition
+                    let esp_mount_point =
+                        std::path::PathBuf::from(format!("{}/esp", base_mount_path.display()));
+
+                    std::fs::create_dir_all(&esp_mount_point)?;
 
                     info!(
-                        "Prepare {} and {} then press enter to complete the installation...",
-                        deployment_rootfs_dir.display(),
-                        deployment_rootfs_data_dir.display()
+                        "Mounting ESP partition {} to {}...",
+                        partition_esp,
+                        esp_mount_point.display()
                     );
-                    let mut input = String::new();
-                    std::io::stdin().read_line(&mut input)?;
-                }
-            }
 
-            let bootfile_installed = deployment_rootfs_dir
-                .clone()
-                .join("boot")
-                .join("bzImage");
+                    Command::new("mount")
+                        .arg(&partition_esp)
+                        .arg(&esp_mount_point)
+                        .status()
+                        .await
+                        .map_err(|e| e.to_string())?;
 
-            if !bootfile_installed.exists() {
-                error!(
-                    "Boot file not found in the deployment: {}",
-                    bootfile_installed.display()
-                );
-                return Err(Box::new(std::io::Error::new(
-                    std::io::ErrorKind::NotFound,
-                    "Boot file not found in the deployment",
-                )) as Box<dyn std::error::Error>);
-            }
+                    mounts.push_front(MountType::Device(std::path::PathBuf::from(&partition_esp)));
 
-            let manifet_installed = deployment_rootfs_dir
-                .clone()
-                .join("usr")
-                .join("share")
-                .join("embuer")
-                .join("manifest.json");
-
-            if !manifet_installed.exists() {
-                error!(
-                    "Manifest file not found in the deployment: {}",
-                    manifet_installed.display()
+                    Ok::<_, Box<dyn std::error::Error>>(esp_mount_point)
+                })?;
+
+                install_bootloader_refind(
+                    &refind_dir,
+                    &esp_mount_dir,
+                    &architecture,
+                    rootfs_partuuid.as_str(),
+                    cli.cmdline.as_deref().unwrap_or(""),
+                    name.as_str(),
+                )
+                .await?;
+            }
+            Some(Bootloader::IMX8(path)) => {
+                info!(
+                    "Installing bootloader: IMX8 from file {}...",
+                    path.display()
                 );
-                return Err(Box::new(std::io::Error::new(
-                    std::io::ErrorKind::NotFound,
-                    "Manifest file not found in the deployment",
-                )) as Box<dyn std::error::Error>);
+
+                todo!()
+            }
+            None => {
+                info!("No bootloader specified: skipping...");
             }
+        }
 
-            // Parse the manifest and decide whether the installed deployment should be read-only
-            let manifest = match Manifest::from_file(&manifet_installed) {
-                Ok(m) => m,
-                Err(err) => {
-                    error!("Failed to read manifest: {}", err);
-                    return Err(Box::new(err) as Box<dyn std::error::Error>);
-                }
-            };
+        Ok::<(), Box<dyn std::error::Error>>(())
+    };
 
-            let subvol_id = btrfs
-                .btrfs_subvol_get_id(&deployment_rootfs_dir)
-                .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+    let deployment_stage = async {
+        info!(
+            "Prepare the rootfs from source image {}...",
+            cli.deployment_source
+        );
 
-            if manifest.is_readonly() {
-                info!("Manifest requests read-only deployment; setting subvolume ID {subvol_id} to read-only...");
-                btrfs
-                    .subvolume_set_ro(&deployment_rootfs_dir)
-                    .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
-            } else {
-                info!("Manifest requests read-write deployment; ensuring subvolume ID {subvol_id} is read-write...");
-                btrfs
-                    .subvolume_set_rw(&deployment_rootfs_dir)
-                    .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+        // Opening the source reads the index and metadata of the update package,
+        // which do not need the rootfs subvolumes
+        let ((deployments_dir, deployments_data_dir), source) = tokio::try_join!(
+            prepare_rootfs_partition(btrfs.clone(), &rootfs_mount_dir),
+            open_deployment_source(cli.deployment_source.as_str(), cli.external_xz),
+        )?;
+
+        let deployment_name = cli.deployment_name.clone();
+        let (deployment_rootfs_dir, deployment_rootfs_data_dir) = match cli.deployment_source.as_str() {
+            "manual" => {
+                prepare_deployment_directories(
+                    btrfs.clone(),
+                    &deployments_dir,
+                    &deployments_data_dir,
+                    &deployment_name,
+                )
+                .await?
             }
+            _ => {
+                // For non-manual installs, the actual deployment subvolume name is determined
+                // by the incoming btrfs stream (e.g. "chimeraos_50"). We cannot know it yet,
+                // so we only compute the paths here; the subvolumes themselves will be created
+                // after install using the real name.
+                let deployment_rootfs_dir = deployments_dir.join(&deployment_name);
+                let deployments_data_rootfs_dir = deployments_data_dir.join(&deployment_name);
+                (deployment_rootfs_dir, deployments_data_rootfs_dir)
+            }
+        };
 
-            let display_root_disk = rootfs_mount_dir.display();
-            info!("Setting the default subvolume of {display_root_disk} to {deployment_name} ({subvol_id})...");
-            btrfs
-                .subvolume_set_default(subvol_id, &rootfs_mount_dir)
-                .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
-        }
-        src => {
-            // Determine source stream: prefer local file if it exists, otherwise try HTTP(S).
-            let local_path = std::path::PathBuf::from(&src);
-            let wrapped_reader: Pin<Box<dyn tokio::io::AsyncRead + Send + Unpin>> =
-                if local_path.exists() {
+        // From here on let the core component take over
+        match source {
+            None => {
+                // If a manual kernel source was specified, build and install it now
+                if let Some(kernel_src) = cli.manual_kernel.as_ref() {
                     info!(
-                        "Using local file as deployment source (update package): {}",
-                        local_path.display()
-                    );
-                    let file = tokio::fs::File::open(&local_path).await?;
-                    extract_update_stream_from_package(file).await?
-                } else if cli.deployment_source.as_str().starts_with("https://")
-                    || cli.deployment_source.as_str().starts_with("http://")
-                {
-                    let url = cli.deployment_source.clone();
-                    info!(
-                        "Downloading deployment update package from URL: {}",
-                        url
+                        "Manual kernel specified: building and installing from {}",
+                        kernel_src
                     );
+                    let kernel_path = std::path::Path::new(kernel_src);
+                    manual_kernel(
+                        kernel_path,
+                        cli.arch.as_deref(),
+                        cli.manual_kernel_defconfig.as_deref(),
+                        &deployment_rootfs_dir,
+                    )
+                    .await?;
+                }
 
-                    let client = Client::new();
-                    let resp = client
-                        .get(&url)
-                        .send()
-                        .await
-                        .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+                match &cli.manual_script {
+                    Some(script_path) => {
+                        info!("Executing manual installation script: {script_path} {} {} {}", cli.deployment_name, deployment_rootfs_dir.display(), deployment_rootfs_data_dir.display());
+                        let status = Command::new(script_path)
+                            .arg(&cli.deployment_name)
+                            .arg(&deployment_rootfs_dir)
+                            .arg(&deployment_rootfs_data_dir)
+                            .status()
+                            .await?;
+
+                        if !status.success() {
+                            error!(
+                                "Manual installation script failed with exit code: {}",
+                                status.code().unwrap_or(-1)
+                            );
+                            return Err(Box::new(std::io::Error::other(
+                                "Manual installation script failed",
+                            )) as Box<dyn std::error::Error>);
+                        }
+                    }
+                    None => {
+                        info!("No manual installation script specified: entering full manual mode.");
 
-                    if !resp.status().is_success() {
-                        error!("Failed to download {}: HTTP {}", url, resp.status());
-                        return Err(Box::new(std::io::Error::other("Failed to download update"))
-                            as Box<dyn std::error::Error>);
+                        info!(
+                            "Prepare {} and {} then press enter to complete the installation...",
+                            deployment_rootfs_dir.display(),
+                            deployment_rootfs_data_dir.display()
+                        );
+                        let mut input = String::new();
+                        BufReader::new(tokio::io::stdin()).read_line(&mut input).await?;
                     }
+                }
 
-                    let byte_stream = resp.bytes_stream().map_err(std::io::Error::other);
-                    let stream_reader = StreamReader::new(byte_stream);
+                let bootfile_installed = deployment_rootfs_dir
+                    .clone()
+                    .join("boot")
+                    .join("bzImage");
 
-                    // The update package is a tar archive; extract the inner update.btrfs.xz
-                    extract_update_stream_from_package(stream_reader).await?
-                } else {
+                if !bootfile_installed.exists() {
                     error!(
-                        "Deployment source not found or unsupported: {}",
-                        cli.deployment_source
+                        "Boot file not found in the deployment: {}",
+                        bootfile_installed.display()
                     );
                     return Err(Box::new(std::io::Error::new(
-                        std::io::ErrorKind::InvalidInput,
-                        "Deployment source not found or unsupported",
+                        std::io::ErrorKind::NotFound,
+                        "Boot file not found in the deployment",
                     )) as Box<dyn std::error::Error>);
-                };
+                }
 
-            // Single unified install call
-            let installed_deployment_name = match embuer::core::install_update(
-                None,
-                rootfs_mount_dir.clone(),
-                deployments_dir.clone(),
-                deployment_name.clone(),
-                &btrfs,
-                wrapped_reader,
-            )
-            .await
-            {
-                Ok(name) => match name {
-                    Some(name) => {
-                        info!("Successfully installed deployment: {name}");
-
-                        if cli.wait.unwrap_or(false) {
-                            info!("Press enter to continue...");
-                            let mut input = String::new();
-                            std::io::stdin().read_line(&mut input)?;
-                        }
+                let manifet_installed = deployment_rootfs_dir
+                    .clone()
+                    .join("usr")
+                    .join("share")
+                    .join("embuer")
+                    .join("manifest.json");
 
-                        let real_name = name;
+                if !manifet_installed.exists() {
+                    error!(
+                        "Manifest file not found in the deployment: {}",
+                        manifet_installed.display()
+                    );
+                    return Err(Box::new(std::io::Error::new(
+                        std::io::ErrorKind::NotFound,
+                        "Manifest file not found in the deployment",
+                    )) as Box<dyn std::error::Error>);
+                }
 
-                        // Ensure the deployments_data layout exists for the actual deployment
-                        // name created by the btrfs stream. We *do not* create the rootfs
-                        // subvolume here, as it already exists.
-                        let data_name = if real_name != deployment_name {
-                            info!(
-                                "Deployment name from stream ({}) differs from requested name ({}); creating data subvolumes for the real name",
-                                real_name, deployment_name
-                            );
-                            real_name.as_str()
-                        } else {
-                            deployment_name.as_str()
-                        };
+                // Parse the manifest and decide whether the installed deployment should be read-only
+                let manifest = match Manifest::from_file(&manifet_installed) {
+                    Ok(m) => m,
+                    Err(err) => {
+                        error!("Failed to read manifest: {}", err);
+                        return Err(Box::new(err) as Box<dyn std::error::Error>);
+                    }
+                };
 
-                        let _real_data_dir =
-                            prepare_deployment_data_directories(btrfs.clone(), &deployments_data_dir, data_name).await?;
+                let subvol_id = btrfs
+                    .btrfs_subvol_get_id(&deployment_rootfs_dir)
+                    .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
 
-                        real_name
-                    }
-                    None => {
-                        error!("Failed to install deployment: no deployment name returned");
-                        return Err(
-                            Box::new(std::io::Error::other("No deployment name returned"))
-                                as Box<dyn std::error::Error>,
-                        );
-                    }
-                },
-                Err(e) => {
-                    error!("Failed to install deployment: {}", e);
-                    return Err(Box::new(e) as Box<dyn std::error::Error>);
+                if manifest.is_readonly() {
+                    info!("Manifest requests read-only deployment; setting subvolume ID {subvol_id} to read-only...");
+                    btrfs
+                        .subvolume_set_ro(&deployment_rootfs_dir)
+                        .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+                } else {
+                    info!("Manifest requests read-write deployment; ensuring subvolume ID {subvol_id} is read-write...");
+                    btrfs
+                        .subvolume_set_rw(&deployment_rootfs_dir)
+                        .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
                 }
-            };
 
-            info!("Installed deployment: {}", installed_deployment_name);
+                let display_root_disk = rootfs_mount_dir.display();
+                info!("Setting the default subvolume of {display_root_disk} to {deployment_name} ({subvol_id})...");
+                btrfs
+                    .subvolume_set_default(subvol_id, &rootfs_mount_dir)
+                    .map_err(|e| Box::new(e) as Box<dyn std::error::Error>)?;
+            }
+            Some((wrapped_reader, decompressor)) => {
+                // Single unified install call
+                let installed_deployment_name = match embuer::core::install_update(
+                    None,
+                    rootfs_mount_dir.clone(),
+                    deployments_dir.clone(),
+                    deployment_name.clone(),
+                    &btrfs,
+                    embuer::core::ReceiveOptions {
+                        decompressor,
+                        receiver: match cli.native_receiver {
+                            true => embuer::core::Receiver::Native,
+                            false => embuer::core::Receiver::BtrfsCli,
+                        },
+                        hash_thread: cli.hash_thread,
+                        progress: None,
+                        metrics: None,
+                        pipe_size: embuer::splice::DEFAULT_PIPE_BUFFER_SIZE,
+                        priority: Default::default(),
+                    },
+                    wrapped_reader,
+                )
+                .await
+                {
+                    Ok(name) => match name {
+                        Some(name) => {
+                            info!("Successfully installed deployment: {name}");
+
+                            if cli.wait.unwrap_or(false) {
+                                info!("Press enter to continue...");
+                                let mut input = String::new();
+                                BufReader::new(tokio::io::stdin()).read_line(&mut input).await?;
+                            }
+
+                            let real_name = name;
+
+                            // Ensure the deployments_data layout exists for the actual deployment
+                            // name created by the btrfs stream. We *do not* create the rootfs
+                            // subvolume here, as it already exists.
+                            let data_name = if real_name != deployment_name {
+                                info!(
+                                    "Deployment name from stream ({}) differs from requested name ({}); creating data subvolumes for the real name",
+                                    real_name, deployment_name
+                                );
+                                real_name.as_str()
+                            } else {
+                                deployment_name.as_str()
+                            };
+
+                            let _real_data_dir =
+                                prepare_deployment_data_directories(btrfs.clone(), &deployments_data_dir, data_name).await?;
+
+                            real_name
+                        }
+                        None => {
+                            error!("Failed to install deployment: no deployment name returned");
+                            return Err(
+                                Box::new(std::io::Error::other("No deployment name returned"))
+                                    as Box<dyn std::error::Error>,
+                            );
+                        }
+                    },
+                    Err(e) => {
+                        error!("Failed to install deployment: {}", e);
+                        return Err(Box::new(e) as Box<dyn std::error::Error>);
+                    }
+                };
+
+                info!("Installed deployment: {}", installed_deployment_name);
+            }
         }
+
+        Ok::<_, Box<dyn std::error::Error>>(deployment_rootfs_dir)
     };
 
+    let ((), deployment_rootfs_dir) = tokio::try_join!(bootloader_stage, deployment_stage)?;
+
     // TODO: here if asked extract the deployment
     if let Some(btrfs_send_path) = cli.generate_deployment.as_ref() {
         let btrfs_send_file = btrfs_send_path.join(format!("update.btrfs"));
@@ -1171,24 +1353,31 @@ async fn prepare_rootfs_partition(
     btrfs: Arc<embuer::btrfs::Btrfs>,
     rootfs_mount_dir: &std::path::Path,
 ) -> Result<(std::path::PathBuf, std::path::PathBuf), Box<dyn std::error::Error>> {
-    let deployments_dir = rootfs_mount_dir.join("deployments");
-    let result = btrfs.subvolume_create(&deployments_dir)?;
-    debug!("{}", result.trim());
+    // The btrfs tool is run synchronously: keep it off the stages running meanwhile
+    let rootfs_mount_dir = rootfs_mount_dir.to_path_buf();
+    let dirs = tokio::task::spawn_blocking(move || -> Result<_, embuer::ServiceError> {
+        let deployments_dir = rootfs_mount_dir.join("deployments");
+        let result = btrfs.subvolume_create(&deployments_dir)?;
+        debug!("{}", result.trim());
 
-    let deployments_data_dir = rootfs_mount_dir.join("deployments_data");
-    let result = btrfs.subvolume_create(&deployments_data_dir)?;
-    debug!("{}", result.trim());
+        let deployments_data_dir = rootfs_mount_dir.join("deployments_data");
+        let result = btrfs.subvolume_create(&deployments_data_dir)?;
+        debug!("{}", result.trim());
 
-    info!("Sealing the main subvolume");
-    btrfs.subvolume_set_ro(rootfs_mount_dir)?;
+        info!("Sealing the main subvolume");
+        btrfs.subvolume_set_ro(&rootfs_mount_dir)?;
 
-    Ok((deployments_dir, deployments_data_dir))
+        Ok((deployments_dir, deployments_data_dir))
+    })
+    .await??;
+
+    Ok(dirs)
 }
 
 const ZIP_DATA: &[u8] = include_bytes!("../../refind-bin-0.14.2.zip");
-async fn decompress_refind(
+fn decompress_refind(
     destination: &std::path::Path,
-) -> Result<(), Box<dyn std::error::Error>> {
+) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
     use std::io::Cursor;
     use zip::ZipArchive;
 
@@ -1224,28 +1413,40 @@ async fn decompress_refind(
     Ok(())
 }
 
-const REFIND_CONFIG: &[u8] = include_bytes!("../../refind.conf");
-const SHIM_BOOTX64: &[u8] = include_bytes!("../../BOOTX64.EFI");
-const SHIM_MMX64: &[u8] = include_bytes!("../../mmx64.efi");
-async fn install_bootloader_refind(
-    mount_point: &std::path::Path,
-    arch: &Architecture,
-    rootfs_partuuid: &str,
-    cmdline: &str,
-    name: &str,
-) -> Result<(), Box<dyn std::error::Error>> {
+/// Decompress rEFInd to a temporary directory on a blocking thread, so that
+/// the stages running meanwhile are not stalled
+async fn extract_refind() -> Result<std::path::PathBuf, Box<dyn std::error::Error>> {
     let tmp_dir = std::env::temp_dir().join("refind_install");
     if tmp_dir.exists() {
         std::fs::remove_dir_all(&tmp_dir)?;
     }
     std::fs::create_dir_all(&tmp_dir)?;
-    decompress_refind(&tmp_dir).await?;
+
+    let destination = tmp_dir.clone();
+    tokio::task::spawn_blocking(move || decompress_refind(&destination))
+        .await?
+        .map_err(|e| e as Box<dyn std::error::Error>)?;
 
     info!(
         "Decompressed rEFInd to temporary directory: {}",
         tmp_dir.display()
     );
 
+    Ok(tmp_dir)
+}
+
+const REFIND_CONFIG: &[u8] = include_bytes!("../../refind.conf");
+const SHIM_BOOTX64: &[u8] = include_bytes!("../../BOOTX64.EFI");
+const SHIM_MMX64: &[u8] = include_bytes!("../../mmx64.efi");
+/// Install rEFInd, decompressed in `tmp_dir` by [`extract_refind`], on the ESP mounted at `mount_point`
+async fn install_bootloader_refind(
+    tmp_dir: &std::path::Path,
+    mount_point: &std::path::Path,
+    arch: &Architecture,
+    rootfs_partuuid: &str,
+    cmdline: &str,
+    name: &str,
+) -> Result<(), Box<dyn std::error::Error>> {
     let refind_search_result = Command::new("find")
         .arg(&tmp_dir)
         .arg("-name")
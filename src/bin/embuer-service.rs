@@ -64,27 +64,26 @@ async fn main() -> Result<(), ServiceError> {
         },
     };
 
-    // Probe for btrfs tool and construct wrapper. If this fails, terminate.
-    let btrfs = match embuer::btrfs::Btrfs::new() {
-        Ok(b) => {
-            info!("Found btrfs: {}", b.version());
-            b
-        }
-        Err(e) => {
-            error!("btrfs probe failed: {e}");
-            return Err(e);
-        }
-    };
-
-    let service = Arc::new(RwLock::new(service::Service::new(config.clone(), btrfs)?));
+    // The btrfs tool is only probed when an update needs it: the running
+    // deployment is found with ioctls
+    let btrfs = embuer::btrfs::Btrfs::lazy();
+
+    // Connect to the bus while the running deployment is looked up
+    let (dbus_manager, service) = tokio::try_join!(
+        async {
+            connection::Builder::system()
+                .map_err(ServiceError::ZbusError)?
+                .build()
+                .await
+                .map_err(ServiceError::ZbusError)
+        },
+        async { tokio::task::spawn_blocking(move || service::Service::new(config, btrfs)).await? },
+    )?;
+    let service = Arc::new(RwLock::new(service));
 
-    let dbus_manager = connection::Builder::system()
-        .map_err(ServiceError::ZbusError)?
-        .name("org.neroreflex.embuer")
-        .map_err(ServiceError::ZbusError)?
-        .serve_at("/org/neroreflex/embuer", EmbuerDBus::new(service.clone()))
-        .map_err(ServiceError::ZbusError)?
-        .build()
+    dbus_manager
+        .object_server()
+        .at("/org/neroreflex/embuer", EmbuerDBus::new(service.clone()))
         .await
         .map_err(ServiceError::ZbusError)?;
 
@@ -98,6 +97,13 @@ async fn main() -> Result<(), ServiceError> {
     let signal_emitter = interface_ref.signal_emitter().clone();
     EmbuerDBus::start_status_monitor(service.clone(), signal_emitter).await;
 
+    // Requested last: on D-Bus activation, callers wait for the name and
+    // find the object served and the status monitor running
+    dbus_manager
+        .request_name("org.neroreflex.embuer")
+        .await
+        .map_err(ServiceError::ZbusError)?;
+
     info!("Application running (status monitor active)");
 
     // Create a signal listener for SIGTERM
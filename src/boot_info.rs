@@ -0,0 +1,147 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Identity of the running deployment, computed once per boot
+//!
+//! The running deployment is the default subvolume of the rootfs when the
+//! service first starts after a boot. It is recorded in [`BOOT_INFO_PATH`],
+//! on a tmpfs, together with the kernel boot ID: a restart of the service
+//! within the same boot (on failure, or on D-Bus activation) reads it back
+//! instead of scanning the deployments again, and keeps protecting the
+//! running deployment even after an update changed the default subvolume.
+
+use std::path::{Path, PathBuf};
+
+use log::warn;
+use serde::{Deserialize, Serialize};
+
+use crate::ServiceError;
+
+/// Random identifier generated by the kernel at every boot
+pub const KERNEL_BOOT_ID_PATH: &str = "/proc/sys/kernel/random/boot_id";
+
+/// Boot info of the running deployment, cleared at every boot
+pub const BOOT_INFO_PATH: &str = "/run/embuer/boot-info.json";
+
+/// Read the identifier of the current boot
+pub fn kernel_boot_id() -> Result<String, ServiceError> {
+    Ok(std::fs::read_to_string(KERNEL_BOOT_ID_PATH)?
+        .trim()
+        .to_string())
+}
+
+/// Running deployment of a boot
+#[derive(Serialize, Deserialize, Debug, Clone, PartialEq, Eq)]
+pub struct BootInfo {
+    kernel_boot_id: String,
+    rootfs_dir: PathBuf,
+    subvolume_id: u64,
+    name: String,
+    uuid: Option<String>,
+}
+
+impl BootInfo {
+    pub fn new(
+        kernel_boot_id: String,
+        rootfs_dir: PathBuf,
+        subvolume_id: u64,
+        name: String,
+        uuid: Option<String>,
+    ) -> Self {
+        Self {
+            kernel_boot_id,
+            rootfs_dir,
+            subvolume_id,
+            name,
+            uuid,
+        }
+    }
+
+    /// Load the boot info saved at `path`, if it was computed during the
+    /// boot `kernel_boot_id` for `rootfs_dir`
+    pub fn load(path: &Path, kernel_boot_id: &str, rootfs_dir: &Path) -> Option<Self> {
+        let content = std::fs::read_to_string(path).ok()?;
+        serde_json::from_str::<Self>(&content)
+            .inspect_err(|e| warn!("Ignoring invalid {}: {e}", path.display()))
+            .ok()
+            .filter(|info| info.kernel_boot_id == kernel_boot_id && info.rootfs_dir == rootfs_dir)
+    }
+
+    /// Persist the boot info to `path`, atomically replacing the previous one
+    pub fn save(&self, path: &Path) -> std::io::Result<()> {
+        if let Some(parent) = path.parent() {
+            std::fs::create_dir_all(parent)?;
+        }
+
+        let content = serde_json::to_string(self).map_err(std::io::Error::other)?;
+        let tmp_path = path.with_extension("tmp");
+        std::fs::write(&tmp_path, content)?;
+        std::fs::rename(&tmp_path, path)
+    }
+
+    /// Subvolume ID of the running deployment
+    pub fn subvolume_id(&self) -> u64 {
+        self.subvolume_id
+    }
+
+    /// Name of the running deployment
+    pub fn name(&self) -> &str {
+        &self.name
+    }
+
+    /// UUID of the running deployment, if it can be the parent of incremental updates
+    pub fn uuid(&self) -> Option<&str> {
+        self.uuid.as_deref()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_boot_info_roundtrip() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("embuer").join("boot-info.json");
+        let rootfs_dir = Path::new("/mnt/rootfs");
+
+        assert_eq!(BootInfo::load(&path, "boot-a", rootfs_dir), None);
+
+        let info = BootInfo::new(
+            "boot-a".to_string(),
+            rootfs_dir.to_path_buf(),
+            256,
+            "deployment_1".to_string(),
+            Some("0c7b2a3e-5d4f-4e8a-9b1c-2d3e4f5a6b7c".to_string()),
+        );
+        info.save(&path).unwrap();
+
+        assert_eq!(BootInfo::load(&path, "boot-a", rootfs_dir), Some(info));
+        assert_eq!(
+            BootInfo::load(&path, "boot-b", rootfs_dir),
+            None,
+            "Boot info of a previous boot must not be used"
+        );
+        assert_eq!(
+            BootInfo::load(&path, "boot-a", Path::new("/mnt/other")),
+            None,
+            "Boot info of another rootfs must not be used"
+        );
+    }
+}
@@ -17,45 +17,88 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+mod deployments;
+mod ioctl;
+mod send_stream;
+mod tree;
+
+pub use deployments::Deployment;
+pub use send_stream::{read_parent_uuid, read_stream_head, ReceiveProgress, StreamSubvol};
+
+use deployments::DeploymentIndex;
+
+use crate::qos::ProcessPriority;
 use crate::ServiceError;
 use log::{error, info};
 use std::os::unix::fs::MetadataExt;
 use std::process::Command;
+use std::sync::Arc;
 use tokio::io::{AsyncBufReadExt, AsyncRead, BufReader};
 use tokio::process::Command as TokioCommand;
 
+/// Number of parsed send stream commands buffered between the reader and the applier
+const RECEIVE_QUEUE_DEPTH: usize = 64;
+
 /// Lightweight wrapper for invoking the `btrfs` command-line tool.
 ///
 /// `Btrfs::new()` attempts to run `btrfs --version` and returns an error
 /// if the executable is not available or returns a non-zero exit status.
+/// `Btrfs::lazy()` defers that probe to the first use of the tool, so that
+/// the native ioctl paths never pay for spawning it.
 pub struct Btrfs {
-    version: String,
+    /// Output of `btrfs --version`, or the reason the tool can't be used
+    version: std::sync::OnceLock<Result<String, String>>,
+    /// Deployments of the last listed deployments directory
+    deployments: std::sync::Mutex<Option<DeploymentIndex>>,
 }
 
 impl Btrfs {
     /// Try to construct a new `Btrfs` instance by probing the installed tool.
     ///
-    /// Returns an IOError-wrapped `ServiceError` when the `btrfs` executable
+    /// Returns a `ServiceError::BtrfsError` when the `btrfs` executable
     /// can't be executed (missing on PATH) or it returns a failing exit
     /// status when asked for its version.
     pub fn new() -> Result<Self, ServiceError> {
-        let output = Command::new("btrfs").arg("--version").output()?;
+        let btrfs = Self::lazy();
+        btrfs.version()?;
+        Ok(btrfs)
+    }
 
-        if !output.status.success() {
-            let stderr = String::from_utf8_lossy(&output.stderr).trim().to_string();
-            return Err(ServiceError::BtrfsError(format!(
-                "btrfs returned non-zero exit status: {}",
-                stderr
-            )));
+    /// Construct a `Btrfs` instance without probing the installed tool:
+    /// the probe runs on the first command that needs it.
+    pub fn lazy() -> Self {
+        Self {
+            version: std::sync::OnceLock::new(),
+            deployments: std::sync::Mutex::new(None),
         }
+    }
 
-        let version = String::from_utf8_lossy(&output.stdout).trim().to_string();
-        Ok(Self { version })
+    /// Return the discovered btrfs version string, probing the tool if needed.
+    pub fn version(&self) -> Result<&str, ServiceError> {
+        self.version
+            .get_or_init(|| {
+                let output = Command::new("btrfs")
+                    .arg("--version")
+                    .output()
+                    .map_err(|e| format!("failed to run btrfs: {e}"))?;
+
+                if !output.status.success() {
+                    let stderr = String::from_utf8_lossy(&output.stderr).trim().to_string();
+                    return Err(format!("btrfs returned non-zero exit status: {stderr}"));
+                }
+
+                Ok(String::from_utf8_lossy(&output.stdout).trim().to_string())
+            })
+            .as_deref()
+            .map_err(|e| ServiceError::BtrfsError(e.clone()))
     }
 
-    /// Return the discovered btrfs version string.
-    pub fn version(&self) -> &str {
-        &self.version
+    /// Forget the indexed deployments, after a subvolume was changed
+    /// without going through this instance (e.g. received by `btrfs receive`)
+    pub fn invalidate_deployments(&self) {
+        if let Ok(mut index) = self.deployments.lock() {
+            *index = None;
+        }
     }
 
     /// Run `btrfs` with arbitrary arguments and return stdout on success.
@@ -67,6 +110,8 @@ impl Btrfs {
         I: IntoIterator<Item = S>,
         S: AsRef<std::ffi::OsStr>,
     {
+        self.version()?;
+
         let output = Command::new("btrfs").args(args).output()?;
         if output.status.success() {
             Ok(String::from_utf8_lossy(&output.stdout).to_string())
@@ -102,6 +147,8 @@ impl Btrfs {
     {
         use tokio::io::AsyncWriteExt;
 
+        self.version()?;
+
         let lossy_path = path.as_ref().as_os_str().to_string_lossy();
         let command = format!("btrfs receive {lossy_path} -e 1>&2");
         let mut btrfs_proc = TokioCommand::new("bash")
@@ -206,6 +253,116 @@ impl Btrfs {
         Ok(subvol_name)
     }
 
+    /// Receive a btrfs send stream in-process, without spawning `btrfs receive`.
+    ///
+    /// The stream is parsed asynchronously and its commands are applied with
+    /// plain syscalls and btrfs ioctls on a blocking thread, so decoding and
+    /// writing to disk overlap. `progress` is updated as commands are applied.
+    ///
+    /// The stream must be terminated by an end command: a truncated stream is
+    /// an error and the partially received subvolume is deleted. After the end
+    /// command the remaining input is drained, so that readers wrapping
+    /// `input_stream` (e.g. hashing) observe the whole payload.
+    ///
+    /// The blocking thread runs with `priority` until the stream is applied.
+    ///
+    /// Returns the received subvolume name, like [`Btrfs::receive`].
+    pub async fn receive_native<R, P>(
+        &self,
+        path: P,
+        mut input_stream: R,
+        progress: Arc<ReceiveProgress>,
+        priority: ProcessPriority,
+    ) -> Result<Option<String>, ServiceError>
+    where
+        R: AsyncRead + Unpin + Send + 'static,
+        P: AsRef<std::path::Path>,
+    {
+        let version = send_stream::read_stream_header(&mut input_stream)
+            .await
+            .inspect_err(|e| error!("Error reading the btrfs send stream header: {e}"))?;
+
+        let mut applier = send_stream::StreamApplier::new(path.as_ref().to_path_buf(), version);
+        let (command_tx, mut command_rx) =
+            tokio::sync::mpsc::channel::<send_stream::SendCommand>(RECEIVE_QUEUE_DEPTH);
+
+        let apply_progress = progress.clone();
+        let apply_task = tokio::task::spawn_blocking(move || {
+            let _priority = priority.apply_to_current_thread();
+            loop {
+                let waiting = std::time::Instant::now();
+                let Some(command) = command_rx.blocking_recv() else {
+                    break;
+                };
+                apply_progress.record_apply_wait(waiting.elapsed());
+
+                if let Err(e) = applier.apply(&command) {
+                    applier.abort();
+                    return Err(e);
+                }
+
+                apply_progress.record(command.stream_len());
+
+                if applier.is_finished() {
+                    return Ok(applier.subvol_name());
+                }
+            }
+
+            applier.abort();
+            Err(std::io::Error::new(
+                std::io::ErrorKind::UnexpectedEof,
+                "btrfs send stream ended before the end command",
+            ))
+        });
+
+        let read_res = async {
+            let mut complete = false;
+            while let Some(command) = send_stream::read_command(&mut input_stream).await? {
+                let end = command.is_end();
+                let len = command.stream_len();
+
+                // A closed channel means the applier failed: its error is reported below
+                let waiting = std::time::Instant::now();
+                if command_tx.send(command).await.is_err() {
+                    break;
+                }
+                progress.record_queued(len, waiting.elapsed());
+
+                if end {
+                    complete = true;
+                    break;
+                }
+            }
+            drop(command_tx);
+
+            if complete {
+                tokio::io::copy(&mut input_stream, &mut tokio::io::sink()).await?;
+            }
+
+            Ok::<(), std::io::Error>(())
+        }
+        .await;
+
+        let apply_res = apply_task.await?;
+
+        // When reading failed the applier only sees a truncated stream: report the cause
+        if let Err(e) = read_res {
+            error!("Error reading the btrfs send stream: {e}");
+            return Err(ServiceError::IOError(e));
+        }
+
+        let subvol_name =
+            apply_res.inspect_err(|e| error!("Error applying the btrfs send stream: {e}"))?;
+
+        info!(
+            "Received btrfs send stream in-process: {} bytes applied, {} commands processed",
+            progress.bytes_applied(),
+            progress.commands_processed()
+        );
+
+        Ok(subvol_name)
+    }
+
     /// Check if the given directory is a btrfs subvolume.
     ///
     /// This method verifies two conditions:
@@ -247,11 +404,11 @@ impl Btrfs {
     /// Get the btrfs subvolume ID of the given subvolume path.
     ///
     /// This method first verifies that the path is a btrfs subvolume,
-    /// then runs `btrfs subvolume show` to retrieve the subvolume ID.
+    /// then queries its ID with `BTRFS_IOC_GET_SUBVOL_INFO`.
     ///
     /// Returns the subvolume ID as a `u64` on success.
     /// Returns an error if the path is not a btrfs subvolume or if
-    /// the ID cannot be retrieved or parsed.
+    /// the ID cannot be retrieved.
     pub fn btrfs_subvol_get_id<P: AsRef<std::path::Path>>(
         &self,
         path: P,
@@ -266,134 +423,94 @@ impl Btrfs {
             )));
         }
 
-        // Run btrfs subvolume show
-        let output = self.run_and_get_stdout(["subvolume", "show", &path_ref.to_string_lossy()])?;
-
-        // Parse the output to find "Subvolume ID:" line
-        for line in output.lines() {
-            let trimmed = line.trim_start();
-            if let Some(id_part) = trimmed.strip_prefix("Subvolume ID:") {
-                let subvol_id = id_part.trim().parse::<u64>().map_err(|e| {
-                    ServiceError::BtrfsError(format!(
-                        "Failed to parse subvolume ID from '{}': {}",
-                        id_part.trim(),
-                        e
-                    ))
-                })?;
-                return Ok(subvol_id);
-            }
-        }
+        let subvol = std::fs::File::open(path_ref)?;
+        let info = ioctl::get_subvol_info(&subvol).map_err(|e| {
+            ServiceError::BtrfsError(format!(
+                "Failed to read the subvolume ID of {:?}: {e}",
+                path_ref
+            ))
+        })?;
 
-        Err(ServiceError::BtrfsError(format!(
-            "Could not find 'Subvolume ID:' in output for {:?}",
-            path_ref
-        )))
+        Ok(info.id)
     }
 
-    /// Set a subvolume to read-write state.
-    ///
-    /// This method ensures the subvolume is in RW state by:
-    /// 1. Verifying it's a btrfs subvolume
-    /// 2. Checking the current read-only property
-    /// 3. Setting ro=false if needed
-    /// 4. Verifying the property was changed successfully
+    /// Make the subvolume at `path` read-only or read-write via the subvolume flags.
     ///
-    /// Returns `Ok(())` on success or if already in RW state.
-    /// Returns an error if the path is not a btrfs subvolume or if
-    /// the property cannot be changed.
-    pub fn subvolume_set_rw<P: AsRef<std::path::Path>>(&self, path: P) -> Result<(), ServiceError> {
-        let path_ref = path.as_ref();
-
+    /// Like `btrfs property set -f`, a received subvolume made read-write
+    /// forgets the UUID it was received from: its content may change, so it
+    /// can't be the parent of incremental streams anymore.
+    fn subvolume_set_readonly(
+        &self,
+        path: &std::path::Path,
+        readonly: bool,
+    ) -> Result<(), ServiceError> {
         // Check if it's a btrfs subvolume
-        if !self.is_btrfs_subvolume(path_ref)? {
+        if !self.is_btrfs_subvolume(path)? {
             return Err(ServiceError::BtrfsError(format!(
                 "The given path {:?} is not a btrfs subvolume",
-                path_ref
+                path
             )));
         }
 
-        // Get current read-only property
-        let property_state =
-            self.run_and_get_stdout(["property", "get", "-fts", &path_ref.to_string_lossy()])?;
-
-        // Check if currently read-only
-        if property_state.contains("ro=true") {
-            // Set to read-write
-            self.run_and_get_stdout([
-                "property",
-                "set",
-                "-fts",
-                &path_ref.to_string_lossy(),
-                "ro",
-                "false",
-            ])?;
-
-            // Verify the change
-            let property_state_after =
-                self.run_and_get_stdout(["property", "get", "-fts", &path_ref.to_string_lossy()])?;
-
-            if !property_state_after.contains("ro=false") {
-                return Err(ServiceError::BtrfsError(format!(
-                    "The subvolume {:?} is still read-only after attempting to set it read-write",
-                    path_ref
-                )));
+        let subvol = std::fs::File::open(path)?;
+        let flags = ioctl::subvol_get_flags(&subvol)?;
+        if (flags & ioctl::BTRFS_SUBVOL_RDONLY != 0) == readonly {
+            return Ok(());
+        }
+
+        self.invalidate_deployments();
+        let flags = match readonly {
+            true => flags | ioctl::BTRFS_SUBVOL_RDONLY,
+            false => flags & !ioctl::BTRFS_SUBVOL_RDONLY,
+        };
+        ioctl::subvol_set_flags(&subvol, flags).map_err(|e| {
+            ServiceError::BtrfsError(format!(
+                "Failed to set the subvolume {:?} {}: {e}",
+                path,
+                match readonly {
+                    true => "read-only",
+                    false => "read-write",
+                }
+            ))
+        })?;
+
+        // The received UUID can only be changed while the subvolume is writable
+        if !readonly {
+            let info = ioctl::get_subvol_info(&subvol)?;
+            if info.received_uuid != [0u8; ioctl::BTRFS_UUID_SIZE] {
+                ioctl::set_received_subvol(&subvol, [0u8; ioctl::BTRFS_UUID_SIZE], 0)?;
             }
         }
 
         Ok(())
     }
 
+    /// Set a subvolume to read-write state.
+    ///
+    /// This method ensures the subvolume is in RW state by:
+    /// 1. Verifying it's a btrfs subvolume
+    /// 2. Checking the current read-only flag
+    /// 3. Clearing the read-only flag if needed
+    ///
+    /// Returns `Ok(())` on success or if already in RW state.
+    /// Returns an error if the path is not a btrfs subvolume or if
+    /// the flag cannot be changed.
+    pub fn subvolume_set_rw<P: AsRef<std::path::Path>>(&self, path: P) -> Result<(), ServiceError> {
+        self.subvolume_set_readonly(path.as_ref(), false)
+    }
+
     /// Set a subvolume to read-only state.
     ///
     /// This method ensures the subvolume is in RO state by:
     /// 1. Verifying it's a btrfs subvolume
-    /// 2. Checking the current read-only property
-    /// 3. Setting ro=true if needed
-    /// 4. Verifying the property was changed successfully
+    /// 2. Checking the current read-only flag
+    /// 3. Setting the read-only flag if needed
     ///
     /// Returns `Ok(())` on success or if already in RO state.
     /// Returns an error if the path is not a btrfs subvolume or if
-    /// the property cannot be changed.
+    /// the flag cannot be changed.
     pub fn subvolume_set_ro<P: AsRef<std::path::Path>>(&self, path: P) -> Result<(), ServiceError> {
-        let path_ref = path.as_ref();
-
-        // Check if it's a btrfs subvolume
-        if !self.is_btrfs_subvolume(path_ref)? {
-            return Err(ServiceError::BtrfsError(format!(
-                "The given path {:?} is not a btrfs subvolume",
-                path_ref
-            )));
-        }
-
-        // Get current read-only property
-        let property_state =
-            self.run_and_get_stdout(["property", "get", "-fts", &path_ref.to_string_lossy()])?;
-
-        // Check if currently read-write
-        if property_state.contains("ro=false") {
-            // Set to read-only
-            self.run_and_get_stdout([
-                "property",
-                "set",
-                "-fts",
-                &path_ref.to_string_lossy(),
-                "ro",
-                "true",
-            ])?;
-
-            // Verify the change
-            let property_state_after =
-                self.run_and_get_stdout(["property", "get", "-fts", &path_ref.to_string_lossy()])?;
-
-            if !property_state_after.contains("ro=true") {
-                return Err(ServiceError::BtrfsError(format!(
-                    "The subvolume {:?} is still read-write after attempting to set it read-only",
-                    path_ref
-                )));
-            }
-        }
-
-        Ok(())
+        self.subvolume_set_readonly(path.as_ref(), true)
     }
 
     /// Set the default subvolume for a btrfs filesystem.
@@ -415,14 +532,13 @@ impl Btrfs {
     ) -> Result<(), ServiceError> {
         let rootfs_ref = rootfs.as_ref();
 
-        self.run_and_get_stdout([
-            "subvolume",
-            "set-default",
-            &subvol_id.to_string(),
-            &rootfs_ref.to_string_lossy(),
-        ])?;
-
-        Ok(())
+        let fs = std::fs::File::open(rootfs_ref)?;
+        ioctl::set_default_subvol(&fs, subvol_id).map_err(|e| {
+            ServiceError::BtrfsError(format!(
+                "Failed to set the default subvolume of {:?} to {subvol_id}: {e}",
+                rootfs_ref
+            ))
+        })
     }
 
     /// Get the default subvolume ID for a btrfs filesystem.
@@ -436,28 +552,20 @@ impl Btrfs {
     /// * `rootfs` - Path to the btrfs filesystem root
     ///
     /// Returns the default subvolume ID as a `u64` on success.
-    /// Returns an error if the command fails or the ID cannot be parsed.
+    /// Returns an error if the root tree cannot be searched.
     pub fn subvolume_get_default<P: AsRef<std::path::Path>>(
         &self,
         rootfs: P,
     ) -> Result<u64, ServiceError> {
         let rootfs_ref = rootfs.as_ref();
 
-        let output =
-            self.run_and_get_stdout(["subvolume", "get-default", &rootfs_ref.to_string_lossy()])?;
-
-        // Parse output like "ID 256 gen 123 top level 5 path deployments/current"
-        // or "ID 5 (FS_TREE)"
-        for word in output.split_whitespace() {
-            if let Ok(id) = word.parse::<u64>() {
-                return Ok(id);
-            }
-        }
-
-        Err(ServiceError::BtrfsError(format!(
-            "Could not parse default subvolume ID from output: {}",
-            output
-        )))
+        let fs = std::fs::File::open(rootfs_ref)?;
+        tree::default_subvol_id(&fs).map_err(|e| {
+            ServiceError::BtrfsError(format!(
+                "Could not read the default subvolume of {:?}: {e}",
+                rootfs_ref
+            ))
+        })
     }
 
     /// Create a btrfs subvolume.
@@ -476,6 +584,7 @@ impl Btrfs {
     ) -> Result<String, ServiceError> {
         let path_ref = path.as_ref();
 
+        self.invalidate_deployments();
         self.run_and_get_stdout(["subvolume", "create", &path_ref.to_string_lossy()])
     }
 
@@ -495,13 +604,120 @@ impl Btrfs {
         path: P,
     ) -> Result<String, ServiceError> {
         let path_ref = path.as_ref();
+
+        self.invalidate_deployments();
         self.run_and_get_stdout(["subvolume", "delete", &path_ref.to_string_lossy()])
     }
 
+    /// Delete several btrfs subvolumes at once.
+    ///
+    /// Each subvolume is deleted with `BTRFS_IOC_SNAP_DESTROY`, without
+    /// waiting for a commit, and the transaction deleting all of them is then
+    /// committed once. The space they used is freed afterwards by the
+    /// filesystem cleaner, in the background.
+    ///
+    /// Like [`Btrfs::subvolume_delete`], a subvolume must not be mounted nor
+    /// be the default subvolume.
+    ///
+    /// Returns the outcome of the deletion of each subvolume, in order.
+    pub fn subvolumes_delete<P: AsRef<std::path::Path>>(
+        &self,
+        paths: &[P],
+    ) -> Vec<Result<(), ServiceError>> {
+        use std::os::unix::ffi::OsStrExt;
+
+        self.invalidate_deployments();
+
+        let mut parent = None;
+        let results: Vec<_> = paths
+            .iter()
+            .map(|path| {
+                let path_ref = path.as_ref();
+                let (Some(dir), Some(name)) = (path_ref.parent(), path_ref.file_name()) else {
+                    return Err(ServiceError::BtrfsError(format!(
+                        "{:?} is not a subvolume inside a directory",
+                        path_ref
+                    )));
+                };
+
+                let dir = std::fs::File::open(dir)?;
+                ioctl::subvol_destroy(&dir, name.as_bytes()).map_err(|e| {
+                    ServiceError::BtrfsError(format!(
+                        "Failed to delete subvolume {:?}: {e}",
+                        path_ref
+                    ))
+                })?;
+
+                parent.get_or_insert(dir);
+                Ok(())
+            })
+            .collect();
+
+        if let Some(dir) = parent {
+            if let Err(e) = ioctl::commit_transaction(&dir) {
+                error!("Failed to commit the deletion of subvolumes: {e}");
+            }
+        }
+
+        results
+    }
+
+    /// Return the bytes available to unprivileged users on the filesystem of `path`.
+    ///
+    /// On btrfs this is an estimate, and space freed by deleted subvolumes
+    /// only shows up once the cleaner reclaimed it.
+    pub fn available_space<P: AsRef<std::path::Path>>(&self, path: P) -> Result<u64, ServiceError> {
+        let stat = nix::sys::statvfs::statvfs(path.as_ref()).map_err(|e| {
+            ServiceError::IOError(std::io::Error::other(format!(
+                "Failed to get filesystem info for {:?}: {e}",
+                path.as_ref()
+            )))
+        })?;
+
+        Ok(stat.blocks_available() as u64 * stat.fragment_size() as u64)
+    }
+
+    /// List the deployments in the deployments directory.
+    ///
+    /// The subvolumes and their manifests are indexed with a search of the
+    /// root tree, and the index is reused as long as neither the directory
+    /// nor, through this instance, its subvolumes changed.
+    ///
+    /// # Arguments
+    ///
+    /// * `deployments_dir` - Path to the deployments directory
+    ///
+    /// Returns an error if the directory cannot be searched.
+    pub fn deployments<P: AsRef<std::path::Path>>(
+        &self,
+        deployments_dir: P,
+    ) -> Result<Vec<Deployment>, ServiceError> {
+        let deployments_ref = deployments_dir.as_ref();
+
+        let mut index = self
+            .deployments
+            .lock()
+            .map_err(|_| ServiceError::BtrfsError("deployment index poisoned".to_string()))?;
+
+        if let Some(current) = index.as_ref().filter(|i| i.is_current(deployments_ref)) {
+            return Ok(current.deployments().to_vec());
+        }
+
+        let scanned = DeploymentIndex::scan(deployments_ref, index.as_ref()).map_err(|e| {
+            ServiceError::BtrfsError(format!(
+                "Failed to list the deployments in {:?}: {e}",
+                deployments_ref
+            ))
+        })?;
+        let deployments = scanned.deployments().to_vec();
+        *index = Some(scanned);
+
+        Ok(deployments)
+    }
+
     /// List all deployment subvolumes in the deployments directory.
     ///
-    /// This method reads the deployments directory and returns a list
-    /// of all entries that are btrfs subvolumes.
+    /// This method returns the subvolumes found by [`Btrfs::deployments`].
     ///
     /// # Arguments
     ///
@@ -513,24 +729,33 @@ impl Btrfs {
         &self,
         deployments_dir: P,
     ) -> Result<Vec<(String, u64, std::path::PathBuf)>, ServiceError> {
-        let deployments_ref = deployments_dir.as_ref();
-
-        let mut result = Vec::new();
+        Ok(self
+            .deployments(deployments_dir)?
+            .into_iter()
+            .map(|deployment| (deployment.name, deployment.id, deployment.path))
+            .collect())
+    }
 
-        let entries = std::fs::read_dir(deployments_ref)?;
+    /// Return the UUID the subvolume at `path` was received from, when it can
+    /// be the parent of an incremental send stream.
+    ///
+    /// Only read-only received subvolumes qualify: an incremental stream
+    /// describes the changes against the exact content of its parent.
+    pub fn subvolume_parent_uuid<P: AsRef<std::path::Path>>(
+        &self,
+        path: P,
+    ) -> Result<Option<String>, ServiceError> {
+        let subvol = std::fs::File::open(path.as_ref())?;
 
-        for entry in entries {
-            let entry = entry?;
-            let path = entry.path();
+        if ioctl::subvol_get_flags(&subvol)? & ioctl::BTRFS_SUBVOL_RDONLY == 0 {
+            return Ok(None);
+        }
 
-            // Check if it's a directory and a btrfs subvolume
-            if path.is_dir() && self.is_btrfs_subvolume(&path)? {
-                let name = entry.file_name().to_string_lossy().to_string();
-                let id = self.btrfs_subvol_get_id(&path)?;
-                result.push((name, id, path));
-            }
+        let info = ioctl::get_subvol_info(&subvol)?;
+        if info.received_uuid == [0u8; ioctl::BTRFS_UUID_SIZE] {
+            return Ok(None);
         }
 
-        Ok(result)
+        Ok(Some(send_stream::format_uuid(&info.received_uuid)))
     }
 }
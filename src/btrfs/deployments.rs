@@ -0,0 +1,142 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! In-memory index of the deployments directory.
+//!
+//! The index is built with a single search of the root tree and reused
+//! until the directory changes: creating or deleting a subvolume in it
+//! updates its modification time, and [`super::Btrfs`] drops the index
+//! whenever it changes a subvolume itself.
+
+use std::io::Result;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+
+use log::{debug, warn};
+
+use super::send_stream::format_uuid;
+use super::tree;
+use crate::manifest::{Manifest, MANIFEST_PATH};
+
+/// A deployment subvolume
+#[derive(Debug, Clone, PartialEq)]
+pub struct Deployment {
+    /// Name of the deployment inside the deployments directory
+    pub name: String,
+    /// Subvolume ID
+    pub id: u64,
+    /// Full path of the deployment subvolume
+    pub path: PathBuf,
+    /// UUID of the subvolume
+    pub uuid: String,
+    /// UUID of the subvolume the deployment was received from, if any
+    pub received_uuid: Option<String>,
+    pub readonly: bool,
+    /// Manifest of the deployment, `None` if missing or invalid
+    pub manifest: Option<Manifest>,
+}
+
+/// Modification time of a directory, in seconds and nanoseconds
+type Mtime = (i64, i64);
+
+fn mtime(dir: &Path) -> Result<Mtime> {
+    let metadata = std::fs::metadata(dir)?;
+    Ok((metadata.mtime(), metadata.mtime_nsec()))
+}
+
+/// The deployments of a directory as of its last scan
+#[derive(Debug)]
+pub(super) struct DeploymentIndex {
+    dir: PathBuf,
+    mtime: Mtime,
+    deployments: Vec<Deployment>,
+}
+
+impl DeploymentIndex {
+    /// Scan the deployments in `dir`
+    ///
+    /// Manifests of read-only deployments already in `previous` are reused,
+    /// as their content can't change.
+    pub(super) fn scan(dir: &Path, previous: Option<&DeploymentIndex>) -> Result<Self> {
+        // Read the time first: a change during the scan makes the index stale
+        let mtime = mtime(dir)?;
+        let handle = std::fs::File::open(dir)?;
+        let dir_ino = handle.metadata()?.ino();
+
+        let deployments = tree::list_child_subvols(&handle, dir_ino)?
+            .into_iter()
+            .map(|entry| {
+                let path = dir.join(&entry.name);
+                let uuid = format_uuid(&entry.uuid);
+
+                let cached = previous
+                    .and_then(|index| index.deployments.iter().find(|d| d.id == entry.id))
+                    .filter(|d| d.readonly && entry.readonly && d.uuid == uuid);
+                let manifest = match cached {
+                    Some(deployment) => deployment.manifest.clone(),
+                    None => read_manifest(&path),
+                };
+
+                Deployment {
+                    name: entry.name,
+                    id: entry.id,
+                    path,
+                    uuid,
+                    received_uuid: (entry.received_uuid != [0; super::ioctl::BTRFS_UUID_SIZE])
+                        .then(|| format_uuid(&entry.received_uuid)),
+                    readonly: entry.readonly,
+                    manifest,
+                }
+            })
+            .collect::<Vec<_>>();
+
+        debug!(
+            "Indexed {} deployments in {}",
+            deployments.len(),
+            dir.display()
+        );
+
+        Ok(Self {
+            dir: dir.to_path_buf(),
+            mtime,
+            deployments,
+        })
+    }
+
+    /// Whether the index still describes the deployments of `dir`
+    pub(super) fn is_current(&self, dir: &Path) -> bool {
+        self.dir == dir && mtime(dir).is_ok_and(|mtime| mtime == self.mtime)
+    }
+
+    pub(super) fn deployments(&self) -> &[Deployment] {
+        &self.deployments
+    }
+}
+
+/// Read the manifest of the deployment at `path`
+fn read_manifest(path: &Path) -> Option<Manifest> {
+    let manifest_path = path.join(MANIFEST_PATH);
+    if !manifest_path.is_file() {
+        return None;
+    }
+
+    Manifest::from_file(&manifest_path)
+        .inspect_err(|e| warn!("Failed to read manifest {}: {e}", manifest_path.display()))
+        .ok()
+}
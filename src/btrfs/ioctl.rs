@@ -0,0 +1,488 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Raw definitions of the btrfs ioctl interface (see linux/btrfs.h).
+
+use std::os::unix::io::AsRawFd;
+
+use nix::{ioctl_read, ioctl_readwrite, ioctl_write_ptr};
+
+const BTRFS_IOCTL_MAGIC: u8 = 0x94;
+
+pub const BTRFS_PATH_NAME_MAX: usize = 4087;
+pub const BTRFS_SUBVOL_NAME_MAX: usize = 4039;
+pub const BTRFS_VOL_NAME_MAX: usize = 255;
+pub const BTRFS_UUID_SIZE: usize = 16;
+
+pub const BTRFS_INO_LOOKUP_PATH_MAX: usize = 4080;
+
+/// Subvolume flag: the subvolume is read-only
+pub const BTRFS_SUBVOL_RDONLY: u64 = 1 << 1;
+
+/// Tree holding the root items of every subvolume
+pub const BTRFS_ROOT_TREE_OBJECTID: u64 = 1;
+/// Directory of the root tree holding the "default" subvolume entry
+pub const BTRFS_ROOT_TREE_DIR_OBJECTID: u64 = 6;
+/// Objectid of the top-level subvolume
+pub const BTRFS_FS_TREE_OBJECTID: u64 = 5;
+/// First objectid available to subvolumes (and inode of a subvolume root)
+pub const BTRFS_FIRST_FREE_OBJECTID: u64 = 256;
+/// Last objectid available to subvolumes
+pub const BTRFS_LAST_FREE_OBJECTID: u64 = -256i64 as u64;
+
+/// Item types (see fs/btrfs/accessors.h)
+pub const BTRFS_DIR_ITEM_KEY: u32 = 84;
+pub const BTRFS_ROOT_ITEM_KEY: u32 = 132;
+pub const BTRFS_ROOT_BACKREF_KEY: u32 = 144;
+/// Item types are stored on disk as a single byte
+pub const BTRFS_MAX_KEY_TYPE: u32 = u8::MAX as u32;
+
+/// Items requested by a single tree search, more than fit in its buffer
+const SEARCH_MAX_ITEMS: u32 = 4096;
+
+/// Root item flag: the subvolume is read-only (on-disk value of [`BTRFS_SUBVOL_RDONLY`])
+pub const BTRFS_ROOT_SUBVOL_RDONLY: u64 = 1 << 0;
+
+#[repr(C)]
+pub struct btrfs_ioctl_vol_args {
+    pub fd: i64,
+    pub name: [u8; BTRFS_PATH_NAME_MAX + 1],
+}
+
+#[repr(C)]
+pub struct btrfs_ioctl_vol_args_v2 {
+    pub fd: i64,
+    pub transid: u64,
+    pub flags: u64,
+    pub unused: [u64; 4],
+    pub name: [u8; BTRFS_SUBVOL_NAME_MAX + 1],
+}
+
+#[repr(C)]
+pub struct btrfs_ioctl_clone_range_args {
+    pub src_fd: i64,
+    pub src_offset: u64,
+    pub src_length: u64,
+    pub dest_offset: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct btrfs_ioctl_timespec {
+    pub sec: u64,
+    pub nsec: u32,
+}
+
+#[repr(C)]
+pub struct btrfs_ioctl_received_subvol_args {
+    pub uuid: [u8; BTRFS_UUID_SIZE],
+    pub stransid: u64,
+    pub rtransid: u64,
+    pub stime: btrfs_ioctl_timespec,
+    pub rtime: btrfs_ioctl_timespec,
+    pub flags: u64,
+    pub reserved: [u64; 16],
+}
+
+#[repr(C)]
+pub struct btrfs_ioctl_get_subvol_info_args {
+    pub treeid: u64,
+    pub name: [u8; BTRFS_VOL_NAME_MAX + 1],
+    pub parent_id: u64,
+    pub dirid: u64,
+    pub generation: u64,
+    pub flags: u64,
+    pub uuid: [u8; BTRFS_UUID_SIZE],
+    pub parent_uuid: [u8; BTRFS_UUID_SIZE],
+    pub received_uuid: [u8; BTRFS_UUID_SIZE],
+    pub ctransid: u64,
+    pub otransid: u64,
+    pub stransid: u64,
+    pub rtransid: u64,
+    pub ctime: btrfs_ioctl_timespec,
+    pub otime: btrfs_ioctl_timespec,
+    pub stime: btrfs_ioctl_timespec,
+    pub rtime: btrfs_ioctl_timespec,
+    pub reserved: [u64; 8],
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct btrfs_ioctl_search_key {
+    pub tree_id: u64,
+    pub min_objectid: u64,
+    pub max_objectid: u64,
+    pub min_offset: u64,
+    pub max_offset: u64,
+    pub min_transid: u64,
+    pub max_transid: u64,
+    pub min_type: u32,
+    pub max_type: u32,
+    pub nr_items: u32,
+    pub unused: u32,
+    pub unused1: u64,
+    pub unused2: u64,
+    pub unused3: u64,
+    pub unused4: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct btrfs_ioctl_search_header {
+    pub transid: u64,
+    pub objectid: u64,
+    pub offset: u64,
+    pub r#type: u32,
+    pub len: u32,
+}
+
+pub const BTRFS_SEARCH_ARGS_BUFSIZE: usize = 4096 - std::mem::size_of::<btrfs_ioctl_search_key>();
+
+#[repr(C)]
+pub struct btrfs_ioctl_search_args {
+    pub key: btrfs_ioctl_search_key,
+    pub buf: [u8; BTRFS_SEARCH_ARGS_BUFSIZE],
+}
+
+#[repr(C)]
+pub struct btrfs_ioctl_ino_lookup_args {
+    pub treeid: u64,
+    pub objectid: u64,
+    pub name: [u8; BTRFS_INO_LOOKUP_PATH_MAX],
+}
+
+ioctl_write_ptr!(
+    btrfs_ioc_clone_range,
+    BTRFS_IOCTL_MAGIC,
+    13,
+    btrfs_ioctl_clone_range_args
+);
+ioctl_write_ptr!(
+    btrfs_ioc_subvol_create,
+    BTRFS_IOCTL_MAGIC,
+    14,
+    btrfs_ioctl_vol_args
+);
+ioctl_write_ptr!(
+    btrfs_ioc_snap_destroy,
+    BTRFS_IOCTL_MAGIC,
+    15,
+    btrfs_ioctl_vol_args
+);
+ioctl_readwrite!(
+    btrfs_ioc_tree_search,
+    BTRFS_IOCTL_MAGIC,
+    17,
+    btrfs_ioctl_search_args
+);
+ioctl_readwrite!(
+    btrfs_ioc_ino_lookup,
+    BTRFS_IOCTL_MAGIC,
+    18,
+    btrfs_ioctl_ino_lookup_args
+);
+ioctl_write_ptr!(btrfs_ioc_default_subvol, BTRFS_IOCTL_MAGIC, 19, u64);
+ioctl_write_ptr!(btrfs_ioc_wait_sync, BTRFS_IOCTL_MAGIC, 22, u64);
+ioctl_write_ptr!(
+    btrfs_ioc_snap_create_v2,
+    BTRFS_IOCTL_MAGIC,
+    23,
+    btrfs_ioctl_vol_args_v2
+);
+ioctl_read!(btrfs_ioc_start_sync, BTRFS_IOCTL_MAGIC, 24, u64);
+ioctl_read!(btrfs_ioc_subvol_getflags, BTRFS_IOCTL_MAGIC, 25, u64);
+ioctl_write_ptr!(btrfs_ioc_subvol_setflags, BTRFS_IOCTL_MAGIC, 26, u64);
+ioctl_readwrite!(
+    btrfs_ioc_set_received_subvol,
+    BTRFS_IOCTL_MAGIC,
+    37,
+    btrfs_ioctl_received_subvol_args
+);
+ioctl_read!(
+    btrfs_ioc_get_subvol_info,
+    BTRFS_IOCTL_MAGIC,
+    60,
+    btrfs_ioctl_get_subvol_info_args
+);
+
+/// Copy `name` into a NUL-terminated ioctl name buffer
+pub fn copy_name<const N: usize>(dest: &mut [u8; N], name: &[u8]) -> std::io::Result<()> {
+    if name.is_empty() || name.len() >= N || name.contains(&0) {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::InvalidInput,
+            format!("invalid subvolume name: {}", String::from_utf8_lossy(name)),
+        ));
+    }
+
+    dest[..name.len()].copy_from_slice(name);
+    dest[name.len()] = 0;
+    Ok(())
+}
+
+/// Create the subvolume `name` inside the directory `parent`
+pub fn subvol_create<F: AsRawFd>(parent: &F, name: &[u8]) -> std::io::Result<()> {
+    let mut args = btrfs_ioctl_vol_args {
+        fd: 0,
+        name: [0; BTRFS_PATH_NAME_MAX + 1],
+    };
+    copy_name(&mut args.name, name)?;
+
+    unsafe { btrfs_ioc_subvol_create(parent.as_raw_fd(), &args) }?;
+    Ok(())
+}
+
+/// Delete the subvolume `name` inside the directory `parent`
+pub fn subvol_destroy<F: AsRawFd>(parent: &F, name: &[u8]) -> std::io::Result<()> {
+    let mut args = btrfs_ioctl_vol_args {
+        fd: 0,
+        name: [0; BTRFS_PATH_NAME_MAX + 1],
+    };
+    copy_name(&mut args.name, name)?;
+
+    unsafe { btrfs_ioc_snap_destroy(parent.as_raw_fd(), &args) }?;
+    Ok(())
+}
+
+/// Create a writable snapshot of the subvolume opened as `source`
+/// named `name` inside the directory `parent`
+pub fn snapshot_create<F: AsRawFd, S: AsRawFd>(
+    parent: &F,
+    source: &S,
+    name: &[u8],
+) -> std::io::Result<()> {
+    let mut args = btrfs_ioctl_vol_args_v2 {
+        fd: source.as_raw_fd() as i64,
+        transid: 0,
+        flags: 0,
+        unused: [0; 4],
+        name: [0; BTRFS_SUBVOL_NAME_MAX + 1],
+    };
+    copy_name(&mut args.name, name)?;
+
+    unsafe { btrfs_ioc_snap_create_v2(parent.as_raw_fd(), &args) }?;
+    Ok(())
+}
+
+/// Clone `len` bytes at `src_offset` of `source` into `dest` at `dest_offset`
+pub fn clone_range<F: AsRawFd, S: AsRawFd>(
+    dest: &F,
+    source: &S,
+    src_offset: u64,
+    len: u64,
+    dest_offset: u64,
+) -> std::io::Result<()> {
+    let args = btrfs_ioctl_clone_range_args {
+        src_fd: source.as_raw_fd() as i64,
+        src_offset,
+        src_length: len,
+        dest_offset,
+    };
+
+    unsafe { btrfs_ioc_clone_range(dest.as_raw_fd(), &args) }?;
+    Ok(())
+}
+
+/// Read the flags (e.g. [`BTRFS_SUBVOL_RDONLY`]) of the subvolume opened as `subvol`
+pub fn subvol_get_flags<F: AsRawFd>(subvol: &F) -> std::io::Result<u64> {
+    let mut flags: u64 = 0;
+    unsafe { btrfs_ioc_subvol_getflags(subvol.as_raw_fd(), &mut flags) }?;
+    Ok(flags)
+}
+
+/// Replace the flags of the subvolume opened as `subvol`
+pub fn subvol_set_flags<F: AsRawFd>(subvol: &F, flags: u64) -> std::io::Result<()> {
+    unsafe { btrfs_ioc_subvol_setflags(subvol.as_raw_fd(), &flags) }?;
+    Ok(())
+}
+
+/// Record the subvolume opened as `subvol` as received from `uuid` at `stransid`
+pub fn set_received_subvol<F: AsRawFd>(
+    subvol: &F,
+    uuid: [u8; BTRFS_UUID_SIZE],
+    stransid: u64,
+) -> std::io::Result<()> {
+    let mut args = btrfs_ioctl_received_subvol_args {
+        uuid,
+        stransid,
+        rtransid: 0,
+        stime: btrfs_ioctl_timespec::default(),
+        rtime: btrfs_ioctl_timespec::default(),
+        flags: 0,
+        reserved: [0; 16],
+    };
+
+    unsafe { btrfs_ioc_set_received_subvol(subvol.as_raw_fd(), &mut args) }?;
+    Ok(())
+}
+
+/// Commit the running transaction of the filesystem containing `fd` and
+/// wait until it is on disk
+pub fn commit_transaction<F: AsRawFd>(fd: &F) -> std::io::Result<()> {
+    let mut transid: u64 = 0;
+    unsafe { btrfs_ioc_start_sync(fd.as_raw_fd(), &mut transid) }?;
+    unsafe { btrfs_ioc_wait_sync(fd.as_raw_fd(), &transid) }?;
+    Ok(())
+}
+
+/// Make the subvolume `id` the default of the filesystem containing `fd`
+pub fn set_default_subvol<F: AsRawFd>(fd: &F, id: u64) -> std::io::Result<()> {
+    unsafe { btrfs_ioc_default_subvol(fd.as_raw_fd(), &id) }?;
+    Ok(())
+}
+
+/// Return the ID of the subvolume containing the file opened as `fd`
+pub fn containing_subvol_id<F: AsRawFd>(fd: &F) -> std::io::Result<u64> {
+    let mut args = btrfs_ioctl_ino_lookup_args {
+        treeid: 0,
+        objectid: BTRFS_FIRST_FREE_OBJECTID,
+        name: [0; BTRFS_INO_LOOKUP_PATH_MAX],
+    };
+
+    unsafe { btrfs_ioc_ino_lookup(fd.as_raw_fd(), &mut args) }?;
+    Ok(args.treeid)
+}
+
+/// Call `visit` with the header and data of every item of the tree search `key`
+///
+/// The search is resumed after the last item returned until the whole range
+/// has been visited. Items are returned in key order; as the range is a
+/// range of (objectid, type, offset) keys, items of any type between the
+/// bounds are returned and must be filtered by `visit`.
+pub fn tree_search<F: AsRawFd>(
+    fd: &F,
+    key: btrfs_ioctl_search_key,
+    mut visit: impl FnMut(&btrfs_ioctl_search_header, &[u8]),
+) -> std::io::Result<()> {
+    const HEADER_LEN: usize = std::mem::size_of::<btrfs_ioctl_search_header>();
+
+    let mut args = btrfs_ioctl_search_args {
+        key,
+        buf: [0; BTRFS_SEARCH_ARGS_BUFSIZE],
+    };
+
+    loop {
+        args.key.nr_items = SEARCH_MAX_ITEMS;
+        unsafe { btrfs_ioc_tree_search(fd.as_raw_fd(), &mut args) }?;
+        if args.key.nr_items == 0 {
+            return Ok(());
+        }
+
+        let mut pos = 0;
+        let mut last = None;
+        for _ in 0..args.key.nr_items {
+            if pos + HEADER_LEN > args.buf.len() {
+                break;
+            }
+            // The header is in CPU order, unlike the on-disk item that follows it
+            let header: btrfs_ioctl_search_header =
+                unsafe { std::ptr::read_unaligned(args.buf[pos..].as_ptr() as *const _) };
+            pos += HEADER_LEN;
+
+            let end = (pos + header.len as usize).min(args.buf.len());
+            visit(&header, &args.buf[pos..end]);
+            pos = end;
+            last = Some(header);
+        }
+
+        // Resume from the key following the last item returned
+        let Some(last) = last else {
+            return Ok(());
+        };
+        let next = match (last.offset, last.r#type, last.objectid) {
+            (u64::MAX, BTRFS_MAX_KEY_TYPE, u64::MAX) => return Ok(()),
+            (u64::MAX, BTRFS_MAX_KEY_TYPE, objectid) => (objectid + 1, 0, 0),
+            (u64::MAX, ty, objectid) => (objectid, ty + 1, 0),
+            (offset, ty, objectid) => (objectid, ty, offset + 1),
+        };
+        (
+            args.key.min_objectid,
+            args.key.min_type,
+            args.key.min_offset,
+        ) = next;
+
+        if (
+            args.key.min_objectid,
+            args.key.min_type,
+            args.key.min_offset,
+        ) > (
+            args.key.max_objectid,
+            args.key.max_type,
+            args.key.max_offset,
+        ) {
+            return Ok(());
+        }
+    }
+}
+
+/// Subvolume information as returned by `BTRFS_IOC_GET_SUBVOL_INFO`
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct SubvolInfo {
+    pub id: u64,
+    pub flags: u64,
+    pub uuid: [u8; BTRFS_UUID_SIZE],
+    pub parent_uuid: [u8; BTRFS_UUID_SIZE],
+    pub received_uuid: [u8; BTRFS_UUID_SIZE],
+    pub ctransid: u64,
+    pub stransid: u64,
+}
+
+/// Query information about the subvolume opened (at its root) as `subvol`
+pub fn get_subvol_info<F: AsRawFd>(subvol: &F) -> std::io::Result<SubvolInfo> {
+    let mut args: btrfs_ioctl_get_subvol_info_args = unsafe { std::mem::zeroed() };
+    unsafe { btrfs_ioc_get_subvol_info(subvol.as_raw_fd(), &mut args) }?;
+
+    Ok(SubvolInfo {
+        id: args.treeid,
+        flags: args.flags,
+        uuid: args.uuid,
+        parent_uuid: args.parent_uuid,
+        received_uuid: args.received_uuid,
+        ctransid: args.ctransid,
+        stransid: args.stransid,
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_ioctl_struct_sizes() {
+        // Sizes are part of the ioctl request codes: they must match linux/btrfs.h
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_vol_args>(), 4096);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_vol_args_v2>(), 4096);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_clone_range_args>(), 32);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_received_subvol_args>(), 200);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_get_subvol_info_args>(), 504);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_search_key>(), 104);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_search_header>(), 32);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_search_args>(), 4096);
+        assert_eq!(std::mem::size_of::<btrfs_ioctl_ino_lookup_args>(), 4096);
+    }
+
+    #[test]
+    fn test_copy_name_rejects_invalid() {
+        let mut buf = [0u8; 8];
+        assert!(copy_name(&mut buf, b"").is_err());
+        assert!(copy_name(&mut buf, b"too-long-name").is_err());
+        assert!(copy_name(&mut buf, b"a\0b").is_err());
+        assert!(copy_name(&mut buf, b"ok").is_ok());
+        assert_eq!(&buf[..3], b"ok\0");
+    }
+}
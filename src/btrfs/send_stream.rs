@@ -0,0 +1,1387 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Parser and applier for the btrfs send stream format (see fs/btrfs/send.h).
+//!
+//! A stream is a magic header followed by commands, each made of a
+//! (length, command, crc32c) header and a list of TLV attributes.
+//! Commands are applied with plain syscalls plus a few btrfs ioctls,
+//! mirroring what `btrfs receive` does.
+
+use std::ffi::{CString, OsStr};
+use std::fs::{File, OpenOptions};
+use std::io::{Error, ErrorKind, Result};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::{FileExt, OpenOptionsExt};
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::path::{Component, Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+use log::{debug, warn};
+use tokio::io::{AsyncRead, AsyncReadExt};
+
+use super::ioctl;
+
+pub const SEND_STREAM_MAGIC: &[u8; 13] = b"btrfs-stream\0";
+
+/// Highest stream version understood by the parser
+pub const SEND_STREAM_MAX_VERSION: u32 = 2;
+
+/// Size of a command header: le32 length, le16 command, le32 crc32c
+const CMD_HEADER_LEN: usize = 10;
+
+/// Upper bound for a single command: the kernel never emits more than
+/// its send buffer (64 KiB for v1, slightly above 128 KiB for v2)
+const CMD_MAX_LEN: usize = 16 * 1024 * 1024;
+
+/// Command types
+mod cmd {
+    pub const SUBVOL: u16 = 1;
+    pub const SNAPSHOT: u16 = 2;
+    pub const MKFILE: u16 = 3;
+    pub const MKDIR: u16 = 4;
+    pub const MKNOD: u16 = 5;
+    pub const MKFIFO: u16 = 6;
+    pub const MKSOCK: u16 = 7;
+    pub const SYMLINK: u16 = 8;
+    pub const RENAME: u16 = 9;
+    pub const LINK: u16 = 10;
+    pub const UNLINK: u16 = 11;
+    pub const RMDIR: u16 = 12;
+    pub const SET_XATTR: u16 = 13;
+    pub const REMOVE_XATTR: u16 = 14;
+    pub const WRITE: u16 = 15;
+    pub const CLONE: u16 = 16;
+    pub const TRUNCATE: u16 = 17;
+    pub const CHMOD: u16 = 18;
+    pub const CHOWN: u16 = 19;
+    pub const UTIMES: u16 = 20;
+    pub const END: u16 = 21;
+    pub const UPDATE_EXTENT: u16 = 22;
+    pub const FALLOCATE: u16 = 23;
+    pub const FILEATTR: u16 = 24;
+    pub const ENCODED_WRITE: u16 = 25;
+    pub const ENABLE_VERITY: u16 = 26;
+}
+
+/// Attribute types
+mod attr {
+    pub const UUID: u16 = 1;
+    pub const CTRANSID: u16 = 2;
+    pub const SIZE: u16 = 4;
+    pub const MODE: u16 = 5;
+    pub const UID: u16 = 6;
+    pub const GID: u16 = 7;
+    pub const RDEV: u16 = 8;
+    pub const MTIME: u16 = 10;
+    pub const ATIME: u16 = 11;
+    pub const XATTR_NAME: u16 = 13;
+    pub const XATTR_DATA: u16 = 14;
+    pub const PATH: u16 = 15;
+    pub const PATH_TO: u16 = 16;
+    pub const PATH_LINK: u16 = 17;
+    pub const FILE_OFFSET: u16 = 18;
+    pub const DATA: u16 = 19;
+    pub const CLONE_UUID: u16 = 20;
+    pub const CLONE_CTRANSID: u16 = 21;
+    pub const CLONE_PATH: u16 = 22;
+    pub const CLONE_OFFSET: u16 = 23;
+    pub const CLONE_LEN: u16 = 24;
+    pub const FALLOCATE_MODE: u16 = 25;
+
+    /// Attribute slots tracked per command
+    pub const MAX: usize = 64;
+}
+
+/// Progress of a native receive, updated as commands are applied
+///
+/// Commands are queued by the stream reader and applied on a blocking
+/// thread: the time either side waits on the queue tells which one is slower.
+#[derive(Debug, Default)]
+pub struct ReceiveProgress {
+    bytes_applied: AtomicU64,
+    commands_processed: AtomicU64,
+    bytes_queued: AtomicU64,
+    peak_queued: AtomicU64,
+    apply_blocked_us: AtomicU64,
+    queue_blocked_us: AtomicU64,
+}
+
+impl ReceiveProgress {
+    /// Bytes of the (decompressed) send stream applied so far
+    pub fn bytes_applied(&self) -> u64 {
+        self.bytes_applied.load(Ordering::Relaxed)
+    }
+
+    /// Number of send stream commands applied so far
+    pub fn commands_processed(&self) -> u64 {
+        self.commands_processed.load(Ordering::Relaxed)
+    }
+
+    /// Peak bytes of commands read but not applied yet
+    pub fn peak_queued_bytes(&self) -> u64 {
+        self.peak_queued.load(Ordering::Relaxed)
+    }
+
+    /// Time the applier waited for commands to be read
+    pub fn apply_blocked(&self) -> Duration {
+        Duration::from_micros(self.apply_blocked_us.load(Ordering::Relaxed))
+    }
+
+    /// Time the reader waited for room in the queue of the applier
+    pub fn queue_blocked(&self) -> Duration {
+        Duration::from_micros(self.queue_blocked_us.load(Ordering::Relaxed))
+    }
+
+    pub(super) fn record(&self, bytes: u64) {
+        self.bytes_applied.fetch_add(bytes, Ordering::Relaxed);
+        self.commands_processed.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub(super) fn record_queued(&self, bytes: u64, waited: Duration) {
+        let queued = self.bytes_queued.fetch_add(bytes, Ordering::Relaxed) + bytes;
+        self.peak_queued.fetch_max(
+            queued.saturating_sub(self.bytes_applied()),
+            Ordering::Relaxed,
+        );
+        self.queue_blocked_us
+            .fetch_add(waited.as_micros() as u64, Ordering::Relaxed);
+    }
+
+    pub(super) fn record_apply_wait(&self, waited: Duration) {
+        self.apply_blocked_us
+            .fetch_add(waited.as_micros() as u64, Ordering::Relaxed);
+    }
+}
+
+const CRC32C_TABLE: [u32; 256] = {
+    let mut table = [0u32; 256];
+    let mut i = 0;
+    while i < 256 {
+        let mut crc = i as u32;
+        let mut bit = 0;
+        while bit < 8 {
+            crc = if crc & 1 != 0 {
+                (crc >> 1) ^ 0x82F6_3B78
+            } else {
+                crc >> 1
+            };
+            bit += 1;
+        }
+        table[i] = crc;
+        i += 1;
+    }
+    table
+};
+
+/// Raw crc32c (no pre/post inversion), as used by the btrfs send stream
+fn crc32c(mut crc: u32, data: &[u8]) -> u32 {
+    for byte in data {
+        crc = CRC32C_TABLE[((crc ^ *byte as u32) & 0xFF) as usize] ^ (crc >> 8);
+    }
+    crc
+}
+
+fn invalid_data(msg: impl Into<String>) -> Error {
+    Error::new(ErrorKind::InvalidData, msg.into())
+}
+
+/// A single command read from the send stream
+pub struct SendCommand {
+    cmd: u16,
+    payload: Vec<u8>,
+}
+
+impl SendCommand {
+    /// Whether this is the end-of-stream marker
+    pub fn is_end(&self) -> bool {
+        self.cmd == cmd::END
+    }
+
+    /// Size of the command in the stream, header included
+    pub fn stream_len(&self) -> u64 {
+        (CMD_HEADER_LEN + self.payload.len()) as u64
+    }
+}
+
+/// Read and validate the stream header, returning the stream version
+pub async fn read_stream_header<R>(reader: &mut R) -> Result<u32>
+where
+    R: AsyncRead + Unpin,
+{
+    let mut magic = [0u8; SEND_STREAM_MAGIC.len()];
+    reader.read_exact(&mut magic).await?;
+    if &magic != SEND_STREAM_MAGIC {
+        return Err(invalid_data("not a btrfs send stream: bad magic"));
+    }
+
+    let version = reader.read_u32_le().await?;
+    if version == 0 || version > SEND_STREAM_MAX_VERSION {
+        return Err(invalid_data(format!(
+            "unsupported btrfs send stream version {version}"
+        )));
+    }
+
+    Ok(version)
+}
+
+/// Read the next command, verifying its checksum.
+///
+/// Returns `None` when the stream ends cleanly before a command header.
+pub async fn read_command<R>(reader: &mut R) -> Result<Option<SendCommand>>
+where
+    R: AsyncRead + Unpin,
+{
+    let mut header = [0u8; CMD_HEADER_LEN];
+    match reader.read_exact(&mut header).await {
+        Ok(_) => {}
+        Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+        Err(e) => return Err(e),
+    }
+
+    let len = u32::from_le_bytes([header[0], header[1], header[2], header[3]]) as usize;
+    let cmd = u16::from_le_bytes([header[4], header[5]]);
+    let crc = u32::from_le_bytes([header[6], header[7], header[8], header[9]]);
+
+    if len > CMD_MAX_LEN {
+        return Err(invalid_data(format!(
+            "send stream command {cmd} too large: {len} bytes"
+        )));
+    }
+
+    let mut payload = vec![0u8; len];
+    reader.read_exact(&mut payload).await?;
+
+    // The checksum covers the header (with a zeroed crc field) and the payload
+    header[6..].fill(0);
+    let computed = crc32c(crc32c(0, &header), &payload);
+    if computed != crc {
+        return Err(invalid_data(format!(
+            "send stream command {cmd} checksum mismatch"
+        )));
+    }
+
+    Ok(Some(SendCommand { cmd, payload }))
+}
+
+/// Read the UUID of the parent of an incremental stream (`btrfs send -p`).
+///
+/// Only the stream header and the first command are consumed: returns
+/// `None` for a full stream, whose first command creates a new subvolume.
+pub async fn read_parent_uuid<R>(reader: &mut R) -> Result<Option<String>>
+where
+    R: AsyncRead + Unpin,
+{
+    let version = read_stream_header(reader).await?;
+    let Some(command) = read_command(reader).await? else {
+        return Err(invalid_data("empty btrfs send stream"));
+    };
+
+    match command.cmd {
+        cmd::SNAPSHOT => {
+            let attrs = Attrs::parse(&command, version)?;
+            Ok(Some(format_uuid(&attrs.uuid(attr::CLONE_UUID)?)))
+        }
+        _ => Ok(None),
+    }
+}
+
+/// Subvolume created by a send stream
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct StreamSubvol {
+    /// Name of the subvolume inside the receiving directory
+    pub name: String,
+    /// UUID of the sent subvolume, recorded as the received UUID
+    pub uuid: String,
+}
+
+/// Read the stream header and the first command, naming the subvolume the
+/// stream creates.
+///
+/// Returns the bytes read along with the subvolume: they must be fed to the
+/// receiver ahead of the rest of the stream.
+pub async fn read_stream_head<R>(reader: &mut R) -> Result<(Vec<u8>, StreamSubvol)>
+where
+    R: AsyncRead + Unpin,
+{
+    let header_len = SEND_STREAM_MAGIC.len() + 4;
+    let mut head = vec![0u8; header_len + CMD_HEADER_LEN];
+    reader.read_exact(&mut head[..header_len]).await?;
+    let version = read_stream_header(&mut &head[..header_len]).await?;
+
+    reader.read_exact(&mut head[header_len..]).await?;
+    let len = u32::from_le_bytes([
+        head[header_len],
+        head[header_len + 1],
+        head[header_len + 2],
+        head[header_len + 3],
+    ]) as usize;
+    if len > CMD_MAX_LEN {
+        return Err(invalid_data(format!(
+            "send stream command too large: {len} bytes"
+        )));
+    }
+    head.resize(header_len + CMD_HEADER_LEN + len, 0);
+    reader
+        .read_exact(&mut head[header_len + CMD_HEADER_LEN..])
+        .await?;
+
+    let Some(command) = read_command(&mut &head[header_len..]).await? else {
+        return Err(invalid_data("empty btrfs send stream"));
+    };
+    if !matches!(command.cmd, cmd::SUBVOL | cmd::SNAPSHOT) {
+        return Err(invalid_data(
+            "btrfs send stream does not start with a subvolume",
+        ));
+    }
+
+    let attrs = Attrs::parse(&command, version)?;
+    let name = attrs.path(attr::PATH)?;
+    if name.components().count() != 1 {
+        return Err(invalid_data(format!(
+            "invalid subvolume name in send stream: {}",
+            name.display()
+        )));
+    }
+
+    let subvol = StreamSubvol {
+        name: name.to_string_lossy().to_string(),
+        uuid: format_uuid(&attrs.uuid(attr::UUID)?),
+    };
+    Ok((head, subvol))
+}
+
+/// Format a UUID the way `btrfs subvolume show` does
+pub fn format_uuid(uuid: &[u8; ioctl::BTRFS_UUID_SIZE]) -> String {
+    let hex = hex::encode(uuid);
+    format!(
+        "{}-{}-{}-{}-{}",
+        &hex[0..8],
+        &hex[8..12],
+        &hex[12..16],
+        &hex[16..20],
+        &hex[20..32]
+    )
+}
+
+/// Attributes of a single command, indexed by attribute type
+struct Attrs<'a> {
+    cmd: u16,
+    values: [Option<&'a [u8]>; attr::MAX],
+}
+
+impl<'a> Attrs<'a> {
+    fn parse(command: &'a SendCommand, version: u32) -> Result<Self> {
+        let mut values = [None; attr::MAX];
+        let data = command.payload.as_slice();
+        let mut pos = 0;
+
+        while pos < data.len() {
+            if pos + 2 > data.len() {
+                return Err(invalid_data("truncated send stream attribute"));
+            }
+            let ty = u16::from_le_bytes([data[pos], data[pos + 1]]);
+            pos += 2;
+
+            // Since v2 the data attribute has no length and spans the rest of the command
+            let value = if version >= 2 && ty == attr::DATA {
+                let value = &data[pos..];
+                pos = data.len();
+                value
+            } else {
+                if pos + 2 > data.len() {
+                    return Err(invalid_data("truncated send stream attribute"));
+                }
+                let len = u16::from_le_bytes([data[pos], data[pos + 1]]) as usize;
+                pos += 2;
+                if pos + len > data.len() {
+                    return Err(invalid_data("truncated send stream attribute"));
+                }
+                let value = &data[pos..pos + len];
+                pos += len;
+                value
+            };
+
+            if let Some(slot) = values.get_mut(ty as usize) {
+                *slot = Some(value);
+            }
+        }
+
+        Ok(Self {
+            cmd: command.cmd,
+            values,
+        })
+    }
+
+    fn bytes(&self, ty: u16) -> Result<&'a [u8]> {
+        self.values
+            .get(ty as usize)
+            .copied()
+            .flatten()
+            .ok_or_else(|| {
+                invalid_data(format!(
+                    "send stream command {} is missing attribute {ty}",
+                    self.cmd
+                ))
+            })
+    }
+
+    fn u64(&self, ty: u16) -> Result<u64> {
+        let value = self.bytes(ty)?;
+        let value: [u8; 8] = value
+            .try_into()
+            .map_err(|_| invalid_data(format!("invalid size of attribute {ty}")))?;
+        Ok(u64::from_le_bytes(value))
+    }
+
+    fn uuid(&self, ty: u16) -> Result<[u8; ioctl::BTRFS_UUID_SIZE]> {
+        self.bytes(ty)?
+            .try_into()
+            .map_err(|_| invalid_data(format!("invalid size of attribute {ty}")))
+    }
+
+    fn timespec(&self, ty: u16) -> Result<libc::timespec> {
+        let value = self.bytes(ty)?;
+        if value.len() != 12 {
+            return Err(invalid_data(format!("invalid size of attribute {ty}")));
+        }
+
+        let sec = u64::from_le_bytes(value[..8].try_into().unwrap_or_default());
+        let nsec = u32::from_le_bytes(value[8..].try_into().unwrap_or_default());
+        Ok(libc::timespec {
+            tv_sec: sec as libc::time_t,
+            tv_nsec: nsec as _,
+        })
+    }
+
+    fn path(&self, ty: u16) -> Result<&'a Path> {
+        let path = Path::new(OsStr::from_bytes(self.bytes(ty)?));
+
+        // Paths are relative to the subvolume being received: never let a
+        // (not yet verified) stream escape from it. Symlinks are handled when
+        // the path is resolved, see open_dir_beneath
+        if path
+            .components()
+            .any(|c| !matches!(c, Component::Normal(_) | Component::CurDir))
+        {
+            return Err(invalid_data(format!(
+                "refusing unsafe path in send stream: {}",
+                path.display()
+            )));
+        }
+
+        Ok(path)
+    }
+}
+
+fn check(ret: libc::c_int) -> Result<()> {
+    match ret {
+        -1 => Err(Error::last_os_error()),
+        _ => Ok(()),
+    }
+}
+
+fn c_name(name: &OsStr) -> Result<CString> {
+    CString::new(name.as_bytes()).map_err(|_| invalid_data("path contains a NUL byte"))
+}
+
+/// `openat(2)` returning an owned file
+fn openat(dir: &File, name: &CString, flags: libc::c_int, mode: libc::mode_t) -> Result<File> {
+    let fd = unsafe {
+        libc::openat(
+            dir.as_raw_fd(),
+            name.as_ptr(),
+            flags | libc::O_CLOEXEC,
+            mode as libc::c_uint,
+        )
+    };
+    match fd {
+        -1 => Err(Error::last_os_error()),
+        fd => Ok(unsafe { File::from_raw_fd(fd) }),
+    }
+}
+
+/// Open the directory `rel` beneath `root`, one component at a time and
+/// without following symlinks: like the chroot of `btrfs receive`, a stream
+/// creating `a -> /etc` can't reach outside of the subvolume with `a/passwd`
+fn open_dir_beneath(root: &File, rel: &Path) -> Result<File> {
+    let mut dir = root.try_clone()?;
+    for component in rel.components() {
+        // Attrs::path already refused anything but normal components
+        let Component::Normal(name) = component else {
+            continue;
+        };
+        dir = openat(
+            &dir,
+            &c_name(name)?,
+            libc::O_PATH | libc::O_DIRECTORY | libc::O_NOFOLLOW,
+            0,
+        )?;
+    }
+    Ok(dir)
+}
+
+/// Directory holding the entry `rel` beneath `root`, and the name of the
+/// entry in it (`.` for `root` itself)
+fn entry_beneath(root: &File, rel: &Path) -> Result<(File, CString)> {
+    match rel.file_name() {
+        Some(name) => Ok((
+            open_dir_beneath(root, rel.parent().unwrap_or(Path::new("")))?,
+            c_name(name)?,
+        )),
+        None => Ok((open_dir_beneath(root, rel)?, c_name(OsStr::new("."))?)),
+    }
+}
+
+/// `fstatat(2)` of an entry, without following a symlink
+fn stat_entry(dir: &File, name: &CString) -> Result<libc::stat> {
+    let mut stat = std::mem::MaybeUninit::<libc::stat>::uninit();
+    check(unsafe {
+        libc::fstatat(
+            dir.as_raw_fd(),
+            name.as_ptr(),
+            stat.as_mut_ptr(),
+            libc::AT_SYMLINK_NOFOLLOW,
+        )
+    })?;
+    Ok(unsafe { stat.assume_init() })
+}
+
+/// Open a regular file: never a symlink, nor a device or a fifo created by
+/// the stream itself
+fn open_regular(dir: &File, name: &CString, flags: libc::c_int) -> Result<File> {
+    let is_regular = |stat: &libc::stat| stat.st_mode & libc::S_IFMT == libc::S_IFREG;
+    if !is_regular(&stat_entry(dir, name)?) {
+        return Err(invalid_data(
+            "send stream writes to a file that is not regular",
+        ));
+    }
+
+    let file = openat(dir, name, flags | libc::O_NOFOLLOW | libc::O_NONBLOCK, 0)?;
+    let mut stat = std::mem::MaybeUninit::<libc::stat>::uninit();
+    check(unsafe { libc::fstat(file.as_raw_fd(), stat.as_mut_ptr()) })?;
+    if !is_regular(&unsafe { stat.assume_init() }) {
+        return Err(invalid_data(
+            "send stream writes to a file that is not regular",
+        ));
+    }
+    Ok(file)
+}
+
+/// Path of an entry through the descriptor of its directory, for the
+/// syscalls without an `*at` variant
+fn proc_fd_path(dir: &File, name: &CString) -> Result<CString> {
+    let mut path = format!("/proc/self/fd/{}/", dir.as_raw_fd()).into_bytes();
+    path.extend_from_slice(name.as_bytes());
+    CString::new(path).map_err(|_| invalid_data("path contains a NUL byte"))
+}
+
+/// The subvolume currently being received
+struct ReceivingSubvol {
+    name: String,
+    path: PathBuf,
+    /// Directory of the subvolume, every path of the stream is resolved from
+    root: Option<File>,
+    uuid: [u8; ioctl::BTRFS_UUID_SIZE],
+    ctransid: u64,
+}
+
+/// Applies send stream commands to a destination directory
+pub struct StreamApplier {
+    dest_dir: PathBuf,
+    version: u32,
+    subvol: Option<ReceivingSubvol>,
+    write_file: Option<(PathBuf, File)>,
+    finished: bool,
+}
+
+impl StreamApplier {
+    pub fn new(dest_dir: PathBuf, version: u32) -> Self {
+        Self {
+            dest_dir,
+            version,
+            subvol: None,
+            write_file: None,
+            finished: false,
+        }
+    }
+
+    /// Whether the end command has been applied
+    pub fn is_finished(&self) -> bool {
+        self.finished
+    }
+
+    /// Name of the received subvolume, if any
+    pub fn subvol_name(&self) -> Option<String> {
+        self.subvol.as_ref().map(|s| s.name.clone())
+    }
+
+    /// Delete the subvolume being received after a failure
+    pub fn abort(&mut self) {
+        self.write_file = None;
+
+        if self.finished {
+            return;
+        }
+
+        if let Some(subvol) = self.subvol.take() {
+            warn!("Deleting partially received subvolume {}", subvol.name);
+            let res = File::open(&self.dest_dir)
+                .and_then(|dir| ioctl::subvol_destroy(&dir, subvol.name.as_bytes()));
+            if let Err(e) = res {
+                warn!(
+                    "Failed to delete partially received subvolume {}: {e}",
+                    subvol.name
+                );
+            }
+        }
+    }
+
+    /// Directory of the subvolume being received
+    fn root(&self) -> Result<&File> {
+        self.subvol
+            .as_ref()
+            .and_then(|subvol| subvol.root.as_ref())
+            .ok_or_else(|| invalid_data("send stream command before the subvolume command"))
+    }
+
+    /// Directory and name of the entry at the path attribute `ty`
+    fn entry(&self, attrs: &Attrs, ty: u16) -> Result<(File, CString)> {
+        entry_beneath(self.root()?, attrs.path(ty)?)
+    }
+
+    /// Locate a subvolume in the destination directory by (received) UUID
+    fn find_subvol_by_uuid(&self, uuid: &[u8; ioctl::BTRFS_UUID_SIZE]) -> Result<PathBuf> {
+        if let Some(subvol) = &self.subvol {
+            if &subvol.uuid == uuid {
+                return Ok(subvol.path.clone());
+            }
+        }
+
+        for entry in std::fs::read_dir(&self.dest_dir)? {
+            let path = entry?.path();
+            let Ok(dir) = File::open(&path) else {
+                continue;
+            };
+            let Ok(info) = ioctl::get_subvol_info(&dir) else {
+                continue;
+            };
+            if &info.received_uuid == uuid || &info.uuid == uuid {
+                return Ok(path);
+            }
+        }
+
+        Err(Error::new(
+            ErrorKind::NotFound,
+            format!(
+                "cannot find the parent subvolume {} in {}",
+                hex::encode(uuid),
+                self.dest_dir.display()
+            ),
+        ))
+    }
+
+    /// Close the file kept open for writing if `path` is it or one of its
+    /// parents: the name may be about to refer to another inode
+    fn forget_write_file(&mut self, path: &Path) {
+        if matches!(&self.write_file, Some((p, _)) if p.starts_with(path)) {
+            self.write_file = None;
+        }
+    }
+
+    fn open_for_write(&mut self, path: &Path) -> Result<&File> {
+        let reuse = matches!(&self.write_file, Some((p, _)) if p == path);
+        if !reuse {
+            let (dir, name) = entry_beneath(self.root()?, path)?;
+            let file = open_regular(&dir, &name, libc::O_WRONLY)?;
+            self.write_file = Some((path.to_path_buf(), file));
+        }
+
+        match &self.write_file {
+            Some((_, file)) => Ok(file),
+            None => Err(Error::other("write file unexpectedly closed")),
+        }
+    }
+
+    /// Mark the current subvolume as received and read-only
+    fn finish_subvol(&mut self) -> Result<()> {
+        self.write_file = None;
+
+        let Some(subvol) = &self.subvol else {
+            return Ok(());
+        };
+
+        let root = File::open(&subvol.path)?;
+        ioctl::set_received_subvol(&root, subvol.uuid, subvol.ctransid)?;
+
+        let flags = ioctl::subvol_get_flags(&root)?;
+        ioctl::subvol_set_flags(&root, flags | ioctl::BTRFS_SUBVOL_RDONLY)?;
+
+        debug!("Finished receiving subvolume {}", subvol.name);
+        Ok(())
+    }
+
+    fn begin_subvol(&mut self, attrs: &Attrs) -> Result<ReceivingSubvol> {
+        if self.subvol.is_some() {
+            return Err(invalid_data(
+                "send streams with more than one subvolume are not supported",
+            ));
+        }
+
+        let name = attrs.path(attr::PATH)?;
+        if name.components().count() != 1 {
+            return Err(invalid_data(format!(
+                "invalid subvolume name in send stream: {}",
+                name.display()
+            )));
+        }
+
+        Ok(ReceivingSubvol {
+            name: name.to_string_lossy().to_string(),
+            path: self.dest_dir.join(name),
+            root: None,
+            uuid: attrs.uuid(attr::UUID)?,
+            ctransid: attrs.u64(attr::CTRANSID)?,
+        })
+    }
+
+    /// Start receiving into the subvolume just created
+    fn open_subvol(&mut self, mut subvol: ReceivingSubvol) -> Result<()> {
+        let result = OpenOptions::new()
+            .read(true)
+            .custom_flags(libc::O_DIRECTORY | libc::O_NOFOLLOW)
+            .open(&subvol.path)
+            .map(|root| subvol.root = Some(root));
+        // Recorded on failure too, so that abort deletes the subvolume
+        self.subvol = Some(subvol);
+        result
+    }
+
+    /// Apply a single command
+    pub fn apply(&mut self, command: &SendCommand) -> Result<()> {
+        let attrs = Attrs::parse(command, self.version)?;
+
+        match command.cmd {
+            cmd::SUBVOL => {
+                let subvol = self.begin_subvol(&attrs)?;
+                debug!("Receiving subvolume {}", subvol.name);
+
+                let dest = File::open(&self.dest_dir)?;
+                ioctl::subvol_create(&dest, subvol.name.as_bytes())?;
+                self.open_subvol(subvol)?;
+            }
+            cmd::SNAPSHOT => {
+                let subvol = self.begin_subvol(&attrs)?;
+                let parent_uuid = attrs.uuid(attr::CLONE_UUID)?;
+                let parent_path = self.find_subvol_by_uuid(&parent_uuid)?;
+                debug!(
+                    "Receiving snapshot {} of {}",
+                    subvol.name,
+                    parent_path.display()
+                );
+
+                let dest = File::open(&self.dest_dir)?;
+                let parent = File::open(&parent_path)?;
+                ioctl::snapshot_create(&dest, &parent, subvol.name.as_bytes())?;
+                self.open_subvol(subvol)?;
+            }
+            cmd::MKFILE => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                openat(
+                    &dir,
+                    &name,
+                    libc::O_WRONLY | libc::O_CREAT | libc::O_EXCL | libc::O_NOFOLLOW,
+                    0o600,
+                )?;
+            }
+            cmd::MKDIR => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                check(unsafe { libc::mkdirat(dir.as_raw_fd(), name.as_ptr(), 0o700) })?;
+            }
+            cmd::MKNOD | cmd::MKFIFO | cmd::MKSOCK => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                let (kind, rdev) = match command.cmd {
+                    cmd::MKFIFO => (libc::S_IFIFO, 0),
+                    cmd::MKSOCK => (libc::S_IFSOCK, 0),
+                    _ => (
+                        attrs.u64(attr::MODE)? as libc::mode_t & libc::S_IFMT,
+                        attrs.u64(attr::RDEV)?,
+                    ),
+                };
+                check(unsafe {
+                    libc::mknodat(
+                        dir.as_raw_fd(),
+                        name.as_ptr(),
+                        kind | 0o600,
+                        rdev as libc::dev_t,
+                    )
+                })?;
+            }
+            cmd::SYMLINK => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                // The target is stored as is: it is never followed while receiving
+                let target = CString::new(attrs.bytes(attr::PATH_LINK)?)
+                    .map_err(|_| invalid_data("symlink target contains a NUL byte"))?;
+                check(unsafe { libc::symlinkat(target.as_ptr(), dir.as_raw_fd(), name.as_ptr()) })?;
+            }
+            cmd::RENAME => {
+                self.forget_write_file(attrs.path(attr::PATH)?);
+                self.forget_write_file(attrs.path(attr::PATH_TO)?);
+                let (from_dir, from) = self.entry(&attrs, attr::PATH)?;
+                let (to_dir, to) = self.entry(&attrs, attr::PATH_TO)?;
+                check(unsafe {
+                    libc::renameat(
+                        from_dir.as_raw_fd(),
+                        from.as_ptr(),
+                        to_dir.as_raw_fd(),
+                        to.as_ptr(),
+                    )
+                })?;
+            }
+            cmd::LINK => {
+                self.forget_write_file(attrs.path(attr::PATH)?);
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                let (existing_dir, existing) = self.entry(&attrs, attr::PATH_LINK)?;
+                check(unsafe {
+                    libc::linkat(
+                        existing_dir.as_raw_fd(),
+                        existing.as_ptr(),
+                        dir.as_raw_fd(),
+                        name.as_ptr(),
+                        0,
+                    )
+                })?;
+            }
+            cmd::UNLINK => {
+                self.forget_write_file(attrs.path(attr::PATH)?);
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                check(unsafe { libc::unlinkat(dir.as_raw_fd(), name.as_ptr(), 0) })?;
+            }
+            cmd::RMDIR => {
+                self.forget_write_file(attrs.path(attr::PATH)?);
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                check(unsafe {
+                    libc::unlinkat(dir.as_raw_fd(), name.as_ptr(), libc::AT_REMOVEDIR)
+                })?;
+            }
+            cmd::SET_XATTR => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                let path = proc_fd_path(&dir, &name)?;
+                let xattr = CString::new(attrs.bytes(attr::XATTR_NAME)?)
+                    .map_err(|_| invalid_data("xattr name contains a NUL byte"))?;
+                let value = attrs.bytes(attr::XATTR_DATA)?;
+                check(unsafe {
+                    libc::lsetxattr(
+                        path.as_ptr(),
+                        xattr.as_ptr(),
+                        value.as_ptr() as *const libc::c_void,
+                        value.len(),
+                        0,
+                    )
+                })?;
+            }
+            cmd::REMOVE_XATTR => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                let path = proc_fd_path(&dir, &name)?;
+                let xattr = CString::new(attrs.bytes(attr::XATTR_NAME)?)
+                    .map_err(|_| invalid_data("xattr name contains a NUL byte"))?;
+                check(unsafe { libc::lremovexattr(path.as_ptr(), xattr.as_ptr()) })?;
+            }
+            cmd::WRITE => {
+                let path = attrs.path(attr::PATH)?;
+                let offset = attrs.u64(attr::FILE_OFFSET)?;
+                let data = attrs.bytes(attr::DATA)?;
+                self.open_for_write(path)?.write_all_at(data, offset)?;
+            }
+            cmd::CLONE => {
+                let path = attrs.path(attr::PATH)?;
+                let offset = attrs.u64(attr::FILE_OFFSET)?;
+                let len = attrs.u64(attr::CLONE_LEN)?;
+                let source_subvol = self.find_subvol_by_uuid(&attrs.uuid(attr::CLONE_UUID)?)?;
+                let source_root = OpenOptions::new()
+                    .read(true)
+                    .custom_flags(libc::O_DIRECTORY | libc::O_NOFOLLOW)
+                    .open(source_subvol)?;
+                let (source_dir, source_name) =
+                    entry_beneath(&source_root, attrs.path(attr::CLONE_PATH)?)?;
+                let source_offset = attrs.u64(attr::CLONE_OFFSET)?;
+
+                let source = open_regular(&source_dir, &source_name, libc::O_RDONLY)?;
+                let dest = self.open_for_write(path)?;
+                ioctl::clone_range(dest, &source, source_offset, len, offset)?;
+            }
+            cmd::TRUNCATE => {
+                let path = attrs.path(attr::PATH)?;
+                let size = attrs.u64(attr::SIZE)?;
+                self.open_for_write(path)?.set_len(size)?;
+            }
+            cmd::CHMOD => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                let mode = attrs.u64(attr::MODE)? as libc::mode_t & 0o7777;
+                // fchmodat follows symlinks, whose mode is meaningless anyway
+                if stat_entry(&dir, &name)?.st_mode & libc::S_IFMT != libc::S_IFLNK {
+                    check(unsafe { libc::fchmodat(dir.as_raw_fd(), name.as_ptr(), mode, 0) })?;
+                }
+            }
+            cmd::CHOWN => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                let uid = attrs.u64(attr::UID)? as libc::uid_t;
+                let gid = attrs.u64(attr::GID)? as libc::gid_t;
+                check(unsafe {
+                    libc::fchownat(
+                        dir.as_raw_fd(),
+                        name.as_ptr(),
+                        uid,
+                        gid,
+                        libc::AT_SYMLINK_NOFOLLOW,
+                    )
+                })?;
+            }
+            cmd::UTIMES => {
+                let (dir, name) = self.entry(&attrs, attr::PATH)?;
+                let times = [attrs.timespec(attr::ATIME)?, attrs.timespec(attr::MTIME)?];
+                check(unsafe {
+                    libc::utimensat(
+                        dir.as_raw_fd(),
+                        name.as_ptr(),
+                        times.as_ptr(),
+                        libc::AT_SYMLINK_NOFOLLOW,
+                    )
+                })?;
+            }
+            cmd::FALLOCATE => {
+                let path = attrs.path(attr::PATH)?;
+                let mode = attrs.u64(attr::FALLOCATE_MODE)? as libc::c_int;
+                let offset = attrs.u64(attr::FILE_OFFSET)? as libc::off_t;
+                let len = attrs.u64(attr::SIZE)? as libc::off_t;
+                let file = self.open_for_write(path)?;
+                check(unsafe { libc::fallocate(file.as_raw_fd(), mode, offset, len) })?;
+            }
+            cmd::UPDATE_EXTENT | cmd::FILEATTR => {
+                // No data to apply (--no-data streams) / inode flags are not restored
+            }
+            cmd::END => {
+                self.finish_subvol()?;
+                self.finished = true;
+            }
+            cmd::ENCODED_WRITE | cmd::ENABLE_VERITY => {
+                return Err(Error::new(
+                    ErrorKind::Unsupported,
+                    format!(
+                        "send stream command {} is not supported by the native receiver",
+                        command.cmd
+                    ),
+                ));
+            }
+            other => {
+                return Err(invalid_data(format!("unknown send stream command {other}")));
+            }
+        }
+
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::os::unix::fs::{MetadataExt, PermissionsExt};
+
+    fn encode_command(cmd: u16, attrs: &[(u16, &[u8])]) -> Vec<u8> {
+        let mut payload = Vec::new();
+        for (ty, value) in attrs {
+            payload.extend_from_slice(&ty.to_le_bytes());
+            payload.extend_from_slice(&(value.len() as u16).to_le_bytes());
+            payload.extend_from_slice(value);
+        }
+
+        let mut header = Vec::new();
+        header.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+        header.extend_from_slice(&cmd.to_le_bytes());
+        header.extend_from_slice(&0u32.to_le_bytes());
+        let crc = crc32c(crc32c(0, &header), &payload);
+        header[6..].copy_from_slice(&crc.to_le_bytes());
+
+        header.extend_from_slice(&payload);
+        header
+    }
+
+    /// Applier receiving into `dir`, as if a subvolume command created it
+    fn applier_in(dir: &Path) -> StreamApplier {
+        let mut applier = StreamApplier::new(dir.parent().unwrap().to_path_buf(), 1);
+        applier
+            .open_subvol(ReceivingSubvol {
+                name: "deployment".to_string(),
+                path: dir.to_path_buf(),
+                root: None,
+                uuid: [0u8; ioctl::BTRFS_UUID_SIZE],
+                ctransid: 0,
+            })
+            .unwrap();
+        applier
+    }
+
+    fn apply_command(applier: &mut StreamApplier, cmd: u16, attrs: &[(u16, &[u8])]) -> Result<()> {
+        let encoded = encode_command(cmd, attrs);
+        applier.apply(&SendCommand {
+            cmd,
+            payload: encoded[CMD_HEADER_LEN..].to_vec(),
+        })
+    }
+
+    #[test]
+    fn test_crc32c_check_value() {
+        // Raw (non-inverted) crc32c: inverting input and output gives the standard check value
+        let crc = !crc32c(!0, b"123456789");
+        assert_eq!(crc, 0xE306_9283);
+    }
+
+    #[tokio::test]
+    async fn test_read_commands() {
+        let mut stream = Vec::new();
+        stream.extend_from_slice(SEND_STREAM_MAGIC);
+        stream.extend_from_slice(&1u32.to_le_bytes());
+        stream.extend(encode_command(cmd::MKDIR, &[(attr::PATH, b"usr")]));
+        stream.extend(encode_command(cmd::END, &[]));
+
+        let mut reader = std::io::Cursor::new(stream);
+        assert_eq!(read_stream_header(&mut reader).await.unwrap(), 1);
+
+        let mkdir = read_command(&mut reader).await.unwrap().unwrap();
+        let attrs = Attrs::parse(&mkdir, 1).unwrap();
+        assert_eq!(attrs.path(attr::PATH).unwrap(), Path::new("usr"));
+        assert!(!mkdir.is_end());
+
+        let end = read_command(&mut reader).await.unwrap().unwrap();
+        assert!(end.is_end());
+        assert_eq!(end.stream_len(), CMD_HEADER_LEN as u64);
+
+        assert!(read_command(&mut reader).await.unwrap().is_none());
+    }
+
+    #[tokio::test]
+    async fn test_reject_corrupted_command() {
+        let mut command = encode_command(cmd::MKDIR, &[(attr::PATH, b"usr")]);
+        let last = command.len() - 1;
+        command[last] ^= 0xFF;
+
+        let mut reader = std::io::Cursor::new(command);
+        let err = read_command(&mut reader).await.err().unwrap();
+        assert_eq!(err.kind(), ErrorKind::InvalidData);
+    }
+
+    #[tokio::test]
+    async fn test_reject_bad_magic() {
+        let mut reader = std::io::Cursor::new(b"not-a-stream\0\x01\0\0\0".to_vec());
+        assert!(read_stream_header(&mut reader).await.is_err());
+    }
+
+    #[tokio::test]
+    async fn test_reject_unsafe_paths() {
+        for path in [&b"../etc"[..], b"/etc/passwd", b"usr/../../etc"] {
+            let command = encode_command(cmd::MKDIR, &[(attr::PATH, path)]);
+            let mut reader = std::io::Cursor::new(command);
+            let command = read_command(&mut reader).await.unwrap().unwrap();
+            let attrs = Attrs::parse(&command, 1).unwrap();
+            assert!(attrs.path(attr::PATH).is_err());
+        }
+    }
+
+    #[tokio::test]
+    async fn test_read_parent_uuid() {
+        let parent = [0x11u8; ioctl::BTRFS_UUID_SIZE];
+        let mut snapshot = Vec::new();
+        snapshot.extend_from_slice(SEND_STREAM_MAGIC);
+        snapshot.extend_from_slice(&1u32.to_le_bytes());
+        snapshot.extend(encode_command(
+            cmd::SNAPSHOT,
+            &[(attr::PATH, b"deployment-2"), (attr::CLONE_UUID, &parent)],
+        ));
+
+        let mut reader = std::io::Cursor::new(snapshot);
+        assert_eq!(
+            read_parent_uuid(&mut reader).await.unwrap().as_deref(),
+            Some("11111111-1111-1111-1111-111111111111")
+        );
+
+        let mut full = Vec::new();
+        full.extend_from_slice(SEND_STREAM_MAGIC);
+        full.extend_from_slice(&1u32.to_le_bytes());
+        full.extend(encode_command(
+            cmd::SUBVOL,
+            &[(attr::PATH, b"deployment-2")],
+        ));
+
+        let mut reader = std::io::Cursor::new(full);
+        assert!(read_parent_uuid(&mut reader).await.unwrap().is_none());
+    }
+
+    #[tokio::test]
+    async fn test_read_stream_head() {
+        let uuid = [0x22u8; ioctl::BTRFS_UUID_SIZE];
+        let mut stream = Vec::new();
+        stream.extend_from_slice(SEND_STREAM_MAGIC);
+        stream.extend_from_slice(&1u32.to_le_bytes());
+        stream.extend(encode_command(
+            cmd::SUBVOL,
+            &[(attr::PATH, b"deployment-2"), (attr::UUID, &uuid)],
+        ));
+        let head_len = stream.len();
+        stream.extend(encode_command(cmd::END, &[]));
+
+        let mut reader = std::io::Cursor::new(stream.clone());
+        let (head, subvol) = read_stream_head(&mut reader).await.unwrap();
+        assert_eq!(head, stream[..head_len]);
+        assert_eq!(subvol.name, "deployment-2");
+        assert_eq!(subvol.uuid, "22222222-2222-2222-2222-222222222222");
+
+        // Only the head is consumed
+        let mut rest = Vec::new();
+        reader.read_to_end(&mut rest).await.unwrap();
+        assert_eq!(rest, stream[head_len..]);
+
+        let mut no_subvol = stream[..SEND_STREAM_MAGIC.len() + 4].to_vec();
+        no_subvol.extend(encode_command(cmd::MKDIR, &[(attr::PATH, b"usr")]));
+        let mut reader = std::io::Cursor::new(no_subvol);
+        assert!(read_stream_head(&mut reader).await.is_err());
+    }
+
+    #[test]
+    fn test_format_uuid() {
+        let uuid: [u8; ioctl::BTRFS_UUID_SIZE] = core::array::from_fn(|i| i as u8);
+        assert_eq!(format_uuid(&uuid), "00010203-0405-0607-0809-0a0b0c0d0e0f");
+    }
+
+    #[test]
+    fn test_v2_data_attribute_spans_the_command() {
+        let mut payload = Vec::new();
+        payload.extend_from_slice(&attr::FILE_OFFSET.to_le_bytes());
+        payload.extend_from_slice(&8u16.to_le_bytes());
+        payload.extend_from_slice(&4096u64.to_le_bytes());
+        payload.extend_from_slice(&attr::DATA.to_le_bytes());
+        payload.extend_from_slice(b"file contents");
+
+        let command = SendCommand {
+            cmd: cmd::WRITE,
+            payload,
+        };
+        let attrs = Attrs::parse(&command, 2).unwrap();
+        assert_eq!(attrs.u64(attr::FILE_OFFSET).unwrap(), 4096);
+        assert_eq!(attrs.bytes(attr::DATA).unwrap(), b"file contents");
+    }
+
+    #[test]
+    fn test_apply_commands() {
+        let dir = tempfile::tempdir().unwrap();
+        let subvol = dir.path().join("deployment");
+        std::fs::create_dir(&subvol).unwrap();
+        let mut applier = applier_in(&subvol);
+
+        apply_command(&mut applier, cmd::MKDIR, &[(attr::PATH, b"usr")]).unwrap();
+        apply_command(&mut applier, cmd::MKFILE, &[(attr::PATH, b"usr/file")]).unwrap();
+        apply_command(
+            &mut applier,
+            cmd::WRITE,
+            &[
+                (attr::PATH, b"usr/file"),
+                (attr::FILE_OFFSET, &0u64.to_le_bytes()),
+                (attr::DATA, b"contents"),
+            ],
+        )
+        .unwrap();
+        apply_command(
+            &mut applier,
+            cmd::CHMOD,
+            &[
+                (attr::PATH, b"usr/file"),
+                (attr::MODE, &0o644u64.to_le_bytes()),
+            ],
+        )
+        .unwrap();
+        apply_command(
+            &mut applier,
+            cmd::SYMLINK,
+            &[(attr::PATH, b"usr/link"), (attr::PATH_LINK, b"file")],
+        )
+        .unwrap();
+        // The root of the subvolume has an empty path
+        apply_command(
+            &mut applier,
+            cmd::CHMOD,
+            &[(attr::PATH, b""), (attr::MODE, &0o755u64.to_le_bytes())],
+        )
+        .unwrap();
+
+        assert_eq!(std::fs::read(subvol.join("usr/file")).unwrap(), b"contents");
+        let mode = std::fs::metadata(subvol.join("usr/file")).unwrap().mode();
+        assert_eq!(mode & 0o7777, 0o644);
+        assert_eq!(
+            std::fs::read_link(subvol.join("usr/link")).unwrap(),
+            Path::new("file")
+        );
+        let mode = std::fs::metadata(&subvol).unwrap().mode();
+        assert_eq!(mode & 0o7777, 0o755);
+    }
+
+    #[test]
+    fn test_symlinks_never_escape_the_subvolume() {
+        let dir = tempfile::tempdir().unwrap();
+        let outside = dir.path().join("outside");
+        let subvol = dir.path().join("deployment");
+        std::fs::create_dir(&outside).unwrap();
+        std::fs::create_dir(&subvol).unwrap();
+        std::fs::write(outside.join("target"), b"original").unwrap();
+        std::fs::set_permissions(
+            outside.join("target"),
+            std::fs::Permissions::from_mode(0o600),
+        )
+        .unwrap();
+        let mut applier = applier_in(&subvol);
+
+        // A directory symlink pointing outside must not be walked through
+        let outside_bytes = outside.as_os_str().as_bytes();
+        apply_command(
+            &mut applier,
+            cmd::SYMLINK,
+            &[(attr::PATH, b"etc"), (attr::PATH_LINK, outside_bytes)],
+        )
+        .unwrap();
+        assert!(apply_command(&mut applier, cmd::MKFILE, &[(attr::PATH, b"etc/pwned")]).is_err());
+        assert!(apply_command(&mut applier, cmd::MKDIR, &[(attr::PATH, b"etc/pwned")]).is_err());
+        assert!(apply_command(
+            &mut applier,
+            cmd::WRITE,
+            &[
+                (attr::PATH, b"etc/target"),
+                (attr::FILE_OFFSET, &0u64.to_le_bytes()),
+                (attr::DATA, b"pwned"),
+            ],
+        )
+        .is_err());
+        assert!(!outside.join("pwned").exists());
+
+        // Nor a file symlink written, truncated or chmod-ed through
+        let target = outside.join("target");
+        apply_command(
+            &mut applier,
+            cmd::SYMLINK,
+            &[
+                (attr::PATH, b"passwd"),
+                (attr::PATH_LINK, target.as_os_str().as_bytes()),
+            ],
+        )
+        .unwrap();
+        assert!(apply_command(
+            &mut applier,
+            cmd::WRITE,
+            &[
+                (attr::PATH, b"passwd"),
+                (attr::FILE_OFFSET, &0u64.to_le_bytes()),
+                (attr::DATA, b"pwned"),
+            ],
+        )
+        .is_err());
+        assert!(apply_command(
+            &mut applier,
+            cmd::TRUNCATE,
+            &[(attr::PATH, b"passwd"), (attr::SIZE, &0u64.to_le_bytes())],
+        )
+        .is_err());
+        apply_command(
+            &mut applier,
+            cmd::CHMOD,
+            &[
+                (attr::PATH, b"passwd"),
+                (attr::MODE, &0o777u64.to_le_bytes()),
+            ],
+        )
+        .unwrap();
+
+        assert_eq!(std::fs::read(&target).unwrap(), b"original");
+        let mode = std::fs::metadata(&target).unwrap().mode();
+        assert_eq!(mode & 0o7777, 0o600);
+
+        // Writes only ever go to regular files
+        apply_command(&mut applier, cmd::MKFIFO, &[(attr::PATH, b"fifo")]).unwrap();
+        assert!(apply_command(
+            &mut applier,
+            cmd::WRITE,
+            &[
+                (attr::PATH, b"fifo"),
+                (attr::FILE_OFFSET, &0u64.to_le_bytes()),
+                (attr::DATA, b"data"),
+            ],
+        )
+        .is_err());
+    }
+
+    #[test]
+    fn test_writes_follow_renamed_names() {
+        let dir = tempfile::tempdir().unwrap();
+        let subvol = dir.path().join("deployment");
+        std::fs::create_dir(&subvol).unwrap();
+        let mut applier = applier_in(&subvol);
+        let write = |applier: &mut StreamApplier, path: &[u8], data: &[u8]| {
+            apply_command(
+                applier,
+                cmd::WRITE,
+                &[
+                    (attr::PATH, path),
+                    (attr::FILE_OFFSET, &0u64.to_le_bytes()),
+                    (attr::DATA, data),
+                ],
+            )
+        };
+
+        // Incremental streams orphan a file, then rename another inode onto its name
+        apply_command(&mut applier, cmd::MKFILE, &[(attr::PATH, b"bin")]).unwrap();
+        write(&mut applier, b"bin", b"old").unwrap();
+        apply_command(&mut applier, cmd::MKFILE, &[(attr::PATH, b"o257-1-0")]).unwrap();
+        apply_command(
+            &mut applier,
+            cmd::RENAME,
+            &[(attr::PATH, b"o257-1-0"), (attr::PATH_TO, b"bin")],
+        )
+        .unwrap();
+        write(&mut applier, b"bin", b"new").unwrap();
+        assert_eq!(std::fs::read(subvol.join("bin")).unwrap(), b"new");
+
+        // Same for a file replaced after being unlinked, and for its parents
+        apply_command(&mut applier, cmd::UNLINK, &[(attr::PATH, b"bin")]).unwrap();
+        apply_command(&mut applier, cmd::MKFILE, &[(attr::PATH, b"bin")]).unwrap();
+        write(&mut applier, b"bin", b"newest").unwrap();
+        assert_eq!(std::fs::read(subvol.join("bin")).unwrap(), b"newest");
+
+        apply_command(&mut applier, cmd::MKDIR, &[(attr::PATH, b"usr")]).unwrap();
+        apply_command(&mut applier, cmd::MKFILE, &[(attr::PATH, b"usr/file")]).unwrap();
+        write(&mut applier, b"usr/file", b"old").unwrap();
+        apply_command(
+            &mut applier,
+            cmd::RENAME,
+            &[(attr::PATH, b"usr"), (attr::PATH_TO, b"usr.old")],
+        )
+        .unwrap();
+        apply_command(&mut applier, cmd::MKDIR, &[(attr::PATH, b"usr")]).unwrap();
+        apply_command(&mut applier, cmd::MKFILE, &[(attr::PATH, b"usr/file")]).unwrap();
+        write(&mut applier, b"usr/file", b"new").unwrap();
+        assert_eq!(std::fs::read(subvol.join("usr/file")).unwrap(), b"new");
+        assert_eq!(std::fs::read(subvol.join("usr.old/file")).unwrap(), b"old");
+    }
+}
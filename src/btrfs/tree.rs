@@ -0,0 +1,274 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Subvolume enumeration through searches of the root tree.
+//!
+//! The root tree holds a root item (flags, UUIDs) for every subvolume and a
+//! backref naming the subvolume inside its parent directory: a single
+//! `BTRFS_IOC_TREE_SEARCH` walk returns all of them, where the `btrfs` tool
+//! would take a process, and a few ioctls, per subvolume.
+
+use std::collections::HashMap;
+use std::io::{Error, ErrorKind, Result};
+use std::os::unix::io::AsRawFd;
+
+use super::ioctl::{self, BTRFS_UUID_SIZE};
+
+/// Offset of the flags in a `btrfs_root_item`
+const ROOT_ITEM_FLAGS: usize = 208;
+/// Offset of the UUID in a `btrfs_root_item`, only present in items written
+/// by kernels newer than 3.6 (along with everything after it)
+const ROOT_ITEM_UUID: usize = 247;
+/// Offset of the received UUID in a `btrfs_root_item`
+const ROOT_ITEM_RECEIVED_UUID: usize = 279;
+
+/// Length of a `btrfs_root_ref` (dirid, sequence, name_len), followed by the name
+const ROOT_REF_LEN: usize = 18;
+/// Length of a `btrfs_dir_item`, followed by its name and data
+const DIR_ITEM_LEN: usize = 30;
+
+/// A subvolume listed in a directory
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct SubvolEntry {
+    pub id: u64,
+    /// Name of the subvolume in its parent directory
+    pub name: String,
+    pub readonly: bool,
+    pub uuid: [u8; BTRFS_UUID_SIZE],
+    pub received_uuid: [u8; BTRFS_UUID_SIZE],
+}
+
+/// The fields of a `btrfs_root_item` needed to describe a subvolume
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+struct RootItem {
+    flags: u64,
+    uuid: [u8; BTRFS_UUID_SIZE],
+    received_uuid: [u8; BTRFS_UUID_SIZE],
+}
+
+fn le_u64(data: &[u8], at: usize) -> Option<u64> {
+    Some(u64::from_le_bytes(data.get(at..at + 8)?.try_into().ok()?))
+}
+
+fn le_u16(data: &[u8], at: usize) -> Option<u16> {
+    Some(u16::from_le_bytes(data.get(at..at + 2)?.try_into().ok()?))
+}
+
+fn uuid(data: &[u8], at: usize) -> [u8; BTRFS_UUID_SIZE] {
+    data.get(at..at + BTRFS_UUID_SIZE)
+        .and_then(|uuid| uuid.try_into().ok())
+        .unwrap_or_default()
+}
+
+/// Parse a `btrfs_root_item`; UUIDs of pre-3.6 items are reported as zero
+fn parse_root_item(data: &[u8]) -> Option<RootItem> {
+    Some(RootItem {
+        flags: le_u64(data, ROOT_ITEM_FLAGS)?,
+        uuid: uuid(data, ROOT_ITEM_UUID),
+        received_uuid: uuid(data, ROOT_ITEM_RECEIVED_UUID),
+    })
+}
+
+/// Parse a `btrfs_root_ref` into the inode of the directory holding the
+/// subvolume and the name of the subvolume in it
+fn parse_root_ref(data: &[u8]) -> Option<(u64, &[u8])> {
+    let dirid = le_u64(data, 0)?;
+    let name_len = le_u16(data, 16)? as usize;
+    let name = data.get(ROOT_REF_LEN..ROOT_REF_LEN + name_len)?;
+    Some((dirid, name))
+}
+
+/// Find the entry `name` among the `btrfs_dir_item`s of `data` (entries with
+/// colliding name hashes share an item) and return the objectid it points to
+fn find_dir_item(mut data: &[u8], name: &[u8]) -> Option<u64> {
+    while data.len() >= DIR_ITEM_LEN {
+        let objectid = le_u64(data, 0)?;
+        let data_len = le_u16(data, 25)? as usize;
+        let name_len = le_u16(data, 27)? as usize;
+        let entry_name = data.get(DIR_ITEM_LEN..DIR_ITEM_LEN + name_len)?;
+        if entry_name == name {
+            return Some(objectid);
+        }
+
+        data = data.get(DIR_ITEM_LEN + name_len + data_len..)?;
+    }
+
+    None
+}
+
+/// Search key covering the items of every subvolume in the root tree
+fn root_tree_key(
+    min_objectid: u64,
+    max_objectid: u64,
+    min_type: u32,
+    max_type: u32,
+) -> ioctl::btrfs_ioctl_search_key {
+    ioctl::btrfs_ioctl_search_key {
+        tree_id: ioctl::BTRFS_ROOT_TREE_OBJECTID,
+        min_objectid,
+        max_objectid,
+        min_offset: 0,
+        max_offset: u64::MAX,
+        min_transid: 0,
+        max_transid: u64::MAX,
+        min_type,
+        max_type,
+        ..Default::default()
+    }
+}
+
+/// List the subvolumes directly inside the directory opened as `dir`, whose
+/// inode number is `dir_ino`.
+///
+/// Needs CAP_SYS_ADMIN, as the tree search ioctl does.
+pub fn list_child_subvols<F: AsRawFd>(dir: &F, dir_ino: u64) -> Result<Vec<SubvolEntry>> {
+    let parent_id = ioctl::containing_subvol_id(dir)?;
+
+    let mut items = HashMap::new();
+    let mut children = Vec::new();
+    let key = root_tree_key(
+        ioctl::BTRFS_FIRST_FREE_OBJECTID,
+        ioctl::BTRFS_LAST_FREE_OBJECTID,
+        ioctl::BTRFS_ROOT_ITEM_KEY,
+        ioctl::BTRFS_ROOT_BACKREF_KEY,
+    );
+    ioctl::tree_search(dir, key, |header, data| match header.r#type {
+        ioctl::BTRFS_ROOT_ITEM_KEY => {
+            if let Some(item) = parse_root_item(data) {
+                items.insert(header.objectid, item);
+            }
+        }
+        // Backrefs are keyed (subvolume, ROOT_BACKREF, parent subvolume)
+        ioctl::BTRFS_ROOT_BACKREF_KEY if header.offset == parent_id => {
+            if let Some((dirid, name)) = parse_root_ref(data) {
+                if dirid == dir_ino {
+                    children.push((header.objectid, String::from_utf8_lossy(name).into_owned()));
+                }
+            }
+        }
+        _ => {}
+    })?;
+
+    children
+        .into_iter()
+        .map(|(id, name)| {
+            let item = items.get(&id).ok_or_else(|| {
+                Error::new(
+                    ErrorKind::NotFound,
+                    format!("no root item for subvolume {name} (ID {id})"),
+                )
+            })?;
+
+            Ok(SubvolEntry {
+                id,
+                name,
+                readonly: item.flags & ioctl::BTRFS_ROOT_SUBVOL_RDONLY != 0,
+                uuid: item.uuid,
+                received_uuid: item.received_uuid,
+            })
+        })
+        .collect()
+}
+
+/// Return the ID of the default subvolume of the filesystem containing `fd`.
+///
+/// Needs CAP_SYS_ADMIN, as the tree search ioctl does.
+pub fn default_subvol_id<F: AsRawFd>(fd: &F) -> Result<u64> {
+    let mut default = None;
+    let key = root_tree_key(
+        ioctl::BTRFS_ROOT_TREE_DIR_OBJECTID,
+        ioctl::BTRFS_ROOT_TREE_DIR_OBJECTID,
+        ioctl::BTRFS_DIR_ITEM_KEY,
+        ioctl::BTRFS_DIR_ITEM_KEY,
+    );
+    ioctl::tree_search(fd, key, |header, data| {
+        if header.r#type == ioctl::BTRFS_DIR_ITEM_KEY && default.is_none() {
+            default = find_dir_item(data, b"default");
+        }
+    })?;
+
+    default.ok_or_else(|| Error::new(ErrorKind::NotFound, "no default subvolume entry"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn root_ref(dirid: u64, name: &[u8]) -> Vec<u8> {
+        let mut data = Vec::new();
+        data.extend_from_slice(&dirid.to_le_bytes());
+        data.extend_from_slice(&7u64.to_le_bytes());
+        data.extend_from_slice(&(name.len() as u16).to_le_bytes());
+        data.extend_from_slice(name);
+        data
+    }
+
+    fn dir_item(objectid: u64, name: &[u8], payload: &[u8]) -> Vec<u8> {
+        let mut data = Vec::new();
+        data.extend_from_slice(&objectid.to_le_bytes());
+        data.push(ioctl::BTRFS_ROOT_ITEM_KEY as u8);
+        data.extend_from_slice(&u64::MAX.to_le_bytes());
+        data.extend_from_slice(&1u64.to_le_bytes());
+        data.extend_from_slice(&(payload.len() as u16).to_le_bytes());
+        data.extend_from_slice(&(name.len() as u16).to_le_bytes());
+        data.push(2);
+        assert_eq!(data.len(), DIR_ITEM_LEN);
+        data.extend_from_slice(name);
+        data.extend_from_slice(payload);
+        data
+    }
+
+    #[test]
+    fn test_parse_root_item() {
+        // A kernel >= 3.6 root item is 439 bytes
+        let mut data = vec![0u8; 439];
+        data[ROOT_ITEM_FLAGS..ROOT_ITEM_FLAGS + 8]
+            .copy_from_slice(&ioctl::BTRFS_ROOT_SUBVOL_RDONLY.to_le_bytes());
+        data[ROOT_ITEM_UUID..ROOT_ITEM_UUID + 16].copy_from_slice(&[1; 16]);
+        data[ROOT_ITEM_RECEIVED_UUID..ROOT_ITEM_RECEIVED_UUID + 16].copy_from_slice(&[2; 16]);
+
+        let item = parse_root_item(&data).unwrap();
+        assert_eq!(item.flags, ioctl::BTRFS_ROOT_SUBVOL_RDONLY);
+        assert_eq!(item.uuid, [1; 16]);
+        assert_eq!(item.received_uuid, [2; 16]);
+
+        // Old root items end before the UUIDs
+        let item = parse_root_item(&data[..239]).unwrap();
+        assert_eq!(item.uuid, [0; 16]);
+        assert!(parse_root_item(&data[..100]).is_none());
+    }
+
+    #[test]
+    fn test_parse_root_ref() {
+        let data = root_ref(256, b"deployment-1");
+        assert_eq!(parse_root_ref(&data), Some((256, &b"deployment-1"[..])));
+        assert!(parse_root_ref(&data[..data.len() - 1]).is_none());
+    }
+
+    #[test]
+    fn test_find_dir_item() {
+        let mut data = dir_item(300, b"other", b"xattr");
+        data.extend(dir_item(257, b"default", b""));
+
+        assert_eq!(find_dir_item(&data, b"default"), Some(257));
+        assert_eq!(find_dir_item(&data, b"other"), Some(300));
+        assert_eq!(find_dir_item(&data, b"missing"), None);
+        assert_eq!(find_dir_item(&data[..40], b"default"), None);
+    }
+}
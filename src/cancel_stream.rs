@@ -0,0 +1,106 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+use std::{
+    future::Future,
+    pin::Pin,
+    task::{Context, Poll},
+};
+
+use tokio::io::{AsyncRead, ReadBuf};
+use tokio_util::sync::{CancellationToken, WaitForCancellationFutureOwned};
+
+/// A wrapper around AsyncRead that fails once its token is cancelled
+///
+/// Every consumer of the stream (the tar parser, the decompressor, the pipe
+/// tasks feeding `xz` and `btrfs receive`) sees a read error as soon as the
+/// token is cancelled, even while the inner reader is waiting for data, and
+/// tears down its own stage as it would for a truncated download.
+pub struct CancellableReader<R> {
+    inner: R,
+    cancelled: Pin<Box<WaitForCancellationFutureOwned>>,
+}
+
+impl<R: AsyncRead + Unpin> CancellableReader<R> {
+    pub fn new(inner: R, token: CancellationToken) -> Self {
+        Self {
+            inner,
+            cancelled: Box::pin(token.cancelled_owned()),
+        }
+    }
+}
+
+/// Message of the error returned by reads of a cancelled [`CancellableReader`]
+pub const CANCELLED_MESSAGE: &str = "update cancelled";
+
+/// The error returned by reads of a cancelled [`CancellableReader`]
+///
+/// This is deliberately not `ErrorKind::Interrupted`, which read loops retry.
+pub fn cancelled_error() -> std::io::Error {
+    std::io::Error::other(CANCELLED_MESSAGE)
+}
+
+impl<R: AsyncRead + Unpin> AsyncRead for CancellableReader<R> {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut ReadBuf<'_>,
+    ) -> Poll<std::io::Result<()>> {
+        // Registers the waker, so that a pending read is woken up by cancel()
+        if self.cancelled.as_mut().poll(cx).is_ready() {
+            return Poll::Ready(Err(cancelled_error()));
+        }
+
+        Pin::new(&mut self.inner).poll_read(cx, buf)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio::io::AsyncReadExt;
+
+    #[tokio::test]
+    async fn test_cancellable_reader_passthrough() {
+        let data = vec![7u8; 10_000];
+        let mut reader = CancellableReader::new(&data[..], CancellationToken::new());
+
+        let mut buffer = Vec::new();
+        reader.read_to_end(&mut buffer).await.unwrap();
+        assert_eq!(buffer, data);
+    }
+
+    #[tokio::test]
+    async fn test_cancellable_reader_wakes_pending_read() {
+        // The writer is never written to: the read only ends through cancellation
+        let (_writer, pipe) = tokio::io::duplex(64);
+        let token = CancellationToken::new();
+        let mut reader = CancellableReader::new(pipe, token.clone());
+
+        let canceller = tokio::spawn(async move {
+            tokio::time::sleep(std::time::Duration::from_millis(10)).await;
+            token.cancel();
+        });
+
+        let mut buffer = [0u8; 16];
+        let err = reader.read(&mut buffer).await.unwrap_err();
+        assert_eq!(err.to_string(), CANCELLED_MESSAGE);
+        canceller.await.unwrap();
+    }
+}
@@ -0,0 +1,336 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Per-chunk SHA512 digests of an update payload.
+//!
+//! The chunk table is signed like the payload itself: once its signature is
+//! verified, [`ChunkVerifyingReader`] checks every chunk as soon as it has
+//! been read, so a corrupted or tampered stream is rejected after at most one
+//! chunk instead of after the whole payload has been received.
+
+use std::{
+    io::{Error, ErrorKind, Read, Result},
+    pin::Pin,
+    task::{Context, Poll},
+};
+
+use sha2::{Digest, Sha512};
+use tokio::io::{AsyncRead, ReadBuf};
+
+/// Chunk size used by `embuer-genupdate`
+pub const DEFAULT_CHUNK_SIZE: u32 = 4 * 1024 * 1024;
+
+const CHUNK_TABLE_MAGIC: &[u8; 8] = b"EMBCHNK1";
+
+/// magic, le32 chunk size, le64 payload size
+const CHUNK_TABLE_HEADER_LEN: usize = 8 + 4 + 8;
+
+const DIGEST_LEN: usize = 64;
+
+fn invalid_data(msg: impl Into<String>) -> Error {
+    Error::new(ErrorKind::InvalidData, msg.into())
+}
+
+/// SHA512 digests of consecutive fixed-size chunks of a payload
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ChunkTable {
+    chunk_size: u32,
+    total_size: u64,
+    digests: Vec<[u8; DIGEST_LEN]>,
+}
+
+impl ChunkTable {
+    /// Hash `reader` in chunks of `chunk_size` bytes
+    pub fn compute<R: Read>(mut reader: R, chunk_size: u32) -> Result<Self> {
+        if chunk_size == 0 {
+            return Err(Error::new(
+                ErrorKind::InvalidInput,
+                "chunk size must not be 0",
+            ));
+        }
+
+        let mut buffer = vec![0u8; chunk_size as usize];
+        let mut total_size = 0u64;
+        let mut digests = Vec::new();
+
+        loop {
+            let mut filled = 0;
+            while filled < buffer.len() {
+                match reader.read(&mut buffer[filled..])? {
+                    0 => break,
+                    n => filled += n,
+                }
+            }
+            if filled == 0 {
+                break;
+            }
+
+            total_size += filled as u64;
+            digests.push(Sha512::digest(&buffer[..filled]).into());
+
+            if filled < buffer.len() {
+                break;
+            }
+        }
+
+        Ok(Self {
+            chunk_size,
+            total_size,
+            digests,
+        })
+    }
+
+    /// Parse a table serialized by [`ChunkTable::to_bytes`]
+    pub fn parse(data: &[u8]) -> Result<Self> {
+        if data.len() < CHUNK_TABLE_HEADER_LEN || &data[..8] != CHUNK_TABLE_MAGIC {
+            return Err(invalid_data("not a chunk table: bad header"));
+        }
+
+        let chunk_size = u32::from_le_bytes(data[8..12].try_into().unwrap());
+        let total_size = u64::from_le_bytes(data[12..20].try_into().unwrap());
+        if chunk_size == 0 {
+            return Err(invalid_data("chunk table has a null chunk size"));
+        }
+
+        let digests_data = &data[CHUNK_TABLE_HEADER_LEN..];
+        if digests_data.len() % DIGEST_LEN != 0
+            || (digests_data.len() / DIGEST_LEN) as u64 != total_size.div_ceil(chunk_size as u64)
+        {
+            return Err(invalid_data("chunk table does not match the payload size"));
+        }
+
+        let digests = digests_data
+            .chunks_exact(DIGEST_LEN)
+            .map(|digest| digest.try_into().unwrap())
+            .collect();
+
+        Ok(Self {
+            chunk_size,
+            total_size,
+            digests,
+        })
+    }
+
+    /// Size of the serialized table of a payload of `total_size` bytes
+    pub fn encoded_len(total_size: u64, chunk_size: u32) -> u64 {
+        CHUNK_TABLE_HEADER_LEN as u64
+            + total_size.div_ceil(chunk_size.max(1) as u64) * DIGEST_LEN as u64
+    }
+
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut data = Vec::with_capacity(CHUNK_TABLE_HEADER_LEN + self.digests.len() * DIGEST_LEN);
+        data.extend_from_slice(CHUNK_TABLE_MAGIC);
+        data.extend_from_slice(&self.chunk_size.to_le_bytes());
+        data.extend_from_slice(&self.total_size.to_le_bytes());
+        for digest in &self.digests {
+            data.extend_from_slice(digest);
+        }
+        data
+    }
+
+    pub fn chunk_size(&self) -> u32 {
+        self.chunk_size
+    }
+
+    /// Size of the payload described by the table
+    pub fn total_size(&self) -> u64 {
+        self.total_size
+    }
+}
+
+/// A wrapper around AsyncRead that checks each chunk against a [`ChunkTable`]
+///
+/// Data is passed through as soon as it is read; the read completing a chunk
+/// fails with `InvalidData` when its digest does not match, and so does the
+/// end of a stream that is shorter or longer than the table.
+pub struct ChunkVerifyingReader<R> {
+    inner: R,
+    table: ChunkTable,
+    hasher: Sha512,
+    /// Index of the chunk being read
+    chunk: usize,
+    /// Bytes of the current chunk read so far
+    chunk_read: u64,
+    failed: bool,
+}
+
+impl<R: AsyncRead + Unpin> ChunkVerifyingReader<R> {
+    pub fn new(inner: R, table: ChunkTable) -> Self {
+        Self {
+            inner,
+            table,
+            hasher: Sha512::new(),
+            chunk: 0,
+            chunk_read: 0,
+            failed: false,
+        }
+    }
+
+    /// Hash `data`, verifying every chunk it completes
+    fn update(&mut self, mut data: &[u8]) -> Result<()> {
+        let chunk_size = self.table.chunk_size as u64;
+
+        while !data.is_empty() {
+            if self.chunk >= self.table.digests.len() {
+                return Err(invalid_data("stream is longer than its chunk table"));
+            }
+
+            let take = (chunk_size - self.chunk_read).min(data.len() as u64) as usize;
+            self.hasher.update(&data[..take]);
+            self.chunk_read += take as u64;
+            data = &data[take..];
+
+            if self.chunk_read == chunk_size {
+                self.finish_chunk()?;
+            }
+        }
+
+        Ok(())
+    }
+
+    fn finish_chunk(&mut self) -> Result<()> {
+        let digest = std::mem::take(&mut self.hasher).finalize();
+        if digest.as_slice() != self.table.digests[self.chunk] {
+            return Err(invalid_data(format!(
+                "chunk {} of the update stream does not match its digest",
+                self.chunk
+            )));
+        }
+
+        self.chunk += 1;
+        self.chunk_read = 0;
+        Ok(())
+    }
+
+    /// Verify the last (possibly partial) chunk at EOF
+    fn finish(&mut self) -> Result<()> {
+        if self.chunk_read > 0 {
+            self.finish_chunk()?;
+        }
+
+        if self.chunk != self.table.digests.len() {
+            return Err(invalid_data("stream is shorter than its chunk table"));
+        }
+
+        Ok(())
+    }
+}
+
+impl<R: AsyncRead + Unpin> AsyncRead for ChunkVerifyingReader<R> {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut ReadBuf<'_>,
+    ) -> Poll<Result<()>> {
+        if self.failed {
+            return Poll::Ready(Err(invalid_data("update stream failed verification")));
+        }
+
+        let before = buf.filled().len();
+        let result = Pin::new(&mut self.inner).poll_read(cx, buf);
+
+        if let Poll::Ready(Ok(())) = &result {
+            let reader = self.get_mut();
+            let filled = &buf.filled()[before..];
+            let verified = match filled.is_empty() {
+                true => reader.finish(),
+                false => reader.update(filled),
+            };
+
+            if let Err(err) = verified {
+                reader.failed = true;
+                return Poll::Ready(Err(err));
+            }
+        }
+
+        result
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio::io::AsyncReadExt;
+
+    fn payload() -> Vec<u8> {
+        (0..10_000).map(|i| (i % 251) as u8).collect()
+    }
+
+    #[test]
+    fn test_chunk_table_roundtrip() {
+        let table = ChunkTable::compute(&payload()[..], 4096).unwrap();
+        assert_eq!(table.total_size(), 10_000);
+        assert_eq!(table.digests.len(), 3);
+        assert_eq!(ChunkTable::parse(&table.to_bytes()).unwrap(), table);
+        assert_eq!(
+            ChunkTable::encoded_len(10_000, 4096),
+            table.to_bytes().len() as u64
+        );
+    }
+
+    #[test]
+    fn test_chunk_table_rejects_truncated_table() {
+        let data = ChunkTable::compute(&payload()[..], 4096)
+            .unwrap()
+            .to_bytes();
+        assert!(ChunkTable::parse(&data[..data.len() - DIGEST_LEN]).is_err());
+    }
+
+    #[tokio::test]
+    async fn test_verifying_reader_accepts_payload() {
+        let data = payload();
+        let table = ChunkTable::compute(&data[..], 4096).unwrap();
+
+        let mut reader = ChunkVerifyingReader::new(&data[..], table);
+        let mut output = Vec::new();
+        reader.read_to_end(&mut output).await.unwrap();
+        assert_eq!(output, data);
+    }
+
+    #[tokio::test]
+    async fn test_verifying_reader_stops_at_corrupted_chunk() {
+        let mut data = payload();
+        let table = ChunkTable::compute(&data[..], 4096).unwrap();
+        data[5000] ^= 0xFF;
+
+        let mut reader = ChunkVerifyingReader::new(&data[..], table);
+        let mut buffer = [0u8; 1024];
+        let mut total_read = 0;
+        let err = loop {
+            match reader.read(&mut buffer).await {
+                Ok(n) => total_read += n,
+                Err(err) => break err,
+            }
+        };
+
+        assert_eq!(err.kind(), ErrorKind::InvalidData);
+        // The error is raised by the read completing the second chunk
+        assert!(total_read < 2 * 4096);
+    }
+
+    #[tokio::test]
+    async fn test_verifying_reader_rejects_truncated_stream() {
+        let data = payload();
+        let table = ChunkTable::compute(&data[..], 4096).unwrap();
+
+        let mut reader = ChunkVerifyingReader::new(&data[..8192], table);
+        let mut output = Vec::new();
+        assert!(reader.read_to_end(&mut output).await.is_err());
+    }
+}
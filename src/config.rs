@@ -20,7 +20,13 @@
 use serde::{Deserialize, Serialize};
 use std::fs;
 use std::path::Path;
+use std::time::Duration;
 
+use crate::download::{DEFAULT_DOWNLOAD_BUFFER_SIZE, DEFAULT_DOWNLOAD_MAX_RETRIES};
+use crate::peer::PeerSettings;
+use crate::qos::QosProfile;
+use crate::schedule::{CheckSchedule, DEFAULT_CHECK_INTERVAL};
+use crate::splice::DEFAULT_PIPE_BUFFER_SIZE;
 use crate::ServiceError;
 
 #[derive(Serialize, Deserialize, Default, Clone, PartialEq, Debug)]
@@ -32,6 +38,51 @@ pub struct Config {
 
     // Directory where deployments are stored on the filesystem. Optional.
     rootfs_dir: Option<String>,
+
+    // Decompress updates with an external `xz -d` process instead of in-process.
+    #[serde(default)]
+    use_external_xz: bool,
+
+    // Apply updates with the in-process receiver instead of the `btrfs receive` tool.
+    #[serde(default)]
+    native_receiver: bool,
+
+    // Hash the update payload on a dedicated thread, overlapping with decompression.
+    #[serde(default)]
+    hash_on_thread: bool,
+
+    // Receive and verify updates while awaiting confirmation, so that accepting is instant.
+    #[serde(default)]
+    prestage_updates: bool,
+
+    // Consecutive attempts to resume an interrupted download (0 disables resuming).
+    download_max_retries: Option<u32>,
+
+    // Number of parallel connections used to download an update (1 disables segmented downloads).
+    download_connections: Option<usize>,
+
+    // Bytes buffered in memory to reorder the ranges of a segmented download.
+    download_buffer_size: Option<u64>,
+
+    // Seconds between two checks of update_url (unset or 0 only checks at startup).
+    update_check_interval: Option<u64>,
+
+    // Maximum random seconds added to every check, by default a tenth of the interval.
+    update_check_jitter: Option<u64>,
+
+    // Maximum seconds between retries of a failed check, by default the interval.
+    update_check_max_backoff: Option<u64>,
+
+    // Size in bytes requested for the pipes to the external xz and btrfs receive (0 keeps the default).
+    pipe_buffer_size: Option<usize>,
+
+    // Download rate limit, priorities and cgroup of the update pipeline.
+    #[serde(default)]
+    qos: QosProfile,
+
+    // Sharing of installed update archives with the devices of the LAN.
+    #[serde(default)]
+    peer_cache: PeerSettings,
 }
 
 impl Config {
@@ -97,6 +148,18 @@ impl Config {
             })
     }
 
+    /// Return the file recording the ETag/Last-Modified of the last update
+    /// archive installed from `update_url`, inside the rootfs directory.
+    pub fn last_update_path(&self) -> Result<std::path::PathBuf, ServiceError> {
+        self.rootfs_dir()
+            .map(|p| p.join(".embuer-last-update.json"))
+    }
+
+    /// Return the directory of the archive shared with peers, inside the rootfs directory.
+    pub fn peer_cache_dir(&self) -> Result<std::path::PathBuf, ServiceError> {
+        self.rootfs_dir().map(|p| p.join(".embuer-peer-cache"))
+    }
+
     /// Accessors for config fields for external use/tests.
     pub fn update_url(&self) -> Option<&str> {
         self.update_url.as_deref()
@@ -105,4 +168,64 @@ impl Config {
     pub fn auto_install_updates(&self) -> bool {
         self.auto_install_updates
     }
+
+    pub fn use_external_xz(&self) -> bool {
+        self.use_external_xz
+    }
+
+    pub fn native_receiver(&self) -> bool {
+        self.native_receiver
+    }
+
+    pub fn hash_on_thread(&self) -> bool {
+        self.hash_on_thread
+    }
+
+    pub fn prestage_updates(&self) -> bool {
+        self.prestage_updates
+    }
+
+    pub fn download_max_retries(&self) -> u32 {
+        self.download_max_retries
+            .unwrap_or(DEFAULT_DOWNLOAD_MAX_RETRIES)
+    }
+
+    pub fn download_connections(&self) -> usize {
+        self.download_connections.unwrap_or(1).max(1)
+    }
+
+    pub fn download_buffer_size(&self) -> u64 {
+        self.download_buffer_size
+            .unwrap_or(DEFAULT_DOWNLOAD_BUFFER_SIZE)
+    }
+
+    /// Return the schedule of the checks of `update_url`.
+    pub fn update_check_schedule(&self) -> CheckSchedule {
+        let interval = match self.update_check_interval {
+            None | Some(0) => None,
+            Some(secs) => Some(Duration::from_secs(secs)),
+        };
+        let jitter = self
+            .update_check_jitter
+            .map(Duration::from_secs)
+            .unwrap_or_else(|| interval.unwrap_or(DEFAULT_CHECK_INTERVAL) / 10);
+        let max_backoff = self
+            .update_check_max_backoff
+            .map(Duration::from_secs)
+            .unwrap_or_else(|| interval.unwrap_or(DEFAULT_CHECK_INTERVAL));
+
+        CheckSchedule::new(interval, jitter, max_backoff)
+    }
+
+    pub fn pipe_buffer_size(&self) -> usize {
+        self.pipe_buffer_size.unwrap_or(DEFAULT_PIPE_BUFFER_SIZE)
+    }
+
+    pub fn qos(&self) -> &QosProfile {
+        &self.qos
+    }
+
+    pub fn peer_cache(&self) -> &PeerSettings {
+        &self.peer_cache
+    }
 }
@@ -2,15 +2,33 @@ use std::os::unix::fs::PermissionsExt;
 use std::pin::Pin;
 use std::sync::Arc;
 
+use async_compression::tokio::bufread::{XzDecoder, ZstdDecoder};
 use log::{debug, error, info, warn};
 use rsa::RsaPublicKey;
-use tokio::io::{AsyncBufReadExt, AsyncRead, AsyncWriteExt, BufReader};
-use tokio::process::Command;
-
-use crate::btrfs::Btrfs;
-use crate::hash_stream::HashingReader;
+use sha2::{Digest, Sha512};
+use tokio::io::{AsyncBufReadExt, AsyncRead, AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::process::{ChildStdout, Command};
+use tokio::task::JoinHandle;
+use tokio_util::sync::CancellationToken;
+
+use crate::btrfs::{read_stream_head, Btrfs, ReceiveProgress};
+use crate::chunked_hash::ChunkTable;
+use crate::hash_stream::{HashingReader, DEFAULT_HASH_QUEUE_DEPTH};
+use crate::metrics::{MeteredReader, PipelineMetrics, PipelineStage};
+use crate::progress_stream::TransferProgress;
+use crate::qos::ProcessPriority;
+use crate::splice::{set_pipe_size, splice_all};
+use crate::status::UpdateStage;
 use crate::ServiceError;
 
+/// DER-encoded DigestInfo prefix of a SHA-512 hash in a PKCS#1 v1.5 signature
+///
+/// ASN.1 encoding: SEQUENCE { SEQUENCE { OID sha512 NULL } OCTET STRING (64 bytes) }
+pub const SHA512_DIGEST_INFO: [u8; 19] = [
+    0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05,
+    0x00, 0x04, 0x40,
+];
+
 /// Verify RSA signature of SHA512 hash using PKCS#1 v1.5 padding
 /// Returns Ok(()) if signature is valid, Err otherwise
 pub fn verify_signature(
@@ -80,11 +98,7 @@ pub fn verify_signature(
         )));
     }
 
-    // SHA-512 DigestInfo: 30 51 30 0d 06 09 60 86 48 01 65 03 04 02 03 05 00 04 40
-    let sha512_digest_info: &[u8] = &[
-        0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03,
-        0x05, 0x00, 0x04, 0x40,
-    ];
+    let sha512_digest_info: &[u8] = &SHA512_DIGEST_INFO;
 
     let digest_start = sep_idx + 1;
     if digest_start + sha512_digest_info.len() + hash_bytes.len() > padded_bytes.len() {
@@ -151,20 +165,560 @@ pub fn verify_signature(
     Ok(())
 }
 
+/// Verify the signature of a small file signed like a payload
+/// (`openssl dgst -sha512 -sign`), covering the SHA512 of `data`.
+pub fn verify_data_signature(
+    pubkey: &RsaPublicKey,
+    data: &[u8],
+    signature_bytes: &[u8],
+) -> Result<(), ServiceError> {
+    let hash_hex = hex::encode(Sha512::digest(data));
+    verify_signature(pubkey, signature_bytes, &hash_hex)
+}
+
+/// Verify the signature of a serialized chunk table and parse it.
+pub fn verify_chunk_table(
+    pubkey: &RsaPublicKey,
+    table: &[u8],
+    signature_bytes: &[u8],
+) -> Result<ChunkTable, ServiceError> {
+    verify_data_signature(pubkey, table, signature_bytes)?;
+
+    Ok(ChunkTable::parse(table)?)
+}
+
+/// Decoder used to decompress the update stream before it reaches `btrfs receive`
+#[derive(Debug, Clone, PartialEq, Eq, Default)]
+pub enum Decompressor {
+    /// Decode xz in-process, as a stage of the `AsyncRead` chain
+    #[default]
+    Xz,
+    /// Spawn an external `xz -d` process and pipe the stream through it
+    ExternalXz,
+    /// Decode zstd in-process, optionally with the dictionary the payload was compressed with
+    Zstd(Option<Arc<[u8]>>),
+}
+
+impl Decompressor {
+    /// Pick the decoder of the payload entry `name` from its extension
+    /// (`.xz` or `.zst`), or `None` if the compression is not supported.
+    pub fn for_entry(
+        name: &str,
+        external_xz: bool,
+        zstd_dictionary: Option<Arc<[u8]>>,
+    ) -> Option<Self> {
+        match std::path::Path::new(name).extension()?.to_str()? {
+            "xz" if external_xz => Some(Decompressor::ExternalXz),
+            "xz" => Some(Decompressor::Xz),
+            "zst" => Some(Decompressor::Zstd(zstd_dictionary)),
+            _ => None,
+        }
+    }
+}
+
+/// Implementation used to apply the decompressed btrfs send stream
+///
+/// `btrfs receive` stays the default until the native receiver has been
+/// validated against real full and incremental `btrfs send` streams.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub enum Receiver {
+    /// Parse the stream and apply it through btrfs ioctls, see [`Btrfs::receive_native`]
+    Native,
+    /// Spawn `btrfs receive` and pipe the stream to its stdin
+    #[default]
+    BtrfsCli,
+}
+
+/// How an update stream is turned into a deployment subvolume
+#[derive(Debug, Clone, Default)]
+pub struct ReceiveOptions {
+    pub decompressor: Decompressor,
+    pub receiver: Receiver,
+    /// Compute the payload SHA512 on a dedicated thread instead of inline
+    pub hash_thread: bool,
+    /// Progress moved to the Verifying stage once the stream is received
+    pub progress: Option<Arc<TransferProgress>>,
+    /// Metrics of the hash, decompress and receive stages
+    pub metrics: Option<Arc<PipelineMetrics>>,
+    /// Size requested for the pipes to external processes (0 keeps the kernel default)
+    pub pipe_size: usize,
+    /// Priorities of the `xz` and `btrfs receive` processes and of the native receiver
+    pub priority: ProcessPriority,
+}
+
+/// Size of the buffer feeding the in-process decoder
+const DECODER_BUFFER_SIZE: usize = 128 * 1024;
+
+/// Resize the pipe `fd` to `size` bytes, unless `size` is 0
+///
+/// The pipe keeps working at its current size if it can't be resized.
+fn resize_pipe<F: std::os::fd::AsFd>(fd: &F, size: usize, name: &str) {
+    if size == 0 {
+        return;
+    }
+
+    match set_pipe_size(fd, size) {
+        Ok(set) => debug!("Resized the pipe of {name} to {set} bytes"),
+        Err(e) => warn!("Failed to resize the pipe of {name} to {size} bytes: {e}"),
+    }
+}
+
+/// Send stream read by `btrfs receive`
+enum BtrfsReceiveInput {
+    /// Copied to the stdin of `btrfs receive` through a user-space buffer
+    Stream(Pin<Box<dyn AsyncRead + Send>>),
+    /// Stdout pipe of a child process, spliced into the stdin of `btrfs receive`
+    /// in the kernel after the head already read from it; its bytes and wall
+    /// time are the Decompress stage metrics
+    Pipe(ChildStdout, Option<Arc<PipelineMetrics>>, Vec<u8>),
+}
+
+/// Read the head of the send stream `stream`, refusing a subvolume that was
+/// already received into `deployments_dir`.
+///
+/// Receiving it again could only fail on the existing subvolume: an archive
+/// checked again without validators is reported as no update instead.
+/// Returns the bytes read, to be fed to the receiver ahead of the rest.
+async fn check_stream_head<S>(
+    btrfs: &Btrfs,
+    deployments_dir: &std::path::Path,
+    stream: &mut S,
+) -> Result<Vec<u8>, ServiceError>
+where
+    S: AsyncRead + Unpin,
+{
+    let (head, subvol) = read_stream_head(stream)
+        .await
+        .inspect_err(|e| error!("Error reading the btrfs send stream head: {e}"))?;
+
+    if deployments_dir
+        .join(&subvol.name)
+        .symlink_metadata()
+        .is_ok()
+    {
+        info!("Deployment {} is already installed", subvol.name);
+        return Err(ServiceError::NoUpdateAvailable);
+    }
+
+    match btrfs.deployments(deployments_dir) {
+        Ok(deployments) => {
+            let received = deployments
+                .iter()
+                .find(|d| d.received_uuid.as_deref() == Some(subvol.uuid.as_str()));
+            if let Some(deployment) = received {
+                info!(
+                    "Deployment {} was already received from subvolume {}",
+                    deployment.name, subvol.uuid
+                );
+                return Err(ServiceError::NoUpdateAvailable);
+            }
+        }
+        Err(e) => warn!(
+            "Failed to look for a deployment received from {}: {e}",
+            subvol.uuid
+        ),
+    }
+
+    Ok(head)
+}
+
+/// Spawn `btrfs receive` into `deployments_dir` and feed it with `input`.
+///
+/// The returned task resolves to the name of the received subvolume, parsed
+/// from stderr (line like "At subvol subvolname"). A failure to read
+/// `input` is reported as an error even when `btrfs receive` succeeded, as it
+/// would otherwise accept a truncated stream.
+fn spawn_btrfs_receive(
+    deployments_dir: std::path::PathBuf,
+    input: BtrfsReceiveInput,
+    pipe_size: usize,
+    priority: &ProcessPriority,
+) -> Result<JoinHandle<Result<Option<String>, ServiceError>>, ServiceError> {
+    let lossy_path = deployments_dir.as_os_str().to_string_lossy().to_string();
+    let mut btrfs_cmd = Command::new("bash");
+    btrfs_cmd
+        .arg("-c")
+        .arg(format!("btrfs receive {lossy_path} -e 1>&2"))
+        .stdin(std::process::Stdio::piped())
+        .stderr(std::process::Stdio::piped());
+    priority.apply_to_command(&mut btrfs_cmd);
+    let mut btrfs_proc = btrfs_cmd.spawn().map_err(ServiceError::IOError)?;
+    priority.place(btrfs_proc.id());
+
+    let mut btrfs_stdin = btrfs_proc.stdin.take().ok_or_else(|| {
+        ServiceError::IOError(std::io::Error::other(
+            "Failed to open stdin for btrfs receive",
+        ))
+    })?;
+
+    let btrfs_stderr = btrfs_proc.stderr.take().ok_or_else(|| {
+        ServiceError::IOError(std::io::Error::other(
+            "Failed to open stderr for btrfs receive",
+        ))
+    })?;
+
+    let btrfs_stderr_reader = BufReader::new(btrfs_stderr);
+
+    resize_pipe(&btrfs_stdin, pipe_size, "btrfs receive stdin");
+
+    let pipe_task = match input {
+        // Pipe stream -> btrfs_stdin
+        BtrfsReceiveInput::Stream(mut stream) => tokio::spawn(async move {
+            let copy_res = tokio::io::copy(&mut stream, &mut btrfs_stdin)
+                .await
+                .inspect_err(|e| error!("Error piping data to btrfs receive: {e}"))?;
+
+            btrfs_stdin
+                .shutdown()
+                .await
+                .inspect_err(|e| error!("Error closing btrfs receive stdin: {e}"))?;
+
+            debug!("Piped {} bytes to btrfs receive", copy_res);
+            Ok::<u64, std::io::Error>(copy_res)
+        }),
+        // Splice source -> btrfs_stdin, on a blocking thread: closing the
+        // descriptor of btrfs_stdin at the end signals EOF
+        BtrfsReceiveInput::Pipe(source, metrics, head) => {
+            let source = source.into_owned_fd()?;
+            let sink = btrfs_stdin.into_owned_fd()?;
+            tokio::task::spawn_blocking(move || {
+                use std::io::Write;
+
+                let started = std::time::Instant::now();
+                let mut sink = std::fs::File::from(sink);
+                sink.write_all(&head)
+                    .inspect_err(|e| error!("Error writing data to btrfs receive: {e}"))?;
+                let sink = std::os::fd::OwnedFd::from(sink);
+                let spliced = splice_all(&source, &sink)
+                    .inspect_err(|e| error!("Error splicing data to btrfs receive: {e}"))?;
+
+                if let Some(metrics) = &metrics {
+                    let decompress = metrics.stage(PipelineStage::Decompress);
+                    decompress.add_bytes(head.len() as u64 + spliced);
+                    decompress.set_wall(started.elapsed());
+                }
+
+                debug!("Spliced {} bytes to btrfs receive", spliced);
+                Ok::<u64, std::io::Error>(spliced)
+            })
+        }
+    };
+
+    // Read stderr concurrently - capture all output for error diagnosis and logging
+    let stderr_task = tokio::spawn(async move {
+        let mut subvol_name: Option<String> = None;
+        let mut stderr_lines = Vec::new();
+        let mut lines = btrfs_stderr_reader.lines();
+        while let Ok(Some(line)) = lines.next_line().await {
+            let line_clone = line.clone();
+            stderr_lines.push(line_clone.clone());
+            // Log each stderr line for debugging
+            debug!("btrfs receive stderr: {}", line_clone);
+            if let Some(name) = line.strip_prefix("At subvol ") {
+                subvol_name = Some(name.to_string());
+            }
+        }
+        // Log complete stderr output for debugging
+        if !stderr_lines.is_empty() {
+            let stderr_text = stderr_lines.join("\n");
+            info!("btrfs receive stderr output:\n{}", stderr_text);
+        }
+        (subvol_name, stderr_lines)
+    });
+
+    Ok(tokio::spawn(async move {
+        let (pipe_res, btrfs_res, stderr_res) =
+            tokio::join!(pipe_task, btrfs_proc.wait(), stderr_task);
+
+        // Get stderr output first for better error messages
+        let (subvol_name, stderr_lines) = match stderr_res {
+            Ok((name, lines)) => (name, lines),
+            Err(e) => {
+                error!("stderr read task join error: {e}");
+                return Err(ServiceError::IOError(std::io::Error::other(format!(
+                    "reading stderr from btrfs receive failed: {e}",
+                ))));
+            }
+        };
+
+        // Check pipe result - broken pipe is expected if btrfs receive fails early
+        let pipe_err = match pipe_res {
+            Ok(Ok(_)) => None,
+            Ok(Err(e)) => Some(e.to_string()),
+            Err(e) => Some(e.to_string()),
+        };
+        if let Some(e) = &pipe_err {
+            warn!("btrfs pipe task error: {e} (may be expected if btrfs receive failed)");
+        }
+
+        let btrfs_status = match btrfs_res {
+            Ok(s) => s,
+            Err(e) => {
+                let stderr_text = stderr_lines.join("\n");
+                error!("btrfs receive wait error: {e}");
+                if !stderr_text.is_empty() {
+                    error!("btrfs receive stderr: {stderr_text}");
+                }
+                // Return error without stderr in the message (stderr is logged separately)
+                return Err(ServiceError::IOError(std::io::Error::other(format!(
+                    "btrfs receive wait failed: {e}",
+                ))));
+            }
+        };
+
+        // btrfs receive accepts a stream cut at a command boundary, and leaves
+        // what it received when cut anywhere else: never keep a subvolume
+        // whose input could not be read until the end
+        if pipe_err.is_some() {
+            if let Some(name) = &subvol_name {
+                warn!("Deleting partially received subvolume {name}");
+                let partial = deployments_dir.join(name);
+                if let Err(e) = Command::new("btrfs")
+                    .args(["subvolume", "delete"])
+                    .arg(&partial)
+                    .output()
+                    .await
+                {
+                    warn!("Failed to delete partial subvolume {name}: {e}");
+                }
+            }
+        }
+
+        if !btrfs_status.success() {
+            let stderr_text = stderr_lines.join("\n");
+            error!("btrfs receive failed with status: {btrfs_status}");
+            if !stderr_text.is_empty() {
+                error!("btrfs receive stderr: {stderr_text}");
+            }
+            // Return error without stderr in the message (stderr is logged separately)
+            return Err(ServiceError::IOError(std::io::Error::other(format!(
+                "btrfs receive failed with status: {btrfs_status}",
+            ))));
+        }
+
+        if let Some(e) = pipe_err {
+            return Err(ServiceError::IOError(std::io::Error::other(format!(
+                "reading the update stream failed: {e}",
+            ))));
+        }
+
+        Ok(subvol_name)
+    }))
+}
+
+/// Apply the decompressed send stream `stream` into `deployments_dir` with `receiver`
+///
+/// With `metrics`, the decompressed stream is measured as the Decompress
+/// stage and the receiver as the Receive stage.
+async fn receive_decompressed<S>(
+    btrfs: &Btrfs,
+    deployments_dir: std::path::PathBuf,
+    receiver: Receiver,
+    metrics: Option<Arc<PipelineMetrics>>,
+    pipe_size: usize,
+    priority: &ProcessPriority,
+    stream: S,
+) -> Result<Option<String>, ServiceError>
+where
+    S: AsyncRead + Send + 'static,
+{
+    let mut stream: Pin<Box<dyn AsyncRead + Send>> = match &metrics {
+        Some(metrics) => Box::pin(MeteredReader::new(
+            Box::pin(stream),
+            metrics.clone(),
+            PipelineStage::Decompress,
+        )),
+        None => Box::pin(stream),
+    };
+
+    let head = check_stream_head(btrfs, &deployments_dir, &mut stream).await?;
+    let stream: Pin<Box<dyn AsyncRead + Send>> = Box::pin(std::io::Cursor::new(head).chain(stream));
+
+    let started = std::time::Instant::now();
+    let progress = Arc::new(ReceiveProgress::default());
+    let result = match receiver {
+        Receiver::Native => {
+            btrfs
+                .receive_native(deployments_dir, stream, progress.clone(), priority.clone())
+                .await
+        }
+        Receiver::BtrfsCli => {
+            join_btrfs_receive(spawn_btrfs_receive(
+                deployments_dir,
+                BtrfsReceiveInput::Stream(stream),
+                pipe_size,
+                priority,
+            )?)
+            .await
+        }
+    };
+
+    // Receivers create a subvolume and change its flags when done
+    btrfs.invalidate_deployments();
+
+    // Only the native receiver reports its queue: for `btrfs receive` the
+    // Decompress stage write time is the time spent in the pipe
+    if let Some(metrics) = &metrics {
+        let wall = started.elapsed();
+        let receive = metrics.stage(PipelineStage::Receive);
+        receive.add_bytes(progress.bytes_applied());
+        receive.add_read_blocked(progress.apply_blocked());
+        receive.add_write_blocked(wall.saturating_sub(progress.apply_blocked()));
+        receive.record_buffer(progress.peak_queued_bytes());
+        receive.set_wall(wall);
+    }
+
+    result
+}
+
+/// Apply the send stream written by a child process to `stdout` with `btrfs receive`
+///
+/// The stream is spliced from one process to the other, only its head reaching
+/// user space to be checked; `metrics` only get the bytes and the wall times
+/// of the stages.
+async fn receive_spliced(
+    btrfs: &Btrfs,
+    deployments_dir: std::path::PathBuf,
+    metrics: Option<Arc<PipelineMetrics>>,
+    pipe_size: usize,
+    priority: &ProcessPriority,
+    mut stdout: ChildStdout,
+) -> Result<Option<String>, ServiceError> {
+    let started = std::time::Instant::now();
+    let head = check_stream_head(btrfs, &deployments_dir, &mut stdout).await?;
+    let result = join_btrfs_receive(spawn_btrfs_receive(
+        deployments_dir,
+        BtrfsReceiveInput::Pipe(stdout, metrics.clone(), head),
+        pipe_size,
+        priority,
+    )?)
+    .await;
+
+    if let Some(metrics) = &metrics {
+        metrics
+            .stage(PipelineStage::Receive)
+            .set_wall(started.elapsed());
+    }
+
+    result
+}
+
+/// Wait for the `btrfs receive` task spawned by [`spawn_btrfs_receive`]
+async fn join_btrfs_receive(
+    task: JoinHandle<Result<Option<String>, ServiceError>>,
+) -> Result<Option<String>, ServiceError> {
+    match task.await {
+        Ok(result) => result,
+        Err(e) => {
+            error!("btrfs receive join error: {e}");
+            Err(ServiceError::IOError(std::io::Error::other(
+                "joining of btrfs receive failed".to_string(),
+            )))
+        }
+    }
+}
+
+/// Decompress the update stream and receive it as a new subvolume in `deployments_dir`.
+///
+/// Returns the name of the received subvolume, if the receiver reported it,
+/// or [`ServiceError::NoUpdateAvailable`] when the subvolume was already received.
 pub async fn receive_btrfs_stream<R>(
+    btrfs: &Btrfs,
     deployments_dir: std::path::PathBuf,
+    options: ReceiveOptions,
+    input_stream: R,
+) -> Result<Option<String>, ServiceError>
+where
+    R: AsyncRead + Unpin + Send + 'static,
+{
+    // Fail before consuming the stream when `btrfs receive` is missing
+    if matches!(options.receiver, Receiver::BtrfsCli) {
+        btrfs.version()?;
+    }
+
+    match options.decompressor {
+        Decompressor::Xz => {
+            debug!("[PROGRESS] receive_btrfs_stream: Decoding xz in-process -> btrfs");
+
+            // Concatenated .xz streams are valid, as accepted by xz -d
+            let mut decoder =
+                XzDecoder::new(BufReader::with_capacity(DECODER_BUFFER_SIZE, input_stream));
+            decoder.multiple_members(true);
+
+            receive_decompressed(
+                btrfs,
+                deployments_dir,
+                options.receiver,
+                options.metrics,
+                options.pipe_size,
+                &options.priority,
+                decoder,
+            )
+            .await
+        }
+        Decompressor::ExternalXz => {
+            receive_btrfs_stream_external_xz(
+                btrfs,
+                deployments_dir,
+                options.receiver,
+                options.metrics,
+                options.pipe_size,
+                &options.priority,
+                input_stream,
+            )
+            .await
+        }
+        Decompressor::Zstd(dictionary) => {
+            debug!("[PROGRESS] receive_btrfs_stream: Decoding zstd in-process -> btrfs");
+
+            let input = BufReader::with_capacity(DECODER_BUFFER_SIZE, input_stream);
+            let mut decoder = match dictionary {
+                Some(dictionary) => ZstdDecoder::with_dict(input, &dictionary)?,
+                None => ZstdDecoder::new(input),
+            };
+            // Concatenated frames are valid, as accepted by zstd -d
+            decoder.multiple_members(true);
+
+            receive_decompressed(
+                btrfs,
+                deployments_dir,
+                options.receiver,
+                options.metrics,
+                options.pipe_size,
+                &options.priority,
+                decoder,
+            )
+            .await
+        }
+    }
+}
+
+/// Fallback for [`receive_btrfs_stream`] piping the stream through an `xz -d` process
+///
+/// With `btrfs receive`, the output of xz is spliced to it in the kernel.
+async fn receive_btrfs_stream_external_xz<R>(
+    btrfs: &Btrfs,
+    deployments_dir: std::path::PathBuf,
+    receiver: Receiver,
+    metrics: Option<Arc<PipelineMetrics>>,
+    pipe_size: usize,
+    priority: &ProcessPriority,
     mut input_stream: R,
 ) -> Result<Option<String>, ServiceError>
 where
     R: AsyncRead + Unpin + Send + 'static,
 {
     // Spawn the xz -d decompressor
-    let mut xz_proc = Command::new("xz")
+    let mut xz_cmd = Command::new("xz");
+    xz_cmd
         .arg("-d")
         .stdin(std::process::Stdio::piped())
         .stdout(std::process::Stdio::piped())
-        .spawn()
-        .map_err(ServiceError::IOError)?;
+        // Do not leave a decompressor behind when a cancelled update is dropped
+        .kill_on_drop(true);
+    priority.apply_to_command(&mut xz_cmd);
+    let mut xz_proc = xz_cmd.spawn().map_err(ServiceError::IOError)?;
+    priority.place(xz_proc.id());
 
     let mut xz_stdin = xz_proc.stdin.take().ok_or_else(|| {
         ServiceError::IOError(std::io::Error::other("Failed to open stdin for xz"))
@@ -174,6 +728,9 @@ where
         ServiceError::IOError(std::io::Error::other("Failed to open stdout for xz"))
     })?;
 
+    resize_pipe(&xz_stdin, pipe_size, "xz stdin");
+    resize_pipe(&xz_stdout, pipe_size, "xz stdout");
+
     // Pipe input stream -> xz stdin
     debug!(
         "[PROGRESS] receive_btrfs_stream: Starting to pipe data from ProgressReader -> xz -> btrfs"
@@ -202,130 +759,39 @@ where
         }
     });
 
-    // Pipe xz stdout -> btrfs receive directly (avoiding Unpin requirement)
-    // We'll duplicate the btrfs receive logic here to handle ChildStdout properly
-    let deployments_dir = deployments_dir.clone();
-    let btrfs_task = {
-        let lossy_path = deployments_dir.as_os_str().to_string_lossy().to_string();
-        let mut btrfs_proc = tokio::process::Command::new("bash")
-            .arg("-c")
-            .arg(format!("btrfs receive {lossy_path} -e 1>&2"))
-            .stdin(std::process::Stdio::piped())
-            .stderr(std::process::Stdio::piped())
-            .spawn()
-            .map_err(ServiceError::IOError)?;
-
-        let mut btrfs_stdin = btrfs_proc.stdin.take().ok_or_else(|| {
-            ServiceError::IOError(std::io::Error::other(
-                "Failed to open stdin for btrfs receive",
-            ))
-        })?;
-
-        let btrfs_stderr = btrfs_proc.stderr.take().ok_or_else(|| {
-            ServiceError::IOError(std::io::Error::other(
-                "Failed to open stderr for btrfs receive",
-            ))
-        })?;
-
-        let btrfs_stderr_reader = BufReader::new(btrfs_stderr);
-
-        // Pipe xz_stdout -> btrfs_stdin (using pin! to handle non-Unpin type)
-        let pipe_task = {
-            let mut xz_stdout_pinned = Box::pin(xz_stdout);
-            tokio::spawn(async move {
-                use tokio::io::AsyncWriteExt;
-                let Ok(copy_res) = tokio::io::copy(&mut *xz_stdout_pinned, &mut btrfs_stdin)
-                    .await
-                    .inspect_err(|e| error!("Error piping data from xz to btrfs receive: {e}"))
-                else {
-                    return;
-                };
-                let Ok(_) = btrfs_stdin
-                    .shutdown()
-                    .await
-                    .inspect_err(|e| error!("Error closing btrfs receive stdin: {e}"))
-                else {
-                    return;
-                };
-                debug!("Piped {} bytes from xz to btrfs receive", copy_res);
-            })
-        };
-
-        // Read stderr concurrently - capture all output for error diagnosis and logging
-        let stderr_task = tokio::spawn(async move {
-            let mut subvol_name: Option<String> = None;
-            let mut stderr_lines = Vec::new();
-            let mut lines = btrfs_stderr_reader.lines();
-            while let Ok(Some(line)) = lines.next_line().await {
-                let line_clone = line.clone();
-                stderr_lines.push(line_clone.clone());
-                // Log each stderr line for debugging
-                debug!("btrfs receive stderr: {}", line_clone);
-                if let Some(name) = line.strip_prefix("At subvol ") {
-                    subvol_name = Some(name.to_string());
-                }
-            }
-            // Log complete stderr output for debugging
-            if !stderr_lines.is_empty() {
-                let stderr_text = stderr_lines.join("\n");
-                info!("btrfs receive stderr output:\n{}", stderr_text);
+    // Pipe xz stdout -> btrfs receive
+    let received_dir = deployments_dir.clone();
+    let btrfs_task = async {
+        match receiver {
+            Receiver::BtrfsCli => {
+                let result = receive_spliced(
+                    btrfs,
+                    deployments_dir,
+                    metrics,
+                    pipe_size,
+                    priority,
+                    xz_stdout,
+                )
+                .await;
+                btrfs.invalidate_deployments();
+                result
             }
-            (subvol_name, stderr_lines)
-        });
-
-        tokio::spawn(async move {
-            let (pipe_res, btrfs_res, stderr_res) =
-                tokio::join!(pipe_task, btrfs_proc.wait(), stderr_task);
-
-            // Get stderr output first for better error messages
-            let (subvol_name, stderr_lines) = match stderr_res {
-                Ok((name, lines)) => (name, lines),
-                Err(e) => {
-                    error!("stderr read task join error: {e}");
-                    return Err(ServiceError::IOError(std::io::Error::other(format!(
-                        "reading stderr from btrfs receive failed: {e}",
-                    ))));
-                }
-            };
-
-            // Check pipe result - broken pipe is expected if btrfs receive fails early
-            let pipe_err = pipe_res.err();
-            if let Some(e) = pipe_err {
-                warn!("btrfs pipe task error: {e} (may be expected if btrfs receive failed)");
+            Receiver::Native => {
+                receive_decompressed(
+                    btrfs,
+                    deployments_dir,
+                    receiver,
+                    metrics,
+                    pipe_size,
+                    priority,
+                    xz_stdout,
+                )
+                .await
             }
-
-            let btrfs_status = match btrfs_res {
-                Ok(s) => s,
-                Err(e) => {
-                    let stderr_text = stderr_lines.join("\n");
-                    error!("btrfs receive wait error: {e}");
-                    if !stderr_text.is_empty() {
-                        error!("btrfs receive stderr: {stderr_text}");
-                    }
-                    // Return error without stderr in the message (stderr is logged separately)
-                    return Err(ServiceError::IOError(std::io::Error::other(format!(
-                        "btrfs receive wait failed: {e}",
-                    ))));
-                }
-            };
-
-            if !btrfs_status.success() {
-                let stderr_text = stderr_lines.join("\n");
-                error!("btrfs receive failed with status: {btrfs_status}");
-                if !stderr_text.is_empty() {
-                    error!("btrfs receive stderr: {stderr_text}");
-                }
-                // Return error without stderr in the message (stderr is logged separately)
-                return Err(ServiceError::IOError(std::io::Error::other(format!(
-                    "btrfs receive failed with status: {btrfs_status}",
-                ))));
-            }
-
-            Ok(subvol_name)
-        })
+        }
     };
 
-    let (xz_input_task_res, xz_task_res, btrfs_task_res) = tokio::join!(
+    let (xz_input_task_res, xz_task_res, subvolume_result) = tokio::join!(
         // Copy bytes from incoming stream to xz
         input_to_xz,
         // Run the xz command receiving the stream
@@ -352,16 +818,6 @@ where
         )));
     };
 
-    let subvolume_result = match btrfs_task_res {
-        Ok(result) => result,
-        Err(e) => {
-            error!("btrfs receive join error: {e}");
-            return Err(ServiceError::IOError(std::io::Error::other(
-                "joining of btrfs receive failed".to_string(),
-            )));
-        }
-    };
-
     // Check xz status - but if btrfs receive failed, xz may have gotten SIGPIPE which is expected
     if !xz_status.success() {
         // If btrfs receive failed, xz getting SIGPIPE (signal 13) is expected (broken pipe)
@@ -372,7 +828,14 @@ where
             warn!("xz decompressor failed (likely SIGPIPE) because btrfs receive failed - returning btrfs receive error");
             return subvolume_result;
         }
-        // Otherwise, xz failed independently
+        // Otherwise, xz failed independently: a truncated input (e.g. a
+        // cancelled update) can still end in a received subvolume
+        if let Ok(Some(name)) = &subvolume_result {
+            warn!("Deleting subvolume {name} received from a failed decompression");
+            if let Err(e) = btrfs.subvolume_delete(received_dir.join(name)) {
+                warn!("Failed to delete subvolume {name}: {e}");
+            }
+        }
         return Err(ServiceError::IOError(std::io::Error::other(format!(
             "xz decompressor failed with status: {xz_status}"
         ))));
@@ -383,38 +846,63 @@ where
     subvolume_result
 }
 
-/// Common method to install an update from a reader
-pub async fn install_update<R>(
+/// A received and verified deployment, not yet bootable
+#[derive(Debug)]
+pub struct StagedDeployment {
+    /// Name of the deployment subvolume inside the deployments directory
+    pub name: String,
+    /// Subvolume ID of the deployment
+    pub id: u64,
+    /// Full path of the deployment subvolume
+    pub path: std::path::PathBuf,
+    manifest: crate::manifest::Manifest,
+}
+
+/// Receive and verify an update from a reader, without making it bootable.
+///
+/// The new deployment is left in `deployments_dir` and is not the default
+/// subvolume: use [`commit_staged_update`] to make it bootable, or delete it
+/// to discard the update.
+pub async fn stage_update<R>(
     signature_verify_data: Option<(&RsaPublicKey, &Vec<u8>)>,
-    rootfs_dir: std::path::PathBuf,
     deployments_dir: std::path::PathBuf,
-    boot_name: String,
     btrfs: &Arc<Btrfs>,
+    options: ReceiveOptions,
     reader: R,
-) -> Result<Option<String>, ServiceError>
+) -> Result<StagedDeployment, ServiceError>
 where
     R: AsyncRead + Unpin + Send + 'static,
 {
     debug!("[PROGRESS] install_update: Creating HashingReader wrapper");
     // Create hashing reader to compute SHA512 during streaming
-    let hashing_reader = HashingReader::new(reader);
+    let hashing_reader = match options.hash_thread {
+        true => HashingReader::with_hash_thread(reader, DEFAULT_HASH_QUEUE_DEPTH),
+        false => HashingReader::new(reader),
+    };
     let hash_result = hashing_reader.hash_result();
+    let hashed_stream: Pin<Box<dyn AsyncRead + Send + Unpin>> = match &options.metrics {
+        Some(metrics) => Box::pin(MeteredReader::new(
+            hashing_reader,
+            metrics.clone(),
+            PipelineStage::Hash,
+        )),
+        None => Box::pin(hashing_reader),
+    };
 
     debug!("[PROGRESS] install_update: Calling receive_btrfs_stream - stream consumption should start now");
-    let subvolume = receive_btrfs_stream(
-        deployments_dir.clone(),
-        Box::pin(hashing_reader) as Pin<Box<dyn AsyncRead + Send + Unpin>>,
-    )
-    .await?;
+    let progress = options.progress.clone();
+    let subvolume =
+        receive_btrfs_stream(btrfs, deployments_dir.clone(), options, hashed_stream).await?;
     let name = subvolume
         .ok_or_else(|| ServiceError::IOError(std::io::Error::other("No subvolume name found")))?;
 
     info!("Received subvolume: {name}");
-    let rootfs_path = rootfs_dir.clone();
-    let deployments_dir = deployments_dir.clone();
-    let currently_running_name = boot_name.clone();
     let subvolume_path = deployments_dir.join(&name);
 
+    if let Some(progress) = &progress {
+        progress.set_stage(UpdateStage::Verifying);
+    }
+
     let subvol_id = btrfs
         .btrfs_subvol_get_id(subvolume_path.clone())
         .map_err(|e| {
@@ -489,9 +977,74 @@ where
     // Verify signature before proceeding with installation
     if let Some((pubkey, signature)) = signature_verify_data {
         debug!("Verifying signature of the update stream hash");
-        verify_signature(pubkey, signature, hash_hex)?;
+        if let Err(err) = verify_signature(pubkey, signature, hash_hex) {
+            // Try to delete the invalid subvolume right away
+            if let Err(e) = btrfs.subvolume_delete(subvolume_path.clone()) {
+                warn!("Failed to delete invalid subvolume {name}: {e}");
+            }
+            return Err(err);
+        }
     };
 
+    Ok(StagedDeployment {
+        name,
+        id: subvol_id,
+        path: subvolume_path,
+        manifest,
+    })
+}
+
+/// Stop a [`stage_update`] in progress and delete what it received.
+///
+/// `cancel` must stop the stream read by `staging`: dropping the future alone
+/// leaves the tasks feeding `btrfs receive` running until the end of the
+/// stream. Once cancelled, the receiver deletes its partial subvolume; a
+/// deployment staged in the meantime, or already `staged`, is deleted here.
+pub async fn discard_staged_update<F>(
+    btrfs: &Btrfs,
+    cancel: &CancellationToken,
+    staging: F,
+    staged: Option<StagedDeployment>,
+) where
+    F: std::future::Future<Output = Result<StagedDeployment, ServiceError>>,
+{
+    cancel.cancel();
+
+    let staged = match staged {
+        Some(deployment) => Some(deployment),
+        None => staging.await.ok(),
+    };
+
+    if let Some(deployment) = staged {
+        if let Err(e) = btrfs.subvolume_delete(deployment.path.clone()) {
+            warn!(
+                "Failed to delete staged deployment {}: {e}",
+                deployment.name
+            );
+        }
+    }
+}
+
+/// Make a deployment staged by [`stage_update`] bootable.
+///
+/// Runs the install script declared in its manifest, if any, then sets the
+/// deployment as the default subvolume of `rootfs_dir`.
+pub async fn commit_staged_update(
+    staged: StagedDeployment,
+    rootfs_dir: std::path::PathBuf,
+    deployments_dir: std::path::PathBuf,
+    boot_name: String,
+    btrfs: &Arc<Btrfs>,
+) -> Result<String, ServiceError> {
+    let StagedDeployment {
+        name,
+        id: subvol_id,
+        path: subvolume_path,
+        manifest,
+    } = staged;
+    let rootfs_path = rootfs_dir;
+    let currently_running_name = boot_name;
+
     // If an install script is specified in the manifest run it now
     if let Some(install_script) = manifest.install_script() {
         info!("Running install script for the new deployment");
@@ -543,5 +1096,32 @@ where
 
     info!("Installed deployment {name} (ID={subvol_id})");
 
-    Ok(name.into())
+    Ok(name)
+}
+
+/// Common method to install an update from a reader
+pub async fn install_update<R>(
+    signature_verify_data: Option<(&RsaPublicKey, &Vec<u8>)>,
+    rootfs_dir: std::path::PathBuf,
+    deployments_dir: std::path::PathBuf,
+    boot_name: String,
+    btrfs: &Arc<Btrfs>,
+    options: ReceiveOptions,
+    reader: R,
+) -> Result<Option<String>, ServiceError>
+where
+    R: AsyncRead + Unpin + Send + 'static,
+{
+    let staged = stage_update(
+        signature_verify_data,
+        deployments_dir.clone(),
+        btrfs,
+        options,
+        reader,
+    )
+    .await?;
+
+    commit_staged_update(staged, rootfs_dir, deployments_dir, boot_name, btrfs)
+        .await
+        .map(Some)
 }
@@ -19,15 +19,16 @@
 
 use std::sync::Arc;
 
-use log::{debug, error};
-use tokio::sync::RwLock;
+use log::{debug, error, warn};
+use tokio::sync::{broadcast, RwLock};
 use zbus::object_server::SignalEmitter;
 use zbus::{fdo, interface};
 
-use crate::{
-    service::{Service, UpdateRequest, UpdateSource},
-    status::UpdateStatus,
+use crate::metrics::PIPELINE_STAGES;
+use crate::service::{
+    RequestEvent, RequestId, RequestPriority, Service, Submission, UpdateRequest, UpdateSource,
 };
+use crate::status::UpdateStatus;
 
 pub struct EmbuerDBus {
     service: Arc<RwLock<Service>>,
@@ -39,72 +40,152 @@ impl EmbuerDBus {
     }
 
     /// Start a background task to monitor status changes and emit DBus signals
+    ///
+    /// The task sleeps until the status is changed, so an idle daemon
+    /// has no periodic wakeups.
     pub async fn start_status_monitor(
         service: Arc<RwLock<Service>>,
         signal_emitter: SignalEmitter<'static>,
     ) {
+        Self::start_progress_monitor(service.clone(), signal_emitter.clone()).await;
+        Self::start_request_monitor(service.clone(), signal_emitter.clone()).await;
+
         tokio::spawn(async move {
-            let status_handle = {
+            let mut status_rx = {
                 let svc = service.read().await;
-                svc.update_status_handle().await
+                svc.subscribe_update_status().await
             };
 
-            let mut last_status = UpdateStatus::Idle;
-            let mut last_progress = -1;
+            while status_rx.changed().await.is_ok() {
+                let current_status = status_rx.borrow_and_update().clone();
+                let current_progress = current_status.progress();
 
-            loop {
-                tokio::time::sleep(std::time::Duration::from_millis(200)).await;
+                debug!(
+                    "Status update: {} - {} ({}%)",
+                    current_status.as_str(),
+                    current_status.details(),
+                    current_progress
+                );
 
-                let current_status = status_handle.read().await.clone();
-                let current_progress = current_status.progress();
+                // Emit DBus signal with progress
+                if let Err(e) = EmbuerDBus::update_status_changed(
+                    &signal_emitter,
+                    current_status.as_str(),
+                    &current_status.details(),
+                    current_progress,
+                )
+                .await
+                {
+                    error!("Failed to emit DBus signal: {}", e);
+                }
+            }
+
+            debug!("Status channel closed: status monitor stopped");
+        });
+    }
+
+    /// Start a background task emitting UpdateProgressChanged signals
+    ///
+    /// Progress is sampled by the update stream at most every 100ms: the
+    /// signal rate is bounded by that, by stage changes and by the changes of
+    /// the update queue depth.
+    async fn start_progress_monitor(
+        service: Arc<RwLock<Service>>,
+        signal_emitter: SignalEmitter<'static>,
+    ) {
+        tokio::spawn(async move {
+            let (mut progress_rx, mut depth_rx) = {
+                let svc = service.read().await;
+                (
+                    svc.subscribe_update_progress().await,
+                    svc.subscribe_update_queue_depth(),
+                )
+            };
 
-                // Emit signal if status changed OR progress changed
-                let should_emit = current_status.as_str() != last_status.as_str()
-                    || current_status.details() != last_status.details()
-                    || current_progress != last_progress;
-
-                if should_emit {
-                    debug!(
-                        "Status update: {} - {} ({}%)",
-                        current_status.as_str(),
-                        current_status.details(),
-                        current_progress
-                    );
-
-                    // Emit DBus signal with progress
-                    if let Err(e) = EmbuerDBus::update_status_changed(
-                        &signal_emitter,
-                        current_status.as_str(),
-                        &current_status.details(),
-                        current_progress,
+            loop {
+                let changed = tokio::select! {
+                    changed = progress_rx.changed() => changed,
+                    changed = depth_rx.changed() => changed,
+                };
+                if changed.is_err() {
+                    break;
+                }
+                progress_rx.mark_unchanged();
+                depth_rx.mark_unchanged();
+
+                let (progress, queue_depth) = {
+                    let svc = service.read().await;
+                    (
+                        svc.get_update_progress().await,
+                        svc.get_update_queue_depth(),
                     )
-                    .await
-                    {
-                        error!("Failed to emit DBus signal: {}", e);
-                    }
+                };
 
-                    last_status = current_status;
-                    last_progress = current_progress;
+                if let Err(e) = EmbuerDBus::update_progress_changed(
+                    &signal_emitter,
+                    progress.stage as u32,
+                    progress.bytes_done,
+                    progress.bytes_total,
+                    progress.rate,
+                    progress.average_rate,
+                    progress.eta_seconds,
+                    queue_depth as u32,
+                )
+                .await
+                {
+                    error!("Failed to emit DBus progress signal: {}", e);
                 }
             }
+
+            debug!("Progress channel closed: progress monitor stopped");
         });
     }
-}
 
-#[interface(
-    name = "org.neroreflex.embuer1",
-    proxy(
-        default_service = "org.neroreflex.embuer",
-        default_path = "/org/neroreflex/embuer"
-    )
-)]
-impl EmbuerDBus {
-    /// Install an update from a file path
-    async fn install_update_from_file(&self, file_path: String) -> fdo::Result<String> {
-        let service = self.service.read().await;
-        let update_tx = service.update_sender();
+    /// Start a background task emitting UpdateRequestStarted and
+    /// UpdateRequestFinished signals
+    async fn start_request_monitor(
+        service: Arc<RwLock<Service>>,
+        signal_emitter: SignalEmitter<'static>,
+    ) {
+        tokio::spawn(async move {
+            let mut events_rx = service.read().await.subscribe_update_requests();
+
+            loop {
+                let result = match events_rx.recv().await {
+                    Ok(RequestEvent::Started(id)) => {
+                        EmbuerDBus::update_request_started(&signal_emitter, id).await
+                    }
+                    Ok(RequestEvent::Finished(id, status)) => {
+                        EmbuerDBus::update_request_finished(
+                            &signal_emitter,
+                            id,
+                            status.as_str(),
+                            &status.details(),
+                            status.progress(),
+                        )
+                        .await
+                    }
+                    Err(broadcast::error::RecvError::Lagged(missed)) => {
+                        warn!(
+                            "Request monitor lagged behind: {missed} request events not signalled"
+                        );
+                        continue;
+                    }
+                    Err(broadcast::error::RecvError::Closed) => break,
+                };
+
+                if let Err(e) = result {
+                    error!("Failed to emit DBus request signal: {}", e);
+                }
+            }
+
+            debug!("Request events channel closed: request monitor stopped");
+        });
+    }
 
-        let path = std::path::PathBuf::from(&file_path);
+    /// Submit a user request for the update file `file_path`
+    async fn submit_file(&self, file_path: &str) -> fdo::Result<(RequestId, Submission)> {
+        let path = std::path::PathBuf::from(file_path);
         if !path.exists() {
             return Err(fdo::Error::Failed(format!(
                 "File does not exist: {}",
@@ -112,33 +193,82 @@ impl EmbuerDBus {
             )));
         }
 
+        self.submit(UpdateSource::File(path)).await
+    }
+
+    /// Submit a user request for the update at `source`
+    async fn submit(&self, source: UpdateSource) -> fdo::Result<(RequestId, Submission)> {
+        let service = self.service.read().await;
+
         let request = UpdateRequest {
-            source: UpdateSource::File(path),
+            source,
+            priority: RequestPriority::User,
+            outcome: None,
         };
 
-        update_tx
-            .send(request)
-            .await
-            .map_err(|e| fdo::Error::Failed(format!("Failed to send update request: {}", e)))?;
+        service
+            .submit_update(request)
+            .map_err(|e| fdo::Error::Failed(format!("Failed to send update request: {}", e)))
+    }
+}
+
+/// Reply to an install request for the `kind` source `source`
+fn submission_message(submission: Submission, kind: &str, source: &str) -> String {
+    match submission {
+        Submission::Queued(0) => format!("Update request queued for {kind}: {source}"),
+        Submission::Queued(ahead) => {
+            format!("Update request queued for {kind}: {source} ({ahead} requests ahead)")
+        }
+        Submission::Coalesced => {
+            format!("Update request merged with the queued request for {kind}: {source}")
+        }
+        Submission::InProgress => format!("Update already in progress for {kind}: {source}"),
+    }
+}
 
-        Ok(format!("Update request queued for file: {}", file_path))
+#[interface(
+    name = "org.neroreflex.embuer1",
+    proxy(
+        default_service = "org.neroreflex.embuer",
+        default_path = "/org/neroreflex/embuer"
+    )
+)]
+impl EmbuerDBus {
+    /// Install an update from a file path
+    async fn install_update_from_file(&self, file_path: String) -> fdo::Result<String> {
+        let (_, submission) = self.submit_file(&file_path).await?;
+        Ok(submission_message(submission, "file", &file_path))
     }
 
     /// Install an update from a URL
     async fn install_update_from_url(&self, url: String) -> fdo::Result<String> {
-        let service = self.service.read().await;
-        let update_tx = service.update_sender();
-
-        let request = UpdateRequest {
-            source: UpdateSource::Url(url.clone()),
-        };
+        let (_, submission) = self.submit(UpdateSource::Url(url.clone())).await?;
+        Ok(submission_message(submission, "URL", &url))
+    }
 
-        update_tx
-            .send(request)
-            .await
-            .map_err(|e| fdo::Error::Failed(format!("Failed to send update request: {}", e)))?;
+    /// Install an update from a file path, as InstallUpdateFromFile
+    /// Returns: (request_id: u64, in_progress: bool, message: String)
+    /// request_id identifies the request in CancelUpdateRequest and in the
+    /// UpdateRequestStarted and UpdateRequestFinished signals; in_progress is
+    /// true if the request was attached to the one being processed
+    async fn queue_update_from_file(&self, file_path: String) -> fdo::Result<(u64, bool, String)> {
+        let (id, submission) = self.submit_file(&file_path).await?;
+        Ok((
+            id,
+            submission == Submission::InProgress,
+            submission_message(submission, "file", &file_path),
+        ))
+    }
 
-        Ok(format!("Update request queued for URL: {}", url))
+    /// Install an update from a URL, as InstallUpdateFromUrl
+    /// Returns: as QueueUpdateFromFile
+    async fn queue_update_from_url(&self, url: String) -> fdo::Result<(u64, bool, String)> {
+        let (id, submission) = self.submit(UpdateSource::Url(url.clone())).await?;
+        Ok((
+            id,
+            submission == Submission::InProgress,
+            submission_message(submission, "URL", &url),
+        ))
     }
 
     /// Get the current update status (state, details, and progress)
@@ -154,6 +284,80 @@ impl EmbuerDBus {
         ))
     }
 
+    /// Get the structured progress of the update pipeline
+    /// Returns: (stage: u32, bytes_done: u64, bytes_total: u64, rate: u64,
+    ///           average_rate: u64, eta_seconds: i64, queue_depth: u32)
+    /// stage is 0 idle, 1 checking, 2 downloading, 3 reading, 4 receiving, 5 verifying;
+    /// rates are in bytes per second; bytes_total is 0 and eta_seconds -1 if unknown;
+    /// queue_depth is as returned by GetUpdateQueueDepth
+    async fn get_update_progress(&self) -> fdo::Result<(u32, u64, u64, u64, u64, i64, u32)> {
+        let service = self.service.read().await;
+        let progress = service.get_update_progress().await;
+        Ok((
+            progress.stage as u32,
+            progress.bytes_done,
+            progress.bytes_total,
+            progress.rate,
+            progress.average_rate,
+            progress.eta_seconds,
+            service.get_update_queue_depth() as u32,
+        ))
+    }
+
+    /// Get the metrics of every stage of the last update pipeline
+    /// Returns: array of (stage: String, bytes: u64, read_blocked_us: u64,
+    ///           write_blocked_us: u64, wall_us: u64, peak_buffer: u64)
+    /// stages are "source", "hash", "decompress" and "receive", in pipeline order
+    async fn get_metrics(&self) -> fdo::Result<Vec<(String, u64, u64, u64, u64, u64)>> {
+        let service = self.service.read().await;
+        let metrics = service.get_pipeline_metrics().await;
+        Ok(PIPELINE_STAGES
+            .iter()
+            .zip(metrics)
+            .map(|(stage, m)| {
+                (
+                    stage.as_str().to_string(),
+                    m.bytes,
+                    m.read_blocked_us,
+                    m.write_blocked_us,
+                    m.wall_us,
+                    m.peak_buffer,
+                )
+            })
+            .collect())
+    }
+
+    /// Get the status, transfer progress and boot deployment in a single call
+    /// Returns: (status: String, details: String, version: String, progress: i32,
+    ///           bytes_done: u64, bytes_total: u64, boot_id: u64)
+    /// version is the version of the pending update, if any; bytes_total is 0 if unknown
+    async fn get_snapshot(&self) -> fdo::Result<(String, String, String, i32, u64, u64, u64)> {
+        let service = self.service.read().await;
+        let status = service.get_update_status().await;
+        let (bytes_done, bytes_total) = service.get_transfer_progress().await;
+        let version = match &status {
+            UpdateStatus::AwaitingConfirmation { version, .. } => version.clone(),
+            _ => String::new(),
+        };
+
+        Ok((
+            status.as_str().to_string(),
+            status.details(),
+            version,
+            status.progress(),
+            bytes_done,
+            bytes_total.unwrap_or(0),
+            service.get_boot_id().await,
+        ))
+    }
+
+    /// Get the number of update requests waiting for the one in progress
+    /// Requests for a source already queued or in progress are merged and not counted
+    async fn get_update_queue_depth(&self) -> fdo::Result<u32> {
+        let service = self.service.read().await;
+        Ok(service.get_update_queue_depth() as u32)
+    }
+
     /// Get the boot deployment information
     /// Returns: The subvolume ID and name of the currently running deployment
     async fn get_boot_info(&self) -> fdo::Result<(u64, String)> {
@@ -192,6 +396,54 @@ impl EmbuerDBus {
         }
     }
 
+    /// Cancel the update being downloaded, installed or awaiting confirmation
+    /// The partially received deployment is deleted and the status becomes Failed
+    async fn cancel_update(&self) -> fdo::Result<String> {
+        let service = self.service.read().await;
+        service
+            .cancel_update()
+            .await
+            .map_err(|e| fdo::Error::Failed(format!("Failed to cancel update: {}", e)))?;
+
+        Ok("Update cancelled".to_string())
+    }
+
+    /// Cancel the update request returned by QueueUpdateFromFile or QueueUpdateFromUrl
+    /// A queued request is dropped, the request in progress is stopped as by
+    /// CancelUpdate; either way UpdateRequestFinished reports it Failed
+    async fn cancel_update_request(&self, request_id: u64) -> fdo::Result<String> {
+        let service = self.service.read().await;
+        service
+            .cancel_update_request(request_id)
+            .await
+            .map_err(|e| fdo::Error::Failed(format!("Failed to cancel update request: {}", e)))?;
+
+        Ok(format!("Update request {request_id} cancelled"))
+    }
+
+    /// Pause the update in progress: its source is not read until it is resumed
+    /// Returns false if the update was already paused
+    async fn pause_update(&self) -> fdo::Result<bool> {
+        let service = self.service.read().await;
+        service
+            .pause_update()
+            .await
+            .map_err(|e| fdo::Error::Failed(format!("Failed to pause update: {}", e)))
+    }
+
+    /// Resume the paused update
+    /// Returns false if the update was not paused
+    async fn resume_update(&self) -> fdo::Result<bool> {
+        let service = self.service.read().await;
+        Ok(service.resume_update().await)
+    }
+
+    /// Whether the update in progress is paused
+    async fn is_update_paused(&self) -> fdo::Result<bool> {
+        let service = self.service.read().await;
+        Ok(service.is_update_paused().await)
+    }
+
     /// DBus signal emitted when update status changes
     /// Arguments: status (string), details (string), progress (i32: 0-100, or -1 if N/A)
     #[zbus(signal)]
@@ -201,4 +453,37 @@ impl EmbuerDBus {
         details: &str,
         progress: i32,
     ) -> zbus::Result<()>;
+
+    /// DBus signal emitted when the update progress is sampled, its stage changes
+    /// or the update queue depth changes
+    /// Arguments: as returned by GetUpdateProgress
+    #[zbus(signal)]
+    async fn update_progress_changed(
+        signal_emitter: &SignalEmitter<'_>,
+        stage: u32,
+        bytes_done: u64,
+        bytes_total: u64,
+        rate: u64,
+        average_rate: u64,
+        eta_seconds: i64,
+        queue_depth: u32,
+    ) -> zbus::Result<()>;
+
+    /// DBus signal emitted when an update request starts being processed
+    #[zbus(signal)]
+    async fn update_request_started(
+        signal_emitter: &SignalEmitter<'_>,
+        request_id: u64,
+    ) -> zbus::Result<()>;
+
+    /// DBus signal emitted when an update request ends, or is cancelled while queued
+    /// Arguments: the request id, then the status it ended with as in UpdateStatusChanged
+    #[zbus(signal)]
+    async fn update_request_finished(
+        signal_emitter: &SignalEmitter<'_>,
+        request_id: u64,
+        status: &str,
+        details: &str,
+        progress: i32,
+    ) -> zbus::Result<()>;
 }
@@ -0,0 +1,661 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Resumable HTTP downloads.
+//!
+//! A [`ResumableDownload`] turns an HTTP response into a byte stream that
+//! survives connection drops: the transfer is resumed with a `Range:` request
+//! from the last byte consumed, after checking (via `If-Range` with the ETag
+//! or Last-Modified of the first response) that the resource did not change.
+//! Consumers of the stream never see the reconnection.
+//!
+//! A [`SegmentedDownload`] fetches consecutive byte ranges of the resource
+//! over several connections at once, and yields them in order: at most
+//! `buffer_size` bytes are held in memory and nothing is written to disk.
+//!
+//! [`ArchiveValidators`] remembers the ETag/Last-Modified of the last
+//! installed archive, so that update checks are conditional requests.
+
+use std::path::Path;
+use std::time::Duration;
+
+use bytes::{Bytes, BytesMut};
+use futures::stream::{self, BoxStream};
+use futures::{StreamExt, TryStreamExt};
+use log::{info, warn};
+use reqwest::header::{
+    HeaderMap, HeaderValue, ACCEPT_RANGES, CONTENT_RANGE, ETAG, IF_MODIFIED_SINCE, IF_NONE_MATCH,
+    IF_RANGE, LAST_MODIFIED, RANGE,
+};
+use reqwest::{Client, RequestBuilder, Response, StatusCode};
+use serde::{Deserialize, Serialize};
+
+/// Default number of consecutive reconnection attempts before giving up
+pub const DEFAULT_DOWNLOAD_MAX_RETRIES: u32 = 5;
+
+/// Delay before the first reconnection attempt, doubled at every further attempt
+const RETRY_BASE_DELAY: Duration = Duration::from_millis(500);
+
+/// Upper bound for the delay between reconnection attempts
+const RETRY_MAX_DELAY: Duration = Duration::from_secs(30);
+
+/// Default size of the reorder buffer of a segmented download
+pub const DEFAULT_DOWNLOAD_BUFFER_SIZE: u64 = 32 * 1024 * 1024;
+
+/// Smallest range fetched by a single connection of a segmented download
+const MIN_SEGMENT_SIZE: u64 = 256 * 1024;
+
+/// Interval of the TCP and HTTP/2 keep-alive probes of pooled connections
+const KEEP_ALIVE_INTERVAL: Duration = Duration::from_secs(30);
+
+/// Time an unused connection is kept in the pool
+const POOL_IDLE_TIMEOUT: Duration = Duration::from_secs(90);
+
+/// Time allowed to establish a connection, TLS handshake included
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// Build the HTTP client shared by every request of the service.
+///
+/// Connections are pooled and kept alive, so the ranges of a segmented
+/// download and the reconnections of a resumed one skip the handshakes, and
+/// HTTP/2 multiplexes them over a single connection when the server supports
+/// it. The TLS session cache lives in the client too: checks spread further
+/// apart than the pool lifetime still resume the previous session.
+///
+/// Responses are never content-encoded: the offsets of resumed and
+/// segmented downloads, `Content-Length` and `Content-Range` must all count
+/// bytes of the archive itself.
+pub fn http_client() -> reqwest::Result<Client> {
+    Client::builder()
+        .no_gzip()
+        .connect_timeout(CONNECT_TIMEOUT)
+        .pool_idle_timeout(POOL_IDLE_TIMEOUT)
+        .tcp_keepalive(KEEP_ALIVE_INTERVAL)
+        .http2_keep_alive_interval(KEEP_ALIVE_INTERVAL)
+        .http2_keep_alive_while_idle(true)
+        .http2_adaptive_window(true)
+        .build()
+}
+
+/// Delay before reconnection attempt number `attempt` (starting from 0)
+fn retry_delay(attempt: u32) -> Duration {
+    RETRY_BASE_DELAY
+        .saturating_mul(1 << attempt.min(16))
+        .min(RETRY_MAX_DELAY)
+}
+
+/// Whether a failed request is worth retrying
+fn is_transient(status: StatusCode) -> bool {
+    status.is_server_error()
+        || status == StatusCode::REQUEST_TIMEOUT
+        || status == StatusCode::TOO_MANY_REQUESTS
+}
+
+/// Identifies the version of the remote resource
+#[derive(Debug, Clone, PartialEq, Eq)]
+enum Validator {
+    /// A strong entity tag (weak ones can't be used with `If-Range`)
+    ETag(HeaderValue),
+    LastModified(HeaderValue),
+}
+
+impl Validator {
+    fn from_headers(headers: &HeaderMap) -> Option<Self> {
+        let strong_etag = headers
+            .get(ETAG)
+            .filter(|etag| !etag.as_bytes().starts_with(b"W/"))
+            .cloned()
+            .map(Self::ETag);
+
+        strong_etag.or_else(|| headers.get(LAST_MODIFIED).cloned().map(Self::LastModified))
+    }
+
+    fn value(&self) -> &HeaderValue {
+        match self {
+            Self::ETag(value) | Self::LastModified(value) => value,
+        }
+    }
+}
+
+/// ETag and Last-Modified of an update archive, persisted after it is installed
+#[derive(Serialize, Deserialize, Debug, Clone, PartialEq, Eq)]
+pub struct ArchiveValidators {
+    url: String,
+    etag: Option<String>,
+    last_modified: Option<String>,
+}
+
+impl ArchiveValidators {
+    /// Validators of the archive served by `response`, if the server provided any
+    pub fn from_response(url: &str, response: &Response) -> Option<Self> {
+        let header = |name| {
+            response
+                .headers()
+                .get(name)
+                .and_then(|value: &HeaderValue| value.to_str().ok())
+                .map(str::to_string)
+        };
+
+        let (etag, last_modified) = (header(ETAG), header(LAST_MODIFIED));
+        if etag.is_none() && last_modified.is_none() {
+            return None;
+        }
+
+        Some(Self {
+            url: url.to_string(),
+            etag,
+            last_modified,
+        })
+    }
+
+    /// Load the validators saved at `path`, if they refer to `url`
+    pub fn load(path: &Path, url: &str) -> Option<Self> {
+        let content = std::fs::read_to_string(path).ok()?;
+        serde_json::from_str::<Self>(&content)
+            .inspect_err(|e| warn!("Ignoring invalid {}: {e}", path.display()))
+            .ok()
+            .filter(|validators| validators.url == url)
+    }
+
+    /// Persist the validators to `path`, atomically replacing the previous ones
+    pub fn save(&self, path: &Path) -> std::io::Result<()> {
+        let content = serde_json::to_string(self).map_err(std::io::Error::other)?;
+        let tmp_path = path.with_extension("tmp");
+        std::fs::write(&tmp_path, content)?;
+        std::fs::rename(&tmp_path, path)
+    }
+
+    /// Make `request` conditional: the server answers 304 if the archive is unchanged
+    pub fn apply(&self, request: RequestBuilder) -> RequestBuilder {
+        match (&self.etag, &self.last_modified) {
+            (Some(etag), _) => request.header(IF_NONE_MATCH, etag),
+            (None, Some(last_modified)) => request.header(IF_MODIFIED_SINCE, last_modified),
+            (None, None) => request,
+        }
+    }
+}
+
+/// Parse the first byte position of a `Content-Range: bytes <first>-<last>/<size>` header
+fn content_range_start(headers: &HeaderMap) -> Option<u64> {
+    let range = headers.get(CONTENT_RANGE)?.to_str().ok()?;
+    let (first, _) = range.strip_prefix("bytes ")?.split_once('-')?;
+    first.trim().parse().ok()
+}
+
+/// Outcome of a failed reconnection attempt
+enum ResumeError {
+    /// Transient failure: try again later
+    Retry(std::io::Error),
+    /// The download can't be resumed
+    Fatal(std::io::Error),
+}
+
+/// An HTTP download resumed transparently when the connection drops
+pub struct ResumableDownload {
+    client: Client,
+    url: String,
+    validator: Option<Validator>,
+    total_size: Option<u64>,
+    offset: u64,
+    max_retries: u32,
+    body: Option<BoxStream<'static, reqwest::Result<Bytes>>>,
+    finished: bool,
+}
+
+impl ResumableDownload {
+    /// Continue the download started by `response`, a successful GET of `url`.
+    ///
+    /// Up to `max_retries` consecutive reconnections are attempted every time
+    /// the transfer is interrupted.
+    pub fn new(client: Client, url: String, response: Response, max_retries: u32) -> Self {
+        let validator = Validator::from_headers(response.headers());
+        if validator.is_none() {
+            warn!(
+                "{url} has neither a strong ETag nor Last-Modified: the download can't be resumed"
+            );
+        }
+
+        Self {
+            client,
+            url,
+            validator,
+            total_size: response.content_length(),
+            offset: 0,
+            max_retries,
+            body: Some(response.bytes_stream().boxed()),
+            finished: false,
+        }
+    }
+
+    /// Size of the resource, if reported by the server
+    pub fn total_size(&self) -> Option<u64> {
+        self.total_size
+    }
+
+    /// Turn the download into a stream of chunks, suitable for `StreamReader`
+    pub fn into_stream(self) -> BoxStream<'static, std::io::Result<Bytes>> {
+        stream::unfold(self, |mut download| async move {
+            let chunk = download.next_chunk().await?;
+            Some((chunk, download))
+        })
+        .boxed()
+    }
+
+    async fn next_chunk(&mut self) -> Option<std::io::Result<Bytes>> {
+        if self.finished {
+            return None;
+        }
+
+        let mut retries = 0;
+        loop {
+            if let Some(body) = self.body.as_mut() {
+                match body.next().await {
+                    Some(Ok(chunk)) => {
+                        self.offset += chunk.len() as u64;
+                        return Some(Ok(chunk));
+                    }
+                    Some(Err(e)) => {
+                        warn!(
+                            "Download of {} interrupted at byte {}: {e}",
+                            self.url, self.offset
+                        );
+                    }
+                    None => match self.total_size {
+                        Some(total) if self.offset < total => {
+                            warn!(
+                                "Download of {} ended early at byte {}/{total}",
+                                self.url, self.offset
+                            );
+                        }
+                        _ => {
+                            self.finished = true;
+                            return None;
+                        }
+                    },
+                }
+
+                self.body = None;
+            }
+
+            if retries >= self.max_retries {
+                self.finished = true;
+                return Some(Err(std::io::Error::other(format!(
+                    "download of {} failed at byte {} after {retries} attempts to resume",
+                    self.url, self.offset
+                ))));
+            }
+
+            tokio::time::sleep(retry_delay(retries)).await;
+            retries += 1;
+
+            match self.resume().await {
+                Ok(body) => {
+                    info!("Resumed download of {} from byte {}", self.url, self.offset);
+                    self.body = Some(body);
+                }
+                Err(ResumeError::Retry(e)) => {
+                    warn!(
+                        "Attempt {retries}/{} to resume {} failed: {e}",
+                        self.max_retries, self.url
+                    );
+                }
+                Err(ResumeError::Fatal(e)) => {
+                    self.finished = true;
+                    return Some(Err(e));
+                }
+            }
+        }
+    }
+
+    /// Request the rest of the resource, starting at the current offset
+    async fn resume(&mut self) -> Result<BoxStream<'static, reqwest::Result<Bytes>>, ResumeError> {
+        let Some(validator) = &self.validator else {
+            return Err(ResumeError::Fatal(std::io::Error::other(format!(
+                "download of {} interrupted and the server provides no validator to resume it",
+                self.url
+            ))));
+        };
+
+        let response = self
+            .client
+            .get(&self.url)
+            .header(RANGE, format!("bytes={}-", self.offset))
+            .header(IF_RANGE, validator.value().clone())
+            .send()
+            .await
+            .map_err(|e| ResumeError::Retry(std::io::Error::other(e)))?;
+
+        let status = response.status();
+        match status {
+            StatusCode::PARTIAL_CONTENT => {
+                if content_range_start(response.headers()) != Some(self.offset) {
+                    return Err(ResumeError::Fatal(std::io::Error::other(format!(
+                        "server resumed {} from an unexpected position",
+                        self.url
+                    ))));
+                }
+
+                Ok(response.bytes_stream().boxed())
+            }
+            // The range was ignored: either the resource changed (If-Range
+            // did not match) or the server does not support ranges at all
+            StatusCode::OK => {
+                if Validator::from_headers(response.headers()).as_ref() != Some(validator) {
+                    return Err(ResumeError::Fatal(std::io::Error::other(format!(
+                        "{} changed during the download",
+                        self.url
+                    ))));
+                }
+
+                info!(
+                    "Server ignored the range request for {}: skipping {} bytes",
+                    self.url, self.offset
+                );
+                self.skip_consumed(response).await
+            }
+            status if is_transient(status) => Err(ResumeError::Retry(std::io::Error::other(
+                format!("server returned {status}"),
+            ))),
+            status => Err(ResumeError::Fatal(std::io::Error::other(format!(
+                "server returned {status} while resuming {}",
+                self.url
+            )))),
+        }
+    }
+
+    /// Drop the bytes already consumed from a full response of the unchanged resource
+    async fn skip_consumed(
+        &mut self,
+        response: Response,
+    ) -> Result<BoxStream<'static, reqwest::Result<Bytes>>, ResumeError> {
+        let mut body = response.bytes_stream();
+        let mut to_skip = self.offset;
+
+        while to_skip > 0 {
+            let mut chunk = body
+                .try_next()
+                .await
+                .map_err(|e| ResumeError::Retry(std::io::Error::other(e)))?
+                .ok_or_else(|| {
+                    ResumeError::Retry(std::io::Error::other("response ended while skipping"))
+                })?;
+
+            if (chunk.len() as u64) <= to_skip {
+                to_skip -= chunk.len() as u64;
+                continue;
+            }
+
+            let rest = chunk.split_off(to_skip as usize);
+            return Ok(stream::once(async move { Ok(rest) }).chain(body).boxed());
+        }
+
+        Ok(body.boxed())
+    }
+}
+
+/// A download split in byte ranges fetched in parallel and yielded in order
+pub struct SegmentedDownload {
+    client: Client,
+    url: String,
+    validator: Validator,
+    total_size: u64,
+    connections: usize,
+    segment_size: u64,
+    max_retries: u32,
+}
+
+impl SegmentedDownload {
+    /// Split the download of `url` over `connections` connections, buffering
+    /// at most `buffer_size` bytes to reorder the ranges.
+    ///
+    /// `response` is the answer to a GET of `url`, used to learn the size and
+    /// version of the resource. It is handed back when the server does not
+    /// support byte ranges or no validator is available, so the caller can
+    /// fall back to a sequential download.
+    pub fn from_response(
+        client: Client,
+        url: String,
+        response: Response,
+        connections: usize,
+        buffer_size: u64,
+        max_retries: u32,
+    ) -> Result<Self, Response> {
+        let accepts_ranges = response
+            .headers()
+            .get(ACCEPT_RANGES)
+            .is_some_and(|value| value.as_bytes().eq_ignore_ascii_case(b"bytes"));
+        let validator = Validator::from_headers(response.headers());
+
+        let (Some(total_size), Some(validator), true) =
+            (response.content_length(), validator, accepts_ranges)
+        else {
+            return Err(response);
+        };
+
+        let connections = connections.max(1);
+        let segment_size = (buffer_size / connections as u64).max(MIN_SEGMENT_SIZE);
+
+        // The body of the probe response is not used: drop the connection
+        drop(response);
+
+        Ok(Self {
+            client,
+            url,
+            validator,
+            total_size,
+            connections,
+            segment_size,
+            max_retries,
+        })
+    }
+
+    /// Size of the resource
+    pub fn total_size(&self) -> u64 {
+        self.total_size
+    }
+
+    /// Turn the download into an ordered stream of chunks, suitable for `StreamReader`
+    pub fn into_stream(self) -> BoxStream<'static, std::io::Result<Bytes>> {
+        info!(
+            "Downloading {} over {} connections in segments of {} bytes",
+            self.url, self.connections, self.segment_size
+        );
+
+        let segment_size = self.segment_size;
+        let total_size = self.total_size;
+        let ranges = (0..total_size)
+            .step_by(segment_size as usize)
+            .map(move |start| (start, (start + segment_size).min(total_size)));
+
+        let connections = self.connections;
+        let download = std::sync::Arc::new(self);
+
+        // buffered() runs up to `connections` fetches at once but yields them
+        // in order: completed segments wait there until their turn
+        stream::iter(ranges)
+            .map(move |(start, end)| {
+                let download = download.clone();
+                async move { download.fetch_segment(start, end).await }
+            })
+            .buffered(connections)
+            .boxed()
+    }
+
+    /// Fetch the bytes in `start..end`, reconnecting from the last byte received
+    async fn fetch_segment(&self, start: u64, end: u64) -> std::io::Result<Bytes> {
+        let mut segment = BytesMut::with_capacity((end - start) as usize);
+        let mut retries = 0;
+
+        loop {
+            let offset = start + segment.len() as u64;
+            match self.fetch_into(&mut segment, offset, end).await {
+                Ok(()) if segment.len() as u64 == end - start => return Ok(segment.freeze()),
+                Ok(()) => warn!(
+                    "Segment {start}-{end} of {} ended early at byte {}",
+                    self.url,
+                    start + segment.len() as u64
+                ),
+                Err(ResumeError::Retry(e)) => {
+                    warn!("Segment {start}-{end} of {} interrupted: {e}", self.url)
+                }
+                Err(ResumeError::Fatal(e)) => return Err(e),
+            }
+
+            if retries >= self.max_retries {
+                return Err(std::io::Error::other(format!(
+                    "download of {} failed at byte {} after {retries} attempts to resume",
+                    self.url,
+                    start + segment.len() as u64
+                )));
+            }
+
+            tokio::time::sleep(retry_delay(retries)).await;
+            retries += 1;
+        }
+    }
+
+    /// Append the bytes in `offset..end` to `segment`
+    async fn fetch_into(
+        &self,
+        segment: &mut BytesMut,
+        offset: u64,
+        end: u64,
+    ) -> Result<(), ResumeError> {
+        let response = self
+            .client
+            .get(&self.url)
+            .header(RANGE, format!("bytes={offset}-{}", end - 1))
+            .header(IF_RANGE, self.validator.value().clone())
+            .send()
+            .await
+            .map_err(|e| ResumeError::Retry(std::io::Error::other(e)))?;
+
+        match response.status() {
+            StatusCode::PARTIAL_CONTENT => {}
+            // A full response means If-Range did not match
+            StatusCode::OK => {
+                return Err(ResumeError::Fatal(std::io::Error::other(format!(
+                    "{} changed during the download",
+                    self.url
+                ))));
+            }
+            status if is_transient(status) => {
+                return Err(ResumeError::Retry(std::io::Error::other(format!(
+                    "server returned {status}"
+                ))));
+            }
+            status => {
+                return Err(ResumeError::Fatal(std::io::Error::other(format!(
+                    "server returned {status} for a range of {}",
+                    self.url
+                ))));
+            }
+        }
+
+        if content_range_start(response.headers()) != Some(offset) {
+            return Err(ResumeError::Fatal(std::io::Error::other(format!(
+                "server returned an unexpected range of {}",
+                self.url
+            ))));
+        }
+
+        let mut remaining = end - offset;
+        let mut body = response.bytes_stream();
+        while let Some(chunk) = body
+            .try_next()
+            .await
+            .map_err(|e| ResumeError::Retry(std::io::Error::other(e)))?
+        {
+            // Never grow past the requested range, whatever the server sends
+            if chunk.len() as u64 > remaining {
+                return Err(ResumeError::Fatal(std::io::Error::other(format!(
+                    "server returned more data than requested for {}",
+                    self.url
+                ))));
+            }
+            remaining -= chunk.len() as u64;
+            segment.extend_from_slice(&chunk);
+        }
+
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_content_range_start() {
+        let mut headers = HeaderMap::new();
+        assert_eq!(content_range_start(&headers), None);
+
+        headers.insert(
+            CONTENT_RANGE,
+            HeaderValue::from_static("bytes 1024-4095/4096"),
+        );
+        assert_eq!(content_range_start(&headers), Some(1024));
+
+        headers.insert(CONTENT_RANGE, HeaderValue::from_static("bytes */4096"));
+        assert_eq!(content_range_start(&headers), None);
+    }
+
+    #[test]
+    fn test_archive_validators_roundtrip() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("last-update.json");
+        let url = "https://example.com/update.tar";
+
+        assert_eq!(ArchiveValidators::load(&path, url), None);
+
+        let validators = ArchiveValidators {
+            url: url.to_string(),
+            etag: Some("\"v1\"".to_string()),
+            last_modified: None,
+        };
+        validators.save(&path).unwrap();
+
+        assert_eq!(ArchiveValidators::load(&path, url), Some(validators));
+        assert_eq!(
+            ArchiveValidators::load(&path, "https://example.com/other.tar"),
+            None,
+            "Validators of another URL must not be used"
+        );
+    }
+
+    #[test]
+    fn test_validator_prefers_strong_etag() {
+        let mut headers = HeaderMap::new();
+        headers.insert(
+            LAST_MODIFIED,
+            HeaderValue::from_static("Wed, 21 Oct 2015 07:28:00 GMT"),
+        );
+        headers.insert(ETAG, HeaderValue::from_static("W/\"weak\""));
+        assert!(matches!(
+            Validator::from_headers(&headers),
+            Some(Validator::LastModified(_))
+        ));
+
+        headers.insert(ETAG, HeaderValue::from_static("\"strong\""));
+        assert_eq!(
+            Validator::from_headers(&headers),
+            Some(Validator::ETag(HeaderValue::from_static("\"strong\"")))
+        );
+    }
+}
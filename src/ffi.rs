@@ -17,20 +17,152 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+use std::collections::VecDeque;
 use std::ffi::{CStr, CString};
-use std::os::raw::{c_char, c_int};
+use std::io::{Read, Write};
+use std::ops::Deref;
+use std::os::raw::{c_char, c_int, c_uint};
+use std::os::unix::io::AsRawFd;
+use std::os::unix::net::UnixStream;
 use std::ptr;
-use tokio::runtime::Runtime;
+use std::sync::{Arc, Mutex, Once, OnceLock};
+use tokio::runtime::{Builder, Runtime};
+use tokio::task::JoinHandle;
 use zbus::Connection;
 
 use crate::dbus::EmbuerDBusProxy;
 
 /// Opaque handle to the Embuer client context
+///
+/// The DBus proxy is built once when the client is created and reused by
+/// every call, so each query costs a single method call on the bus.
 #[repr(C)]
 #[allow(non_camel_case_types)]
 pub struct embuer_client_t {
-    runtime: Runtime,
-    connection: Connection,
+    runtime: ClientRuntime,
+    proxy: EmbuerDBusProxy<'static>,
+    watch: Option<StatusWatch>,
+}
+
+/// Runtime driving the calls of a client, selected by embuer_client_options_t
+enum ClientRuntime {
+    /// The process-wide current-thread runtime, see shared_runtime()
+    Shared(&'static Runtime),
+    /// A multi-threaded runtime owned by the client
+    Owned(Runtime),
+}
+
+impl Deref for ClientRuntime {
+    type Target = Runtime;
+
+    fn deref(&self) -> &Runtime {
+        match self {
+            ClientRuntime::Shared(runtime) => runtime,
+            ClientRuntime::Owned(runtime) => runtime,
+        }
+    }
+}
+
+static SHARED_RUNTIME: OnceLock<std::io::Result<Runtime>> = OnceLock::new();
+static SHARED_RUNTIME_DRIVER: Once = Once::new();
+
+/// Return the current-thread runtime shared by all clients of the process
+///
+/// The runtime is created by the first client that needs it. Blocking calls
+/// run on the thread of the caller; a single background thread drives the
+/// runtime in between, so that the tasks of embuer_watch_start make progress.
+fn shared_runtime() -> Option<&'static Runtime> {
+    let runtime = SHARED_RUNTIME
+        .get_or_init(|| Builder::new_current_thread().enable_all().build())
+        .as_ref()
+        .ok()?;
+
+    SHARED_RUNTIME_DRIVER.call_once(|| {
+        // Without the driver thread blocking calls still work, only watches stall
+        let _ = std::thread::Builder::new()
+            .name("embuer-runtime".to_string())
+            .spawn(|| runtime.block_on(std::future::pending::<()>()));
+    });
+
+    Some(runtime)
+}
+
+/// A status change queued by the watch task, waiting for embuer_dispatch
+type QueuedStatus = (CString, CString, c_int);
+
+/// State of a non-blocking status watch started with embuer_watch_start
+///
+/// A background task on the client runtime receives the UpdateStatusChanged
+/// signals, queues them and writes a byte to its end of a socket pair: the
+/// caller polls `wake_rx` and runs the callback from its own thread in
+/// embuer_dispatch. When the task ends the socket is closed and `wake_rx`
+/// reports a hangup.
+struct StatusWatch {
+    task: JoinHandle<()>,
+    queue: Arc<Mutex<VecDeque<QueuedStatus>>>,
+    wake_rx: UnixStream,
+    callback: StatusCallback,
+    user_data: *mut std::ffi::c_void,
+}
+
+impl StatusWatch {
+    fn push(
+        queue: &Mutex<VecDeque<QueuedStatus>>,
+        wake_tx: &UnixStream,
+        status: &str,
+        details: &str,
+        progress: c_int,
+    ) {
+        let (Ok(status_c), Ok(details_c)) = (CString::new(status), CString::new(details)) else {
+            return;
+        };
+
+        if let Ok(mut queue) = queue.lock() {
+            queue.push_back((status_c, details_c, progress));
+        }
+
+        // A full socket buffer means a wakeup is already pending
+        let _ = (&*wake_tx).write(&[1]);
+    }
+}
+
+impl Drop for StatusWatch {
+    fn drop(&mut self) {
+        self.task.abort();
+    }
+}
+
+/// Opaque handle to an install started with embuer_install_async
+///
+/// The watch task forwards the status changes of the request to the callback
+/// until the request ends. Dropping the handle stops the callbacks, not the install.
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct embuer_op_t {
+    task: JoinHandle<()>,
+    runtime: tokio::runtime::Handle,
+    proxy: EmbuerDBusProxy<'static>,
+    /// Id of the request queued by the daemon
+    request_id: u64,
+}
+
+impl Drop for embuer_op_t {
+    fn drop(&mut self) {
+        self.task.abort();
+    }
+}
+
+/// User data of a callback invoked from the client runtime
+struct CallbackUserData(*mut std::ffi::c_void);
+
+// SAFETY: the pointer is only handed back to the callback, as documented in
+// the header; the caller guarantees it can be used from the runtime thread
+unsafe impl Send for CallbackUserData {}
+
+impl CallbackUserData {
+    fn get(&self) -> *mut std::ffi::c_void {
+        self.0
+    }
 }
 
 /// Status callback function type
@@ -38,6 +170,111 @@ pub struct embuer_client_t {
 pub type StatusCallback =
     unsafe extern "C" fn(*const c_char, *const c_char, c_int, *mut std::ffi::c_void);
 
+/// Progress callback function type
+/// Parameters: progress, user_data
+pub type ProgressCallback = unsafe extern "C" fn(*const embuer_progress_t, *mut std::ffi::c_void);
+
+/// Stages of the update pipeline reported in embuer_progress_t
+pub const EMBUER_STAGE_IDLE: c_int = 0;
+pub const EMBUER_STAGE_CHECKING: c_int = 1;
+pub const EMBUER_STAGE_DOWNLOADING: c_int = 2;
+pub const EMBUER_STAGE_READING: c_int = 3;
+/// Former name of [`EMBUER_STAGE_READING`]: the stage never tracked the decompressor
+pub const EMBUER_STAGE_DECOMPRESSING: c_int = EMBUER_STAGE_READING;
+pub const EMBUER_STAGE_RECEIVING: c_int = 4;
+pub const EMBUER_STAGE_VERIFYING: c_int = 5;
+
+/// Byte-accurate progress of the update pipeline
+#[repr(C)]
+#[allow(non_camel_case_types)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct embuer_progress_t {
+    /// One of EMBUER_STAGE_*
+    pub stage: c_int,
+    pub bytes_done: u64,
+    /// 0 if unknown
+    pub bytes_total: u64,
+    /// Throughput over the last sampling interval, in bytes per second
+    pub rate: u64,
+    /// Throughput since the payload started streaming, in bytes per second
+    pub average_rate: u64,
+    /// -1 if unknown
+    pub eta_seconds: i64,
+    /// Update requests waiting for the one in progress
+    pub queue_depth: u32,
+}
+
+impl From<(u32, u64, u64, u64, u64, i64, u32)> for embuer_progress_t {
+    fn from(
+        (stage, bytes_done, bytes_total, rate, average_rate, eta_seconds, queue_depth): (
+            u32,
+            u64,
+            u64,
+            u64,
+            u64,
+            i64,
+            u32,
+        ),
+    ) -> Self {
+        Self {
+            stage: stage as c_int,
+            bytes_done,
+            bytes_total,
+            rate,
+            average_rate,
+            eta_seconds,
+            queue_depth,
+        }
+    }
+}
+
+/// Metrics of one stage of the update pipeline
+#[repr(C)]
+#[allow(non_camel_case_types)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct embuer_stage_metrics_t {
+    pub bytes: u64,
+    pub read_blocked_us: u64,
+    pub write_blocked_us: u64,
+    pub wall_us: u64,
+    pub peak_buffer: u64,
+}
+
+/// Metrics of the stages of the last update pipeline
+#[repr(C)]
+#[allow(non_camel_case_types)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct embuer_metrics_t {
+    pub source: embuer_stage_metrics_t,
+    pub hash: embuer_stage_metrics_t,
+    pub decompress: embuer_stage_metrics_t,
+    pub receive: embuer_stage_metrics_t,
+}
+
+impl From<Vec<(String, u64, u64, u64, u64, u64)>> for embuer_metrics_t {
+    fn from(stages: Vec<(String, u64, u64, u64, u64, u64)>) -> Self {
+        let mut metrics = Self::default();
+        for (stage, bytes, read_blocked_us, write_blocked_us, wall_us, peak_buffer) in stages {
+            let slot = match stage.as_str() {
+                "source" => &mut metrics.source,
+                "hash" => &mut metrics.hash,
+                "decompress" => &mut metrics.decompress,
+                "receive" => &mut metrics.receive,
+                // Stages unknown to this version of the library
+                _ => continue,
+            };
+            *slot = embuer_stage_metrics_t {
+                bytes,
+                read_blocked_us,
+                write_blocked_us,
+                wall_us,
+                peak_buffer,
+            };
+        }
+        metrics
+    }
+}
+
 /// Error codes
 pub const EMBUER_OK: c_int = 0;
 pub const EMBUER_ERR_NULL_PTR: c_int = -1;
@@ -46,24 +283,142 @@ pub const EMBUER_ERR_DBUS: c_int = -3;
 pub const EMBUER_ERR_INVALID_STRING: c_int = -4;
 pub const EMBUER_ERR_RUNTIME: c_int = -5;
 pub const EMBUER_ERR_NO_PENDING_UPDATE: c_int = -6;
+pub const EMBUER_ERR_WATCH_ACTIVE: c_int = -7;
+pub const EMBUER_ERR_NOT_WATCHING: c_int = -8;
+
+/// Threading models for embuer_client_options_t
+pub const EMBUER_THREADING_SHARED: c_int = 0;
+pub const EMBUER_THREADING_MULTI_THREAD: c_int = 1;
+
+/// Options for embuer_client_new_with_options
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct embuer_client_options_t {
+    /// One of EMBUER_THREADING_*
+    pub threading: c_int,
+    /// Worker threads of an EMBUER_THREADING_MULTI_THREAD runtime, 0 for one per core
+    pub worker_threads: c_uint,
+}
+
+/// Update status codes reported in embuer_snapshot_t
+pub const EMBUER_STATUS_UNKNOWN: c_int = -1;
+pub const EMBUER_STATUS_IDLE: c_int = 0;
+pub const EMBUER_STATUS_CHECKING: c_int = 1;
+pub const EMBUER_STATUS_CLEARING: c_int = 2;
+pub const EMBUER_STATUS_INSTALLING: c_int = 3;
+pub const EMBUER_STATUS_AWAITING_CONFIRMATION: c_int = 4;
+pub const EMBUER_STATUS_COMPLETED: c_int = 5;
+pub const EMBUER_STATUS_FAILED: c_int = 6;
+
+/// Daemon state filled by embuer_get_snapshot
+///
+/// The strings are copied into caller-owned buffers: `details` and `version`
+/// point to buffers of `details_size` and `version_size` bytes, and the
+/// matching `*_len` fields receive the full length of the string, like the
+/// return value of snprintf. A buffer may be NULL when its size is 0.
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct embuer_snapshot_t {
+    pub status: c_int,
+    pub progress: c_int,
+    pub bytes_done: u64,
+    pub bytes_total: u64,
+    pub boot_id: u64,
+    pub details: *mut c_char,
+    pub details_size: usize,
+    pub details_len: usize,
+    pub version: *mut c_char,
+    pub version_size: usize,
+    pub version_len: usize,
+}
+
+/// Map a status string reported by the daemon to an EMBUER_STATUS_* code
+fn status_code(status: &str) -> c_int {
+    match status {
+        "Idle" => EMBUER_STATUS_IDLE,
+        "Checking" => EMBUER_STATUS_CHECKING,
+        "Clearing" => EMBUER_STATUS_CLEARING,
+        "Installing" => EMBUER_STATUS_INSTALLING,
+        "AwaitingConfirmation" => EMBUER_STATUS_AWAITING_CONFIRMATION,
+        "Completed" => EMBUER_STATUS_COMPLETED,
+        "Failed" => EMBUER_STATUS_FAILED,
+        _ => EMBUER_STATUS_UNKNOWN,
+    }
+}
+
+/// Copy `s` into a caller buffer of `size` bytes with snprintf semantics
+///
+/// At most `size - 1` bytes are copied and the buffer is always
+/// NUL-terminated when `size` is not 0. Returns the length of `s`.
+unsafe fn copy_to_buffer(s: &str, buf: *mut c_char, size: usize) -> usize {
+    if !buf.is_null() && size > 0 {
+        let n = s.len().min(size - 1);
+        unsafe {
+            ptr::copy_nonoverlapping(s.as_ptr() as *const c_char, buf, n);
+            *buf.add(n) = 0;
+        }
+    }
+
+    s.len()
+}
 
 /// Initialize a new Embuer client
+///
+/// The client runs on the current-thread runtime shared by the process, see
+/// embuer_client_new_with_options.
+///
 /// Returns a handle to the client or NULL on error
 #[no_mangle]
 pub unsafe extern "C" fn embuer_client_new() -> *mut embuer_client_t {
-    let runtime = match Runtime::new() {
-        Ok(rt) => rt,
-        Err(_) => return ptr::null_mut(),
+    unsafe { embuer_client_new_with_options(ptr::null()) }
+}
+
+/// Initialize a new Embuer client with the given options
+///
+/// Parameters:
+/// - options: Client options, or NULL for the defaults (EMBUER_THREADING_SHARED)
+///
+/// Returns a handle to the client or NULL on error
+#[no_mangle]
+pub unsafe extern "C" fn embuer_client_new_with_options(
+    options: *const embuer_client_options_t,
+) -> *mut embuer_client_t {
+    let (threading, worker_threads) = match unsafe { options.as_ref() } {
+        Some(options) => (options.threading, options.worker_threads),
+        None => (EMBUER_THREADING_SHARED, 0),
+    };
+
+    let runtime = match threading {
+        EMBUER_THREADING_SHARED => match shared_runtime() {
+            Some(rt) => ClientRuntime::Shared(rt),
+            None => return ptr::null_mut(),
+        },
+        EMBUER_THREADING_MULTI_THREAD => {
+            let mut builder = Builder::new_multi_thread();
+            if worker_threads > 0 {
+                builder.worker_threads(worker_threads as usize);
+            }
+
+            match builder.enable_all().build() {
+                Ok(rt) => ClientRuntime::Owned(rt),
+                Err(_) => return ptr::null_mut(),
+            }
+        }
+        _ => return ptr::null_mut(),
     };
 
-    let connection = match runtime.block_on(async { Connection::system().await }) {
-        Ok(conn) => conn,
+    let proxy = match runtime.block_on(async {
+        let connection = Connection::system().await?;
+        EmbuerDBusProxy::new(&connection).await
+    }) {
+        Ok(proxy) => proxy,
         Err(_) => return ptr::null_mut(),
     };
 
     let client = Box::new(embuer_client_t {
         runtime,
-        connection,
+        proxy,
+        watch: None,
     });
 
     Box::into_raw(client)
@@ -97,10 +452,9 @@ pub unsafe extern "C" fn embuer_get_boot_info(
 
     let client = unsafe { &*client };
 
-    let result = client.runtime.block_on(async {
-        let proxy = EmbuerDBusProxy::new(&client.connection).await?;
-        proxy.get_boot_info().await
-    });
+    let result = client
+        .runtime
+        .block_on(async { client.proxy.get_boot_info().await });
 
     match result {
         Ok((boot_id, boot_name)) => {
@@ -142,10 +496,9 @@ pub unsafe extern "C" fn embuer_get_status(
 
     let client = unsafe { &*client };
 
-    let result = client.runtime.block_on(async {
-        let proxy = EmbuerDBusProxy::new(&client.connection).await?;
-        proxy.get_update_status().await
-    });
+    let result = client
+        .runtime
+        .block_on(async { client.proxy.get_update_status().await });
 
     match result {
         Ok((status, details, progress)) => {
@@ -171,6 +524,45 @@ pub unsafe extern "C" fn embuer_get_status(
     }
 }
 
+/// Get the update status, transfer progress and boot deployment at once
+///
+/// Parameters:
+/// - client: Client handle
+/// - out: Snapshot to fill; its string buffers are provided by the caller
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_get_snapshot(
+    client: *mut embuer_client_t,
+    out: *mut embuer_snapshot_t,
+) -> c_int {
+    if client.is_null() || out.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+    let out = unsafe { &mut *out };
+
+    let result = client
+        .runtime
+        .block_on(async { client.proxy.get_snapshot().await });
+
+    match result {
+        Ok((status, details, version, progress, bytes_done, bytes_total, boot_id)) => {
+            out.status = status_code(&status);
+            out.progress = progress;
+            out.bytes_done = bytes_done;
+            out.bytes_total = bytes_total;
+            out.boot_id = boot_id;
+            out.details_len = unsafe { copy_to_buffer(&details, out.details, out.details_size) };
+            out.version_len = unsafe { copy_to_buffer(&version, out.version, out.version_size) };
+
+            EMBUER_OK
+        }
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
 /// Install an update from a file
 ///
 /// Parameters:
@@ -198,8 +590,10 @@ pub unsafe extern "C" fn embuer_install_from_file(
     };
 
     let result = client.runtime.block_on(async {
-        let proxy = EmbuerDBusProxy::new(&client.connection).await?;
-        proxy.install_update_from_file(path_str.to_string()).await
+        client
+            .proxy
+            .install_update_from_file(path_str.to_string())
+            .await
     });
 
     match result {
@@ -246,8 +640,10 @@ pub unsafe extern "C" fn embuer_install_from_url(
     };
 
     let result = client.runtime.block_on(async {
-        let proxy = EmbuerDBusProxy::new(&client.connection).await?;
-        proxy.install_update_from_url(url_str.to_string()).await
+        client
+            .proxy
+            .install_update_from_url(url_str.to_string())
+            .await
     });
 
     match result {
@@ -300,10 +696,9 @@ pub unsafe extern "C" fn embuer_get_pending_update(
 
     let client = unsafe { &*client };
 
-    let result = client.runtime.block_on(async {
-        let proxy = EmbuerDBusProxy::new(&client.connection).await?;
-        proxy.get_pending_update().await
-    });
+    let result = client
+        .runtime
+        .block_on(async { client.proxy.get_pending_update().await });
 
     match result {
         Ok((version, changelog, source)) => {
@@ -355,10 +750,9 @@ pub unsafe extern "C" fn embuer_confirm_update(
     let client = unsafe { &*client };
     let accepted_bool = accepted != 0;
 
-    let result = client.runtime.block_on(async {
-        let proxy = EmbuerDBusProxy::new(&client.connection).await?;
-        proxy.confirm_update(accepted_bool).await
-    });
+    let result = client
+        .runtime
+        .block_on(async { client.proxy.confirm_update(accepted_bool).await });
 
     match result {
         Ok(msg) => {
@@ -377,9 +771,288 @@ pub unsafe extern "C" fn embuer_confirm_update(
     }
 }
 
+/// Pause the update in progress
+///
+/// Parameters:
+/// - client: Client handle
+///
+/// Returns: EMBUER_OK on success (also if already paused), EMBUER_ERR_DBUS if
+/// no update is in progress
+#[no_mangle]
+pub unsafe extern "C" fn embuer_pause_update(client: *mut embuer_client_t) -> c_int {
+    if client.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    match client
+        .runtime
+        .block_on(async { client.proxy.pause_update().await })
+    {
+        Ok(_) => EMBUER_OK,
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Resume the paused update
+///
+/// Parameters:
+/// - client: Client handle
+///
+/// Returns: EMBUER_OK on success (also if not paused), error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_resume_update(client: *mut embuer_client_t) -> c_int {
+    if client.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    match client
+        .runtime
+        .block_on(async { client.proxy.resume_update().await })
+    {
+        Ok(_) => EMBUER_OK,
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Check whether the update in progress is paused
+///
+/// Parameters:
+/// - client: Client handle
+/// - paused_out: Pointer to store 1 if paused, 0 otherwise
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_is_update_paused(
+    client: *mut embuer_client_t,
+    paused_out: *mut c_int,
+) -> c_int {
+    if client.is_null() || paused_out.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    match client
+        .runtime
+        .block_on(async { client.proxy.is_update_paused().await })
+    {
+        Ok(paused) => {
+            unsafe {
+                *paused_out = paused as c_int;
+            }
+            EMBUER_OK
+        }
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Get the number of update requests waiting for the one in progress
+///
+/// Requests for a source already queued or in progress are merged with it
+/// and not counted.
+///
+/// Parameters:
+/// - client: Client handle
+/// - depth_out: Pointer to store the number of waiting requests
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_get_update_queue_depth(
+    client: *mut embuer_client_t,
+    depth_out: *mut c_uint,
+) -> c_int {
+    if client.is_null() || depth_out.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    match client
+        .runtime
+        .block_on(async { client.proxy.get_update_queue_depth().await })
+    {
+        Ok(depth) => {
+            unsafe {
+                *depth_out = depth as c_uint;
+            }
+            EMBUER_OK
+        }
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Start installing an update without blocking
+///
+/// `source` is downloaded when it is an http(s) URL, or read as a local file
+/// path otherwise. `callback` is invoked from a library thread for every
+/// status change of this request, the last one being the status it ended
+/// with. Status changes of the other requests are not reported.
+///
+/// Parameters:
+/// - client: Client handle
+/// - source: URL or file path of the update
+/// - callback: Function to call on status updates
+/// - user_data: User data to pass to the callback
+/// - op_out: Pointer to store the operation handle (must be freed with embuer_op_free)
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_install_async(
+    client: *mut embuer_client_t,
+    source: *const c_char,
+    callback: StatusCallback,
+    user_data: *mut std::ffi::c_void,
+    op_out: *mut *mut embuer_op_t,
+) -> c_int {
+    if client.is_null() || source.is_null() || op_out.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+    let source = unsafe {
+        match CStr::from_ptr(source).to_str() {
+            Ok(s) => s.to_string(),
+            Err(_) => return EMBUER_ERR_INVALID_STRING,
+        }
+    };
+
+    // Subscribe before queueing the request so that no change is lost
+    let proxy = client.proxy.clone();
+    let Ok((mut statuses, mut started, mut finished)) = client.runtime.block_on(async {
+        Ok::<_, zbus::Error>((
+            proxy.receive_update_status_changed().await?,
+            proxy.receive_update_request_started().await?,
+            proxy.receive_update_request_finished().await?,
+        ))
+    }) else {
+        return EMBUER_ERR_DBUS;
+    };
+
+    let queued = client.runtime.block_on(async {
+        if source.starts_with("http://") || source.starts_with("https://") {
+            client.proxy.queue_update_from_url(source).await
+        } else {
+            client.proxy.queue_update_from_file(source).await
+        }
+    });
+    let Ok((request_id, in_progress, _)) = queued else {
+        return EMBUER_ERR_DBUS;
+    };
+
+    let user_data = CallbackUserData(user_data);
+    let task = client.runtime.spawn(async move {
+        use futures_util::StreamExt;
+
+        let report = move |status: &str, details: &str, progress: c_int| {
+            let (Ok(status_c), Ok(details_c)) = (CString::new(status), CString::new(details))
+            else {
+                return;
+            };
+            unsafe {
+                callback(
+                    status_c.as_ptr(),
+                    details_c.as_ptr(),
+                    progress,
+                    user_data.get(),
+                );
+            }
+        };
+
+        // The status is the one of this request only while it is processed
+        let mut processing = in_progress;
+        loop {
+            tokio::select! {
+                Some(signal) = started.next() => {
+                    if let Ok(args) = signal.args() {
+                        processing = args.request_id == request_id;
+                    }
+                }
+                Some(signal) = statuses.next(), if processing => {
+                    if let Ok(args) = signal.args() {
+                        // The end of the request is reported by its own signal
+                        if !matches!(args.status, "Completed" | "Failed") {
+                            report(args.status, args.details, args.progress);
+                        }
+                    }
+                }
+                Some(signal) = finished.next() => {
+                    if let Ok(args) = signal.args() {
+                        if args.request_id == request_id {
+                            report(args.status, args.details, args.progress);
+                            break;
+                        }
+                    }
+                }
+                else => break,
+            }
+        }
+    });
+
+    let op = Box::new(embuer_op_t {
+        task,
+        runtime: client.runtime.handle().clone(),
+        proxy: client.proxy.clone(),
+        request_id,
+    });
+
+    unsafe {
+        *op_out = Box::into_raw(op);
+    }
+
+    EMBUER_OK
+}
+
+/// Cancel an install started with embuer_install_async
+///
+/// A request still queued is dropped. For the request being processed, the
+/// daemon stops the download, decompression and receive of the update and
+/// deletes the partially received deployment; an update awaiting
+/// confirmation is rejected. Other requests are left alone. The callback
+/// then reports the Failed status.
+///
+/// Parameters:
+/// - op: Operation handle
+///
+/// Returns: EMBUER_OK on success, EMBUER_ERR_DBUS if the request already
+/// ended, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_op_cancel(op: *mut embuer_op_t) -> c_int {
+    if op.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let op = unsafe { &*op };
+
+    match op
+        .runtime
+        .block_on(async { op.proxy.cancel_update_request(op.request_id).await })
+    {
+        Ok(_) => EMBUER_OK,
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Free an operation handle
+///
+/// No new callback is started once this returns, although one already
+/// running on the library thread may still be completing. The install itself
+/// goes on: use embuer_op_cancel first to stop it.
+#[no_mangle]
+pub unsafe extern "C" fn embuer_op_free(op: *mut embuer_op_t) {
+    if !op.is_null() {
+        let _ = Box::from_raw(op);
+    }
+}
+
 /// Watch for status updates (blocking call)
 /// This function will block and call the callback whenever the status changes
 ///
+/// Prefer embuer_watch_start/embuer_dispatch to integrate with an event loop.
+///
 /// Parameters:
 /// - client: Client handle
 /// - callback: Function to call on status updates
@@ -399,7 +1072,7 @@ pub unsafe extern "C" fn embuer_watch_status(
     let client = unsafe { &*client };
 
     let result = client.runtime.block_on(async {
-        let proxy = EmbuerDBusProxy::new(&client.connection).await?;
+        let proxy = &client.proxy;
 
         // Get initial status
         let (status, details, progress) = proxy.get_update_status().await?;
@@ -440,6 +1113,289 @@ pub unsafe extern "C" fn embuer_watch_status(
     }
 }
 
+/// Get the structured progress of the update pipeline
+///
+/// Parameters:
+/// - client: Client handle
+/// - out: Progress to fill
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_get_progress(
+    client: *mut embuer_client_t,
+    out: *mut embuer_progress_t,
+) -> c_int {
+    if client.is_null() || out.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    match client
+        .runtime
+        .block_on(async { client.proxy.get_update_progress().await })
+    {
+        Ok(progress) => {
+            unsafe { *out = progress.into() };
+            EMBUER_OK
+        }
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Get the metrics of the stages of the last update pipeline
+///
+/// Parameters:
+/// - client: Client handle
+/// - out: Metrics to fill
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_get_metrics(
+    client: *mut embuer_client_t,
+    out: *mut embuer_metrics_t,
+) -> c_int {
+    if client.is_null() || out.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    match client
+        .runtime
+        .block_on(async { client.proxy.get_metrics().await })
+    {
+        Ok(stages) => {
+            unsafe { *out = stages.into() };
+            EMBUER_OK
+        }
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Watch for progress updates (blocking call)
+/// This function will block and call the callback with the current progress,
+/// then whenever it is sampled (at most every 100ms), its stage changes or the
+/// update queue depth changes
+///
+/// Parameters:
+/// - client: Client handle
+/// - callback: Function to call on progress updates
+/// - user_data: User data to pass to the callback
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_watch_progress(
+    client: *mut embuer_client_t,
+    callback: ProgressCallback,
+    user_data: *mut std::ffi::c_void,
+) -> c_int {
+    if client.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    let result = client.runtime.block_on(async {
+        let proxy = &client.proxy;
+
+        // Subscribe first so that no sample is lost after the initial one
+        let mut stream = proxy.receive_update_progress_changed().await?;
+
+        let progress: embuer_progress_t = proxy.get_update_progress().await?.into();
+        callback(&progress, user_data);
+
+        use futures_util::StreamExt;
+        while let Some(signal) = stream.next().await {
+            let args = signal.args()?;
+
+            let progress = embuer_progress_t {
+                stage: args.stage as c_int,
+                bytes_done: args.bytes_done,
+                bytes_total: args.bytes_total,
+                rate: args.rate,
+                average_rate: args.average_rate,
+                eta_seconds: args.eta_seconds,
+                queue_depth: args.queue_depth,
+            };
+            callback(&progress, user_data);
+        }
+
+        Ok::<(), zbus::Error>(())
+    });
+
+    match result {
+        Ok(_) => EMBUER_OK,
+        Err(_) => EMBUER_ERR_DBUS,
+    }
+}
+
+/// Start watching for status updates without blocking
+///
+/// Subscribes to the UpdateStatusChanged signal and returns a file descriptor
+/// that becomes readable whenever status changes are queued. The caller adds
+/// it to its own poll/epoll loop and calls embuer_dispatch when it is readable.
+/// The current status is queued right away, so the first dispatch reports it.
+///
+/// Parameters:
+/// - client: Client handle
+/// - callback: Function to call on status updates (from embuer_dispatch)
+/// - user_data: User data to pass to the callback
+///
+/// Returns: a pollable file descriptor (>= 0) on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_watch_start(
+    client: *mut embuer_client_t,
+    callback: StatusCallback,
+    user_data: *mut std::ffi::c_void,
+) -> c_int {
+    if client.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &mut *client };
+
+    if client.watch.is_some() {
+        return EMBUER_ERR_WATCH_ACTIVE;
+    }
+
+    let Ok((wake_tx, wake_rx)) = UnixStream::pair() else {
+        return EMBUER_ERR_RUNTIME;
+    };
+
+    if wake_tx.set_nonblocking(true).is_err() || wake_rx.set_nonblocking(true).is_err() {
+        return EMBUER_ERR_RUNTIME;
+    }
+
+    let queue = Arc::new(Mutex::new(VecDeque::new()));
+
+    // Subscribe before reading the initial status so no change is lost in between
+    let proxy = client.proxy.clone();
+    let Ok(mut stream) = client
+        .runtime
+        .block_on(async { proxy.receive_update_status_changed().await })
+    else {
+        return EMBUER_ERR_DBUS;
+    };
+
+    let Ok((status, details, progress)) = client
+        .runtime
+        .block_on(async { client.proxy.get_update_status().await })
+    else {
+        return EMBUER_ERR_DBUS;
+    };
+    StatusWatch::push(&queue, &wake_tx, &status, &details, progress);
+
+    let task = {
+        let queue = queue.clone();
+        client.runtime.spawn(async move {
+            use futures_util::StreamExt;
+            while let Some(signal) = stream.next().await {
+                let Ok(args) = signal.args() else {
+                    continue;
+                };
+
+                StatusWatch::push(&queue, &wake_tx, args.status, args.details, args.progress);
+            }
+        })
+    };
+
+    let fd = wake_rx.as_raw_fd();
+
+    client.watch = Some(StatusWatch {
+        task,
+        queue,
+        wake_rx,
+        callback,
+        user_data,
+    });
+
+    fd
+}
+
+/// Dispatch queued status updates without blocking
+///
+/// Invokes the callback registered with embuer_watch_start once for every
+/// queued status change, on the calling thread, and returns immediately when
+/// the queue is empty.
+///
+/// Parameters:
+/// - client: Client handle
+///
+/// Returns: the number of dispatched updates (>= 0), EMBUER_ERR_DBUS once the
+/// signal stream has ended, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_dispatch(client: *mut embuer_client_t) -> c_int {
+    if client.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &*client };
+
+    let Some(watch) = client.watch.as_ref() else {
+        return EMBUER_ERR_NOT_WATCHING;
+    };
+
+    // Drain the wakeup bytes before the queue: anything pushed afterwards
+    // writes a new byte and leaves the fd readable for the next poll
+    let mut drain = [0u8; 64];
+    let mut hangup = false;
+    while let Ok(n) = (&watch.wake_rx).read(&mut drain) {
+        if n == 0 {
+            hangup = true;
+            break;
+        }
+    }
+
+    let pending = match watch.queue.lock() {
+        Ok(mut queue) => std::mem::take(&mut *queue),
+        Err(_) => return EMBUER_ERR_RUNTIME,
+    };
+
+    // The signal stream ended (e.g. the bus connection dropped)
+    if hangup && pending.is_empty() {
+        return EMBUER_ERR_DBUS;
+    }
+
+    let mut dispatched: c_int = 0;
+    for (status_c, details_c, progress) in pending {
+        unsafe {
+            (watch.callback)(
+                status_c.as_ptr(),
+                details_c.as_ptr(),
+                progress,
+                watch.user_data,
+            );
+        }
+        dispatched = dispatched.saturating_add(1);
+    }
+
+    dispatched
+}
+
+/// Stop watching for status updates
+///
+/// Unsubscribes from the status signal and closes the file descriptor
+/// returned by embuer_watch_start. Queued updates are discarded.
+///
+/// Parameters:
+/// - client: Client handle
+///
+/// Returns: EMBUER_OK on success, error code otherwise
+#[no_mangle]
+pub unsafe extern "C" fn embuer_watch_stop(client: *mut embuer_client_t) -> c_int {
+    if client.is_null() {
+        return EMBUER_ERR_NULL_PTR;
+    }
+
+    let client = unsafe { &mut *client };
+
+    match client.watch.take() {
+        Some(_) => EMBUER_OK,
+        None => EMBUER_ERR_NOT_WATCHING,
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -467,5 +1423,128 @@ mod tests {
         };
 
         assert_eq!(result, EMBUER_ERR_NULL_PTR);
+
+        let result = unsafe { embuer_get_snapshot(ptr::null_mut(), ptr::null_mut()) };
+        assert_eq!(result, EMBUER_ERR_NULL_PTR);
+
+        assert_eq!(
+            unsafe { embuer_pause_update(ptr::null_mut()) },
+            EMBUER_ERR_NULL_PTR
+        );
+        assert_eq!(
+            unsafe { embuer_resume_update(ptr::null_mut()) },
+            EMBUER_ERR_NULL_PTR
+        );
+        let mut paused = 0;
+        assert_eq!(
+            unsafe { embuer_is_update_paused(ptr::null_mut(), &mut paused) },
+            EMBUER_ERR_NULL_PTR
+        );
+        let mut depth = 0;
+        assert_eq!(
+            unsafe { embuer_get_update_queue_depth(ptr::null_mut(), &mut depth) },
+            EMBUER_ERR_NULL_PTR
+        );
+
+        assert_eq!(
+            unsafe { embuer_op_cancel(ptr::null_mut()) },
+            EMBUER_ERR_NULL_PTR
+        );
+        unsafe { embuer_op_free(ptr::null_mut()) };
+    }
+
+    #[test]
+    fn test_shared_runtime() {
+        let first = shared_runtime().expect("shared runtime");
+        let second = shared_runtime().expect("shared runtime");
+        assert!(std::ptr::eq(first, second));
+
+        // Blocking calls from several threads share the same runtime
+        let workers: Vec<_> = (0..4)
+            .map(|i| {
+                std::thread::spawn(move || shared_runtime().unwrap().block_on(async { i * 2 }))
+            })
+            .collect();
+        let results: Vec<_> = workers.into_iter().map(|w| w.join().unwrap()).collect();
+        assert_eq!(results, vec![0, 2, 4, 6]);
+
+        // Spawned tasks run without any caller blocking on the runtime
+        let (tx, rx) = std::sync::mpsc::channel();
+        first.spawn(async move { tx.send(42).unwrap() });
+        assert_eq!(rx.recv_timeout(std::time::Duration::from_secs(5)), Ok(42));
+    }
+
+    #[test]
+    fn test_invalid_threading() {
+        let options = embuer_client_options_t {
+            threading: 42,
+            worker_threads: 0,
+        };
+        assert!(unsafe { embuer_client_new_with_options(&options) }.is_null());
+    }
+
+    #[test]
+    fn test_copy_to_buffer() {
+        let mut buf = [0x7f as c_char; 8];
+
+        let len = unsafe { copy_to_buffer("abc", buf.as_mut_ptr(), buf.len()) };
+        assert_eq!(len, 3);
+        assert_eq!(unsafe { CStr::from_ptr(buf.as_ptr()) }.to_bytes(), b"abc");
+
+        // Truncated, but the full length is still reported
+        let len = unsafe { copy_to_buffer("0123456789", buf.as_mut_ptr(), buf.len()) };
+        assert_eq!(len, 10);
+        assert_eq!(
+            unsafe { CStr::from_ptr(buf.as_ptr()) }.to_bytes(),
+            b"0123456"
+        );
+
+        // A zero-sized buffer only measures the string
+        let len = unsafe { copy_to_buffer("measure", ptr::null_mut(), 0) };
+        assert_eq!(len, 7);
+    }
+
+    #[test]
+    fn test_progress_from_dbus() {
+        let progress: embuer_progress_t = (2, 10, 100, 5, 4, 22, 3).into();
+        assert_eq!(progress.stage, EMBUER_STAGE_DOWNLOADING);
+        assert_eq!(progress.bytes_done, 10);
+        assert_eq!(progress.bytes_total, 100);
+        assert_eq!(progress.eta_seconds, 22);
+        assert_eq!(progress.queue_depth, 3);
+
+        // The C stage codes are the discriminants sent on the bus
+        use crate::status::UpdateStage;
+        assert_eq!(UpdateStage::Idle as c_int, EMBUER_STAGE_IDLE);
+        assert_eq!(UpdateStage::Downloading as c_int, EMBUER_STAGE_DOWNLOADING);
+        assert_eq!(UpdateStage::Reading as c_int, EMBUER_STAGE_READING);
+        assert_eq!(UpdateStage::Receiving as c_int, EMBUER_STAGE_RECEIVING);
+        assert_eq!(UpdateStage::Verifying as c_int, EMBUER_STAGE_VERIFYING);
+    }
+
+    #[test]
+    fn test_metrics_from_dbus() {
+        let metrics: embuer_metrics_t = vec![
+            ("source".to_string(), 100, 1, 2, 3, 0),
+            ("receive".to_string(), 400, 4, 5, 6, 7),
+            ("future-stage".to_string(), 1, 1, 1, 1, 1),
+        ]
+        .into();
+
+        assert_eq!(metrics.source.bytes, 100);
+        assert_eq!(metrics.source.wall_us, 3);
+        assert_eq!(metrics.hash, embuer_stage_metrics_t::default());
+        assert_eq!(metrics.receive.peak_buffer, 7);
+    }
+
+    #[test]
+    fn test_status_code() {
+        assert_eq!(status_code("Idle"), EMBUER_STATUS_IDLE);
+        assert_eq!(
+            status_code("AwaitingConfirmation"),
+            EMBUER_STATUS_AWAITING_CONFIRMATION
+        );
+        assert_eq!(status_code("Failed"), EMBUER_STATUS_FAILED);
+        assert_eq!(status_code("Bogus"), EMBUER_STATUS_UNKNOWN);
     }
 }
@@ -18,22 +18,45 @@
 */
 
 use std::{
+    future::Future,
     pin::Pin,
     sync::Arc,
     task::{Context, Poll},
 };
 
+use bytes::Bytes;
+use log::warn;
 use sha2::{Digest, Sha512};
 use tokio::{
     io::{AsyncRead, ReadBuf},
-    sync::RwLock,
+    sync::{mpsc, oneshot, RwLock},
 };
+use tokio_util::sync::PollSender;
+
+/// Default number of chunks buffered towards the hashing thread
+pub const DEFAULT_HASH_QUEUE_DEPTH: usize = 16;
+
+/// Where the SHA512 of the stream is computed
+enum HashState {
+    /// Hash each chunk inline, in `poll_read`
+    Inline(Sha512),
+    /// Hash on a dedicated thread, fed by a bounded chunk queue
+    Thread {
+        sender: PollSender<Bytes>,
+        done: oneshot::Receiver<()>,
+    },
+    /// The hash has been finalized
+    Finished,
+}
 
 /// A wrapper around AsyncRead that computes SHA512 hash incrementally
 /// The hash result is stored in an Arc for retrieval after streaming completes
+///
+/// sha2 selects the fastest SHA512 backend available on the CPU at runtime
+/// (AVX2 on x86_64, the SHA512 extensions on aarch64).
 pub struct HashingReader<R> {
     inner: R,
-    hasher: Sha512,
+    state: HashState,
     hash_result: Arc<RwLock<Option<String>>>,
 }
 
@@ -41,11 +64,52 @@ impl<R: AsyncRead + Unpin> HashingReader<R> {
     pub fn new(inner: R) -> Self {
         Self {
             inner,
-            hasher: Sha512::new(),
+            state: HashState::Inline(Sha512::new()),
             hash_result: Arc::new(RwLock::new(None)),
         }
     }
 
+    /// Create a reader hashing on a dedicated thread, so that hashing overlaps
+    /// with the I/O and decompression driven by the tokio workers.
+    ///
+    /// At most `queue_depth` chunks are queued: reads wait for the thread when
+    /// it falls behind. Falls back to inline hashing if the thread can't be spawned.
+    pub fn with_hash_thread(inner: R, queue_depth: usize) -> Self {
+        let hash_result = Arc::new(RwLock::new(None));
+
+        let (chunk_tx, mut chunk_rx) = mpsc::channel::<Bytes>(queue_depth.max(1));
+        let (done_tx, done) = oneshot::channel();
+        let thread_result = hash_result.clone();
+        let spawn_res = std::thread::Builder::new()
+            .name("embuer-hash".to_string())
+            .spawn(move || {
+                let mut hasher = Sha512::new();
+                while let Some(chunk) = chunk_rx.blocking_recv() {
+                    hasher.update(&chunk);
+                }
+
+                *thread_result.blocking_write() = Some(hex::encode(hasher.finalize()));
+                let _ = done_tx.send(());
+            });
+
+        let state = match spawn_res {
+            Ok(_) => HashState::Thread {
+                sender: PollSender::new(chunk_tx),
+                done,
+            },
+            Err(e) => {
+                warn!("Failed to spawn the hashing thread, hashing inline: {e}");
+                HashState::Inline(Sha512::new())
+            }
+        };
+
+        Self {
+            inner,
+            state,
+            hash_result,
+        }
+    }
+
     pub fn hash_result(&self) -> Arc<RwLock<Option<String>>> {
         self.hash_result.clone()
     }
@@ -53,21 +117,48 @@ impl<R: AsyncRead + Unpin> HashingReader<R> {
     /// Finalize the hash and return it directly
     /// Call this after the stream has been fully consumed
     pub async fn get_hash(&mut self) -> Option<String> {
-        let hash = std::mem::replace(&mut self.hasher, Sha512::new()).finalize();
-        let hex_hash = hex::encode(hash);
-        if let Ok(mut result) = self.hash_result.try_write() {
-            *result = Some(hex_hash.clone());
+        match std::mem::replace(&mut self.state, HashState::Finished) {
+            // Dropping the sender ends the queue: wait for the thread to finalize
+            HashState::Thread { done, .. } => {
+                let _ = done.await;
+            }
+            state => {
+                self.state = state;
+                self.finalize_hash();
+            }
         }
-        Some(hex_hash)
+
+        self.hash_result.read().await.clone()
     }
 
     fn finalize_hash(&mut self) {
-        let hash = std::mem::replace(&mut self.hasher, Sha512::new()).finalize();
-        let hex_hash = hex::encode(hash);
+        let hasher = match std::mem::replace(&mut self.state, HashState::Finished) {
+            HashState::Inline(hasher) => hasher,
+            // The thread finalizes once the queue is closed by dropping the sender
+            HashState::Thread { .. } => return,
+            HashState::Finished => return,
+        };
+
+        let hex_hash = hex::encode(hasher.finalize());
         if let Ok(mut result) = self.hash_result.try_write() {
             *result = Some(hex_hash);
         }
     }
+
+    /// Wait for the hashing thread to publish the hash, when hashing on a thread
+    fn poll_finalize(&mut self, cx: &mut Context<'_>) -> Poll<()> {
+        if let HashState::Thread { sender, done } = &mut self.state {
+            // Release the slot reserved for this read, or the queue never ends
+            sender.abort_send();
+            sender.close();
+            if Pin::new(done).poll(cx).is_pending() {
+                return Poll::Pending;
+            }
+        }
+
+        self.finalize_hash();
+        Poll::Ready(())
+    }
 }
 
 impl<R: AsyncRead + Unpin> AsyncRead for HashingReader<R> {
@@ -76,6 +167,20 @@ impl<R: AsyncRead + Unpin> AsyncRead for HashingReader<R> {
         cx: &mut Context<'_>,
         buf: &mut ReadBuf<'_>,
     ) -> Poll<std::io::Result<()>> {
+        // Make room in the queue before reading: data can't be un-read later
+        // (a closed sender means EOF was reached and the thread is finalizing)
+        if let HashState::Thread { sender, .. } = &mut self.state {
+            if !sender.is_closed() {
+                match sender.poll_reserve(cx) {
+                    Poll::Ready(Ok(())) => {}
+                    Poll::Ready(Err(_)) => {
+                        return Poll::Ready(Err(std::io::Error::other("hashing thread exited")));
+                    }
+                    Poll::Pending => return Poll::Pending,
+                }
+            }
+        }
+
         // Record how much was filled before the read
         let filled_before = buf.filled().len();
 
@@ -88,15 +193,29 @@ impl<R: AsyncRead + Unpin> AsyncRead for HashingReader<R> {
                 let filled_after = buf.filled();
                 if filled_after.len() > filled_before {
                     let newly_read = &filled_after[filled_before..];
-                    if !newly_read.is_empty() {
-                        self.hasher.update(newly_read);
+                    match &mut self.state {
+                        HashState::Inline(hasher) => hasher.update(newly_read),
+                        HashState::Thread { sender, .. } => {
+                            if sender
+                                .send_item(Bytes::copy_from_slice(newly_read))
+                                .is_err()
+                            {
+                                return Poll::Ready(Err(std::io::Error::other(
+                                    "hashing thread exited",
+                                )));
+                            }
+                        }
+                        HashState::Finished => {}
                     }
                 }
 
                 // Check if we've reached EOF (no new data read - means EOF was reached)
                 if filled_after.len() == filled_before {
-                    // Finalize the hash when stream ends (EOF)
-                    self.finalize_hash();
+                    // Finalize the hash when stream ends (EOF): the hash must be
+                    // available once the consumer observes EOF
+                    if self.poll_finalize(cx).is_pending() {
+                        return Poll::Pending;
+                    }
                 }
             }
             Poll::Ready(Err(_)) => {
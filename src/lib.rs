@@ -19,16 +19,27 @@
 
 pub extern crate zbus;
 
+pub mod boot_info;
 pub mod btrfs;
+pub mod cancel_stream;
+pub mod chunked_hash;
 pub mod config;
 pub mod core;
 pub mod dbus;
+pub mod download;
 pub mod ffi;
 pub mod hash_stream;
 pub mod manifest;
+pub mod metrics;
+pub mod package;
+pub mod peer;
 pub mod progress_stream;
+pub mod qos;
+pub mod schedule;
 pub mod service;
+pub mod splice;
 pub mod status;
+pub mod update_queue;
 
 use zbus::Error as ZError;
 
@@ -74,4 +85,10 @@ pub enum ServiceError {
 
     #[error("Missing update size")]
     MissingUpdateSize,
+
+    #[error("Update cancelled")]
+    UpdateCancelled,
+
+    #[error("Update rejected by user")]
+    UpdateRejected,
 }
@@ -23,6 +23,9 @@ use std::path::Path;
 
 use crate::ServiceError;
 
+/// Location of the manifest inside a deployment
+pub const MANIFEST_PATH: &str = "usr/share/embuer/manifest.json";
+
 #[derive(Serialize, Deserialize, Default, Clone, PartialEq, Debug)]
 pub struct Manifest {
     version: String,
@@ -48,6 +51,10 @@ impl Manifest {
         Ok(cfg)
     }
 
+    pub fn version(&self) -> &str {
+        &self.version
+    }
+
     pub fn is_readonly(&self) -> bool {
         self.readonly
     }
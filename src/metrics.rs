@@ -0,0 +1,292 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+use std::{
+    pin::Pin,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+    task::{Context, Poll},
+    time::{Duration, Instant},
+};
+
+use tokio::io::{AsyncRead, ReadBuf};
+
+/// Stage of the receive pipeline measured by [`PipelineMetrics`]
+///
+/// The discriminants index [`PipelineMetrics::snapshot`] and are part of the
+/// D-Bus and C interfaces.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PipelineStage {
+    /// The archive payload, as read from the network or the file
+    Source = 0,
+    /// The payload after SHA512 hashing
+    Hash = 1,
+    /// The decompressed send stream
+    Decompress = 2,
+    /// The receiver applying the send stream
+    Receive = 3,
+}
+
+pub const PIPELINE_STAGES: [PipelineStage; 4] = [
+    PipelineStage::Source,
+    PipelineStage::Hash,
+    PipelineStage::Decompress,
+    PipelineStage::Receive,
+];
+
+impl PipelineStage {
+    pub fn as_str(&self) -> &str {
+        match self {
+            PipelineStage::Source => "source",
+            PipelineStage::Hash => "hash",
+            PipelineStage::Decompress => "decompress",
+            PipelineStage::Receive => "receive",
+        }
+    }
+}
+
+/// Counters of one pipeline stage, updated lock-free
+#[derive(Debug, Default)]
+pub struct StageMetrics {
+    bytes: AtomicU64,
+    read_blocked_us: AtomicU64,
+    write_blocked_us: AtomicU64,
+    wall_us: AtomicU64,
+    peak_buffer: AtomicU64,
+}
+
+/// Values of a [`StageMetrics`] at one point in time
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct StageSnapshot {
+    /// Bytes that went through the stage
+    pub bytes: u64,
+    /// Microseconds the stage waited for its input
+    pub read_blocked_us: u64,
+    /// Microseconds the stage waited for its output to be consumed
+    pub write_blocked_us: u64,
+    /// Microseconds from the first read to the end of the stage
+    pub wall_us: u64,
+    /// Peak bytes buffered between the stage and the next one, 0 if not measured
+    pub peak_buffer: u64,
+}
+
+impl StageMetrics {
+    pub fn add_bytes(&self, bytes: u64) {
+        self.bytes.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    pub fn add_read_blocked(&self, time: Duration) {
+        self.read_blocked_us
+            .fetch_add(time.as_micros() as u64, Ordering::Relaxed);
+    }
+
+    pub fn add_write_blocked(&self, time: Duration) {
+        self.write_blocked_us
+            .fetch_add(time.as_micros() as u64, Ordering::Relaxed);
+    }
+
+    pub fn set_wall(&self, time: Duration) {
+        self.wall_us
+            .store(time.as_micros() as u64, Ordering::Relaxed);
+    }
+
+    pub fn record_buffer(&self, occupancy: u64) {
+        self.peak_buffer.fetch_max(occupancy, Ordering::Relaxed);
+    }
+
+    pub fn snapshot(&self) -> StageSnapshot {
+        StageSnapshot {
+            bytes: self.bytes.load(Ordering::Relaxed),
+            read_blocked_us: self.read_blocked_us.load(Ordering::Relaxed),
+            write_blocked_us: self.write_blocked_us.load(Ordering::Relaxed),
+            wall_us: self.wall_us.load(Ordering::Relaxed),
+            peak_buffer: self.peak_buffer.load(Ordering::Relaxed),
+        }
+    }
+
+    fn reset(&self) {
+        for counter in [
+            &self.bytes,
+            &self.read_blocked_us,
+            &self.write_blocked_us,
+            &self.wall_us,
+            &self.peak_buffer,
+        ] {
+            counter.store(0, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Metrics of every stage of the last update pipeline
+///
+/// Blocked times are measured at the boundaries between stages, so the read
+/// time of a stage includes the stalls of everything upstream: the bottleneck
+/// is the first stage, from the receiver backwards, that spends little time
+/// blocked on reads.
+#[derive(Debug, Default)]
+pub struct PipelineMetrics {
+    stages: [StageMetrics; PIPELINE_STAGES.len()],
+}
+
+impl PipelineMetrics {
+    pub fn stage(&self, stage: PipelineStage) -> &StageMetrics {
+        &self.stages[stage as usize]
+    }
+
+    /// Clear the counters before a new update
+    pub fn reset(&self) {
+        self.stages.iter().for_each(StageMetrics::reset);
+    }
+
+    pub fn snapshot(&self) -> [StageSnapshot; PIPELINE_STAGES.len()] {
+        PIPELINE_STAGES.map(|stage| self.stage(stage).snapshot())
+    }
+}
+
+/// A wrapper around AsyncRead measuring the boundary after a pipeline stage
+///
+/// The time from a pending read to the next poll is accounted as the stage
+/// waiting for its input; the time from a completed read to the next poll as
+/// the stage waiting for the consumer (backpressure). The wall time runs from
+/// the first read to EOF.
+pub struct MeteredReader<R> {
+    inner: R,
+    metrics: Arc<PipelineMetrics>,
+    stage: PipelineStage,
+    started: Option<Instant>,
+    pending_since: Option<Instant>,
+    returned_at: Option<Instant>,
+}
+
+impl<R: AsyncRead + Unpin> MeteredReader<R> {
+    pub fn new(inner: R, metrics: Arc<PipelineMetrics>, stage: PipelineStage) -> Self {
+        Self {
+            inner,
+            metrics,
+            stage,
+            started: None,
+            pending_since: None,
+            returned_at: None,
+        }
+    }
+}
+
+impl<R: AsyncRead + Unpin> AsyncRead for MeteredReader<R> {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut ReadBuf<'_>,
+    ) -> Poll<std::io::Result<()>> {
+        let reader = self.as_mut().get_mut();
+        let now = Instant::now();
+        let started = *reader.started.get_or_insert(now);
+        let metrics = reader.metrics.stage(reader.stage);
+
+        if let Some(returned_at) = reader.returned_at.take() {
+            metrics.add_write_blocked(now.duration_since(returned_at));
+        }
+
+        let before = buf.filled().len();
+        let result = Pin::new(&mut reader.inner).poll_read(cx, buf);
+
+        match &result {
+            Poll::Pending => {
+                reader.pending_since.get_or_insert(now);
+            }
+            Poll::Ready(res) => {
+                if let Some(pending_since) = reader.pending_since.take() {
+                    metrics.add_read_blocked(now.duration_since(pending_since));
+                }
+
+                let bytes = (buf.filled().len() - before) as u64;
+                metrics.add_bytes(bytes);
+
+                if res.is_err() || (bytes == 0 && buf.remaining() > 0) {
+                    metrics.set_wall(now.duration_since(started));
+                } else {
+                    reader.returned_at = Some(Instant::now());
+                }
+            }
+        }
+
+        result
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio::io::AsyncReadExt;
+
+    #[tokio::test]
+    async fn test_metered_reader_counts() {
+        let data = vec![1u8; 100_000];
+        let metrics = Arc::new(PipelineMetrics::default());
+
+        let mut reader = MeteredReader::new(&data[..], metrics.clone(), PipelineStage::Hash);
+        let mut buffer = Vec::new();
+        reader.read_to_end(&mut buffer).await.unwrap();
+
+        let [source, hash, ..] = metrics.snapshot();
+        assert_eq!(hash.bytes, data.len() as u64);
+        assert_eq!(source, StageSnapshot::default());
+
+        metrics.reset();
+        assert_eq!(metrics.stage(PipelineStage::Hash).snapshot().bytes, 0);
+    }
+
+    #[tokio::test]
+    async fn test_metered_reader_blocked_times() {
+        let (mut writer, pipe) = tokio::io::duplex(64);
+        let metrics = Arc::new(PipelineMetrics::default());
+        let mut reader = MeteredReader::new(pipe, metrics.clone(), PipelineStage::Source);
+
+        let producer = tokio::spawn(async move {
+            use tokio::io::AsyncWriteExt;
+            tokio::time::sleep(Duration::from_millis(20)).await;
+            writer.write_all(b"data").await.unwrap();
+        });
+
+        // Waits for the producer: read blocked
+        let mut buffer = [0u8; 4];
+        reader.read_exact(&mut buffer).await.unwrap();
+        producer.await.unwrap();
+
+        // Slow consumer: write blocked, then EOF records the wall time
+        tokio::time::sleep(Duration::from_millis(20)).await;
+        assert_eq!(reader.read(&mut buffer).await.unwrap(), 0);
+
+        let source = metrics.stage(PipelineStage::Source).snapshot();
+        assert_eq!(source.bytes, 4);
+        assert!(source.read_blocked_us >= 15_000, "{source:?}");
+        assert!(source.write_blocked_us >= 15_000, "{source:?}");
+        assert!(source.wall_us >= source.read_blocked_us, "{source:?}");
+    }
+
+    #[test]
+    fn test_peak_buffer() {
+        let metrics = StageMetrics::default();
+        metrics.record_buffer(10);
+        metrics.record_buffer(30);
+        metrics.record_buffer(20);
+        assert_eq!(metrics.snapshot().peak_buffer, 30);
+    }
+}
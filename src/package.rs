@@ -0,0 +1,462 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Index of the entries of an update package.
+//!
+//! An update package is a tar archive whose first entry, `update.index`, is
+//! a [`PackageIndex`] padded to [`INDEX_SIZE`] bytes: the name, offset, size
+//! and SHA-256 digest of every other entry. The first [`INDEX_HEAD_SIZE`]
+//! bytes of a package are thus enough to locate its entries, with a single
+//! read of a file or a single range request, and the payload can be read
+//! from its offset without going through the entries that precede it.
+//!
+//! The index is a shortcut, not a trust anchor: entries read through it are
+//! checked against its digests, and the payloads are still verified by their
+//! signatures. Packages without an index are read as a sequence of entries.
+//!
+//! A package may hold a [`PADDING_ENTRY`] of zeros before its payload, so
+//! that a payload written before the entries preceding it lands at a fixed
+//! offset: readers skip it like any entry they do not know.
+
+use std::os::unix::fs::FileExt;
+
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+
+use crate::ServiceError;
+
+/// Name of the index entry, always the first of a package
+pub const INDEX_ENTRY: &str = "update.index";
+
+/// Size of the data of the index entry
+pub const INDEX_SIZE: usize = 4096;
+
+/// Bytes at the start of a package holding the index: its tar header and data
+pub const INDEX_HEAD_SIZE: usize = TAR_BLOCK_SIZE + INDEX_SIZE;
+
+/// Name of the entry of zeros laying out the payload at a given offset
+pub const PADDING_ENTRY: &str = "update.padding";
+
+/// Size of a tar header, and alignment of the data of every entry
+pub const TAR_BLOCK_SIZE: usize = 512;
+
+/// Version of the index format
+const INDEX_VERSION: u32 = 1;
+
+/// Largest size stored in octal in the 11 digits of a tar header
+const TAR_OCTAL_SIZE_MAX: u64 = 0o77777777777;
+
+/// An entry of the package, as listed in the index
+#[derive(Serialize, Deserialize, Clone, PartialEq, Eq, Debug)]
+pub struct IndexEntry {
+    name: String,
+    /// Offset of the data of the entry from the start of the package
+    offset: u64,
+    size: u64,
+    sha256: String,
+}
+
+impl IndexEntry {
+    pub fn name(&self) -> &str {
+        &self.name
+    }
+
+    pub fn offset(&self) -> u64 {
+        self.offset
+    }
+
+    pub fn size(&self) -> u64 {
+        self.size
+    }
+
+    /// Value of a `Range:` header selecting the data of the entry
+    pub fn range(&self) -> String {
+        format!(
+            "bytes={}-{}",
+            self.offset,
+            (self.offset + self.size).saturating_sub(1)
+        )
+    }
+
+    /// Check that `data` is the content of the entry
+    pub fn verify(&self, data: &[u8]) -> Result<(), ServiceError> {
+        match data.len() as u64 == self.size && hex::encode(Sha256::digest(data)) == self.sha256 {
+            true => Ok(()),
+            false => Err(ServiceError::IOError(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                format!("{} does not match the package index", self.name),
+            ))),
+        }
+    }
+
+    /// Read the content of the entry from the package `file`
+    pub fn read(&self, file: &std::fs::File) -> Result<Vec<u8>, ServiceError> {
+        let size = usize::try_from(self.size)
+            .map_err(|_| ServiceError::IOError(std::io::Error::other("Entry too large")))?;
+        let mut data = vec![0u8; size];
+        file.read_exact_at(&mut data, self.offset)?;
+
+        self.verify(&data)?;
+        Ok(data)
+    }
+}
+
+/// Name and size of the entry described by a tar header, if `header` is one
+fn parse_tar_header(header: &[u8]) -> Option<(String, u64)> {
+    if header.len() < TAR_BLOCK_SIZE || !header[257..].starts_with(b"ustar") {
+        return None;
+    }
+
+    let name = header[..100].split(|byte| *byte == 0).next()?;
+    let name = std::str::from_utf8(name).ok()?.to_string();
+
+    // Sizes from 8 GiB on are stored in base-256, flagged by the high bit
+    let field = &header[124..136];
+    let size = match field[0] & 0x80 {
+        0 => {
+            let octal = std::str::from_utf8(field).ok()?;
+            u64::from_str_radix(octal.trim_matches(|c: char| c == '\0' || c == ' '), 8).ok()?
+        }
+        _ => field[4..]
+            .iter()
+            .fold(0u64, |size, byte| (size << 8) | *byte as u64),
+    };
+
+    Some((name, size))
+}
+
+/// GNU tar header of the regular file `name` holding `size` bytes
+///
+/// This is the header `tar --format=gnu` writes for a file owned by root,
+/// so that a package can be written without going through `tar`.
+pub fn tar_header(name: &str, size: u64, mtime: u64) -> Result<[u8; TAR_BLOCK_SIZE], ServiceError> {
+    if name.is_empty() || name.len() >= 100 {
+        return Err(ServiceError::IOError(std::io::Error::new(
+            std::io::ErrorKind::InvalidInput,
+            format!("Invalid tar entry name {name:?}"),
+        )));
+    }
+
+    let mut header = [0u8; TAR_BLOCK_SIZE];
+    let mut field = |offset: usize, value: &[u8]| {
+        header[offset..offset + value.len()].copy_from_slice(value);
+    };
+    field(0, name.as_bytes());
+    field(100, b"0000644\0");
+    field(108, b"0000000\0");
+    field(116, b"0000000\0");
+    field(
+        136,
+        format!("{:011o}\0", mtime.min(TAR_OCTAL_SIZE_MAX)).as_bytes(),
+    );
+    field(156, b"0");
+    field(257, b"ustar  \0");
+    field(265, b"root");
+    field(297, b"root");
+
+    // Sizes from 8 GiB on are stored in base-256, flagged by the high bit
+    match size {
+        0..=TAR_OCTAL_SIZE_MAX => field(124, format!("{size:011o}\0").as_bytes()),
+        _ => {
+            field(124, &[0x80]);
+            field(128, &size.to_be_bytes());
+        }
+    }
+
+    // The checksum is computed with its own field filled with spaces
+    header[148..156].fill(b' ');
+    let checksum: u32 = header.iter().map(|byte| *byte as u32).sum();
+    header[148..156].copy_from_slice(format!("{checksum:06o}\0 ").as_bytes());
+
+    Ok(header)
+}
+
+/// Index of the entries of an update package
+#[derive(Serialize, Deserialize, Clone, PartialEq, Eq, Debug)]
+pub struct PackageIndex {
+    version: u32,
+    entries: Vec<IndexEntry>,
+}
+
+impl PackageIndex {
+    /// Lay out the entries `(name, size, sha256)`, in order, after the index
+    pub fn layout<I>(entries: I) -> Self
+    where
+        I: IntoIterator<Item = (String, u64, String)>,
+    {
+        let block = TAR_BLOCK_SIZE as u64;
+        let mut offset = INDEX_HEAD_SIZE as u64;
+        let entries = entries
+            .into_iter()
+            .map(|(name, size, sha256)| {
+                let entry = IndexEntry {
+                    name,
+                    offset: offset + block,
+                    size,
+                    sha256,
+                };
+                offset += block + size.div_ceil(block) * block;
+                entry
+            })
+            .collect();
+
+        Self {
+            version: INDEX_VERSION,
+            entries,
+        }
+    }
+
+    /// Encode the index as the data of the index entry
+    pub fn to_bytes(&self) -> Result<Vec<u8>, ServiceError> {
+        let mut data = serde_json::to_vec(self)?;
+        if data.len() > INDEX_SIZE {
+            return Err(ServiceError::IOError(std::io::Error::other(format!(
+                "The package index takes {} bytes, more than {INDEX_SIZE}",
+                data.len()
+            ))));
+        }
+
+        // JSON allows trailing whitespace
+        data.resize(INDEX_SIZE, b' ');
+        Ok(data)
+    }
+
+    /// Decode the index from the first [`INDEX_HEAD_SIZE`] bytes of a package
+    ///
+    /// Returns `None` for packages without an index.
+    pub fn from_head(head: &[u8]) -> Result<Option<Self>, ServiceError> {
+        match parse_tar_header(head) {
+            Some((name, size)) if name == INDEX_ENTRY && size == INDEX_SIZE as u64 => {}
+            _ => return Ok(None),
+        }
+        let Some(data) = head.get(TAR_BLOCK_SIZE..INDEX_HEAD_SIZE) else {
+            return Ok(None);
+        };
+
+        let index: Self = serde_json::from_slice(data)?;
+        if index.version != INDEX_VERSION {
+            return Err(ServiceError::IOError(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                format!("Unsupported package index version {}", index.version),
+            )));
+        }
+
+        Ok(Some(index))
+    }
+
+    /// Read the index at the start of the package `file`, if it has one
+    pub fn read(file: &std::fs::File) -> Result<Option<Self>, ServiceError> {
+        let mut head = vec![0u8; INDEX_HEAD_SIZE];
+        match file.read_exact_at(&mut head, 0) {
+            Ok(()) => Self::from_head(&head),
+            Err(err) if err.kind() == std::io::ErrorKind::UnexpectedEof => Ok(None),
+            Err(err) => Err(err.into()),
+        }
+    }
+
+    /// Check that the tar headers of the package `file` match the index
+    pub fn check(&self, file: &std::fs::File) -> Result<(), ServiceError> {
+        let mut header = [0u8; TAR_BLOCK_SIZE];
+        for entry in &self.entries {
+            let header_offset = entry.offset.checked_sub(TAR_BLOCK_SIZE as u64);
+            let matches = match header_offset {
+                Some(header_offset) => {
+                    file.read_exact_at(&mut header, header_offset)?;
+                    parse_tar_header(&header)
+                        .is_some_and(|(name, size)| name == entry.name && size == entry.size)
+                }
+                None => false,
+            };
+
+            if !matches {
+                return Err(ServiceError::IOError(std::io::Error::new(
+                    std::io::ErrorKind::InvalidData,
+                    format!("{} is not where the package index places it", entry.name),
+                )));
+            }
+        }
+
+        Ok(())
+    }
+
+    pub fn entries(&self) -> &[IndexEntry] {
+        &self.entries
+    }
+
+    pub fn entry(&self, name: &str) -> Option<&IndexEntry> {
+        self.entries.iter().find(|entry| entry.name == name)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn digest(data: &[u8]) -> String {
+        hex::encode(Sha256::digest(data))
+    }
+
+    #[test]
+    fn test_layout_matches_tar() {
+        let dir = tempfile::tempdir().unwrap();
+        let files: Vec<(&str, Vec<u8>)> = vec![
+            ("CHANGELOG", b"Version 1.2.3\n".to_vec()),
+            ("update.signature", vec![7u8; 512]),
+            ("update.btrfs.xz", (0..70_000u32).map(|i| i as u8).collect()),
+        ];
+        for (name, data) in &files {
+            std::fs::write(dir.path().join(name), data).unwrap();
+        }
+
+        let index = PackageIndex::layout(
+            files
+                .iter()
+                .map(|(name, data)| (name.to_string(), data.len() as u64, digest(data))),
+        );
+        std::fs::write(dir.path().join(INDEX_ENTRY), index.to_bytes().unwrap()).unwrap();
+
+        let package = dir.path().join("update.tar");
+        let status = std::process::Command::new("tar")
+            .arg("--format=gnu")
+            .arg("-cf")
+            .arg(&package)
+            .arg("-C")
+            .arg(dir.path())
+            .arg(INDEX_ENTRY)
+            .args(files.iter().map(|(name, _)| name))
+            .status()
+            .unwrap();
+        assert!(status.success());
+
+        let file = std::fs::File::open(&package).unwrap();
+        let read = PackageIndex::read(&file)
+            .unwrap()
+            .expect("package has an index");
+        assert_eq!(read, index);
+        read.check(&file).unwrap();
+
+        for (name, data) in &files {
+            assert_eq!(read.entry(name).unwrap().read(&file).unwrap(), *data);
+        }
+    }
+
+    #[test]
+    fn test_entry_digest_mismatch() {
+        let index = PackageIndex::layout([("CHANGELOG".to_string(), 3, digest(b"abc"))]);
+        let entry = index.entry("CHANGELOG").unwrap();
+
+        assert!(entry.verify(b"abc").is_ok());
+        assert!(entry.verify(b"abd").is_err());
+        assert!(entry.verify(b"abcd").is_err());
+        assert_eq!(
+            entry.range(),
+            format!("bytes={}-{}", entry.offset(), entry.offset() + 2)
+        );
+    }
+
+    #[test]
+    fn test_package_without_index() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("short");
+        std::fs::write(&path, b"not a package").unwrap();
+        assert_eq!(
+            PackageIndex::read(&std::fs::File::open(&path).unwrap()).unwrap(),
+            None
+        );
+
+        let mut header = vec![0u8; INDEX_HEAD_SIZE];
+        header[..9].copy_from_slice(b"CHANGELOG");
+        header[124..135].copy_from_slice(b"00000010000");
+        header[257..262].copy_from_slice(b"ustar");
+        assert_eq!(
+            parse_tar_header(&header),
+            Some(("CHANGELOG".to_string(), 4096))
+        );
+        assert_eq!(PackageIndex::from_head(&header).unwrap(), None);
+    }
+
+    #[test]
+    fn test_base256_size() {
+        let mut header = vec![0u8; TAR_BLOCK_SIZE];
+        header[..15].copy_from_slice(b"update.btrfs.xz");
+        header[257..262].copy_from_slice(b"ustar");
+        header[124] = 0x80;
+        header[131] = 0x02;
+        assert_eq!(
+            parse_tar_header(&header),
+            Some(("update.btrfs.xz".to_string(), 1 << 33))
+        );
+    }
+
+    #[test]
+    fn test_tar_header_matches_tar() {
+        let dir = tempfile::tempdir().unwrap();
+        let files: Vec<(&str, Vec<u8>)> = vec![
+            ("CHANGELOG", b"Version 1.2.3\n".to_vec()),
+            (PADDING_ENTRY, vec![0u8; 1024]),
+            ("update.btrfs.zst", (0..5_000u32).map(|i| i as u8).collect()),
+        ];
+        let index = PackageIndex::layout(
+            files
+                .iter()
+                .map(|(name, data)| (name.to_string(), data.len() as u64, digest(data))),
+        );
+
+        let mut package = tar_header(INDEX_ENTRY, INDEX_SIZE as u64, 1_700_000_000)
+            .unwrap()
+            .to_vec();
+        package.extend(index.to_bytes().unwrap());
+        for (name, data) in &files {
+            package.extend(tar_header(name, data.len() as u64, 1_700_000_000).unwrap());
+            package.extend(data);
+            package.resize(package.len().next_multiple_of(TAR_BLOCK_SIZE), 0);
+        }
+        package.resize(package.len() + 2 * TAR_BLOCK_SIZE, 0);
+
+        let path = dir.path().join("update.tar");
+        std::fs::write(&path, &package).unwrap();
+        let file = std::fs::File::open(&path).unwrap();
+        PackageIndex::read(&file)
+            .unwrap()
+            .expect("package has an index")
+            .check(&file)
+            .unwrap();
+
+        let out = dir.path().join("out");
+        std::fs::create_dir(&out).unwrap();
+        let status = std::process::Command::new("tar")
+            .arg("-xf")
+            .arg(&path)
+            .arg("-C")
+            .arg(&out)
+            .status()
+            .unwrap();
+        assert!(status.success());
+        for (name, data) in &files {
+            assert_eq!(std::fs::read(out.join(name)).unwrap(), *data);
+        }
+
+        let header = tar_header("update.btrfs.xz", 20 << 30, 0).unwrap();
+        assert_eq!(
+            parse_tar_header(&header),
+            Some(("update.btrfs.xz".to_string(), 20 << 30))
+        );
+        assert!(tar_header(&"x".repeat(100), 0, 0).is_err());
+    }
+}
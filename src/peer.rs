@@ -0,0 +1,1071 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Sharing of update archives between the devices of a LAN.
+//!
+//! Devices that installed an update keep its archive in a [`PeerCache`] and
+//! serve it over plain HTTP to their neighbours, so that a site behind a
+//! single uplink downloads every update from `update_url` once.
+//!
+//! Peers are found with a query sent to a multicast group: devices holding
+//! the same archive (same origin URL, strong ETag and size, see
+//! [`ArchiveKey`]) answer with the port of their HTTP server. Nothing is
+//! trusted from a peer: the archive is verified by its signatures as if it
+//! came from the origin, and a peer whose archive failed to install is not
+//! asked again. Without an answer the download proceeds from the origin.
+
+use std::collections::HashSet;
+use std::io::{Seek, SeekFrom, Write};
+use std::net::{IpAddr, Ipv4Addr, SocketAddr};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::Duration;
+
+use bytes::{Bytes, BytesMut};
+use futures::stream::{self, BoxStream};
+use futures::StreamExt;
+use log::{debug, info, warn};
+use reqwest::header::{CONTENT_RANGE, ETAG, IF_RANGE, RANGE};
+use reqwest::{Client, Response, StatusCode};
+use serde::{Deserialize, Serialize};
+use tokio::fs::File;
+use tokio::io::{AsyncBufReadExt, AsyncReadExt, AsyncSeekExt, AsyncWriteExt, BufReader};
+use tokio::net::{TcpListener, TcpStream, UdpSocket};
+use tokio::sync::Semaphore;
+use tokio::time::Instant;
+use tokio_util::sync::CancellationToken;
+
+use crate::ServiceError;
+
+/// Default UDP port of the discovery queries, also the TCP port of the HTTP server
+pub const DEFAULT_PEER_PORT: u16 = 7969;
+
+/// Default multicast group of the discovery queries (organization-local scope)
+pub const DEFAULT_PEER_GROUP: Ipv4Addr = Ipv4Addr::new(239, 255, 79, 69);
+
+/// Default number of peers served at the same time
+const DEFAULT_MAX_UPLOADS: usize = 4;
+
+/// Default time waited for the answers to a discovery query
+const DEFAULT_DISCOVERY_TIMEOUT: Duration = Duration::from_millis(300);
+
+/// Peers tried, in the order they answered, before falling back to the origin
+const MAX_CANDIDATES: usize = 8;
+
+/// Version of the discovery messages
+const PROTOCOL_VERSION: u32 = 1;
+
+/// Largest discovery message and HTTP request head accepted
+const MAX_MESSAGE_SIZE: usize = 8 * 1024;
+
+/// Time a peer has to send its HTTP request
+const REQUEST_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// Bytes of the archive kept in memory before they are written to the cache
+const CAPTURE_BUFFER_SIZE: usize = 1024 * 1024;
+
+/// Largest end of the archive fetched again when the installation did not
+/// read it (the end-of-archive blocks and the last buffered bytes)
+const MAX_CAPTURE_TAIL: u64 = 4 * 1024 * 1024;
+
+/// Path of the shared archive on the HTTP server
+const ARCHIVE_PATH: &str = "/archive";
+
+/// Files of the cache directory
+const ARCHIVE_FILE: &str = "archive.tar";
+const ARCHIVE_KEY_FILE: &str = "archive.json";
+const CAPTURE_FILE: &str = "archive.tar.partial";
+
+/// LAN peer cache settings, as configured
+#[derive(Serialize, Deserialize, Default, Clone, PartialEq, Debug)]
+pub struct PeerSettings {
+    // Share installed archives with peers, and download from them first.
+    #[serde(default)]
+    enabled: bool,
+
+    // UDP port of the discovery and TCP port of the HTTP server.
+    port: Option<u16>,
+
+    // IPv4 multicast group the discovery queries are sent to.
+    group: Option<Ipv4Addr>,
+
+    // Maximum number of peers served at the same time.
+    max_uploads: Option<usize>,
+
+    // Milliseconds waited for peers to answer a discovery query.
+    discovery_timeout: Option<u64>,
+
+    // IPv4 address of the LAN interface, the only one peers are served and
+    // discovered on. By default, the address of the interface the multicast
+    // group is routed through.
+    address: Option<Ipv4Addr>,
+}
+
+impl PeerSettings {
+    pub fn enabled(&self) -> bool {
+        self.enabled
+    }
+
+    pub fn port(&self) -> u16 {
+        self.port.unwrap_or(DEFAULT_PEER_PORT)
+    }
+
+    pub fn group(&self) -> Ipv4Addr {
+        self.group.unwrap_or(DEFAULT_PEER_GROUP)
+    }
+
+    pub fn max_uploads(&self) -> usize {
+        self.max_uploads.unwrap_or(DEFAULT_MAX_UPLOADS).max(1)
+    }
+
+    pub fn discovery_timeout(&self) -> Duration {
+        self.discovery_timeout
+            .map(Duration::from_millis)
+            .unwrap_or(DEFAULT_DISCOVERY_TIMEOUT)
+    }
+
+    pub fn address(&self) -> Option<Ipv4Addr> {
+        self.address
+    }
+
+    /// Address of the LAN interface: the configured one, or the source
+    /// address the kernel picks for datagrams sent to the multicast group
+    pub async fn lan_address(&self) -> std::io::Result<Ipv4Addr> {
+        if let Some(address) = self.address {
+            return Ok(address);
+        }
+
+        // Connecting a datagram socket only looks up the route
+        let probe = UdpSocket::bind((Ipv4Addr::UNSPECIFIED, 0)).await?;
+        probe.connect((self.group(), self.port())).await?;
+        match probe.local_addr()? {
+            SocketAddr::V4(local) if !local.ip().is_unspecified() => Ok(*local.ip()),
+            _ => Err(std::io::Error::other(format!(
+                "No interface routes the discovery group {}",
+                self.group()
+            ))),
+        }
+    }
+}
+
+/// Identity of an update archive
+///
+/// Only archives with a strong ETag and a known size are shared: together
+/// with the origin URL they identify the exact bytes served by the origin,
+/// including any variant selected by request headers.
+#[derive(Serialize, Deserialize, Clone, PartialEq, Eq, Debug)]
+pub struct ArchiveKey {
+    url: String,
+    etag: String,
+    size: u64,
+}
+
+impl ArchiveKey {
+    /// Identity of the archive of `url` served by `response`, if it can be shared
+    pub fn from_response(url: &str, response: &Response) -> Option<Self> {
+        let etag = response
+            .headers()
+            .get(ETAG)
+            .filter(|etag| !etag.as_bytes().starts_with(b"W/"))
+            .and_then(|etag| etag.to_str().ok())?;
+
+        Some(Self {
+            url: url.to_string(),
+            etag: etag.to_string(),
+            size: response.content_length()?,
+        })
+    }
+
+    pub fn size(&self) -> u64 {
+        self.size
+    }
+}
+
+/// Discovery query, sent to the multicast group
+#[derive(Serialize, Deserialize)]
+struct Query {
+    embuer: u32,
+    archive: ArchiveKey,
+}
+
+/// Answer of a peer holding the queried archive, sent to the querier
+#[derive(Serialize, Deserialize)]
+struct Offer {
+    embuer: u32,
+    archive: ArchiveKey,
+    port: u16,
+}
+
+/// A peer that started sending the archive
+pub struct PeerArchive {
+    pub addr: SocketAddr,
+    /// URL of the archive on the peer, to resume the download
+    pub url: String,
+    pub response: Response,
+}
+
+/// How the update of a captured archive ended
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum CaptureOutcome {
+    /// The update was verified and installed: the archive can be shared
+    Installed,
+    /// The update could not be installed from the archive
+    Failed,
+    /// The update was cancelled or did not need the archive
+    Abandoned,
+}
+
+/// The archive being copied to the cache while it is installed
+struct CaptureFile {
+    file: std::fs::File,
+    written: u64,
+    /// Writes stop when closed by [`PeerCache::finish`] or after an error
+    open: bool,
+}
+
+impl CaptureFile {
+    fn append(&mut self, data: &[u8]) {
+        if !self.open {
+            return;
+        }
+
+        match self.file.write_all(data) {
+            Ok(()) => self.written += data.len() as u64,
+            Err(err) => {
+                warn!("Failed to keep the update archive for peers: {err}");
+                self.open = false;
+            }
+        }
+    }
+}
+
+struct Capture {
+    key: ArchiveKey,
+    peer: Option<SocketAddr>,
+    file: Arc<Mutex<CaptureFile>>,
+}
+
+/// A request of a peer to the HTTP server
+#[derive(Debug, PartialEq)]
+struct PeerRequest {
+    head_only: bool,
+    path: String,
+    range: Option<String>,
+    if_range: Option<String>,
+}
+
+/// Parse the head of an HTTP/1.x request, or return the status to reply with
+fn parse_request(head: &str) -> Result<PeerRequest, StatusCode> {
+    let mut lines = head.lines();
+    let mut request_line = lines
+        .next()
+        .ok_or(StatusCode::BAD_REQUEST)?
+        .split_whitespace();
+    let (Some(method), Some(path), Some(version)) = (
+        request_line.next(),
+        request_line.next(),
+        request_line.next(),
+    ) else {
+        return Err(StatusCode::BAD_REQUEST);
+    };
+    if !version.starts_with("HTTP/1.") {
+        return Err(StatusCode::BAD_REQUEST);
+    }
+
+    let head_only = match method {
+        "GET" => false,
+        "HEAD" => true,
+        _ => return Err(StatusCode::METHOD_NOT_ALLOWED),
+    };
+
+    let mut request = PeerRequest {
+        head_only,
+        path: path.to_string(),
+        range: None,
+        if_range: None,
+    };
+    for line in lines.take_while(|line| !line.is_empty()) {
+        let (name, value) = line.split_once(':').ok_or(StatusCode::BAD_REQUEST)?;
+        if name.eq_ignore_ascii_case(RANGE.as_str()) {
+            request.range = Some(value.trim().to_string());
+        } else if name.eq_ignore_ascii_case(IF_RANGE.as_str()) {
+            request.if_range = Some(value.trim().to_string());
+        }
+    }
+
+    Ok(request)
+}
+
+/// Bytes selected by a `Range:` header, as the first and last offsets
+///
+/// Returns `None` when the header must be ignored (unknown unit, several
+/// ranges) and `Some(Err(()))` when the range is outside a file of `size` bytes.
+fn parse_range(value: &str, size: u64) -> Option<Result<(u64, u64), ()>> {
+    let spec = value.strip_prefix("bytes=")?.trim();
+    if spec.contains(',') {
+        return None;
+    }
+
+    let (first, last) = spec.split_once('-')?;
+    let range = match (first.trim(), last.trim()) {
+        ("", suffix) => {
+            let suffix: u64 = suffix.parse().ok()?;
+            match suffix.min(size) {
+                0 => return Some(Err(())),
+                suffix => (size - suffix, size - 1),
+            }
+        }
+        (first, last) => {
+            let first: u64 = first.parse().ok()?;
+            let last = match last {
+                "" => size.saturating_sub(1),
+                last => last.parse::<u64>().ok()?.min(size.saturating_sub(1)),
+            };
+            if first > last || first >= size {
+                return Some(Err(()));
+            }
+            (first, last)
+        }
+    };
+
+    Some(Ok(range))
+}
+
+/// Send the status line and the headers of a response
+async fn write_head(
+    stream: &mut TcpStream,
+    status: StatusCode,
+    headers: &[(&str, String)],
+) -> std::io::Result<()> {
+    let mut head = format!(
+        "HTTP/1.1 {} {}\r\nConnection: close\r\n",
+        status.as_u16(),
+        status.canonical_reason().unwrap_or_default()
+    );
+    for (name, value) in headers {
+        head.push_str(&format!("{name}: {value}\r\n"));
+    }
+    head.push_str("\r\n");
+
+    stream.write_all(head.as_bytes()).await
+}
+
+/// Reply to a request that has no body
+async fn write_status(stream: &mut TcpStream, status: StatusCode) -> std::io::Result<()> {
+    write_head(stream, status, &[("Content-Length", "0".to_string())]).await?;
+    stream.shutdown().await
+}
+
+/// Read the head of an HTTP request, up to the empty line
+async fn read_request_head(stream: &mut TcpStream) -> std::io::Result<String> {
+    let mut reader = BufReader::new(stream).take(MAX_MESSAGE_SIZE as u64);
+    let mut head = String::new();
+    loop {
+        let len = reader.read_line(&mut head).await?;
+        if len == 0 {
+            return Err(std::io::ErrorKind::UnexpectedEof.into());
+        }
+        if head.ends_with("\r\n\r\n") || head.ends_with("\n\n") {
+            return Ok(head);
+        }
+    }
+}
+
+fn remove_file(path: &Path) {
+    if let Err(err) = std::fs::remove_file(path) {
+        if err.kind() != std::io::ErrorKind::NotFound {
+            warn!("Failed to remove {}: {err}", path.display());
+        }
+    }
+}
+
+/// Update archive shared with the peers of the LAN, and the means to find theirs
+pub struct PeerCache {
+    dir: PathBuf,
+    settings: PeerSettings,
+    /// The archive being served, if any
+    archive: RwLock<Option<ArchiveKey>>,
+    capture: Mutex<Option<Capture>>,
+    /// Peers whose archive could not be installed
+    rejected: Mutex<HashSet<IpAddr>>,
+    uploads: Arc<Semaphore>,
+}
+
+impl PeerCache {
+    /// Open the cache in `dir`, serving again the archive kept there, if any
+    pub fn new(dir: PathBuf, settings: PeerSettings) -> Result<Self, ServiceError> {
+        std::fs::create_dir_all(&dir)?;
+        remove_file(&dir.join(CAPTURE_FILE));
+
+        let archive = std::fs::read(dir.join(ARCHIVE_KEY_FILE))
+            .ok()
+            .and_then(|json| serde_json::from_slice::<ArchiveKey>(&json).ok())
+            .filter(|key| {
+                std::fs::metadata(dir.join(ARCHIVE_FILE)).is_ok_and(|meta| meta.len() == key.size)
+            });
+        match &archive {
+            Some(key) => info!("Sharing the update archive of {} with peers", key.url),
+            None => {
+                remove_file(&dir.join(ARCHIVE_FILE));
+                remove_file(&dir.join(ARCHIVE_KEY_FILE));
+            }
+        }
+
+        Ok(Self {
+            uploads: Arc::new(Semaphore::new(settings.max_uploads())),
+            dir,
+            settings,
+            archive: RwLock::new(archive),
+            capture: Mutex::new(None),
+            rejected: Mutex::new(HashSet::new()),
+        })
+    }
+
+    /// The archive served to peers, if any
+    pub fn archive(&self) -> Option<ArchiveKey> {
+        self.archive.read().unwrap().clone()
+    }
+
+    /// Answer the discovery queries and serve the archive until an error occurs
+    pub async fn serve(self: Arc<Self>) -> std::io::Result<()> {
+        // Nothing listens on the other interfaces, e.g. the uplink to the WAN
+        let port = self.settings.port();
+        let address = self.settings.lan_address().await?;
+        let listener = TcpListener::bind((address, port)).await?;
+        let socket = UdpSocket::bind((self.settings.group(), port)).await?;
+        socket.join_multicast_v4(self.settings.group(), address)?;
+        info!(
+            "Serving update archives to peers on {address}:{port}, discovery on {}",
+            self.settings.group()
+        );
+
+        tokio::try_join!(
+            self.clone().answer_queries(socket, port),
+            self.serve_http(listener)
+        )?;
+        Ok(())
+    }
+
+    /// Offer the archive to the peers looking for it
+    async fn answer_queries(self: Arc<Self>, socket: UdpSocket, port: u16) -> std::io::Result<()> {
+        let mut buf = vec![0u8; MAX_MESSAGE_SIZE];
+        loop {
+            let (len, from) = socket.recv_from(&mut buf).await?;
+            let Ok(query) = serde_json::from_slice::<Query>(&buf[..len]) else {
+                continue;
+            };
+
+            // A busy device lets the others answer
+            if query.embuer != PROTOCOL_VERSION
+                || self.archive().as_ref() != Some(&query.archive)
+                || self.uploads.available_permits() == 0
+            {
+                continue;
+            }
+
+            let offer = serde_json::to_vec(&Offer {
+                embuer: PROTOCOL_VERSION,
+                archive: query.archive,
+                port,
+            })?;
+            if let Err(err) = socket.send_to(&offer, from).await {
+                debug!("Failed to answer the discovery query of {from}: {err}");
+            }
+        }
+    }
+
+    /// Serve the archive to the peers connecting to `listener`
+    pub async fn serve_http(self: Arc<Self>, listener: TcpListener) -> std::io::Result<()> {
+        loop {
+            let (mut stream, from) = listener.accept().await?;
+            let Ok(permit) = self.uploads.clone().try_acquire_owned() else {
+                tokio::spawn(async move {
+                    let _ = write_status(&mut stream, StatusCode::SERVICE_UNAVAILABLE).await;
+                });
+                continue;
+            };
+
+            let cache = self.clone();
+            tokio::spawn(async move {
+                match cache.handle_connection(&mut stream).await {
+                    Ok(()) => debug!("Served the update archive to {from}"),
+                    Err(err) => debug!("Failed to serve the update archive to {from}: {err}"),
+                }
+                drop(permit);
+            });
+        }
+    }
+
+    async fn handle_connection(&self, stream: &mut TcpStream) -> std::io::Result<()> {
+        let head = tokio::time::timeout(REQUEST_TIMEOUT, read_request_head(stream))
+            .await
+            .map_err(|_| std::io::Error::from(std::io::ErrorKind::TimedOut))??;
+        let request = match parse_request(&head) {
+            Ok(request) => request,
+            Err(status) => return write_status(stream, status).await,
+        };
+
+        let Some(key) = self.archive().filter(|_| request.path == ARCHIVE_PATH) else {
+            return write_status(stream, StatusCode::NOT_FOUND).await;
+        };
+
+        // The archive may have been replaced since its key was read
+        let mut file = match File::open(self.dir.join(ARCHIVE_FILE)).await {
+            Ok(file) if file.metadata().await?.len() == key.size => file,
+            _ => return write_status(stream, StatusCode::SERVICE_UNAVAILABLE).await,
+        };
+
+        // A range of a different archive would corrupt the download of the peer
+        let range = request
+            .range
+            .as_deref()
+            .filter(|_| {
+                request
+                    .if_range
+                    .as_ref()
+                    .map_or(true, |etag| *etag == key.etag)
+            })
+            .and_then(|range| parse_range(range, key.size));
+
+        let mut headers = vec![
+            ("ETag", key.etag.clone()),
+            ("Accept-Ranges", "bytes".to_string()),
+            ("Content-Type", "application/x-tar".to_string()),
+        ];
+        let (status, first, len) = match range {
+            None => (StatusCode::OK, 0, key.size),
+            Some(Ok((first, last))) => {
+                headers.push((
+                    "Content-Range",
+                    format!("bytes {first}-{last}/{}", key.size),
+                ));
+                (StatusCode::PARTIAL_CONTENT, first, last - first + 1)
+            }
+            Some(Err(())) => {
+                headers.push(("Content-Range", format!("bytes */{}", key.size)));
+                headers.push(("Content-Length", "0".to_string()));
+                write_head(stream, StatusCode::RANGE_NOT_SATISFIABLE, &headers).await?;
+                return stream.shutdown().await;
+            }
+        };
+        headers.push(("Content-Length", len.to_string()));
+        write_head(stream, status, &headers).await?;
+
+        if !request.head_only {
+            file.seek(SeekFrom::Start(first)).await?;
+            tokio::io::copy(&mut file.take(len), stream).await?;
+        }
+        stream.shutdown().await
+    }
+
+    /// Ask the LAN which peers hold the archive `key`, in the order they answered
+    async fn discover(&self, key: &ArchiveKey) -> std::io::Result<Vec<SocketAddr>> {
+        // Bound to the LAN address, the query is sent through its interface
+        let socket = UdpSocket::bind((self.settings.lan_address().await?, 0)).await?;
+        // Queries never leave the local network
+        socket.set_multicast_ttl_v4(1)?;
+
+        let query = serde_json::to_vec(&Query {
+            embuer: PROTOCOL_VERSION,
+            archive: key.clone(),
+        })?;
+        socket
+            .send_to(&query, (self.settings.group(), self.settings.port()))
+            .await?;
+
+        let deadline = Instant::now() + self.settings.discovery_timeout();
+        let mut buf = vec![0u8; MAX_MESSAGE_SIZE];
+        let mut peers = Vec::new();
+        while peers.len() < MAX_CANDIDATES {
+            let Ok(received) = tokio::time::timeout_at(deadline, socket.recv_from(&mut buf)).await
+            else {
+                break;
+            };
+            let (len, from) = received?;
+            let Ok(offer) = serde_json::from_slice::<Offer>(&buf[..len]) else {
+                continue;
+            };
+
+            let peer = SocketAddr::new(from.ip(), offer.port);
+            if offer.embuer == PROTOCOL_VERSION
+                && offer.archive == *key
+                && !peers.contains(&peer)
+                && !self.rejected.lock().unwrap().contains(&peer.ip())
+            {
+                peers.push(peer);
+            }
+        }
+
+        Ok(peers)
+    }
+
+    /// Start downloading the archive `key` from a peer, if one holds it
+    pub async fn locate(
+        &self,
+        client: &Client,
+        key: &ArchiveKey,
+        cancel: &CancellationToken,
+    ) -> Option<PeerArchive> {
+        let peers = match self.discover(key).await {
+            Ok(peers) => peers,
+            Err(err) => {
+                warn!("Failed to look for peers holding the update: {err}");
+                return None;
+            }
+        };
+
+        for addr in peers {
+            let url = format!("http://{addr}{ARCHIVE_PATH}");
+            let response = tokio::select! {
+                response = client.get(&url).send() => response,
+                _ = cancel.cancelled() => return None,
+            };
+
+            match response {
+                Ok(response)
+                    if response.status() == StatusCode::OK
+                        && ArchiveKey::from_response(&key.url, &response).as_ref() == Some(key) =>
+                {
+                    return Some(PeerArchive {
+                        addr,
+                        url,
+                        response,
+                    });
+                }
+                Ok(response) => {
+                    info!(
+                        "Peer {addr} does not serve the update anymore ({})",
+                        response.status()
+                    )
+                }
+                Err(err) => info!("Peer {addr} is unreachable: {err}"),
+            }
+        }
+
+        None
+    }
+
+    /// Copy the archive `key` read from `stream` to the cache, to share it
+    /// once installed (see [`PeerCache::finish`])
+    ///
+    /// The cache holds a single archive: the one shared so far is dropped.
+    pub fn capture(
+        &self,
+        key: ArchiveKey,
+        peer: Option<SocketAddr>,
+        stream: BoxStream<'static, std::io::Result<Bytes>>,
+    ) -> BoxStream<'static, std::io::Result<Bytes>> {
+        *self.archive.write().unwrap() = None;
+        remove_file(&self.dir.join(ARCHIVE_FILE));
+        remove_file(&self.dir.join(ARCHIVE_KEY_FILE));
+
+        let file = match std::fs::File::create(self.dir.join(CAPTURE_FILE)) {
+            Ok(file) => Arc::new(Mutex::new(CaptureFile {
+                file,
+                written: 0,
+                open: true,
+            })),
+            Err(err) => {
+                warn!("Failed to keep the update archive for peers: {err}");
+                return stream;
+            }
+        };
+        *self.capture.lock().unwrap() = Some(Capture {
+            key,
+            peer,
+            file: file.clone(),
+        });
+
+        // Chunks are written in batches on the blocking pool, and only counted
+        // once written: the tail that was not is fetched again by finish()
+        let flush = move |buffer: BytesMut| {
+            let file = file.clone();
+            async move {
+                let _ =
+                    tokio::task::spawn_blocking(move || file.lock().unwrap().append(&buffer)).await;
+            }
+        };
+        stream::unfold(
+            (stream, BytesMut::new(), flush),
+            |(mut stream, mut buffer, flush)| async move {
+                match stream.next().await {
+                    Some(Ok(chunk)) => {
+                        buffer.extend_from_slice(&chunk);
+                        if buffer.len() >= CAPTURE_BUFFER_SIZE {
+                            flush(buffer.split()).await;
+                        }
+                        Some((Ok(chunk), (stream, buffer, flush)))
+                    }
+                    Some(Err(err)) => Some((Err(err), (stream, buffer, flush))),
+                    None => {
+                        flush(buffer.split()).await;
+                        None
+                    }
+                }
+            },
+        )
+        .boxed()
+    }
+
+    /// Complete the archive captured by the last update, according to its `outcome`
+    ///
+    /// An installed archive is served from now on. The end of the archive the
+    /// installation did not read is fetched from the origin.
+    pub async fn finish(&self, client: &Client, outcome: CaptureOutcome) {
+        let Some(capture) = self.capture.lock().unwrap().take() else {
+            return;
+        };
+        let written = {
+            let mut file = capture.file.lock().unwrap();
+            let open = std::mem::replace(&mut file.open, false);
+            open.then_some(file.written)
+        };
+
+        if outcome == CaptureOutcome::Installed {
+            match self.complete(client, &capture, written).await {
+                Ok(()) => {
+                    info!(
+                        "Sharing the update archive of {} with peers",
+                        capture.key.url
+                    );
+                    *self.archive.write().unwrap() = Some(capture.key);
+                    return;
+                }
+                Err(err) => warn!("Cannot share the update archive with peers: {err}"),
+            }
+        } else if let (CaptureOutcome::Failed, Some(peer)) = (outcome, capture.peer) {
+            warn!("The update from peer {peer} failed: not downloading from it anymore");
+            self.rejected.lock().unwrap().insert(peer.ip());
+        }
+
+        remove_file(&self.dir.join(CAPTURE_FILE));
+    }
+
+    async fn complete(
+        &self,
+        client: &Client,
+        capture: &Capture,
+        written: Option<u64>,
+    ) -> std::io::Result<()> {
+        let key = &capture.key;
+        let written = written.ok_or_else(|| std::io::Error::other("the archive was not kept"))?;
+        let missing = key
+            .size
+            .checked_sub(written)
+            .filter(|missing| *missing <= MAX_CAPTURE_TAIL)
+            .ok_or_else(|| {
+                std::io::Error::other(format!(
+                    "only {written} of {} bytes of the archive were downloaded",
+                    key.size
+                ))
+            })?;
+
+        let tail = match missing {
+            0 => Bytes::new(),
+            _ => fetch_range(client, key, written).await?,
+        };
+        if tail.len() as u64 != missing {
+            return Err(std::io::Error::other(
+                "the end of the archive was truncated",
+            ));
+        }
+
+        let file = capture.file.clone();
+        let dir = self.dir.clone();
+        let key_json = serde_json::to_vec(key)?;
+        tokio::task::spawn_blocking(move || {
+            let mut file = file.lock().unwrap();
+            file.file.seek(SeekFrom::Start(written))?;
+            file.file.write_all(&tail)?;
+            file.file.sync_all()?;
+
+            std::fs::rename(dir.join(CAPTURE_FILE), dir.join(ARCHIVE_FILE))?;
+            std::fs::write(dir.join(ARCHIVE_KEY_FILE), key_json)
+        })
+        .await
+        .map_err(std::io::Error::other)?
+    }
+}
+
+/// Fetch the archive `key` from its origin, starting at byte `first`
+async fn fetch_range(client: &Client, key: &ArchiveKey, first: u64) -> std::io::Result<Bytes> {
+    let response = client
+        .get(&key.url)
+        .header(RANGE, format!("bytes={first}-"))
+        .header(IF_RANGE, &key.etag)
+        .send()
+        .await
+        .map_err(std::io::Error::other)?;
+
+    let resumed = response
+        .headers()
+        .get(CONTENT_RANGE)
+        .and_then(|range| range.to_str().ok())
+        .is_some_and(|range| range.starts_with(&format!("bytes {first}-")));
+    if response.status() != StatusCode::PARTIAL_CONTENT || !resumed {
+        return Err(std::io::Error::other(format!(
+            "{} did not send the end of the archive ({})",
+            key.url,
+            response.status()
+        )));
+    }
+
+    response.bytes().await.map_err(std::io::Error::other)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use futures::TryStreamExt;
+
+    #[test]
+    fn test_parse_range() {
+        assert_eq!(parse_range("bytes=0-", 100), Some(Ok((0, 99))));
+        assert_eq!(parse_range("bytes=10-19", 100), Some(Ok((10, 19))));
+        assert_eq!(parse_range("bytes=90-200", 100), Some(Ok((90, 99))));
+        assert_eq!(parse_range("bytes=-10", 100), Some(Ok((90, 99))));
+        assert_eq!(parse_range("bytes=100-", 100), Some(Err(())));
+        assert_eq!(parse_range("bytes=20-10", 100), Some(Err(())));
+        assert_eq!(parse_range("bytes=0-1,5-6", 100), None);
+        assert_eq!(parse_range("items=0-1", 100), None);
+    }
+
+    #[test]
+    fn test_parse_request() {
+        let request = parse_request(
+            "GET /archive HTTP/1.1\r\nHost: peer\r\nrange: bytes=5-\r\nIf-Range: \"v1\"\r\n\r\n",
+        )
+        .unwrap();
+        assert_eq!(
+            request,
+            PeerRequest {
+                head_only: false,
+                path: "/archive".to_string(),
+                range: Some("bytes=5-".to_string()),
+                if_range: Some("\"v1\"".to_string()),
+            }
+        );
+
+        assert_eq!(
+            parse_request("POST /archive HTTP/1.1\r\n\r\n"),
+            Err(StatusCode::METHOD_NOT_ALLOWED)
+        );
+        assert_eq!(
+            parse_request("garbage\r\n\r\n"),
+            Err(StatusCode::BAD_REQUEST)
+        );
+    }
+
+    /// Serve `cache` on a local port, returning the URL of its archive
+    async fn serve_locally(cache: &Arc<PeerCache>) -> String {
+        let listener = TcpListener::bind((Ipv4Addr::LOCALHOST, 0)).await.unwrap();
+        let url = format!("http://{}{ARCHIVE_PATH}", listener.local_addr().unwrap());
+        tokio::spawn(cache.clone().serve_http(listener));
+        url
+    }
+
+    /// A cache already sharing `data` as the archive of `url`
+    fn shared_cache(dir: &Path, url: &str, data: &[u8]) -> Arc<PeerCache> {
+        let key = ArchiveKey {
+            url: url.to_string(),
+            etag: "\"v1\"".to_string(),
+            size: data.len() as u64,
+        };
+        std::fs::create_dir_all(dir).unwrap();
+        std::fs::write(dir.join(ARCHIVE_FILE), data).unwrap();
+        std::fs::write(
+            dir.join(ARCHIVE_KEY_FILE),
+            serde_json::to_vec(&key).unwrap(),
+        )
+        .unwrap();
+
+        let cache = Arc::new(PeerCache::new(dir.to_path_buf(), PeerSettings::default()).unwrap());
+        assert_eq!(cache.archive(), Some(key));
+        cache
+    }
+
+    #[tokio::test]
+    async fn test_serve_archive_ranges() {
+        let dir = tempfile::tempdir().unwrap();
+        let data: Vec<u8> = (0..100_000u32).map(|i| i as u8).collect();
+        let cache = shared_cache(dir.path(), "https://example.com/update.tar", &data);
+        let url = serve_locally(&cache).await;
+        let client = Client::new();
+
+        let response = client.get(&url).send().await.unwrap();
+        assert_eq!(response.status(), StatusCode::OK);
+        assert_eq!(
+            ArchiveKey::from_response("https://example.com/update.tar", &response),
+            cache.archive()
+        );
+        assert_eq!(response.bytes().await.unwrap(), data);
+
+        let response = client
+            .get(&url)
+            .header(RANGE, "bytes=1000-")
+            .header(IF_RANGE, "\"v1\"")
+            .send()
+            .await
+            .unwrap();
+        assert_eq!(response.status(), StatusCode::PARTIAL_CONTENT);
+        assert_eq!(response.bytes().await.unwrap(), data[1000..]);
+
+        // The range of another version of the archive must not be served
+        let response = client
+            .get(&url)
+            .header(RANGE, "bytes=1000-")
+            .header(IF_RANGE, "\"v0\"")
+            .send()
+            .await
+            .unwrap();
+        assert_eq!(response.status(), StatusCode::OK);
+
+        let response = client.get(format!("{url}/other")).send().await.unwrap();
+        assert_eq!(response.status(), StatusCode::NOT_FOUND);
+    }
+
+    #[tokio::test]
+    async fn test_lan_address() {
+        let settings = PeerSettings {
+            group: Some(Ipv4Addr::LOCALHOST),
+            ..Default::default()
+        };
+        assert_eq!(settings.lan_address().await.unwrap(), Ipv4Addr::LOCALHOST);
+
+        let settings = PeerSettings {
+            address: Some(Ipv4Addr::new(192, 168, 1, 10)),
+            ..settings
+        };
+        assert_eq!(
+            settings.lan_address().await.unwrap(),
+            Ipv4Addr::new(192, 168, 1, 10)
+        );
+    }
+
+    #[tokio::test]
+    async fn test_discover_offers() {
+        let dir = tempfile::tempdir().unwrap();
+        let data = vec![1u8; 1000];
+        let url = "https://example.com/update.tar";
+        let holder = shared_cache(&dir.path().join("holder"), url, &data);
+
+        // Queries are sent to the holder directly instead of a multicast group
+        let socket = UdpSocket::bind((Ipv4Addr::LOCALHOST, 0)).await.unwrap();
+        let port = socket.local_addr().unwrap().port();
+        tokio::spawn(holder.clone().answer_queries(socket, 4242));
+
+        let settings = PeerSettings {
+            enabled: true,
+            port: Some(port),
+            group: Some(Ipv4Addr::LOCALHOST),
+            ..Default::default()
+        };
+        let cache = PeerCache::new(dir.path().join("device"), settings).unwrap();
+
+        let key = holder.archive().unwrap();
+        let peers = cache.discover(&key).await.unwrap();
+        assert_eq!(peers, vec![SocketAddr::from((Ipv4Addr::LOCALHOST, 4242))]);
+
+        let other = ArchiveKey {
+            etag: "\"v2\"".to_string(),
+            ..key
+        };
+        assert!(cache.discover(&other).await.unwrap().is_empty());
+
+        cache
+            .rejected
+            .lock()
+            .unwrap()
+            .insert(IpAddr::V4(Ipv4Addr::LOCALHOST));
+        assert!(cache
+            .discover(&holder.archive().unwrap())
+            .await
+            .unwrap()
+            .is_empty());
+    }
+
+    #[tokio::test]
+    async fn test_capture_completes_tail_from_origin() {
+        let dir = tempfile::tempdir().unwrap();
+        let data: Vec<u8> = (0..3 * CAPTURE_BUFFER_SIZE as u32 + 777)
+            .map(|i| (i % 251) as u8)
+            .collect();
+
+        // The origin is another cache serving the same archive
+        let origin = shared_cache(&dir.path().join("origin"), "unused", &data);
+        let origin_url = serve_locally(&origin).await;
+        let key = ArchiveKey {
+            url: origin_url,
+            etag: "\"v1\"".to_string(),
+            size: data.len() as u64,
+        };
+
+        let cache = PeerCache::new(dir.path().join("device"), PeerSettings::default()).unwrap();
+        let chunks: Vec<std::io::Result<Bytes>> = data
+            .chunks(64 * 1024)
+            .map(|chunk| Ok(Bytes::copy_from_slice(chunk)))
+            .collect();
+        let mut captured = cache.capture(key.clone(), None, stream::iter(chunks).boxed());
+
+        // The installation stops reading before the end of the archive
+        let mut read = 0;
+        while read < data.len() - 100_000 {
+            read += captured.try_next().await.unwrap().unwrap().len();
+        }
+        drop(captured);
+        assert_eq!(cache.archive(), None);
+
+        cache
+            .finish(&Client::new(), CaptureOutcome::Installed)
+            .await;
+        assert_eq!(cache.archive(), Some(key));
+        assert_eq!(
+            std::fs::read(dir.path().join("device").join(ARCHIVE_FILE)).unwrap(),
+            data
+        );
+
+        // The archive is shared again after a restart
+        let cache = PeerCache::new(dir.path().join("device"), PeerSettings::default()).unwrap();
+        assert!(cache.archive().is_some());
+    }
+
+    #[tokio::test]
+    async fn test_failed_capture_is_dropped() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = PeerCache::new(dir.path().to_path_buf(), PeerSettings::default()).unwrap();
+        let key = ArchiveKey {
+            url: "http://127.0.0.1:9/update.tar".to_string(),
+            etag: "\"v1\"".to_string(),
+            size: 3,
+        };
+        let peer: SocketAddr = "192.0.2.1:7969".parse().unwrap();
+
+        let chunks = vec![Ok(Bytes::from_static(b"abc"))];
+        let captured: Vec<_> = cache
+            .capture(key, Some(peer), stream::iter(chunks).boxed())
+            .collect()
+            .await;
+        assert_eq!(captured.len(), 1);
+
+        cache.finish(&Client::new(), CaptureOutcome::Failed).await;
+        assert_eq!(cache.archive(), None);
+        assert!(!dir.path().join(CAPTURE_FILE).exists());
+        assert!(cache.rejected.lock().unwrap().contains(&peer.ip()));
+    }
+}
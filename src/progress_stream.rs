@@ -19,32 +19,201 @@
 
 use std::{
     pin::Pin,
-    sync::Arc,
+    sync::{
+        atomic::{AtomicU64, AtomicU8, Ordering},
+        Arc, Mutex,
+    },
     task::{Context, Poll},
+    time::{Duration, Instant},
 };
 
 use tokio::{
     io::{AsyncRead, ReadBuf},
-    sync::RwLock,
+    sync::watch,
 };
 
-use crate::status::UpdateStatus;
+use crate::status::{UpdateProgress, UpdateStage, UpdateStatus};
+
+/// Minimum interval between two status notifications
+const STATUS_UPDATE_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Throughput samples of a stream, taken at most every [`STATUS_UPDATE_INTERVAL`]
+#[derive(Debug, Default)]
+struct RateSampler {
+    started: Option<Instant>,
+    last: Option<(Instant, u64)>,
+    rate: u64,
+}
+
+impl RateSampler {
+    fn sample(&mut self, now: Instant, bytes: u64) {
+        if let Some((time, previous)) = self.last {
+            let elapsed = now.duration_since(time).as_secs_f64();
+            if elapsed > 0.0 {
+                self.rate = (bytes.saturating_sub(previous) as f64 / elapsed) as u64;
+            }
+        }
+        self.last = Some((now, bytes));
+    }
+
+    fn average_rate(&self, now: Instant, bytes: u64) -> u64 {
+        self.started
+            .map(|started| now.duration_since(started).as_secs_f64())
+            .filter(|&elapsed| elapsed > 0.0)
+            .map(|elapsed| (bytes as f64 / elapsed) as u64)
+            .unwrap_or(0)
+    }
+}
+
+/// Progress of a stream, shared between the reader and status consumers
+///
+/// Byte counters are lock-free; the throughput is sampled under a lock by
+/// the reader at most every [`STATUS_UPDATE_INTERVAL`]. Subscribers are
+/// notified of every sample and stage change, see [`TransferProgress::subscribe`].
+#[derive(Debug)]
+pub struct TransferProgress {
+    bytes_read: AtomicU64,
+    /// Expected size of the stream, 0 if unknown
+    total_size: AtomicU64,
+    /// Current [`UpdateStage`]
+    stage: AtomicU8,
+    /// Stage entered when the payload starts streaming
+    streaming_stage: AtomicU8,
+    sampler: Mutex<RateSampler>,
+    changed: watch::Sender<()>,
+}
+
+impl Default for TransferProgress {
+    fn default() -> Self {
+        Self {
+            bytes_read: AtomicU64::default(),
+            total_size: AtomicU64::default(),
+            stage: AtomicU8::new(UpdateStage::Idle as u8),
+            streaming_stage: AtomicU8::new(UpdateStage::Downloading as u8),
+            sampler: Mutex::default(),
+            changed: watch::Sender::new(()),
+        }
+    }
+}
+
+impl TransferProgress {
+    /// Start tracking a new update request in the Checking stage
+    ///
+    /// `streaming_stage` is entered once its payload starts streaming
+    /// (Downloading or Reading, depending on the source).
+    pub fn start_request(&self, streaming_stage: UpdateStage) {
+        self.bytes_read.store(0, Ordering::Relaxed);
+        self.total_size.store(0, Ordering::Relaxed);
+        self.streaming_stage
+            .store(streaming_stage as u8, Ordering::Relaxed);
+        self.set_stage(UpdateStage::Checking);
+    }
+
+    /// Start tracking a new stream of `total_size` bytes
+    pub fn reset(&self, total_size: Option<u64>) {
+        self.bytes_read.store(0, Ordering::Relaxed);
+        self.total_size
+            .store(total_size.unwrap_or(0), Ordering::Relaxed);
+        if let Ok(mut sampler) = self.sampler.lock() {
+            *sampler = RateSampler {
+                started: Some(Instant::now()),
+                ..Default::default()
+            };
+        }
+        self.set_stage(UpdateStage::from_u8(
+            self.streaming_stage.load(Ordering::Relaxed),
+        ));
+    }
+
+    pub fn stage(&self) -> UpdateStage {
+        UpdateStage::from_u8(self.stage.load(Ordering::Relaxed))
+    }
+
+    /// Move to `stage`, notifying subscribers if it changed
+    pub fn set_stage(&self, stage: UpdateStage) {
+        if self.stage.swap(stage as u8, Ordering::Relaxed) != stage as u8 {
+            self.changed.send_replace(());
+        }
+    }
+
+    /// Wake up whenever the progress is sampled or the stage changes
+    pub fn subscribe(&self) -> watch::Receiver<()> {
+        self.changed.subscribe()
+    }
+
+    /// Current progress, with throughput and ETA
+    pub fn snapshot(&self) -> UpdateProgress {
+        let bytes_done = self.bytes_read();
+        let bytes_total = self.total_size().unwrap_or(0);
+        let (rate, average_rate) = match self.sampler.lock() {
+            Ok(sampler) => (
+                sampler.rate,
+                sampler.average_rate(Instant::now(), bytes_done),
+            ),
+            Err(_) => (0, 0),
+        };
+        let eta_seconds = match (bytes_total, average_rate) {
+            (0, _) | (_, 0) => -1,
+            (total, rate) => (total.saturating_sub(bytes_done) / rate) as i64,
+        };
+
+        UpdateProgress {
+            stage: self.stage(),
+            bytes_done,
+            bytes_total,
+            rate,
+            average_rate,
+            eta_seconds,
+        }
+    }
+
+    /// Record a throughput sample and notify subscribers
+    fn sample(&self) {
+        if let Ok(mut sampler) = self.sampler.lock() {
+            sampler.sample(Instant::now(), self.bytes_read());
+        }
+        self.changed.send_replace(());
+    }
+
+    pub fn bytes_read(&self) -> u64 {
+        self.bytes_read.load(Ordering::Relaxed)
+    }
+
+    pub fn total_size(&self) -> Option<u64> {
+        Some(self.total_size.load(Ordering::Relaxed)).filter(|&size| size > 0)
+    }
+
+    /// Progress percentage (0-100), or -1 if the total size is unknown
+    pub fn percentage(&self) -> i32 {
+        self.total_size()
+            .map(|size| ((self.bytes_read() as f64 / size as f64) * 100.0) as i32)
+            .unwrap_or(-1)
+    }
+
+    fn add(&self, bytes: u64) -> u64 {
+        self.bytes_read.fetch_add(bytes, Ordering::Relaxed) + bytes
+    }
+}
 
 /// A wrapper around AsyncRead that tracks progress
+///
+/// Every read is accounted in the shared [`TransferProgress`]; subscribers of
+/// `status_handle` are notified at most every [`STATUS_UPDATE_INTERVAL`], and
+/// only when the percentage changes.
 pub struct ProgressReader<R> {
     inner: R,
-    bytes_read: u64,
-    total_size: Option<u64>,
-    status_handle: Arc<RwLock<UpdateStatus>>,
+    progress: Arc<TransferProgress>,
+    status_handle: Option<watch::Sender<UpdateStatus>>,
     source: String,
-    last_update: std::time::Instant,
+    last_update: Option<Instant>,
 }
 
 impl<R: AsyncRead + Unpin> ProgressReader<R> {
     pub fn new(
         inner: R,
         total_size: Option<u64>,
-        status_handle: Arc<RwLock<UpdateStatus>>,
+        progress: Arc<TransferProgress>,
+        status_handle: watch::Sender<UpdateStatus>,
         source: String,
     ) -> Self {
         log::debug!(
@@ -52,26 +221,62 @@ impl<R: AsyncRead + Unpin> ProgressReader<R> {
             total_size,
             source
         );
+        progress.reset(total_size);
+
         Self {
             inner,
-            bytes_read: 0,
-            total_size,
-            status_handle,
+            progress,
+            status_handle: Some(status_handle),
             source,
-            last_update: std::time::Instant::now(),
+            last_update: None,
         }
     }
 
-    fn calculate_progress(&self) -> i32 {
-        self.total_size
-            .filter(|&size| size > 0)
-            .map(|size| ((self.bytes_read as f64 / size as f64) * 100.0) as i32)
-            .unwrap_or(-1)
+    /// Track progress in `progress` only, leaving the update status untouched
+    pub fn detached(inner: R, total_size: Option<u64>, progress: Arc<TransferProgress>) -> Self {
+        progress.reset(total_size);
+
+        Self {
+            inner,
+            progress,
+            status_handle: None,
+            source: String::new(),
+            last_update: None,
+        }
     }
 
     fn should_update(&self) -> bool {
-        // Update if 100ms has elapsed since last update
-        self.last_update.elapsed().as_millis() > 100
+        // Update immediately on first read to show progress has started,
+        // then continue updating every STATUS_UPDATE_INTERVAL
+        self.last_update
+            .is_none_or(|last| last.elapsed() > STATUS_UPDATE_INTERVAL)
+    }
+
+    fn notify_progress(&mut self) {
+        let Some(status_handle) = &self.status_handle else {
+            return;
+        };
+        let progress = self.progress.percentage();
+        let source = &self.source;
+
+        // Only wake up status subscribers when the percentage moved; the
+        // source is copied only if the status was not Installing already
+        status_handle.send_if_modified(|status| match status {
+            UpdateStatus::Installing {
+                progress: current, ..
+            } => {
+                let modified = *current != progress;
+                *current = progress;
+                modified
+            }
+            _ => {
+                *status = UpdateStatus::Installing {
+                    source: source.clone(),
+                    progress,
+                };
+                true
+            }
+        });
     }
 }
 
@@ -82,65 +287,131 @@ impl<R: AsyncRead + Unpin> AsyncRead for ProgressReader<R> {
         buf: &mut ReadBuf<'_>,
     ) -> Poll<std::io::Result<()>> {
         let before = buf.filled().len();
-        log::debug!(
-            "[PROGRESS] ProgressReader::poll_read called: before={}, capacity={}",
-            before,
-            buf.capacity()
-        );
         let result = Pin::new(&mut self.inner).poll_read(cx, buf);
 
-        if let Poll::Ready(Ok(())) = &result {
-            let reader = self.get_mut();
-            let bytes_increment = (buf.filled().len() - before) as u64;
-            let was_zero = reader.bytes_read == 0;
-            reader.bytes_read += bytes_increment;
-
-            log::debug!(
-                "[PROGRESS] ProgressReader::poll_read: bytes_read={}, increment={}, was_zero={}, total_size={:?}",
-                reader.bytes_read,
-                bytes_increment,
-                was_zero,
-                reader.total_size
-            );
-
-            // Update immediately on first read to show progress has started
-            // Then continue updating every 100ms
-            if was_zero || reader.should_update() {
-                reader.last_update = std::time::Instant::now();
-                let progress = reader.calculate_progress();
-                let status_handle = reader.status_handle.clone();
-                let source = reader.source.clone();
-
-                log::debug!(
-                    "[PROGRESS] ProgressReader: Spawning status update task: progress={}%, bytes_read={}/{:?}",
-                    progress,
-                    reader.bytes_read,
-                    reader.total_size
-                );
+        match &result {
+            Poll::Ready(Ok(())) => {
+                let reader = self.get_mut();
+                let bytes_increment = (buf.filled().len() - before) as u64;
+                reader.progress.add(bytes_increment);
+
+                // Always publish the final value at EOF
+                if bytes_increment == 0 || reader.should_update() {
+                    reader.last_update = Some(Instant::now());
+                    reader.progress.sample();
+                    reader.notify_progress();
+                }
 
-                tokio::spawn(async move {
-                    let mut status = status_handle.write().await;
-                    log::debug!("[PROGRESS] Status update task: Setting status to Installing with progress={}%", progress);
-                    *status = UpdateStatus::Installing { source, progress };
-                });
-            } else {
-                log::debug!(
-                    "[PROGRESS] ProgressReader: Skipping update (throttled): elapsed={}ms, should_update={}",
-                    reader.last_update.elapsed().as_millis(),
-                    reader.should_update()
+                // What is left is in the decompressor and receiver buffers
+                if bytes_increment == 0 && buf.remaining() > 0 {
+                    reader.progress.set_stage(UpdateStage::Receiving);
+                }
+            }
+            Poll::Ready(Err(e)) => {
+                log::warn!(
+                    "[PROGRESS] ProgressReader::poll_read: Error from inner reader: {}",
+                    e
                 );
             }
-        } else if let Poll::Ready(Err(ref e)) = &result {
-            log::warn!(
-                "[PROGRESS] ProgressReader::poll_read: Error from inner reader: {}",
-                e
-            );
-        } else {
-            log::debug!(
-                "[PROGRESS] ProgressReader::poll_read: Poll::Pending - waiting for more data"
-            );
+            Poll::Pending => {}
         }
 
         result
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio::io::AsyncReadExt;
+
+    #[tokio::test]
+    async fn test_progress_reader_counts_bytes() {
+        let data = vec![0u8; 10_000];
+        let progress = Arc::new(TransferProgress::default());
+        let (status_handle, status_rx) = watch::channel(UpdateStatus::Idle);
+
+        let mut reader = ProgressReader::new(
+            &data[..],
+            Some(data.len() as u64),
+            progress.clone(),
+            status_handle,
+            "test".to_string(),
+        );
+        let mut buffer = Vec::new();
+        reader.read_to_end(&mut buffer).await.unwrap();
+
+        assert_eq!(progress.bytes_read(), data.len() as u64);
+        assert_eq!(progress.percentage(), 100);
+        assert!(matches!(
+            &*status_rx.borrow(),
+            UpdateStatus::Installing { source, .. } if source == "test"
+        ));
+    }
+
+    #[tokio::test]
+    async fn test_progress_reader_detached() {
+        let data = vec![0u8; 4096];
+        let progress = Arc::new(TransferProgress::default());
+
+        let mut reader = ProgressReader::detached(&data[..], Some(8192), progress.clone());
+        let mut buffer = Vec::new();
+        reader.read_to_end(&mut buffer).await.unwrap();
+
+        assert_eq!(progress.bytes_read(), data.len() as u64);
+        assert_eq!(progress.percentage(), 50);
+    }
+
+    #[tokio::test]
+    async fn test_progress_stages_and_rate() {
+        let data = vec![0u8; 64 * 1024];
+        let progress = Arc::new(TransferProgress::default());
+        let mut changed = progress.subscribe();
+
+        progress.start_request(UpdateStage::Reading);
+        assert_eq!(progress.stage(), UpdateStage::Checking);
+        assert!(changed.has_changed().unwrap());
+        changed.mark_unchanged();
+
+        let mut reader =
+            ProgressReader::detached(&data[..], Some(data.len() as u64), progress.clone());
+        assert_eq!(progress.stage(), UpdateStage::Reading);
+
+        let mut buffer = Vec::new();
+        reader.read_to_end(&mut buffer).await.unwrap();
+        assert!(changed.has_changed().unwrap());
+
+        let snapshot = progress.snapshot();
+        assert_eq!(snapshot.stage, UpdateStage::Receiving);
+        assert_eq!(snapshot.bytes_done, data.len() as u64);
+        assert_eq!(snapshot.bytes_total, data.len() as u64);
+        assert_eq!(snapshot.eta_seconds, 0);
+    }
+
+    #[test]
+    fn test_rate_sampler() {
+        let start = Instant::now();
+        let mut sampler = RateSampler {
+            started: Some(start),
+            ..Default::default()
+        };
+
+        sampler.sample(start, 0);
+        sampler.sample(start + Duration::from_secs(2), 4000);
+        assert_eq!(sampler.rate, 2000);
+        assert_eq!(
+            sampler.average_rate(start + Duration::from_secs(4), 4000),
+            1000
+        );
+    }
+
+    #[test]
+    fn test_progress_unknown_size() {
+        let progress = TransferProgress::default();
+        progress.reset(None);
+        progress.add(42);
+        assert_eq!(progress.total_size(), None);
+        assert_eq!(progress.percentage(), -1);
+        assert_eq!(progress.snapshot().eta_seconds, -1);
+    }
+}
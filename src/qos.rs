@@ -0,0 +1,452 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Resource limits of the update pipeline, so that background updates do not
+//! disturb the applications running in the foreground.
+//!
+//! A [`QosProfile`] is read from the configuration. Its download rate and
+//! the pause state live in a [`Governor`] shared by the service and every
+//! [`GovernedReader`] of an update. Its scheduling priorities are a
+//! [`ProcessPriority`], applied to the child processes and to the thread of
+//! the native receiver.
+
+use std::{
+    future::Future,
+    path::PathBuf,
+    pin::Pin,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex,
+    },
+    task::{ready, Context, Poll},
+    time::Duration,
+};
+
+use log::warn;
+use serde::{Deserialize, Serialize};
+use tokio::io::{AsyncRead, ReadBuf};
+use tokio::sync::Notify;
+use tokio::time::Instant;
+
+/// Minimum default burst of a download rate limit
+const MIN_DOWNLOAD_BURST: u64 = 64 * 1024;
+
+/// Shift of the class in an I/O priority, see ioprio_set(2)
+const IOPRIO_CLASS_SHIFT: i32 = 13;
+
+/// `which` argument of ioprio_set(2) selecting a thread
+const IOPRIO_WHO_PROCESS: libc::c_int = 1;
+
+/// Lowest priority within an I/O class
+const IOPRIO_LOWEST: u8 = 7;
+
+/// I/O scheduling class, see ioprio_set(2)
+#[derive(Serialize, Deserialize, Clone, Copy, PartialEq, Eq, Debug)]
+#[serde(rename_all = "kebab-case")]
+pub enum IoClass {
+    RealTime = 1,
+    BestEffort = 2,
+    Idle = 3,
+}
+
+/// QoS profile of the update pipeline, as configured
+#[derive(Serialize, Deserialize, Default, Clone, PartialEq, Debug)]
+pub struct QosProfile {
+    // Maximum download rate in bytes per second (0 or absent is unlimited).
+    download_rate: Option<u64>,
+
+    // Bytes that can be downloaded at once above the rate, by default one second worth.
+    download_burst: Option<u64>,
+
+    // Nice level of the pipeline processes and threads.
+    nice: Option<i32>,
+
+    // I/O scheduling class of the pipeline processes and threads.
+    io_class: Option<IoClass>,
+
+    // Priority within io_class, from 0 (highest) to 7 (lowest, the default).
+    io_priority: Option<u8>,
+
+    // cgroup (v2) directory the child processes are moved into.
+    cgroup: Option<PathBuf>,
+}
+
+impl QosProfile {
+    /// Return the download rate limit and burst in bytes, if any
+    pub fn download_limit(&self) -> Option<(u64, u64)> {
+        let rate = self.download_rate.filter(|rate| *rate > 0)?;
+        let burst = self.download_burst.unwrap_or(rate).max(MIN_DOWNLOAD_BURST);
+
+        Some((rate, burst))
+    }
+
+    pub fn process_priority(&self) -> ProcessPriority {
+        ProcessPriority {
+            nice: self.nice,
+            io_priority: self.io_class.map(|class| {
+                ((class as i32) << IOPRIO_CLASS_SHIFT)
+                    | self.io_priority.unwrap_or(IOPRIO_LOWEST).min(IOPRIO_LOWEST) as i32
+            }),
+            cgroup: self.cgroup.clone(),
+        }
+    }
+}
+
+/// Scheduling priorities of the processes and threads of the update pipeline
+///
+/// The default leaves every priority unchanged.
+#[derive(Clone, Default, PartialEq, Debug)]
+pub struct ProcessPriority {
+    nice: Option<i32>,
+    /// Encoded as for ioprio_set(2)
+    io_priority: Option<i32>,
+    cgroup: Option<PathBuf>,
+}
+
+fn set_nice(nice: i32) -> std::io::Result<()> {
+    // The nice value of PRIO_PROCESS 0 is the one of the calling thread on Linux
+    match unsafe { libc::setpriority(libc::PRIO_PROCESS, 0, nice) } {
+        0 => Ok(()),
+        _ => Err(std::io::Error::last_os_error()),
+    }
+}
+
+fn set_io_priority(io_priority: i32) -> std::io::Result<()> {
+    match unsafe { libc::syscall(libc::SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, io_priority) } {
+        0 => Ok(()),
+        _ => Err(std::io::Error::last_os_error()),
+    }
+}
+
+impl ProcessPriority {
+    /// Make the process spawned by `cmd` start with these priorities
+    pub fn apply_to_command(&self, cmd: &mut tokio::process::Command) {
+        let (nice, io_priority) = (self.nice, self.io_priority);
+        if nice.is_none() && io_priority.is_none() {
+            return;
+        }
+
+        // SAFETY: the closure only makes async-signal-safe syscalls
+        unsafe {
+            cmd.pre_exec(move || {
+                if let Some(nice) = nice {
+                    set_nice(nice)?;
+                }
+                if let Some(io_priority) = io_priority {
+                    set_io_priority(io_priority)?;
+                }
+                Ok(())
+            });
+        }
+    }
+
+    /// Move the spawned process `pid` into the configured cgroup, if any
+    ///
+    /// A process that can't be moved keeps running where it is.
+    pub fn place(&self, pid: Option<u32>) {
+        let (Some(cgroup), Some(pid)) = (&self.cgroup, pid) else {
+            return;
+        };
+
+        if let Err(e) = std::fs::write(cgroup.join("cgroup.procs"), pid.to_string()) {
+            warn!("Failed to move process {pid} into cgroup {:?}: {e}", cgroup);
+        }
+    }
+
+    /// Apply these priorities to the calling thread until the guard is dropped
+    ///
+    /// Used by threads borrowed from a pool, which must give them back with
+    /// their original priorities.
+    pub fn apply_to_current_thread(&self) -> ThreadPriorityGuard {
+        let mut guard = ThreadPriorityGuard::default();
+
+        if let Some(nice) = self.nice {
+            // -1 is also a valid nice value: errno tells errors apart
+            unsafe { *libc::__errno_location() = 0 };
+            let previous = unsafe { libc::getpriority(libc::PRIO_PROCESS, 0) };
+            match std::io::Error::last_os_error().raw_os_error() {
+                Some(0) => match set_nice(nice) {
+                    Ok(()) => guard.nice = Some(previous),
+                    Err(e) => warn!("Failed to set the nice level of the receiver: {e}"),
+                },
+                _ => warn!("Failed to get the nice level of the receiver"),
+            }
+        }
+
+        if let Some(io_priority) = self.io_priority {
+            let previous =
+                unsafe { libc::syscall(libc::SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0) } as i32;
+            if previous < 0 {
+                warn!("Failed to get the I/O priority of the receiver");
+            } else {
+                match set_io_priority(io_priority) {
+                    Ok(()) => guard.io_priority = Some(previous),
+                    Err(e) => warn!("Failed to set the I/O priority of the receiver: {e}"),
+                }
+            }
+        }
+
+        guard
+    }
+}
+
+/// Restores the priorities of a thread changed by [`ProcessPriority::apply_to_current_thread`]
+#[derive(Default)]
+pub struct ThreadPriorityGuard {
+    nice: Option<i32>,
+    io_priority: Option<i32>,
+}
+
+impl Drop for ThreadPriorityGuard {
+    fn drop(&mut self) {
+        if let Some(nice) = self.nice {
+            if let Err(e) = set_nice(nice) {
+                warn!("Failed to restore the nice level of a thread: {e}");
+            }
+        }
+        if let Some(io_priority) = self.io_priority {
+            if let Err(e) = set_io_priority(io_priority) {
+                warn!("Failed to restore the I/O priority of a thread: {e}");
+            }
+        }
+    }
+}
+
+/// A token bucket refilled at `rate` bytes per second, holding up to `burst` bytes
+#[derive(Debug)]
+struct TokenBucket {
+    rate: f64,
+    burst: f64,
+    /// Available bytes, negative when readers are in debt, and when they were counted
+    state: Mutex<(f64, Instant)>,
+}
+
+impl TokenBucket {
+    fn new(rate: u64, burst: u64) -> Self {
+        Self {
+            rate: rate as f64,
+            burst: burst as f64,
+            state: Mutex::new((burst as f64, Instant::now())),
+        }
+    }
+
+    /// Take `bytes` tokens, returning how long to wait for the bucket to be
+    /// out of debt again
+    fn take(&self, bytes: usize) -> Option<Duration> {
+        let mut state = self.state.lock().unwrap();
+        let (tokens, updated) = &mut *state;
+
+        let now = Instant::now();
+        *tokens = (*tokens + now.duration_since(*updated).as_secs_f64() * self.rate)
+            .min(self.burst)
+            - bytes as f64;
+        *updated = now;
+
+        match *tokens < 0.0 {
+            true => Some(Duration::from_secs_f64(-*tokens / self.rate)),
+            false => None,
+        }
+    }
+}
+
+/// Download rate limit and pause state shared by the readers of the update pipeline
+#[derive(Debug, Default)]
+pub struct Governor {
+    bucket: Option<TokenBucket>,
+    paused: AtomicBool,
+    resumed: Notify,
+}
+
+impl Governor {
+    pub fn new(profile: &QosProfile) -> Self {
+        Self {
+            bucket: profile
+                .download_limit()
+                .map(|(rate, burst)| TokenBucket::new(rate, burst)),
+            ..Default::default()
+        }
+    }
+
+    /// Stop the readers of the pipeline before their next read
+    ///
+    /// Returns false if the pipeline was already paused.
+    pub fn pause(&self) -> bool {
+        !self.paused.swap(true, Ordering::SeqCst)
+    }
+
+    /// Let paused readers go on
+    ///
+    /// Returns false if the pipeline was not paused.
+    pub fn resume(&self) -> bool {
+        let was_paused = self.paused.swap(false, Ordering::SeqCst);
+        self.resumed.notify_waiters();
+        was_paused
+    }
+
+    pub fn is_paused(&self) -> bool {
+        self.paused.load(Ordering::SeqCst)
+    }
+
+    /// Wait until the pipeline is not paused
+    async fn wait_resumed(self: Arc<Self>) {
+        loop {
+            // Registered before checking, so that a resume in between is not missed
+            let resumed = self.resumed.notified();
+            if !self.is_paused() {
+                return;
+            }
+            resumed.await;
+        }
+    }
+}
+
+/// A wrapper around AsyncRead that stops while its [`Governor`] is paused and,
+/// for downloads, keeps under its rate limit
+///
+/// The reads of everything downstream (decompressors, `xz`, `btrfs receive`)
+/// wait for this reader, so pausing it pauses the whole pipeline.
+pub struct GovernedReader<R> {
+    inner: R,
+    governor: Arc<Governor>,
+    limit_rate: bool,
+    /// Wait for a resume, or for the bucket to refill, before the next read
+    wait: Option<Pin<Box<dyn Future<Output = ()> + Send>>>,
+}
+
+impl<R: AsyncRead + Unpin> GovernedReader<R> {
+    /// Wrap a download, subject to both the pause and the rate limit
+    pub fn download(inner: R, governor: Arc<Governor>) -> Self {
+        Self {
+            inner,
+            governor,
+            limit_rate: true,
+            wait: None,
+        }
+    }
+
+    /// Wrap a local source, only subject to the pause
+    pub fn local(inner: R, governor: Arc<Governor>) -> Self {
+        Self {
+            limit_rate: false,
+            ..Self::download(inner, governor)
+        }
+    }
+}
+
+impl<R: AsyncRead + Unpin> AsyncRead for GovernedReader<R> {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut ReadBuf<'_>,
+    ) -> Poll<std::io::Result<()>> {
+        loop {
+            if let Some(wait) = self.wait.as_mut() {
+                ready!(wait.as_mut().poll(cx));
+                self.wait = None;
+            }
+
+            if !self.governor.is_paused() {
+                break;
+            }
+            self.wait = Some(Box::pin(self.governor.clone().wait_resumed()));
+        }
+
+        let filled = buf.filled().len();
+        ready!(Pin::new(&mut self.inner).poll_read(cx, buf))?;
+        let read = buf.filled().len() - filled;
+
+        if self.limit_rate && read > 0 {
+            let delay = self.governor.bucket.as_ref().and_then(|b| b.take(read));
+            if let Some(delay) = delay {
+                self.wait = Some(Box::pin(tokio::time::sleep(delay)));
+            }
+        }
+
+        Poll::Ready(Ok(()))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio::io::AsyncReadExt;
+
+    fn profile(json: &str) -> QosProfile {
+        serde_json::from_str(json).unwrap()
+    }
+
+    #[test]
+    fn test_qos_profile_defaults() {
+        let profile = profile("{}");
+        assert_eq!(profile.download_limit(), None);
+        assert_eq!(profile.process_priority(), ProcessPriority::default());
+
+        let profile = self::profile(r#"{"download_rate": 1000, "io_class": "idle"}"#);
+        assert_eq!(profile.download_limit(), Some((1000, MIN_DOWNLOAD_BURST)));
+        assert_eq!(
+            profile.process_priority().io_priority,
+            Some((3 << IOPRIO_CLASS_SHIFT) | 7)
+        );
+
+        let profile = self::profile(r#"{"io_class": "best-effort", "io_priority": 2}"#);
+        assert_eq!(
+            profile.process_priority().io_priority,
+            Some((2 << IOPRIO_CLASS_SHIFT) | 2)
+        );
+    }
+
+    #[tokio::test]
+    async fn test_governed_reader_rate_limit() {
+        let governor = Arc::new(Governor::new(&profile(
+            r#"{"download_rate": 1000000, "download_burst": 100000}"#,
+        )));
+        let data = vec![1u8; 300_000];
+        let mut reader = GovernedReader::download(&data[..], governor);
+
+        // The burst is read at once, the rest at the rate
+        let start = Instant::now();
+        let mut buffer = Vec::new();
+        reader.read_to_end(&mut buffer).await.unwrap();
+
+        assert_eq!(buffer, data);
+        let elapsed = start.elapsed();
+        assert!(elapsed >= Duration::from_millis(190), "{elapsed:?}");
+        assert!(elapsed < Duration::from_secs(1), "{elapsed:?}");
+    }
+
+    #[tokio::test]
+    async fn test_governed_reader_pause() {
+        let governor = Arc::new(Governor::default());
+        let data = vec![2u8; 1000];
+        let mut reader = GovernedReader::local(&data[..], governor.clone());
+
+        assert!(governor.pause());
+        assert!(!governor.pause());
+        let mut buffer = [0u8; 100];
+        let paused =
+            tokio::time::timeout(Duration::from_millis(20), reader.read(&mut buffer)).await;
+        assert!(paused.is_err(), "a paused reader must not read");
+
+        assert!(governor.resume());
+        assert!(!governor.resume());
+        let mut buffer = Vec::new();
+        reader.read_to_end(&mut buffer).await.unwrap();
+        assert_eq!(buffer, data);
+    }
+}
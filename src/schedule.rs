@@ -0,0 +1,186 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Timing of the periodic update checks
+//!
+//! Checks are spaced by a fixed interval plus a random jitter, so that a
+//! fleet of devices started at the same time does not query the update server
+//! in lockstep. A failed check is retried sooner, with a delay doubling at
+//! every consecutive failure up to a configured maximum.
+
+use std::time::Duration;
+
+/// Interval the default jitter and maximum backoff are derived from when
+/// only checking at startup
+pub const DEFAULT_CHECK_INTERVAL: Duration = Duration::from_secs(6 * 60 * 60);
+
+/// Delay before retrying the first failed update check, doubled at every
+/// consecutive failure
+pub const DEFAULT_CHECK_RETRY_DELAY: Duration = Duration::from_secs(60);
+
+/// Delay of the first update check after the service started
+pub const STARTUP_CHECK_DELAY: Duration = Duration::from_millis(500);
+
+/// Upper bound of the jitter added to the first update check
+pub const MAX_STARTUP_CHECK_JITTER: Duration = Duration::from_secs(30);
+
+/// Schedule of the periodic update checks
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct CheckSchedule {
+    interval: Option<Duration>,
+    jitter: Duration,
+    retry_delay: Duration,
+    max_backoff: Duration,
+    failures: u32,
+}
+
+impl CheckSchedule {
+    /// Check every `interval` (only once at startup if `None`), delaying each
+    /// check by up to `jitter` and retrying failures after at most `max_backoff`.
+    pub fn new(interval: Option<Duration>, jitter: Duration, max_backoff: Duration) -> Self {
+        Self {
+            interval,
+            jitter,
+            retry_delay: DEFAULT_CHECK_RETRY_DELAY.min(max_backoff),
+            max_backoff,
+            failures: 0,
+        }
+    }
+
+    /// Interval between successful checks, `None` when only checking at startup
+    pub fn interval(&self) -> Option<Duration> {
+        self.interval
+    }
+
+    /// Number of consecutive failed checks
+    pub fn failures(&self) -> u32 {
+        self.failures
+    }
+
+    /// Record the outcome of a check
+    pub fn record(&mut self, succeeded: bool) {
+        self.failures = match succeeded {
+            true => 0,
+            false => self.failures.saturating_add(1),
+        };
+    }
+
+    /// Delay of the first check after startup
+    pub fn first_delay(&self) -> Duration {
+        STARTUP_CHECK_DELAY + random_up_to(self.jitter.min(MAX_STARTUP_CHECK_JITTER))
+    }
+
+    /// Delay before the next check, without jitter, or `None` if no more
+    /// checks are scheduled
+    ///
+    /// Failures are retried even when only checking at startup, so that a
+    /// device booted while offline still gets its update.
+    pub fn base_delay(&self) -> Option<Duration> {
+        match self.failures {
+            0 => self.interval,
+            failures => {
+                let backoff = self.retry_delay.saturating_mul(1 << (failures - 1).min(31));
+                Some(backoff.min(self.max_backoff))
+            }
+        }
+    }
+
+    /// Delay before the next check, or `None` if no more checks are scheduled
+    ///
+    /// The jitter never exceeds the delay itself, so that quick retries are
+    /// not pushed back by the jitter meant for the regular interval.
+    pub fn next_delay(&self) -> Option<Duration> {
+        self.base_delay()
+            .map(|delay| delay + random_up_to(self.jitter.min(delay)))
+    }
+}
+
+/// A uniformly distributed random duration in `0..=max`, in milliseconds
+fn random_up_to(max: Duration) -> Duration {
+    let max = max.as_millis().min(u64::MAX as u128) as u64;
+    match max {
+        0 => Duration::ZERO,
+        max => Duration::from_millis(rand::random::<u64>() % (max + 1)),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const HOUR: Duration = Duration::from_secs(60 * 60);
+
+    #[test]
+    fn test_interval_after_success() {
+        let mut schedule = CheckSchedule::new(Some(HOUR), Duration::ZERO, HOUR);
+        assert_eq!(schedule.next_delay(), Some(HOUR));
+
+        schedule.record(false);
+        schedule.record(true);
+        assert_eq!(schedule.failures(), 0);
+        assert_eq!(schedule.next_delay(), Some(HOUR));
+    }
+
+    #[test]
+    fn test_exponential_backoff() {
+        let mut schedule = CheckSchedule::new(Some(HOUR), Duration::ZERO, Duration::from_secs(240));
+
+        let delays: Vec<_> = (0..5)
+            .map(|_| {
+                schedule.record(false);
+                schedule.base_delay().unwrap().as_secs()
+            })
+            .collect();
+        assert_eq!(delays, [60, 120, 240, 240, 240]);
+
+        // Long outages must not overflow the backoff
+        for _ in 0..100 {
+            schedule.record(false);
+        }
+        assert_eq!(schedule.base_delay(), Some(Duration::from_secs(240)));
+    }
+
+    #[test]
+    fn test_jitter_bounds() {
+        let mut schedule = CheckSchedule::new(Some(HOUR), Duration::from_secs(600), HOUR);
+        for _ in 0..100 {
+            let delay = schedule.next_delay().unwrap();
+            assert!(delay >= HOUR && delay <= HOUR + Duration::from_secs(600));
+
+            let first = schedule.first_delay();
+            assert!(first >= STARTUP_CHECK_DELAY);
+            assert!(first <= STARTUP_CHECK_DELAY + MAX_STARTUP_CHECK_JITTER);
+        }
+
+        // Retries are jittered by at most their own delay
+        schedule.record(false);
+        for _ in 0..100 {
+            assert!(schedule.next_delay().unwrap() <= 2 * DEFAULT_CHECK_RETRY_DELAY);
+        }
+    }
+
+    #[test]
+    fn test_startup_only() {
+        let mut schedule = CheckSchedule::new(None, Duration::ZERO, HOUR);
+        assert_eq!(schedule.next_delay(), None);
+
+        schedule.record(false);
+        assert_eq!(schedule.next_delay(), Some(DEFAULT_CHECK_RETRY_DELAY));
+    }
+}
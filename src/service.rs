@@ -17,40 +17,66 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
-use crate::core::{install_update, receive_btrfs_stream};
-use crate::progress_stream::ProgressReader;
-use crate::status::UpdateStatus;
-use crate::{btrfs::Btrfs, config::Config, ServiceError};
+use crate::boot_info::{kernel_boot_id, BootInfo, BOOT_INFO_PATH};
+use crate::cancel_stream::CancellableReader;
+use crate::chunked_hash::ChunkVerifyingReader;
+use crate::core::{
+    commit_staged_update, discard_staged_update, install_update, receive_btrfs_stream,
+    stage_update, verify_chunk_table, verify_data_signature, Decompressor, ReceiveOptions,
+    Receiver, StagedDeployment,
+};
+use crate::download::{http_client, ArchiveValidators, ResumableDownload, SegmentedDownload};
+use crate::metrics::{
+    MeteredReader, PipelineMetrics, PipelineStage, StageSnapshot, PIPELINE_STAGES,
+};
+use crate::package::PackageIndex;
+use crate::peer::{ArchiveKey, CaptureOutcome, PeerCache};
+use crate::progress_stream::{ProgressReader, TransferProgress};
+use crate::qos::{GovernedReader, Governor};
+use crate::schedule::CheckSchedule;
+use crate::status::{UpdateProgress, UpdateStage, UpdateStatus};
+use crate::update_queue::{Cancellation, UpdateQueue};
+use crate::{
+    btrfs::{Btrfs, Deployment},
+    config::Config,
+    ServiceError,
+};
 use futures::TryStreamExt;
 use log::{debug, error, info, warn};
-use reqwest::Client;
+use reqwest::{Client, StatusCode};
 use rsa::{pkcs1::DecodeRsaPublicKey, RsaPublicKey};
+use std::collections::HashMap;
+use std::io::SeekFrom;
 use std::os::unix::fs::PermissionsExt;
+use std::path::Path;
 use std::pin::Pin;
 use std::sync::Arc;
 use tokio::fs::File;
-use tokio::io::{AsyncRead, AsyncReadExt, BufReader};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncSeekExt, BufReader};
 use tokio::process::Command;
-use tokio::sync::mpsc;
+use tokio::sync::{broadcast, mpsc, oneshot, watch};
 use tokio::{sync::RwLock, task::JoinHandle};
 use tokio_stream::StreamExt;
 use tokio_tar::Archive;
 use tokio_util::io::StreamReader;
+use tokio_util::sync::CancellationToken;
 
-/// Represents the source of an update
-#[derive(Debug, Clone)]
-pub enum UpdateSource {
-    /// Update from a URL
-    Url(String),
-    /// Update from a file path
-    File(std::path::PathBuf),
-}
+pub use crate::update_queue::{
+    RequestEvent, RequestId, RequestPriority, Submission, UpdateRequest, UpdateSource,
+};
 
-/// A request to install an update
-#[derive(Debug, Clone)]
-pub struct UpdateRequest {
-    pub source: UpdateSource,
-}
+/// Request header advertising the UUID of the running deployment, so that
+/// update servers can serve an incremental update against it
+pub const DEPLOYMENT_UUID_HEADER: &str = "X-Embuer-Deployment-UUID";
+
+/// Time a cancelled update is given to stop its stages and delete what it received
+const CANCEL_GRACE_PERIOD: std::time::Duration = std::time::Duration::from_secs(10);
+
+/// Uninstall scripts of old deployments run at the same time
+const UNINSTALL_SCRIPT_CONCURRENCY: usize = 4;
+
+/// Estimated ratio between the size of a received deployment and its compressed payload
+const PAYLOAD_EXPANSION_ESTIMATE: u64 = 4;
 
 /// Information about a pending update awaiting confirmation
 #[derive(Debug, Clone)]
@@ -65,7 +91,11 @@ pub struct ServiceInner {
     notify: Arc<tokio::sync::Notify>,
     rootfs_dir: std::path::PathBuf,
     deployments_dir: std::path::PathBuf,
-    update_status: Arc<RwLock<UpdateStatus>>,
+    update_status: watch::Sender<UpdateStatus>,
+    /// Bytes read of the update being installed, read on demand by status queries
+    transfer_progress: Arc<TransferProgress>,
+    /// Metrics of the stages of the last update pipeline
+    pipeline_metrics: Arc<PipelineMetrics>,
     /// The default subvolume ID when the service started.
     /// This is the currently running deployment and must NEVER be deleted,
     /// even if a new update has changed the default subvolume.
@@ -73,11 +103,59 @@ pub struct ServiceInner {
     /// The deployment name (path inside deployment_dir) of the booted deployment.
     /// This corresponds to the deployment with subvolume ID matching boot_id.
     boot_name: String,
+    /// The UUID the booted deployment was received from, when incremental
+    /// updates can be applied on top of it.
+    boot_uuid: Option<String>,
     /// Pending update awaiting confirmation (when auto_install_updates is false)
     pending_update: Arc<RwLock<Option<PendingUpdate>>>,
     /// Channel to send confirmation decisions (true = accept, false = reject)
     confirmation_tx: mpsc::Sender<bool>,
     confirmation_rx: Arc<RwLock<Option<mpsc::Receiver<bool>>>>,
+    /// Cancels the update request being processed
+    cancel_token: std::sync::Mutex<CancellationToken>,
+    /// HTTP client reused by every check, keeping connections and TLS sessions
+    http_client: Client,
+    /// Removal of the deployments superseded by the last update, running in the background
+    cleanup_job: std::sync::Mutex<Option<JoinHandle<usize>>>,
+    /// Download rate limit and pause state of the update pipeline
+    governor: Arc<Governor>,
+    /// Archive shared with the LAN peers, when enabled
+    peers: Option<Arc<PeerCache>>,
+}
+
+/// Archive entries holding the full deployment image
+const FULL_PAYLOAD_ENTRIES: [&str; 2] = ["update.btrfs.xz", "update.btrfs.zst"];
+
+/// Archive entries holding an incremental stream against `update.parent`
+const DELTA_PAYLOAD_ENTRIES: [&str; 2] = ["update.delta.btrfs.xz", "update.delta.btrfs.zst"];
+
+/// Archive entries describing the update, read before its payload
+const METADATA_ENTRIES: [&str; 4] = [
+    "CHANGELOG",
+    "update.parent",
+    "update.signature",
+    "update.delta.signature",
+];
+
+/// Small signed archive entries (chunk tables of the payloads and the zstd
+/// dictionary), each followed by its `.signature`
+const SIGNED_ENTRIES: [&str; 6] = [
+    "update.chunks",
+    "update.chunks.signature",
+    "update.delta.chunks",
+    "update.delta.chunks.signature",
+    "update.zstd.dict",
+    "update.zstd.dict.signature",
+];
+
+/// Take the signed entry `name` and its signature, if both were found in the archive
+fn signed_entry(
+    signed_files: &mut HashMap<String, Vec<u8>>,
+    name: &str,
+) -> Option<(Vec<u8>, Vec<u8>)> {
+    let data = signed_files.remove(name);
+    let signature = signed_files.remove(&format!("{name}.signature"));
+    data.zip(signature)
 }
 
 /// Extract version from changelog content
@@ -106,18 +184,35 @@ fn extract_version_from_changelog(changelog: &str) -> String {
 impl ServiceInner {
     pub async fn receive_btrfs_stream<R>(
         &self,
-        _btrfs: &Btrfs,
+        btrfs: &Btrfs,
+        options: ReceiveOptions,
         input_stream: R,
     ) -> Result<Option<String>, ServiceError>
     where
         R: AsyncRead + Unpin + Send + 'static,
     {
-        receive_btrfs_stream(self.deployments_dir.clone(), input_stream).await
+        receive_btrfs_stream(btrfs, self.deployments_dir.clone(), options, input_stream).await
+    }
+
+    /// Replace the cancellation token with the one of a new request
+    fn set_cancel_token(&self, token: &CancellationToken) {
+        if let Ok(mut current) = self.cancel_token.lock() {
+            *current = token.clone();
+        }
     }
 
     /// Set status helper
-    async fn set_status(&self, status: UpdateStatus) {
-        *self.update_status.write().await = status;
+    ///
+    /// Subscribers are only woken up when the status actually changes.
+    fn set_status(&self, status: UpdateStatus) {
+        self.update_status.send_if_modified(|current| {
+            if *current == status {
+                return false;
+            }
+
+            *current = status;
+            true
+        });
     }
 }
 
@@ -127,9 +222,10 @@ pub struct Service {
 
     btrfs: Arc<Btrfs>,
 
-    update_tx: mpsc::Sender<UpdateRequest>,
+    update_queue: Arc<UpdateQueue>,
     update_request_loop: Option<JoinHandle<()>>,
     periodic_url_checker: Option<JoinHandle<()>>,
+    peer_server: Option<JoinHandle<()>>,
 }
 
 impl Drop for Service {
@@ -161,30 +257,55 @@ impl Service {
             Err(_) => return Err(ServiceError::PubKeyImportError),
         };
 
+        let http_client =
+            http_client().map_err(|e| ServiceError::IOError(std::io::Error::other(e)))?;
+
         let notify = Arc::new(tokio::sync::Notify::new());
-        let update_status = Arc::new(RwLock::new(UpdateStatus::Idle));
+        let (update_status, _) = watch::channel(UpdateStatus::Idle);
 
         // CRITICAL: Record the default subvolume ID at service startup.
         // This is the currently running deployment and must NEVER be deleted,
         // even if subsequent updates change the default subvolume.
         // Deleting the running deployment would crash the system!
-        let boot_id = btrfs.subvolume_get_default(&rootfs_dir)?;
-        info!("Service starting - running deployment has subvolume ID: {boot_id}");
-
-        // Find the deployment name that corresponds to this boot_id
-        let boot_name = {
-            let deployments = btrfs.list_deployment_subvolumes(&deployments_dir)?;
-            deployments
-                .into_iter()
-                .find(|(_, id, _)| *id == boot_id)
-                .map(|(name, _, _)| name)
-                .ok_or_else(|| {
-                    ServiceError::BtrfsError(format!(
-                        "Could not find deployment for running subvolume ID {boot_id}"
-                    ))
-                })?
+        // A restart within the same boot reads it back: by then the default
+        // subvolume may already be the update waiting for the next boot.
+        let kernel_boot_id = kernel_boot_id()
+            .inspect_err(|err| warn!("Failed to read the kernel boot ID: {err}"))
+            .ok();
+        let cached_boot_info = kernel_boot_id
+            .as_deref()
+            .and_then(|id| BootInfo::load(Path::new(BOOT_INFO_PATH), id, &rootfs_dir))
+            .filter(|boot_info| deployments_dir.join(boot_info.name()).is_dir());
+        let boot_info = match cached_boot_info {
+            Some(boot_info) => {
+                info!("Service starting - running deployment recorded earlier in this boot");
+                boot_info
+            }
+            None => {
+                let boot_info = Self::find_boot_info(
+                    &btrfs,
+                    kernel_boot_id.clone().unwrap_or_default(),
+                    &rootfs_dir,
+                    &deployments_dir,
+                )?;
+                if kernel_boot_id.is_some() {
+                    if let Err(err) = boot_info.save(Path::new(BOOT_INFO_PATH)) {
+                        warn!("Failed to record the running deployment in {BOOT_INFO_PATH}: {err}");
+                    }
+                }
+                boot_info
+            }
         };
+
+        let boot_id = boot_info.subvolume_id();
+        let boot_name = boot_info.name().to_string();
+        let boot_uuid = boot_info.uuid().map(str::to_string);
+        info!("Service starting - running deployment has subvolume ID: {boot_id}");
         info!("Service starting - running deployment name: {boot_name}");
+        match &boot_uuid {
+            Some(uuid) => info!("Service starting - running deployment UUID: {uuid}"),
+            None => info!("Running deployment cannot be the parent of incremental updates"),
+        }
 
         // Create confirmation channel for update approval
         // SECURITY: Minimal capacity of 1 (smallest allowed) limits confirmation buffering
@@ -192,63 +313,168 @@ impl Service {
         let (confirmation_tx, confirmation_rx) = mpsc::channel::<bool>(1);
         let pending_update = Arc::new(RwLock::new(None));
 
+        let peers = match config.peer_cache().enabled() {
+            true => Some(Arc::new(PeerCache::new(
+                config.peer_cache_dir()?,
+                config.peer_cache().clone(),
+            )?)),
+            false => None,
+        };
+
         let service_data = Arc::new(RwLock::new(ServiceInner {
             pubkey,
             notify,
             rootfs_dir,
             deployments_dir,
             update_status,
+            transfer_progress: Arc::new(TransferProgress::default()),
+            pipeline_metrics: Arc::new(PipelineMetrics::default()),
             boot_id,
             boot_name,
+            boot_uuid,
             pending_update,
             confirmation_tx,
             confirmation_rx: Arc::new(RwLock::new(Some(confirmation_rx))),
+            cancel_token: std::sync::Mutex::new(CancellationToken::new()),
+            http_client,
+            cleanup_job: std::sync::Mutex::new(None),
+            governor: Arc::new(Governor::new(config.qos())),
+            peers: peers.clone(),
         }));
 
         let btrfs = Arc::new(btrfs);
 
-        // Create channel for update requests (from DBus, periodic checker, etc.)
-        let (update_tx, update_rx) = mpsc::channel::<UpdateRequest>(10);
+        // Queue of the update requests (from DBus, periodic checker, etc.)
+        let update_queue = Arc::new(UpdateQueue::new());
 
         // Spawn the main update request loop that processes all update requests from the channel
         let update_request_loop = Some({
             let service_data_clone = service_data.clone();
             let btrfs_clone = btrfs.clone();
             let config_clone = config.clone();
+            let update_queue_clone = update_queue.clone();
             tokio::spawn(async move {
-                Self::update_request_loop(service_data_clone, btrfs_clone, update_rx, config_clone)
-                    .await
+                Self::update_request_loop(
+                    service_data_clone,
+                    btrfs_clone,
+                    update_queue_clone,
+                    config_clone,
+                )
+                .await
             })
         });
 
         // Spawn the periodic URL checker if update_url is configured
-        // This task simply sends update requests to the channel at regular intervals
+        // This task simply submits update requests following the configured schedule
         let periodic_url_checker = if let Some(url) = config.update_url() {
             let update_url = url.to_string();
-            let update_tx_clone = update_tx.clone();
+            let update_queue_clone = update_queue.clone();
             let service_data_clone = service_data.clone();
+            let schedule = config.update_check_schedule();
 
             Some(tokio::spawn(async move {
-                let notify_clone = service_data_clone.read().await.notify.clone();
-                Self::periodic_url_checker(update_url, update_tx_clone, notify_clone).await
+                let (notify_clone, update_status) = {
+                    let data = service_data_clone.read().await;
+                    (data.notify.clone(), data.update_status.subscribe())
+                };
+                Self::periodic_url_checker(
+                    update_url,
+                    update_queue_clone,
+                    notify_clone,
+                    update_status,
+                    schedule,
+                )
+                .await
             }))
         } else {
             None
         };
 
+        // Answer the peers looking for the archive of the last update
+        let peer_server = peers.map(|peers| {
+            tokio::spawn(async move {
+                if let Err(err) = peers.serve().await {
+                    error!("Stopped sharing update archives with peers: {err}");
+                }
+            })
+        });
+
         Ok(Self {
             config,
             service_data,
             btrfs,
-            update_tx,
+            update_queue,
             update_request_loop,
             periodic_url_checker,
+            peer_server,
         })
     }
 
-    /// Get a sender to submit update requests
-    pub fn update_sender(&self) -> mpsc::Sender<UpdateRequest> {
-        self.update_tx.clone()
+    /// Submit an update request, merged with the request of the same source
+    /// if one is already queued or in progress
+    ///
+    /// Returns the id [`Self::cancel_update_request`] and the request events
+    /// refer to the request with.
+    pub fn submit_update(
+        &self,
+        request: UpdateRequest,
+    ) -> Result<(RequestId, Submission), ServiceError> {
+        self.update_queue.submit(request)
+    }
+
+    /// Subscribe to the start and the end of every update request
+    pub fn subscribe_update_requests(&self) -> broadcast::Receiver<RequestEvent> {
+        self.update_queue.subscribe_events()
+    }
+
+    /// Get the number of update requests waiting for the one in progress
+    pub fn get_update_queue_depth(&self) -> usize {
+        self.update_queue.depth()
+    }
+
+    /// Subscribe to the changes of the update queue depth
+    pub fn subscribe_update_queue_depth(&self) -> watch::Receiver<usize> {
+        self.update_queue.subscribe_depth()
+    }
+
+    /// Find the running deployment: the default subvolume of `rootfs_dir`
+    fn find_boot_info(
+        btrfs: &Btrfs,
+        kernel_boot_id: String,
+        rootfs_dir: &Path,
+        deployments_dir: &Path,
+    ) -> Result<BootInfo, ServiceError> {
+        let boot_id = btrfs.subvolume_get_default(rootfs_dir)?;
+
+        // Find the deployment name that corresponds to this boot_id
+        let boot_name = {
+            let deployments = btrfs.list_deployment_subvolumes(deployments_dir)?;
+            deployments
+                .into_iter()
+                .find(|(_, id, _)| *id == boot_id)
+                .map(|(name, _, _)| name)
+                .ok_or_else(|| {
+                    ServiceError::BtrfsError(format!(
+                        "Could not find deployment for running subvolume ID {boot_id}"
+                    ))
+                })?
+        };
+
+        // Incremental updates are only applied on top of the running deployment
+        let boot_uuid = btrfs
+            .subvolume_parent_uuid(deployments_dir.join(&boot_name))
+            .unwrap_or_else(|err| {
+                warn!("Failed to read the UUID of deployment {boot_name}: {err}");
+                None
+            });
+
+        Ok(BootInfo::new(
+            kernel_boot_id,
+            rootfs_dir.to_path_buf(),
+            boot_id,
+            boot_name,
+            boot_uuid,
+        ))
     }
 
     /// Get the boot deployment subvolume ID
@@ -268,14 +494,46 @@ impl Service {
     /// Get the current update status
     pub async fn get_update_status(&self) -> UpdateStatus {
         let data = self.service_data.read().await;
-        let status = data.update_status.read().await.clone();
+        let mut status = data.update_status.borrow().clone();
+
+        // Notifications are throttled: report the exact progress when asked
+        if let UpdateStatus::Installing { progress, .. } = &mut status {
+            if data.transfer_progress.bytes_read() > 0 {
+                *progress = data.transfer_progress.percentage();
+            }
+        }
+
         status
     }
 
-    /// Get a clone of the update status Arc for monitoring
-    pub async fn update_status_handle(&self) -> Arc<RwLock<UpdateStatus>> {
+    /// Get the bytes read of the update stream being installed and its size, if known
+    pub async fn get_transfer_progress(&self) -> (u64, Option<u64>) {
+        let data = self.service_data.read().await;
+        (
+            data.transfer_progress.bytes_read(),
+            data.transfer_progress.total_size(),
+        )
+    }
+
+    /// Get the stage, byte counters, throughput and ETA of the update pipeline
+    pub async fn get_update_progress(&self) -> UpdateProgress {
+        self.service_data.read().await.transfer_progress.snapshot()
+    }
+
+    /// Get the metrics of the stages of the last update pipeline, indexed by [`PipelineStage`]
+    pub async fn get_pipeline_metrics(&self) -> [StageSnapshot; PIPELINE_STAGES.len()] {
+        self.service_data.read().await.pipeline_metrics.snapshot()
+    }
+
+    /// Subscribe to update progress samples and stage changes
+    pub async fn subscribe_update_progress(&self) -> watch::Receiver<()> {
+        self.service_data.read().await.transfer_progress.subscribe()
+    }
+
+    /// Subscribe to update status changes for monitoring
+    pub async fn subscribe_update_status(&self) -> watch::Receiver<UpdateStatus> {
         let data = self.service_data.read().await;
-        data.update_status.clone()
+        data.update_status.subscribe()
     }
 
     /// Get the pending update awaiting confirmation, if any
@@ -303,7 +561,7 @@ impl Service {
         let data = self.service_data.read().await;
 
         // SECURITY: Validate current status is AwaitingConfirmation
-        let current_status = data.update_status.read().await.clone();
+        let current_status = data.update_status.borrow().clone();
         if !matches!(current_status, UpdateStatus::AwaitingConfirmation { .. }) {
             return Err(ServiceError::IOError(std::io::Error::new(
                 std::io::ErrorKind::InvalidInput,
@@ -326,14 +584,105 @@ impl Service {
         })
     }
 
+    /// Cancel the update being processed
+    ///
+    /// The download, decompression and receive stages are stopped and the
+    /// partially received subvolume is deleted. An update awaiting
+    /// confirmation is rejected. The request ends with a Failed status.
+    pub async fn cancel_update(&self) -> Result<(), ServiceError> {
+        let current_status = self
+            .service_data
+            .read()
+            .await
+            .update_status
+            .borrow()
+            .clone();
+        match current_status {
+            UpdateStatus::AwaitingConfirmation { .. } => self.confirm_update(false).await?,
+            UpdateStatus::Checking | UpdateStatus::Clearing | UpdateStatus::Installing { .. } => {}
+            _ => {
+                return Err(ServiceError::IOError(std::io::Error::new(
+                    std::io::ErrorKind::InvalidInput,
+                    "Cannot cancel: no update is in progress",
+                )))
+            }
+        }
+
+        if let Ok(token) = self.service_data.read().await.cancel_token.lock() {
+            token.cancel();
+        }
+
+        Ok(())
+    }
+
+    /// Cancel the update request `id`
+    ///
+    /// A queued request is dropped without being processed. The request in
+    /// progress is stopped as by [`Self::cancel_update`], while any other is
+    /// left alone. Either way, the request ends with a Failed status.
+    pub async fn cancel_update_request(&self, id: RequestId) -> Result<(), ServiceError> {
+        if self.update_queue.cancel(id)? == Cancellation::Dequeued {
+            return Ok(());
+        }
+
+        // The request is stopping; an update it staged is rejected so its
+        // deployment is deleted
+        let awaiting = matches!(
+            *self.service_data.read().await.update_status.borrow(),
+            UpdateStatus::AwaitingConfirmation { .. }
+        );
+        if awaiting {
+            self.confirm_update(false).await?;
+        }
+
+        Ok(())
+    }
+
+    /// Pause the update being processed
+    ///
+    /// Reads of the update source stop, and with them every stage of the
+    /// pipeline, until the update is resumed or cancelled. A download
+    /// dropped by the server meanwhile is resumed like an interrupted one.
+    ///
+    /// Returns false if the update was already paused.
+    pub async fn pause_update(&self) -> Result<bool, ServiceError> {
+        let data = self.service_data.read().await;
+        let in_progress = matches!(
+            *data.update_status.borrow(),
+            UpdateStatus::Checking
+                | UpdateStatus::Clearing
+                | UpdateStatus::Installing { .. }
+                | UpdateStatus::AwaitingConfirmation { .. }
+        );
+        if !in_progress {
+            return Err(ServiceError::IOError(std::io::Error::new(
+                std::io::ErrorKind::InvalidInput,
+                "Cannot pause: no update is in progress",
+            )));
+        }
+
+        Ok(data.governor.pause())
+    }
+
+    /// Resume the paused update
+    ///
+    /// Returns false if the update was not paused.
+    pub async fn resume_update(&self) -> bool {
+        self.service_data.read().await.governor.resume()
+    }
+
+    pub async fn is_update_paused(&self) -> bool {
+        self.service_data.read().await.governor.is_paused()
+    }
+
     pub async fn terminate_update_check(&mut self) {
         // Signal all tasks to stop
         let data_lock = self.service_data.read().await;
         data_lock.notify.notify_waiters();
         drop(data_lock);
 
-        // Close the update channel to signal the request loop to exit
-        drop(self.update_tx.clone());
+        // Close the update queue to signal the request loop to exit
+        self.update_queue.close();
 
         // Wait for periodic URL checker to finish (if it exists)
         if let Some(checker) = self.periodic_url_checker.take() {
@@ -350,6 +699,13 @@ impl Service {
                 Err(err) => error!("Error terminating update request loop task: {err}"),
             }
         }
+
+        if let Some(peer_server) = self.peer_server.take() {
+            peer_server.abort();
+        }
+
+        // Let the removal of old deployments complete
+        Self::wait_for_cleanup(&self.service_data).await;
     }
 
     /// Clear old deployments, preserving the running and default subvolumes.
@@ -358,7 +714,7 @@ impl Service {
     /// 1. Gets the initial default subvolume ID (currently running deployment)
     /// 2. Gets the current default subvolume ID (for next boot)
     /// 3. Lists all deployment subvolumes
-    /// 4. Deletes all subvolumes EXCEPT:
+    /// 4. Removes in the background all subvolumes EXCEPT:
     ///    - The initial default (currently running - CRITICAL for system stability)
     ///    - The current default (will be active after reboot)
     ///
@@ -366,7 +722,12 @@ impl Service {
     /// If the system hasn't rebooted after an update, the initial default is still
     /// the running system. Deleting it would crash the system and cause data loss!
     ///
-    /// Returns the number of deployments cleared.
+    /// The deployments to remove are selected before returning, so that a
+    /// deployment received later is never part of them. Their removal runs
+    /// overlapped with whatever the service does next, see
+    /// [`Self::remove_deployments`].
+    ///
+    /// Returns the number of deployments scheduled for removal.
     async fn clear_old_deployments(
         data: &Arc<RwLock<ServiceInner>>,
         btrfs: &Arc<Btrfs>,
@@ -389,90 +750,87 @@ impl Service {
         let current_id = btrfs.subvolume_get_default(&rootfs_path)?;
         info!("Current default subvolume ID (next boot): {current_id}");
 
-        // List all deployment subvolumes
-        let deployments = btrfs.list_deployment_subvolumes(&deployments_dir)?;
+        // List all deployment subvolumes, with the manifests they were indexed with
+        let deployments = btrfs.deployments(&deployments_dir)?;
         info!("Found {} deployment subvolumes", deployments.len());
 
-        let mut cleared_count = 0;
+        // Select all deployments except the protected ones
+        let old_deployments: Vec<Deployment> = deployments
+            .into_iter()
+            .filter(|Deployment { name, id, .. }| {
+                // CRITICAL: Protect the initial default (currently running system)
+                if *id == boot_id {
+                    debug!("Preserving RUNNING deployment {name} (ID: {id}): currently mounted! (boot_name: {boot_name})");
+                    return false;
+                }
 
-        // Delete all deployments except the protected ones
-        for (name, id, path) in deployments {
-            // CRITICAL: Protect the initial default (currently running system)
-            if id == boot_id {
-                debug!("Preserving RUNNING deployment {name} (ID: {id}): currently mounted! (boot_name: {boot_name})");
-                continue;
-            }
+                // Protect the current default (for next boot)
+                if *id == current_id {
+                    debug!("Preserving NEXT BOOT deployment {name} (ID={id})");
+                    return false;
+                }
 
-            // Protect the current default (for next boot)
-            if id == current_id {
-                debug!("Preserving NEXT BOOT deployment {name} (ID={id})");
-                continue;
-            }
+                true
+            })
+            .collect();
 
-            // in both the currently running system and the new deployment,
-            // the distro is expected to place the manifest at:
-            // /usr/share/embuer/manifest.json
-            let manifet_installed = path
-                .clone()
-                .join("usr")
-                .join("share")
-                .join("embuer")
-                .join("manifest.json");
+        let count = old_deployments.len();
+        if count == 0 {
+            return Ok(0);
+        }
 
-            if !manifet_installed.exists() || !manifet_installed.is_file() {
-                warn!(
-                    "No manifest found in old deployment at {:?}",
-                    manifet_installed
-                );
-            }
+        // A previous removal still running must not race with this one
+        Self::wait_for_cleanup(data).await;
 
-            debug!("Verifying installed manifest at {:?}", manifet_installed);
-            match crate::manifest::Manifest::from_file(&manifet_installed) {
-                Ok(manifest) => {
-                    // If an uninstall script is specified in the manifest run it now
-                    if let Some(uninstall_script) = manifest.uninstall_script() {
-                        info!("Running install script for the new deployment");
-
-                        let script_path = path.join(uninstall_script);
-                        if script_path.exists()
-                            && script_path.is_file()
-                            && script_path
-                                .metadata()
-                                .map(|m| m.permissions().mode() & 0o100 != 0)
-                                .unwrap_or(false)
-                        {
-                            let mut cmd = Command::new(script_path);
-                            cmd.arg(&rootfs_path);
-                            cmd.arg(&deployments_dir);
-                            cmd.arg(&name);
-
-                            let status = cmd.status().await.map_err(|e| {
-                                ServiceError::IOError(std::io::Error::other(format!(
-                                    "Failed to execute install script: {e}"
-                                )))
-                            })?;
-
-                            if !status.success() {
-                                warn!("Install script exited with non-zero status: {}", status);
-                            } else {
-                                info!("Install script completed successfully");
-                            }
-                        } else {
-                            warn!(
-                                "Uninstall script specified in manifest does not exist or cannot be run: {:?}",
-                                script_path
-                            );
-                        }
-                    }
-                }
+        let job = tokio::spawn(Self::remove_deployments(
+            btrfs.clone(),
+            rootfs_path,
+            deployments_dir,
+            old_deployments,
+        ));
+        *data.read().await.cleanup_job.lock().unwrap() = Some(job);
+
+        Ok(count)
+    }
+
+    /// Run the uninstall scripts of `deployments`, then delete them.
+    ///
+    /// Up to [`UNINSTALL_SCRIPT_CONCURRENCY`] scripts run at the same time.
+    /// Regardless of the outcome of its script, every deployment is then
+    /// deleted in a single batch, committed once. The filesystem reclaims the
+    /// space they used afterwards, in the background.
+    ///
+    /// Returns the number of deployments deleted.
+    async fn remove_deployments(
+        btrfs: Arc<Btrfs>,
+        rootfs_path: std::path::PathBuf,
+        deployments_dir: std::path::PathBuf,
+        deployments: Vec<Deployment>,
+    ) -> usize {
+        futures::StreamExt::for_each_concurrent(
+            futures::stream::iter(&deployments),
+            UNINSTALL_SCRIPT_CONCURRENCY,
+            |deployment| Self::run_uninstall_script(&rootfs_path, &deployments_dir, deployment),
+        )
+        .await;
+
+        for Deployment { name, id, .. } in &deployments {
+            info!("Deleting old deployment {name} (ID: {id})");
+        }
+
+        let paths: Vec<_> = deployments.iter().map(|d| d.path.clone()).collect();
+        let results =
+            match tokio::task::spawn_blocking(move || btrfs.subvolumes_delete(&paths)).await {
+                Ok(results) => results,
                 Err(err) => {
-                    warn!("Failed to read/parse manifest: {err}");
+                    warn!("Failed to delete old deployments: {err}");
+                    return 0;
                 }
             };
 
-            // Regardless of the previous outcome, delete the old deployment
-            info!("Deleting old deployment {name} (ID: {id})");
-            match btrfs.subvolume_delete(&path) {
+        let mut cleared_count = 0;
+        for (Deployment { name, id, .. }, result) in deployments.iter().zip(results) {
+            match result {
                 Ok(_) => {
                     info!("Successfully deleted deployment {name} (ID={id})");
                     cleared_count += 1;
@@ -486,12 +844,133 @@ impl Service {
 
         info!("Cleared {cleared_count} old deployments");
 
-        Ok(cleared_count)
+        cleared_count
+    }
+
+    /// Run the uninstall script of the old `deployment`, if its manifest declares one.
+    ///
+    /// Failures are only logged: the deployment is deleted anyway.
+    async fn run_uninstall_script(
+        rootfs_path: &std::path::Path,
+        deployments_dir: &std::path::Path,
+        deployment: &Deployment,
+    ) {
+        let Deployment {
+            name,
+            path,
+            manifest,
+            ..
+        } = deployment;
+
+        // in both the currently running system and the new deployment,
+        // the distro is expected to place the manifest at:
+        // /usr/share/embuer/manifest.json
+        let Some(manifest) = manifest else {
+            warn!("No valid manifest found in old deployment {name}");
+            return;
+        };
+
+        // If an uninstall script is specified in the manifest run it now
+        let Some(uninstall_script) = manifest.uninstall_script() else {
+            return;
+        };
+
+        info!("Running uninstall script of old deployment {name}");
+
+        let script_path = path.join(uninstall_script);
+        if !(script_path.exists()
+            && script_path.is_file()
+            && script_path
+                .metadata()
+                .map(|m| m.permissions().mode() & 0o100 != 0)
+                .unwrap_or(false))
+        {
+            warn!(
+                "Uninstall script specified in manifest does not exist or cannot be run: {:?}",
+                script_path
+            );
+            return;
+        }
+
+        let mut cmd = Command::new(script_path);
+        cmd.arg(rootfs_path);
+        cmd.arg(deployments_dir);
+        cmd.arg(name);
+
+        match cmd.status().await {
+            Ok(status) if status.success() => {
+                info!("Uninstall script of {name} completed successfully");
+            }
+            Ok(status) => {
+                warn!("Uninstall script of {name} exited with non-zero status: {status}");
+            }
+            Err(e) => {
+                warn!("Failed to execute uninstall script of {name}: {e}");
+            }
+        }
+    }
+
+    /// Wait for the removal of old deployments started by the last update, if any.
+    async fn wait_for_cleanup(data: &Arc<RwLock<ServiceInner>>) {
+        let job = data.read().await.cleanup_job.lock().unwrap().take();
+        if let Some(job) = job {
+            if let Err(err) = job.await {
+                error!("Old deployments removal task join error: {err}");
+            }
+        }
+    }
+
+    /// Make sure the deployments directory has room for an update of `update_size`
+    /// compressed bytes before receiving it.
+    ///
+    /// The removal of old deployments only delays the update when the free
+    /// space is not already enough: in that case it is waited for, reporting
+    /// `UpdateStatus::Clearing` if `report` is set. A receive that runs out of
+    /// space anyway fails on its own, so this never fails the update.
+    async fn wait_for_space(
+        data: &Arc<RwLock<ServiceInner>>,
+        btrfs: &Arc<Btrfs>,
+        update_size: u64,
+        report: bool,
+    ) {
+        let deployments_dir = data.read().await.deployments_dir.clone();
+        let required = update_size.saturating_mul(PAYLOAD_EXPANSION_ESTIMATE);
+
+        let available = match btrfs.available_space(&deployments_dir) {
+            Ok(available) => available,
+            Err(err) => {
+                warn!(
+                    "Failed to read the free space of {:?}: {err}",
+                    deployments_dir
+                );
+                return;
+            }
+        };
+        if available >= required {
+            return;
+        }
+
+        let cleaning = data.read().await.cleanup_job.lock().unwrap().is_some();
+        if cleaning {
+            info!("{available} bytes free, about {required} needed: waiting for old deployments to be removed...");
+            if report {
+                data.read().await.set_status(UpdateStatus::Clearing);
+            }
+            Self::wait_for_cleanup(data).await;
+        }
+
+        match btrfs.available_space(&deployments_dir) {
+            Ok(available) if available < required => {
+                warn!("Only {available} bytes free for an update needing about {required}");
+            }
+            _ => {}
+        }
     }
 
     async fn install_update<R>(
         data: &Arc<RwLock<ServiceInner>>,
         btrfs: &Arc<Btrfs>,
+        options: ReceiveOptions,
         reader: R,
         signature: Vec<u8>,
     ) -> Result<Option<String>, ServiceError>
@@ -515,28 +994,114 @@ impl Service {
             deployments_dir.clone(),
             boot_name.clone(),
             btrfs,
+            options,
             reader,
         )
         .await
     }
 
+    async fn stage_update<R>(
+        data: &Arc<RwLock<ServiceInner>>,
+        btrfs: &Arc<Btrfs>,
+        options: ReceiveOptions,
+        reader: R,
+        signature: Vec<u8>,
+    ) -> Result<StagedDeployment, ServiceError>
+    where
+        R: AsyncRead + Unpin + Send + 'static,
+    {
+        let (pubkey, deployments_dir) = {
+            let data_lck = data.read().await;
+
+            (data_lck.pubkey.clone(), data_lck.deployments_dir.clone())
+        };
+
+        stage_update(
+            Some((&pubkey, &signature)),
+            deployments_dir,
+            btrfs,
+            options,
+            reader,
+        )
+        .await
+    }
+
+    async fn commit_staged_update(
+        data: &Arc<RwLock<ServiceInner>>,
+        btrfs: &Arc<Btrfs>,
+        staged: StagedDeployment,
+    ) -> Result<String, ServiceError> {
+        let (rootfs_dir, deployments_dir, boot_name) = {
+            let data_lck = data.read().await;
+
+            (
+                data_lck.rootfs_dir.clone(),
+                data_lck.deployments_dir.clone(),
+                data_lck.boot_name.clone(),
+            )
+        };
+
+        commit_staged_update(staged, rootfs_dir, deployments_dir, boot_name, btrfs).await
+    }
+
     /// Extract changelog and update stream from URL
     ///
     /// IMPORTANT: The update.btrfs.xz file is NEVER extracted to disk.
     /// Instead, the tar Entry is returned as a streaming AsyncRead that
     /// will be piped directly through xz decompression to btrfs receive.
     /// Only the CHANGELOG (small text file) is read into memory.
+    /// Segmented downloads keep at most `download_buffer_size` bytes in memory.
     ///
-    /// Returns: (changelog, archive)
+    /// With `conditional`, the request carries the validators of the last
+    /// installed archive: an unchanged archive costs a single 304 response.
+    /// Explicit requests leave it unset, so that an archive can be installed
+    /// again after its deployment was rolled back or deleted.
+    /// The UUID of the running deployment, if any, is sent in the
+    /// [`DEPLOYMENT_UUID_HEADER`] header so that the server can offer an
+    /// incremental update against it.
+    ///
+    /// With `peers`, the archive is downloaded from a LAN peer holding the
+    /// same one when there is any, and captured to be shared in turn.
+    ///
+    /// Returns: (archive, validators of the archive)
     async fn extract_url_update_contents(
+        client: Client,
         url: String,
-    ) -> Result<Archive<Box<dyn AsyncRead + Send + Unpin>>, ServiceError> {
-        let client = Client::new();
-        let resp = client
-            .get(&url)
-            .send()
-            .await
-            .map_err(|e| ServiceError::IOError(std::io::Error::other(e)))?;
+        config: &Config,
+        boot_uuid: Option<&str>,
+        conditional: bool,
+        governor: Arc<Governor>,
+        peers: Option<Arc<PeerCache>>,
+        cancel: &CancellationToken,
+    ) -> Result<
+        (
+            Archive<Box<dyn AsyncRead + Send + Unpin>>,
+            Option<ArchiveValidators>,
+        ),
+        ServiceError,
+    > {
+        let mut request = client.get(&url);
+        if let Some(uuid) = boot_uuid {
+            request = request.header(DEPLOYMENT_UUID_HEADER, uuid);
+        }
+        if let Some(installed) = config
+            .last_update_path()
+            .ok()
+            .filter(|_| conditional)
+            .and_then(|path| ArchiveValidators::load(&path, &url))
+        {
+            request = installed.apply(request);
+        }
+
+        let resp = tokio::select! {
+            resp = request.send() => resp.map_err(|e| ServiceError::IOError(std::io::Error::other(e)))?,
+            _ = cancel.cancelled() => return Err(ServiceError::UpdateCancelled),
+        };
+
+        if resp.status() == StatusCode::NOT_MODIFIED {
+            info!("No update available at {url}: the archive was already installed");
+            return Err(ServiceError::NoUpdateAvailable);
+        }
 
         // Check if the response is successful - if not, treat as "no update available"
         if !resp.status().is_success() {
@@ -550,14 +1115,76 @@ impl Service {
         }
 
         info!("Downloading update from {}", url);
+        let validators = ArchiveValidators::from_response(&url, &resp);
         let total_size = resp.content_length();
         total_size.map(|size| info!("Download size: {size} bytes"));
 
-        let byte_stream = resp.bytes_stream().map_err(std::io::Error::other);
-        let stream_reader = StreamReader::new(byte_stream);
+        // The body of the origin is not read when a peer sends the same archive
+        let key = peers
+            .as_ref()
+            .and_then(|_| ArchiveKey::from_response(&url, &resp));
+        let (resp, source_url, peer) = match (&peers, &key) {
+            (Some(peers), Some(key)) => match peers.locate(&client, key, cancel).await {
+                Some(found) => {
+                    info!("Downloading update from peer {}", found.addr);
+                    (found.response, found.url, Some(found.addr))
+                }
+                None => (resp, url.clone(), None),
+            },
+            _ => (resp, url.clone(), None),
+        };
+        let capture = |stream| match (&peers, key) {
+            (Some(peers), Some(key)) => peers.capture(key, peer, stream),
+            _ => stream,
+        };
 
-        Ok(Archive::new(
-            Box::new(stream_reader) as Box<dyn AsyncRead + Send + Unpin>
+        // Split large downloads over several connections when the server
+        // supports ranges; segments are reordered in memory, never on disk
+        let max_retries = config.download_max_retries();
+        let resp = match config.download_connections() {
+            1 => resp,
+            connections => match SegmentedDownload::from_response(
+                client.clone(),
+                source_url.clone(),
+                resp,
+                connections,
+                config.download_buffer_size(),
+                max_retries,
+            ) {
+                Ok(download) => {
+                    let stream_reader = Box::new(CancellableReader::new(
+                        GovernedReader::download(
+                            StreamReader::new(capture(download.into_stream())),
+                            governor,
+                        ),
+                        cancel.clone(),
+                    ));
+                    return Ok((Archive::new(stream_reader), validators));
+                }
+                Err(resp) => {
+                    info!("{url} does not support byte ranges: downloading sequentially");
+                    resp
+                }
+            },
+        };
+
+        // Resume interrupted transfers transparently: the tar parser and the
+        // rest of the pipeline see a single uninterrupted stream
+        let stream_reader: Box<dyn AsyncRead + Send + Unpin> = match max_retries {
+            0 => Box::new(StreamReader::new(capture(futures::StreamExt::boxed(
+                resp.bytes_stream().map_err(std::io::Error::other),
+            )))),
+            _ => Box::new(StreamReader::new(capture(
+                ResumableDownload::new(client, source_url, resp, max_retries).into_stream(),
+            ))),
+        };
+
+        Ok((
+            Archive::new(Box::new(CancellableReader::new(
+                GovernedReader::download(stream_reader, governor),
+                cancel.clone(),
+            ))),
+            validators,
         ))
     }
 
@@ -569,6 +1196,8 @@ impl Service {
     /// Only the CHANGELOG (small text file) is read into memory.
     async fn extract_file_update_contents(
         path: std::path::PathBuf,
+        governor: Arc<Governor>,
+        cancel: &CancellationToken,
     ) -> Result<Archive<Box<dyn AsyncRead + Send + Unpin>>, ServiceError> {
         let file = File::open(&path).await?;
 
@@ -576,9 +1205,134 @@ impl Service {
         let total_size = file.metadata().await.ok().map(|m| m.len());
         total_size.map(|size| info!("File size: {} bytes", size));
 
-        Ok(Archive::new(
-            Box::new(file) as Box<dyn AsyncRead + Send + Unpin>
+        Ok(Archive::new(Box::new(CancellableReader::new(
+            GovernedReader::local(file, governor),
+            cancel.clone(),
         ))
+            as Box<dyn AsyncRead + Send + Unpin>))
+    }
+
+    /// Open the package at `path` and read its index, if it has one
+    async fn open_indexed_package(
+        path: std::path::PathBuf,
+    ) -> Result<Option<(std::fs::File, PackageIndex)>, ServiceError> {
+        tokio::task::spawn_blocking(move || {
+            let file = std::fs::File::open(&path)?;
+            let Some(index) = PackageIndex::read(&file)? else {
+                return Ok(None);
+            };
+            index.check(&file)?;
+
+            info!(
+                "Reading update package {} through its index of {} entries",
+                path.display(),
+                index.entries().len()
+            );
+            Ok(Some((file, index)))
+        })
+        .await?
+    }
+
+    /// Install the update of the indexed package `file`.
+    ///
+    /// The metadata entries are read at their offsets, wherever they are in
+    /// the package, and the payload is streamed from its offset: the payload
+    /// that does not apply (the full image when the incremental stream is
+    /// installed, or the opposite) is never read.
+    async fn process_indexed_package(
+        data: &Arc<RwLock<ServiceInner>>,
+        btrfs: &Arc<Btrfs>,
+        config: &Config,
+        confirmation_rx: &mut mpsc::Receiver<bool>,
+        boot_uuid: Option<String>,
+        file: std::fs::File,
+        index: PackageIndex,
+        governor: Arc<Governor>,
+        source_desc: String,
+        cancel: &CancellationToken,
+    ) -> Result<(), ServiceError> {
+        let mut metadata = {
+            let (file, index) = (file.try_clone()?, index.clone());
+            tokio::task::spawn_blocking(move || {
+                let mut metadata = HashMap::new();
+                for entry in index.entries().iter().filter(|entry| {
+                    METADATA_ENTRIES.contains(&entry.name())
+                        || SIGNED_ENTRIES.contains(&entry.name())
+                }) {
+                    metadata.insert(entry.name().to_string(), entry.read(&file)?);
+                }
+                Ok::<_, ServiceError>(metadata)
+            })
+            .await??
+        };
+
+        let changelog = metadata
+            .remove("CHANGELOG")
+            .map(|content| String::from_utf8_lossy(&content).into_owned());
+        let parent_uuid = metadata
+            .remove("update.parent")
+            .map(|content| String::from_utf8_lossy(&content).trim().to_string());
+        let signature = metadata.remove("update.signature");
+        let delta_signature = metadata.remove("update.delta.signature");
+
+        // The incremental stream replaces the full image when it applies
+        let delta = DELTA_PAYLOAD_ENTRIES
+            .iter()
+            .find_map(|name| index.entry(name))
+            .filter(|_| {
+                parent_uuid.is_some() && parent_uuid == boot_uuid && delta_signature.is_some()
+            });
+        let (payload, signature, chunk_table) = match delta {
+            Some(payload) => {
+                info!("Incremental update available against the running deployment");
+                (payload, delta_signature, "update.delta.chunks")
+            }
+            None => (
+                FULL_PAYLOAD_ENTRIES
+                    .iter()
+                    .find_map(|name| index.entry(name))
+                    .ok_or_else(|| {
+                        ServiceError::IOError(std::io::Error::other(
+                            "update.btrfs.xz not found in archive",
+                        ))
+                    })?,
+                signature,
+                "update.chunks",
+            ),
+        };
+        info!("{} size: {} bytes", payload.name(), payload.size());
+
+        let decompressor = Self::payload_decompressor(
+            data,
+            config,
+            payload.name(),
+            signed_entry(&mut metadata, "update.zstd.dict"),
+        )
+        .await?;
+
+        let mut payload_file = File::from_std(file);
+        payload_file.seek(SeekFrom::Start(payload.offset())).await?;
+        let update_stream = Box::pin(CancellableReader::new(
+            GovernedReader::local(payload_file.take(payload.size()), governor),
+            cancel.clone(),
+        )) as Pin<Box<dyn AsyncRead + Send + Unpin>>;
+
+        Self::process_update_entry(
+            data,
+            btrfs,
+            config.clone(),
+            confirmation_rx,
+            changelog,
+            signature,
+            decompressor,
+            signed_entry(&mut metadata, chunk_table),
+            update_stream,
+            payload.size(),
+            source_desc,
+            None,
+        )
+        .await
+        .map(|_| ())
     }
 
     /// Main update request loop that processes all update requests from the channel.
@@ -586,7 +1340,7 @@ impl Service {
     async fn update_request_loop(
         data: Arc<RwLock<ServiceInner>>,
         btrfs: Arc<Btrfs>,
-        mut update_rx: mpsc::Receiver<UpdateRequest>,
+        update_queue: Arc<UpdateQueue>,
         config: Config,
     ) {
         info!("Update request loop started");
@@ -597,210 +1351,457 @@ impl Service {
             .take()
             .expect("Confirmation receiver should be available");
 
-        'check_req: while let Some(request) = update_rx.recv().await {
-            info!("Processing update request: {:?}", request.source);
+        let boot_uuid = data.read().await.boot_uuid.clone();
 
-            let source_desc = match &request.source {
-                UpdateSource::Url(url) => url.clone(),
-                UpdateSource::File(path) => path.display().to_string(),
-            };
+        while let Some((source, priority, cancel)) = update_queue.next().await {
+            info!("Processing update request: {source:?} ({priority:?})");
 
-            // Update status to Checking (will be set to Installing by ProgressReader when data flows)
-            data.read().await.set_status(UpdateStatus::Checking).await;
-
-            // Prepare the archive object from the source
-            info!("Fetching update archive contents...");
-            let mut archive = match request.source.clone() {
-                UpdateSource::Url(url) => {
-                    match Self::extract_url_update_contents(url).await {
-                        Ok(result) => result,
-                        Err(ServiceError::NoUpdateAvailable) => {
-                            // No update available is not an error, just return to Idle
-                            info!("No update available at {source_desc}");
-                            data.read().await.set_status(UpdateStatus::Idle).await;
-                            continue 'check_req;
-                        }
-                        Err(err) => {
-                            error!("Failed to read update contents from {source_desc}: {err}");
-                            data.read()
-                                .await
-                                .set_status(UpdateStatus::Failed {
-                                    source: source_desc,
-                                    error: err.to_string(),
-                                })
-                                .await;
-                            continue 'check_req;
-                        }
+            let source_desc = source.to_string();
+
+            // A fresh token for every request: cancelling only ever stops the one in flight
+            data.read().await.set_cancel_token(&cancel);
+
+            let request_task = Self::process_update_request(
+                &data,
+                &btrfs,
+                &config,
+                &mut confirmation_rx,
+                boot_uuid.clone(),
+                source,
+                priority,
+                &cancel,
+            );
+            tokio::pin!(request_task);
+
+            tokio::select! {
+                biased;
+                _ = &mut request_task => {}
+                _ = cancel.cancelled() => {
+                    info!("Update from {source_desc} cancelled: stopping the pipeline");
+
+                    // Reads of the archive fail from now on: every stage stops and
+                    // deletes what it received, as for an interrupted download
+                    if tokio::time::timeout(CANCEL_GRACE_PERIOD, &mut request_task)
+                        .await
+                        .is_err()
+                    {
+                        warn!("Update from {source_desc} did not stop in {CANCEL_GRACE_PERIOD:?}: dropping it");
+                    }
+
+                    // The update may have been committed just before the cancellation
+                    let data = data.read().await;
+                    let completed =
+                        matches!(*data.update_status.borrow(), UpdateStatus::Completed { .. });
+                    if !completed {
+                        data.set_status(UpdateStatus::Failed {
+                            source: source_desc,
+                            error: ServiceError::UpdateCancelled.to_string(),
+                        });
                     }
                 }
-                UpdateSource::File(path) => {
-                    match Self::extract_file_update_contents(path.clone()).await {
-                        Ok(result) => result,
-                        Err(err) => {
-                            error!("Failed to read update contents from {source_desc}: {err}");
-                            data.read()
-                                .await
-                                .set_status(UpdateStatus::Failed {
-                                    source: source_desc,
-                                    error: err.to_string(),
-                                })
-                                .await;
-                            continue 'check_req;
+            }
+
+            // An installed archive is shared with the peers, any other is dropped
+            let peers = data.read().await.peers.clone();
+            if let Some(peers) = peers {
+                let (client, status) = {
+                    let data = data.read().await;
+                    (
+                        data.http_client.clone(),
+                        data.update_status.borrow().clone(),
+                    )
+                };
+                let outcome = match status {
+                    UpdateStatus::Completed { .. } => CaptureOutcome::Installed,
+                    UpdateStatus::Failed { .. } if !cancel.is_cancelled() => CaptureOutcome::Failed,
+                    _ => CaptureOutcome::Abandoned,
+                };
+                peers.finish(&client, outcome).await;
+            }
+
+            let data = data.read().await;
+            data.transfer_progress.set_stage(UpdateStage::Idle);
+            // A pause only ever applies to the request it was asked for
+            data.governor.resume();
+            // Every requester attached to the request is told how it ended
+            update_queue.finish(&data.update_status.borrow());
+        }
+
+        info!("Update request loop stopped");
+    }
+
+    /// Fetch the archive of `request` and install the update it contains.
+    ///
+    /// Every outcome is reported through the update status. The archive is
+    /// read through `cancel`, so that cancelling the token stops all stages.
+    /// Only the periodic checks of a URL are conditional requests.
+    async fn process_update_request(
+        data: &Arc<RwLock<ServiceInner>>,
+        btrfs: &Arc<Btrfs>,
+        config: &Config,
+        confirmation_rx: &mut mpsc::Receiver<bool>,
+        boot_uuid: Option<String>,
+        source: UpdateSource,
+        priority: RequestPriority,
+        cancel: &CancellationToken,
+    ) {
+        let source_desc = source.to_string();
+
+        // Update status to Checking (will be set to Installing by ProgressReader when data flows)
+        {
+            let data = data.read().await;
+            data.pipeline_metrics.reset();
+            data.transfer_progress.start_request(match &source {
+                UpdateSource::Url(_) => UpdateStage::Downloading,
+                UpdateSource::File(_) => UpdateStage::Reading,
+            });
+            data.set_status(UpdateStatus::Checking);
+        }
+
+        // Prepare the archive object from the source
+        info!("Fetching update archive contents...");
+        let (mut archive, archive_validators) = match source {
+            UpdateSource::Url(url) => {
+                let (client, governor, peers) = {
+                    let data = data.read().await;
+                    (
+                        data.http_client.clone(),
+                        data.governor.clone(),
+                        data.peers.clone(),
+                    )
+                };
+                match Self::extract_url_update_contents(
+                    client,
+                    url,
+                    config,
+                    boot_uuid.as_deref(),
+                    priority == RequestPriority::Periodic,
+                    governor,
+                    peers,
+                    cancel,
+                )
+                .await
+                {
+                    Ok(result) => result,
+                    Err(ServiceError::NoUpdateAvailable) => {
+                        // No update available is not an error, just return to Idle
+                        info!("No update available at {source_desc}");
+                        data.read().await.set_status(UpdateStatus::Idle);
+                        return;
+                    }
+                    Err(err) => {
+                        error!("Failed to read update contents from {source_desc}: {err}");
+                        data.read().await.set_status(UpdateStatus::Failed {
+                            source: source_desc,
+                            error: err.to_string(),
+                        });
+                        return;
+                    }
+                }
+            }
+            UpdateSource::File(path) => {
+                let governor = data.read().await.governor.clone();
+
+                // Indexed packages are read at the offsets of their entries
+                match Self::open_indexed_package(path.clone()).await {
+                    Ok(Some((file, index))) => {
+                        if let Err(err) = Self::process_indexed_package(
+                            data,
+                            btrfs,
+                            config,
+                            confirmation_rx,
+                            boot_uuid,
+                            file,
+                            index,
+                            governor,
+                            source_desc.clone(),
+                            cancel,
+                        )
+                        .await
+                        {
+                            error!("Failed to install the update from {source_desc}: {err}");
+                            data.read().await.set_status(UpdateStatus::Failed {
+                                source: source_desc,
+                                error: err.to_string(),
+                            });
                         }
+                        return;
+                    }
+                    Ok(None) => {}
+                    Err(err) => {
+                        error!("Failed to read the index of {source_desc}: {err}");
+                        data.read().await.set_status(UpdateStatus::Failed {
+                            source: source_desc,
+                            error: err.to_string(),
+                        });
+                        return;
                     }
                 }
-            };
 
-            // Get the iterator over archive entries (contained files)
-            let Ok(mut entries) = archive
-                .entries()
-                .inspect_err(|err| error!("Failed to read archive entries: {err}"))
-            else {
-                data.read()
-                    .await
-                    .set_status(UpdateStatus::Failed {
-                        source: source_desc,
-                        error: "Failed to read archive entries".to_string(),
-                    })
-                    .await;
-                continue 'check_req;
-            };
+                match Self::extract_file_update_contents(path.clone(), governor, cancel).await {
+                    Ok(result) => (result, None),
+                    Err(err) => {
+                        error!("Failed to read update contents from {source_desc}: {err}");
+                        data.read().await.set_status(UpdateStatus::Failed {
+                            source: source_desc,
+                            error: err.to_string(),
+                        });
+                        return;
+                    }
+                }
+            }
+        };
+
+        // Get the iterator over archive entries (contained files)
+        let Ok(mut entries) = archive
+            .entries()
+            .inspect_err(|err| error!("Failed to read archive entries: {err}"))
+        else {
+            data.read().await.set_status(UpdateStatus::Failed {
+                source: source_desc,
+                error: "Failed to read archive entries".to_string(),
+            });
+            return;
+        };
+
+        // Collect CHANGELOG, update.signature, and process the update.btrfs.{xz,zst} payload
+        // An incremental update.delta.btrfs.xz (signed by update.delta.signature)
+        // replaces the full image when update.parent names the running deployment
+        let mut changelog_content: Option<String> = None;
+        let mut signature_content: Option<Vec<u8>> = None;
+        let mut parent_uuid: Option<String> = None;
+        let mut delta_signature_content: Option<Vec<u8>> = None;
+        // Signed chunk tables and zstd dictionary, by entry name
+        let mut signed_files: HashMap<String, Vec<u8>> = HashMap::new();
+
+        'update: while let Some(file) = entries.next().await {
+            match file {
+                Ok(entry) => {
+                    // Handle the path safely - it might not be valid UTF-8
+                    let path_str = match entry.path() {
+                        Ok(p) => p.display().to_string(),
+                        Err(e) => {
+                            error!("Archive entry has invalid path encoding: {}", e);
+                            continue 'update;
+                        }
+                    };
+                    debug!("Found archive entry: {}", path_str);
+
+                    if path_str == "CHANGELOG" {
+                        debug!("Found CHANGELOG");
+                        let mut content = String::new();
+                        let mut reader = BufReader::new(entry);
+                        if let Err(err) = reader.read_to_string(&mut content).await {
+                            error!("Failed to read CHANGELOG: {}", err);
+                            data.read().await.set_status(UpdateStatus::Failed {
+                                source: source_desc.clone(),
+                                error: format!("Failed to read CHANGELOG: {}", err),
+                            });
+                            return;
+                        }
+                        info!("Read CHANGELOG file: {} bytes", content.len());
+                        changelog_content = Some(content);
+                    } else if path_str == "update.parent" {
+                        debug!("Found update.parent");
+                        let mut content = String::new();
+                        let mut reader = BufReader::new(entry);
+                        if let Err(err) = reader.read_to_string(&mut content).await {
+                            error!("Failed to read update.parent: {}", err);
+                            data.read().await.set_status(UpdateStatus::Failed {
+                                source: source_desc.clone(),
+                                error: format!("Failed to read update.parent: {}", err),
+                            });
+                            return;
+                        }
+                        let content = content.trim().to_string();
+                        info!("Incremental update available against deployment {content}");
+                        parent_uuid = Some(content);
+                    } else if path_str == "update.signature"
+                        || path_str == "update.delta.signature"
+                        || SIGNED_ENTRIES.contains(&path_str.as_str())
+                    {
+                        debug!("Found {path_str}");
+                        let mut content = Vec::new();
+                        let mut reader = BufReader::new(entry);
+                        if let Err(err) = reader.read_to_end(&mut content).await {
+                            error!("Failed to read {path_str}: {}", err);
+                            data.read().await.set_status(UpdateStatus::Failed {
+                                source: source_desc.clone(),
+                                error: format!("Failed to read {path_str}: {}", err),
+                            });
+                            return;
+                        }
+                        info!("Read {path_str} file: {} bytes", content.len());
+                        if content.is_empty() {
+                            error!("{path_str} file is empty");
+                            data.read().await.set_status(UpdateStatus::Failed {
+                                source: source_desc.clone(),
+                                error: format!("{path_str} file is empty"),
+                            });
+                            return;
+                        }
+                        debug!(
+                            "Signature first 20 bytes (hex): {}",
+                            hex::encode(&content[..content.len().min(20)])
+                        );
+                        match path_str.as_str() {
+                            "update.signature" => signature_content = Some(content),
+                            "update.delta.signature" => delta_signature_content = Some(content),
+                            _ => {
+                                signed_files.insert(path_str, content);
+                            }
+                        }
+                    } else if DELTA_PAYLOAD_ENTRIES.contains(&path_str.as_str()) {
+                        debug!("Found {path_str}");
+                        if parent_uuid.is_none() || parent_uuid != boot_uuid {
+                            info!("Incremental update does not apply to the running deployment: skipping it");
+                            continue 'update;
+                        } else if delta_signature_content.is_none() {
+                            warn!("Incremental update is not signed: skipping it");
+                            continue 'update;
+                        }
 
-            // Collect CHANGELOG, update.signature, and process update.btrfs.xz
-            let mut changelog_content: Option<String> = None;
-            let mut signature_content: Option<Vec<u8>> = None;
-
-            'update: while let Some(file) = entries.next().await {
-                match file {
-                    Ok(entry) => {
-                        // Handle the path safely - it might not be valid UTF-8
-                        let path_str = match entry.path() {
-                            Ok(p) => p.display().to_string(),
-                            Err(e) => {
-                                error!("Archive entry has invalid path encoding: {}", e);
-                                continue 'update;
+                        let entry_size = match entry.header().entry_size() {
+                            Ok(sz) => sz,
+                            Err(err) => {
+                                error!("Failed to read entry size: {}", err);
+                                data.read().await.set_status(UpdateStatus::Failed {
+                                    source: source_desc.clone(),
+                                    error: format!("Failed to get {path_str} size: {}", err),
+                                });
+                                return;
                             }
                         };
-                        debug!("Found archive entry: {}", path_str);
-
-                        if path_str == "CHANGELOG" {
-                            debug!("Found CHANGELOG");
-                            let mut content = String::new();
-                            let mut reader = BufReader::new(entry);
-                            if let Err(err) = reader.read_to_string(&mut content).await {
-                                error!("Failed to read CHANGELOG: {}", err);
-                                data.read()
-                                    .await
-                                    .set_status(UpdateStatus::Failed {
-                                        source: source_desc.clone(),
-                                        error: format!("Failed to read CHANGELOG: {}", err),
-                                    })
-                                    .await;
-                                continue 'check_req;
+                        info!("{path_str} size: {entry_size} bytes");
+                        let decompressor = match Self::payload_decompressor(
+                            data,
+                            config,
+                            &path_str,
+                            signed_entry(&mut signed_files, "update.zstd.dict"),
+                        )
+                        .await
+                        {
+                            Ok(decompressor) => decompressor,
+                            Err(err) => {
+                                error!("Cannot decompress {path_str}: {err}");
+                                data.read().await.set_status(UpdateStatus::Failed {
+                                    source: source_desc.clone(),
+                                    error: err.to_string(),
+                                });
+                                return;
                             }
-                            info!("Read CHANGELOG file: {} bytes", content.len());
-                            changelog_content = Some(content);
-                        } else if path_str == "update.signature" {
-                            debug!("Found update.signature");
-                            let mut content = Vec::new();
-                            let mut reader = BufReader::new(entry);
-                            if let Err(err) = reader.read_to_end(&mut content).await {
-                                error!("Failed to read update.signature: {}", err);
-                                data.read()
-                                    .await
-                                    .set_status(UpdateStatus::Failed {
-                                        source: source_desc.clone(),
-                                        error: format!("Failed to read update.signature: {}", err),
-                                    })
-                                    .await;
-                                continue 'check_req;
+                        };
+
+                        // The full image that may follow is not needed anymore:
+                        // the rest of the archive is never downloaded
+                        let update_stream =
+                            Box::pin(entry) as Pin<Box<dyn AsyncRead + Send + Unpin>>;
+                        if let Err(err) = Self::process_update_entry(
+                            data,
+                            btrfs,
+                            config.clone(),
+                            confirmation_rx,
+                            changelog_content.clone(),
+                            delta_signature_content.clone(),
+                            decompressor,
+                            signed_entry(&mut signed_files, "update.delta.chunks"),
+                            update_stream,
+                            entry_size,
+                            source_desc.clone(),
+                            archive_validators.clone(),
+                        )
+                        .await
+                        {
+                            error!("Failed to process {path_str}: {err}");
+                            data.read().await.set_status(UpdateStatus::Failed {
+                                source: source_desc.clone(),
+                                error: err.to_string(),
+                            });
+                        }
+                        return;
+                    } else if FULL_PAYLOAD_ENTRIES.contains(&path_str.as_str()) {
+                        debug!("Found {path_str}");
+                        let header = entry.header();
+                        let entry_size = match header.entry_size() {
+                            Ok(sz) => sz,
+                            Err(err) => {
+                                error!("Failed to read entry size: {}", err);
+                                data.read().await.set_status(UpdateStatus::Failed {
+                                    source: source_desc.clone(),
+                                    error: format!("Failed to get {path_str} size: {}", err),
+                                });
+                                return;
                             }
-                            info!("Read update.signature file: {} bytes", content.len());
-                            if content.is_empty() {
-                                error!("update.signature file is empty");
-                                data.read()
-                                    .await
-                                    .set_status(UpdateStatus::Failed {
-                                        source: source_desc.clone(),
-                                        error: "update.signature file is empty".to_string(),
-                                    })
-                                    .await;
-                                continue 'check_req;
+                        };
+                        info!("{path_str} size: {entry_size} bytes");
+                        let decompressor = match Self::payload_decompressor(
+                            data,
+                            config,
+                            &path_str,
+                            signed_entry(&mut signed_files, "update.zstd.dict"),
+                        )
+                        .await
+                        {
+                            Ok(decompressor) => decompressor,
+                            Err(err) => {
+                                error!("Cannot decompress {path_str}: {err}");
+                                data.read().await.set_status(UpdateStatus::Failed {
+                                    source: source_desc.clone(),
+                                    error: err.to_string(),
+                                });
+                                return;
                             }
-                            debug!(
-                                "Signature first 20 bytes (hex): {}",
-                                hex::encode(&content[..content.len().min(20)])
-                            );
-                            signature_content = Some(content);
-                        } else if path_str == "update.btrfs.xz" {
-                            debug!("Found update.btrfs.xz");
-                            let header = entry.header();
-                            let entry_size = match header.entry_size() {
-                                Ok(sz) => sz,
-                                Err(err) => {
-                                    error!("Failed to read entry size: {}", err);
-                                    data.read()
-                                        .await
-                                        .set_status(UpdateStatus::Failed {
-                                            source: source_desc.clone(),
-                                            error: format!(
-                                                "Failed to get update.btrfs.xz size: {}",
-                                                err
-                                            ),
-                                        })
-                                        .await;
-                                    continue 'check_req;
-                                }
-                            };
-                            info!("update.btrfs.xz size: {entry_size} bytes");
-
-                            // CRITICAL: Process the update stream immediately while the entry is valid
-                            // We must consume the entire stream before moving to the next entry
-                            let update_stream =
-                                Box::pin(entry) as Pin<Box<dyn AsyncRead + Send + Unpin>>;
-
-                            // Process this update entry right now
-                            match Self::process_update_entry(
-                                &data,
-                                &btrfs,
-                                config.clone(),
-                                &mut confirmation_rx,
-                                changelog_content.clone(),
-                                signature_content.clone(),
-                                update_stream,
-                                entry_size,
-                                source_desc.clone(),
-                            )
-                            .await
-                            {
-                                Ok(should_continue) => {
-                                    if !should_continue {
-                                        continue 'check_req;
-                                    }
-                                }
-                                Err(_) => {
-                                    continue 'check_req;
+                        };
+
+                        // CRITICAL: Process the update stream immediately while the entry is valid
+                        // We must consume the entire stream before moving to the next entry
+                        let update_stream =
+                            Box::pin(entry) as Pin<Box<dyn AsyncRead + Send + Unpin>>;
+
+                        // Process this update entry right now
+                        match Self::process_update_entry(
+                            data,
+                            btrfs,
+                            config.clone(),
+                            confirmation_rx,
+                            changelog_content.clone(),
+                            signature_content.clone(),
+                            decompressor,
+                            signed_entry(&mut signed_files, "update.chunks"),
+                            update_stream,
+                            entry_size,
+                            source_desc.clone(),
+                            archive_validators.clone(),
+                        )
+                        .await
+                        {
+                            Ok(should_continue) => {
+                                if !should_continue {
+                                    return;
                                 }
                             }
+                            Err(err) => {
+                                error!("Failed to process {path_str}: {err}");
+                                data.read().await.set_status(UpdateStatus::Failed {
+                                    source: source_desc.clone(),
+                                    error: err.to_string(),
+                                });
+                                return;
+                            }
                         }
-                        // For any other entry, we consume and discard it
-                    }
-                    Err(e) => {
-                        error!("Error reading archive entry: {}", e);
-                        data.read()
-                            .await
-                            .set_status(UpdateStatus::Failed {
-                                source: source_desc.clone(),
-                                error: format!("Corrupted tar archive: {}", e),
-                            })
-                            .await;
-                        continue 'check_req;
                     }
+                    // For any other entry, we consume and discard it
+                }
+                Err(e) => {
+                    error!("Error reading archive entry: {}", e);
+                    data.read().await.set_status(UpdateStatus::Failed {
+                        source: source_desc.clone(),
+                        error: format!("Corrupted tar archive: {}", e),
+                    });
+                    return;
                 }
             }
         }
-
-        info!("Update request loop stopped");
     }
 
     /// Process an update entry from the archive.
@@ -814,9 +1815,12 @@ impl Service {
         confirmation_rx: &mut mpsc::Receiver<bool>,
         changelog_content: Option<String>,
         signature_content: Option<Vec<u8>>,
+        decompressor: Decompressor,
+        chunk_table: Option<(Vec<u8>, Vec<u8>)>,
         update_stream: Pin<Box<dyn AsyncRead + Send + Unpin>>,
         update_size: u64,
         source_desc: String,
+        archive_validators: Option<ArchiveValidators>,
     ) -> Result<bool, ServiceError> {
         // Extract version from changelog for confirmation/details
         let changelog = changelog_content.ok_or_else(|| {
@@ -832,6 +1836,30 @@ impl Service {
 
         let version = extract_version_from_changelog(&changelog);
 
+        // With a signed chunk table the stream is verified chunk by chunk, and
+        // a corrupted download aborts the receive within one chunk
+        let update_stream: Pin<Box<dyn AsyncRead + Send + Unpin>> = match chunk_table {
+            Some((table, table_signature)) => {
+                let pubkey = data.read().await.pubkey.clone();
+                let table = verify_chunk_table(&pubkey, &table, &table_signature)
+                    .and_then(|table| match table.total_size() == update_size {
+                        true => Ok(table),
+                        false => Err(ServiceError::IOError(std::io::Error::other(
+                            "Chunk table does not match the update size",
+                        ))),
+                    })
+                    .inspect_err(|err| {
+                        error!("Invalid chunk table: {err}");
+                    })?;
+                info!(
+                    "Verifying the update stream in chunks of {} bytes",
+                    table.chunk_size()
+                );
+                Box::pin(ChunkVerifyingReader::new(update_stream, table))
+            }
+            None => update_stream,
+        };
+
         // Check if we need user confirmation
         if !config.auto_install_updates() {
             info!("Auto-install disabled, awaiting user confirmation");
@@ -849,8 +1877,23 @@ impl Service {
                 .set_status(UpdateStatus::AwaitingConfirmation {
                     version: version.clone(),
                     source: source_desc.clone(),
-                })
+                });
+
+            if config.prestage_updates() {
+                return Self::prestage_update_entry(
+                    data,
+                    btrfs,
+                    config,
+                    decompressor,
+                    confirmation_rx,
+                    signature,
+                    update_stream,
+                    update_size,
+                    source_desc,
+                    archive_validators,
+                )
                 .await;
+            }
 
             info!("Waiting for user confirmation to install {version}...");
 
@@ -866,73 +1909,305 @@ impl Service {
                     info!("Update rejected by user");
                     // SECURITY: Clear pending update immediately
                     *data.read().await.pending_update.write().await = None;
-                    data.read()
-                        .await
-                        .set_status(UpdateStatus::Failed {
-                            source: source_desc,
-                            error: "Update rejected by user".to_string(),
-                        })
-                        .await;
+                    data.read().await.set_status(UpdateStatus::Failed {
+                        source: source_desc,
+                        error: ServiceError::UpdateRejected.to_string(),
+                    });
                     return Ok(false);
                 }
                 None => {
                     error!("Confirmation channel closed unexpectedly");
                     // SECURITY: Clear pending update on error
                     *data.read().await.pending_update.write().await = None;
-                    data.read()
-                        .await
-                        .set_status(UpdateStatus::Failed {
-                            source: source_desc,
-                            error: "Confirmation channel closed".to_string(),
-                        })
-                        .await;
+                    data.read().await.set_status(UpdateStatus::Failed {
+                        source: source_desc,
+                        error: "Confirmation channel closed".to_string(),
+                    });
                     return Ok(false);
                 }
             }
         }
 
-        // Set status to Installing before wrapping stream so ProgressReader can update progress
-        let status_handle = data.read().await.update_status.clone();
-        {
-            let mut status = status_handle.write().await;
-            debug!(
-                "[PROGRESS] Setting status to Installing with progress 0% (update_size: {})",
-                update_size
-            );
-            *status = UpdateStatus::Installing {
-                source: source_desc.clone(),
-                progress: 0,
-            };
-        }
+        // Wrap the stream (resetting the shared progress) before setting the status
+        // to Installing, so that status queries never see the previous update progress
+        Self::wait_for_space(data, btrfs, update_size, true).await;
+
+        let (status_handle, transfer_progress, pipeline_metrics) = {
+            let data_lck = data.read().await;
+            (
+                data_lck.update_status.clone(),
+                data_lck.transfer_progress.clone(),
+                data_lck.pipeline_metrics.clone(),
+            )
+        };
         let wrapped_stream: Pin<Box<dyn AsyncRead + Send + Unpin>> = {
             debug!(
                 "[PROGRESS] Creating ProgressReader with total_size: {:?}",
                 Some(update_size)
             );
             let progress_reader = ProgressReader::new(
-                update_stream,
+                MeteredReader::new(
+                    update_stream,
+                    pipeline_metrics.clone(),
+                    PipelineStage::Source,
+                ),
                 Some(update_size),
+                transfer_progress.clone(),
                 status_handle.clone(),
                 source_desc.clone(),
             );
             Box::pin(progress_reader)
         };
+        debug!(
+            "[PROGRESS] Setting status to Installing with progress 0% (update_size: {})",
+            update_size
+        );
+        status_handle.send_replace(UpdateStatus::Installing {
+            source: source_desc.clone(),
+            progress: 0,
+        });
 
         // Install using the stream (tar Entry -> xz -d -> btrfs receive)
         // Hash computation now happens inside install_update
         debug!("[PROGRESS] Starting install_update - stream should start being consumed");
-        let result = Self::install_update(data, btrfs, wrapped_stream, signature.clone()).await;
+        let options =
+            Self::receive_options(&config, decompressor, transfer_progress, pipeline_metrics);
+        let result =
+            Self::install_update(data, btrfs, options, wrapped_stream, signature.clone()).await;
+
+        Self::finish_update_entry(
+            data,
+            btrfs,
+            &config,
+            result,
+            source_desc,
+            archive_validators,
+        )
+        .await;
+
+        Ok(true)
+    }
+
+    /// Process an update entry by receiving and verifying it in the background
+    /// while waiting for the user confirmation.
+    ///
+    /// The staged deployment is not the default subvolume until the update is
+    /// accepted, so accepting only commits it and rejecting only deletes it.
+    async fn prestage_update_entry(
+        data: &Arc<RwLock<ServiceInner>>,
+        btrfs: &Arc<Btrfs>,
+        config: Config,
+        decompressor: Decompressor,
+        confirmation_rx: &mut mpsc::Receiver<bool>,
+        signature: Vec<u8>,
+        update_stream: Pin<Box<dyn AsyncRead + Send + Unpin>>,
+        update_size: u64,
+        source_desc: String,
+        archive_validators: Option<ArchiveValidators>,
+    ) -> Result<bool, ServiceError> {
+        // The status stays AwaitingConfirmation while staging: only the shared
+        // progress counter follows the stream
+        Self::wait_for_space(data, btrfs, update_size, false).await;
+
+        let (transfer_progress, pipeline_metrics) = {
+            let data_lck = data.read().await;
+            (
+                data_lck.transfer_progress.clone(),
+                data_lck.pipeline_metrics.clone(),
+            )
+        };
+        // Rejecting the update stops the stream being staged through this token
+        let staging_cancel = CancellationToken::new();
+        let wrapped_stream: Pin<Box<dyn AsyncRead + Send + Unpin>> =
+            Box::pin(CancellableReader::new(
+                ProgressReader::detached(
+                    MeteredReader::new(
+                        update_stream,
+                        pipeline_metrics.clone(),
+                        PipelineStage::Source,
+                    ),
+                    Some(update_size),
+                    transfer_progress.clone(),
+                ),
+                staging_cancel.clone(),
+            ));
+
+        info!("Pre-staging the update while waiting for user confirmation...");
+        let options = Self::receive_options(
+            &config,
+            decompressor,
+            transfer_progress.clone(),
+            pipeline_metrics,
+        );
+        let mut staging = Box::pin(Self::stage_update(
+            data,
+            btrfs,
+            options,
+            wrapped_stream,
+            signature,
+        ));
+
+        let mut staged = None;
+        let decision = loop {
+            tokio::select! {
+                result = &mut staging, if staged.is_none() => match result {
+                    Ok(deployment) => {
+                        info!("Deployment {} staged, waiting for user confirmation", deployment.name);
+                        staged = Some(deployment);
+                    }
+                    Err(err) => {
+                        // SECURITY: Clear pending update, there is nothing left to confirm
+                        *data.read().await.pending_update.write().await = None;
+                        let status = match err {
+                            ServiceError::NoUpdateAvailable => {
+                                info!("No update available from {source_desc}: its deployment is already installed");
+                                UpdateStatus::Idle
+                            }
+                            err => {
+                                error!("Failed to pre-stage update: {}", err);
+                                UpdateStatus::Failed {
+                                    source: source_desc,
+                                    error: err.to_string(),
+                                }
+                            }
+                        };
+                        data.read().await.set_status(status);
+                        return Ok(true);
+                    }
+                },
+                decision = confirmation_rx.recv() => break decision,
+            }
+        };
+
+        // SECURITY: Clear pending update immediately to prevent double-confirmation
+        *data.read().await.pending_update.write().await = None;
+
+        if decision != Some(true) {
+            let error = match decision {
+                Some(_) => {
+                    info!("Update rejected by user");
+                    ServiceError::UpdateRejected.to_string()
+                }
+                None => {
+                    error!("Confirmation channel closed unexpectedly");
+                    "Confirmation channel closed".to_string()
+                }
+            };
+
+            // Nothing of a rejected update is kept, staged or still being staged
+            discard_staged_update(btrfs, &staging_cancel, staging, staged).await;
+
+            data.read().await.set_status(UpdateStatus::Failed {
+                source: source_desc,
+                error,
+            });
+            return Ok(false);
+        }
 
-        // Update final status and clear old deployments only after successful installation
+        info!("Update accepted by user: proceeding...");
+        let staged = match staged {
+            Some(deployment) => Ok(deployment),
+            None => {
+                // Accepted before staging completed: report the remaining progress
+                data.read().await.set_status(UpdateStatus::Installing {
+                    source: source_desc.clone(),
+                    progress: transfer_progress.percentage(),
+                });
+                staging.await
+            }
+        };
+
+        let result = match staged {
+            Ok(deployment) => Self::commit_staged_update(data, btrfs, deployment)
+                .await
+                .map(Some),
+            Err(err) => Err(err),
+        };
+
+        Self::finish_update_entry(
+            data,
+            btrfs,
+            &config,
+            result,
+            source_desc,
+            archive_validators,
+        )
+        .await;
+
+        Ok(true)
+    }
+
+    /// Pick the decoder of the payload entry `entry_name`, checking the
+    /// signature of the zstd dictionary shipped in the archive, if any
+    async fn payload_decompressor(
+        data: &Arc<RwLock<ServiceInner>>,
+        config: &Config,
+        entry_name: &str,
+        zstd_dictionary: Option<(Vec<u8>, Vec<u8>)>,
+    ) -> Result<Decompressor, ServiceError> {
+        let zstd_dictionary = match zstd_dictionary {
+            Some((dictionary, signature)) => {
+                let pubkey = data.read().await.pubkey.clone();
+                verify_data_signature(&pubkey, &dictionary, &signature)?;
+                info!(
+                    "Using the zstd dictionary of the archive: {} bytes",
+                    dictionary.len()
+                );
+                Some(Arc::from(dictionary))
+            }
+            None => None,
+        };
+
+        Decompressor::for_entry(entry_name, config.use_external_xz(), zstd_dictionary).ok_or_else(
+            || {
+                ServiceError::IOError(std::io::Error::other(format!(
+                    "Unsupported compression of {entry_name}"
+                )))
+            },
+        )
+    }
+
+    fn receive_options(
+        config: &Config,
+        decompressor: Decompressor,
+        progress: Arc<TransferProgress>,
+        metrics: Arc<PipelineMetrics>,
+    ) -> ReceiveOptions {
+        ReceiveOptions {
+            decompressor,
+            receiver: match config.native_receiver() {
+                true => Receiver::Native,
+                false => Receiver::BtrfsCli,
+            },
+            hash_thread: config.hash_on_thread(),
+            progress: Some(progress),
+            metrics: Some(metrics),
+            pipe_size: config.pipe_buffer_size(),
+            priority: config.qos().process_priority(),
+        }
+    }
+
+    /// Update the final status of an installation and start clearing old
+    /// deployments only after a successful installation.
+    async fn finish_update_entry(
+        data: &Arc<RwLock<ServiceInner>>,
+        btrfs: &Arc<Btrfs>,
+        config: &Config,
+        result: Result<Option<String>, ServiceError>,
+        source_desc: String,
+        archive_validators: Option<ArchiveValidators>,
+    ) {
         let status = match result {
             Ok(Some(deployment_name)) => {
                 info!("Update installed successfully: {deployment_name}");
 
-                // Clear old deployments after successful installation (only once per update cycle)
-                data.read().await.set_status(UpdateStatus::Clearing).await;
+                Self::save_archive_validators(config, archive_validators);
+
+                // Clear old deployments after successful installation (only once per update cycle):
+                // their removal overlaps with the next update
                 match Self::clear_old_deployments(data, btrfs).await {
                     Ok(count) => {
-                        info!("Cleared {} old deployments", count);
+                        info!("Removing {} old deployments in the background", count);
                     }
                     Err(err) => {
                         warn!("Failed to clear old deployments: {}", err);
@@ -945,6 +2220,14 @@ impl Service {
                     deployment: deployment_name,
                 }
             }
+            Err(ServiceError::NoUpdateAvailable) => {
+                info!(
+                    "No update available from {source_desc}: its deployment is already installed"
+                );
+
+                Self::save_archive_validators(config, archive_validators);
+                UpdateStatus::Idle
+            }
             Ok(None) => {
                 error!("Update installed but deployment name not returned");
                 UpdateStatus::Failed {
@@ -961,52 +2244,114 @@ impl Service {
             }
         };
 
-        data.read().await.set_status(status).await;
+        data.read().await.set_status(status);
+    }
 
-        Ok(true)
+    /// Remember the validators of an installed archive: later checks become
+    /// conditional requests
+    fn save_archive_validators(config: &Config, archive_validators: Option<ArchiveValidators>) {
+        let Some(validators) = archive_validators else {
+            return;
+        };
+
+        let saved = config
+            .last_update_path()
+            .and_then(|path| validators.save(&path).map_err(ServiceError::IOError));
+        if let Err(err) = saved {
+            warn!("Failed to save the validators of the installed archive: {err}");
+        }
     }
 
-    /// Periodic URL checker task that sends update requests to the channel at regular intervals.
+    /// Periodic URL checker task that sends update requests to the channel following `schedule`.
     /// This is a simple task with the sole responsibility of triggering periodic updates.
+    ///
+    /// The next check is only scheduled once the previous request is over, so
+    /// an update awaiting confirmation delays it. Failed checks are retried
+    /// with an increasing delay; cancelled and rejected updates are not failures.
+    ///
+    /// No check is made while `update_status` reports an update installed and
+    /// waiting for a reboot, or waiting for the user confirmation.
     async fn periodic_url_checker(
         update_url: String,
-        update_tx: mpsc::Sender<UpdateRequest>,
+        update_queue: Arc<UpdateQueue>,
         notify: Arc<tokio::sync::Notify>,
+        update_status: watch::Receiver<UpdateStatus>,
+        mut schedule: CheckSchedule,
     ) {
         info!("Periodic URL checker started for {}", update_url);
 
-        let mut update_done = false;
+        let mut delay = Some(schedule.first_delay());
+
+        'check: while let Some(wait) = delay {
+            debug!("Next update check at {update_url} in {wait:?}");
 
-        'check: loop {
             tokio::select! {
                 _ = notify.notified() => {
                     info!("Periodic URL checker received termination signal");
                     break 'check;
                 }
-                _ = tokio::time::sleep(std::time::Duration::from_millis(500)) => {
-                    // Skip if update already done
-                    if update_done {
-                        continue 'check;
-                    }
+                _ = tokio::time::sleep(wait) => {}
+            }
+
+            let pending = matches!(
+                *update_status.borrow(),
+                UpdateStatus::Completed { .. } | UpdateStatus::AwaitingConfirmation { .. }
+            );
+            if pending {
+                info!("Skipping the update check at {update_url}: an update is pending");
+                delay = schedule.next_delay();
+                continue 'check;
+            }
 
-                    info!("Checking for updates at {update_url}");
+            info!("Checking for updates at {update_url}");
 
-                    // Send update request to the channel
-                    let request = UpdateRequest {
-                        source: UpdateSource::Url(update_url.clone()),
-                    };
+            // Submit the update request, a request for the same URL is waited for instead
+            let (outcome_tx, outcome_rx) = oneshot::channel();
+            let request = UpdateRequest {
+                source: UpdateSource::Url(update_url.clone()),
+                priority: RequestPriority::Periodic,
+                outcome: Some(outcome_tx),
+            };
 
-                    match update_tx.send(request).await {
-                        Ok(_) => {
-                            info!("Periodic update request sent");
-                            update_done = true;
-                        }
-                        Err(err) => {
-                            error!("Failed to send periodic update request: {}", err);
-                            break 'check;
-                        }
-                    }
+            match update_queue.submit(request) {
+                Ok((id, submission)) => {
+                    info!("Periodic update request {id} submitted: {submission:?}")
                 }
+                Err(err) => {
+                    error!("Failed to submit periodic update request: {}", err);
+                    break 'check;
+                }
+            }
+
+            let outcome = tokio::select! {
+                _ = notify.notified() => {
+                    info!("Periodic URL checker received termination signal");
+                    break 'check;
+                }
+                outcome = outcome_rx => outcome,
+            };
+
+            match outcome {
+                Ok(UpdateStatus::Failed { error, .. })
+                    if error != ServiceError::UpdateCancelled.to_string()
+                        && error != ServiceError::UpdateRejected.to_string() =>
+                {
+                    schedule.record(false);
+                    warn!(
+                        "Update check at {update_url} failed ({} in a row): {error}",
+                        schedule.failures()
+                    );
+                }
+                Ok(_) => schedule.record(true),
+                Err(_) => {
+                    error!("Update request loop stopped before completing the check");
+                    break 'check;
+                }
+            }
+
+            delay = schedule.next_delay();
+            if delay.is_none() {
+                info!("No further update checks scheduled for {update_url}");
             }
         }
 
@@ -0,0 +1,183 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Zero-copy forwarding between pipes
+//!
+//! When both ends of a copy are pipes, such as the stdout of `xz -d` and the
+//! stdin of `btrfs receive`, splice(2) moves the pages from one pipe to the
+//! other inside the kernel: the data is never copied to a user-space buffer,
+//! and every call moves as much as the pipe holds instead of a few KiB.
+
+use std::fs::File;
+use std::io::{self, Read, Write};
+use std::os::fd::{AsFd, AsRawFd, OwnedFd};
+
+/// Default size requested for the pipes between the update stages, the
+/// largest an unprivileged process may set with the default `pipe-max-size`
+pub const DEFAULT_PIPE_BUFFER_SIZE: usize = 1024 * 1024;
+
+/// Bytes moved by a single splice(2) call at most
+const SPLICE_CHUNK_SIZE: usize = 1024 * 1024;
+
+/// Size of the buffer of the read/write fallback
+const COPY_BUFFER_SIZE: usize = 128 * 1024;
+
+/// Resize the pipe `fd` to hold `size` bytes with `F_SETPIPE_SZ`.
+///
+/// Returns the size actually set, which the kernel rounds up to a power of
+/// two pages. Sizes above `/proc/sys/fs/pipe-max-size` need CAP_SYS_RESOURCE.
+pub fn set_pipe_size<F: AsFd>(fd: &F, size: usize) -> io::Result<usize> {
+    let size = libc::c_int::try_from(size)
+        .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "pipe size too large"))?;
+
+    let ret = unsafe { libc::fcntl(fd.as_fd().as_raw_fd(), libc::F_SETPIPE_SZ, size) };
+    match ret {
+        -1 => Err(io::Error::last_os_error()),
+        set => Ok(set as usize),
+    }
+}
+
+/// Forward `input` to `output` until EOF, returning the number of bytes moved.
+///
+/// Both descriptors must be in blocking mode: this is meant to run on a
+/// blocking thread. The data is spliced in the kernel when both ends are
+/// pipes, and copied through a user-space buffer otherwise, or when the
+/// kernel refuses to splice them.
+pub fn splice_all(input: &OwnedFd, output: &OwnedFd) -> io::Result<u64> {
+    let mut total: u64 = 0;
+
+    loop {
+        let ret = unsafe {
+            libc::splice(
+                input.as_raw_fd(),
+                std::ptr::null_mut(),
+                output.as_raw_fd(),
+                std::ptr::null_mut(),
+                SPLICE_CHUNK_SIZE,
+                libc::SPLICE_F_MOVE,
+            )
+        };
+
+        match ret {
+            0 => return Ok(total),
+            n if n > 0 => total += n as u64,
+            _ => {
+                let err = io::Error::last_os_error();
+                match err.raw_os_error() {
+                    Some(libc::EINTR) => continue,
+                    // Nothing was spliced so far: not a pipe, or not supported
+                    Some(libc::EINVAL) | Some(libc::ENOSYS) if total == 0 => {
+                        return copy_all(input, output);
+                    }
+                    _ => return Err(err),
+                }
+            }
+        }
+    }
+}
+
+/// Portable fallback of [`splice_all`]
+fn copy_all(input: &OwnedFd, output: &OwnedFd) -> io::Result<u64> {
+    let mut input = File::from(input.try_clone()?);
+    let mut output = File::from(output.try_clone()?);
+
+    let mut buffer = vec![0u8; COPY_BUFFER_SIZE];
+    let mut total: u64 = 0;
+    loop {
+        let n = match input.read(&mut buffer) {
+            Ok(0) => return Ok(total),
+            Ok(n) => n,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        };
+        output.write_all(&buffer[..n])?;
+        total += n as u64;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::{Seek, SeekFrom};
+    use std::os::fd::FromRawFd;
+
+    fn pipe() -> (OwnedFd, OwnedFd) {
+        let mut fds = [0; 2];
+        assert_eq!(unsafe { libc::pipe(fds.as_mut_ptr()) }, 0);
+        unsafe { (OwnedFd::from_raw_fd(fds[0]), OwnedFd::from_raw_fd(fds[1])) }
+    }
+
+    #[test]
+    fn test_splice_pipes() {
+        let data: Vec<u8> = (0..3 * SPLICE_CHUNK_SIZE + 17)
+            .map(|i| (i % 251) as u8)
+            .collect();
+
+        let (source_read, source_write) = pipe();
+        let (sink_read, sink_write) = pipe();
+
+        let writer = {
+            let data = data.clone();
+            std::thread::spawn(move || File::from(source_write).write_all(&data).unwrap())
+        };
+        let reader = std::thread::spawn(move || {
+            let mut received = Vec::new();
+            File::from(sink_read).read_to_end(&mut received).unwrap();
+            received
+        });
+
+        let moved = splice_all(&source_read, &sink_write).unwrap();
+        drop(sink_write);
+        writer.join().unwrap();
+
+        assert_eq!(moved, data.len() as u64);
+        assert_eq!(reader.join().unwrap(), data);
+    }
+
+    #[test]
+    fn test_copy_fallback() {
+        // Neither end is a pipe: splice(2) fails and the data is copied
+        let mut source = tempfile::tempfile().unwrap();
+        source.write_all(b"not a pipe").unwrap();
+        source.seek(SeekFrom::Start(0)).unwrap();
+        let mut sink = tempfile::tempfile().unwrap();
+
+        let moved = splice_all(
+            &OwnedFd::from(source.try_clone().unwrap()),
+            &OwnedFd::from(sink.try_clone().unwrap()),
+        )
+        .unwrap();
+        assert_eq!(moved, 10);
+
+        let mut received = Vec::new();
+        sink.seek(SeekFrom::Start(0)).unwrap();
+        sink.read_to_end(&mut received).unwrap();
+        assert_eq!(received, b"not a pipe");
+    }
+
+    #[test]
+    fn test_set_pipe_size() {
+        let (_read, write) = pipe();
+        let size = set_pipe_size(&write, 256 * 1024).unwrap();
+        assert!(size >= 256 * 1024);
+
+        let file = tempfile::tempfile().unwrap();
+        assert!(set_pipe_size(&file, 256 * 1024).is_err());
+    }
+}
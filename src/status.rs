@@ -75,3 +75,64 @@ impl UpdateStatus {
         }
     }
 }
+
+/// Stage of the update pipeline, as reported by [`UpdateProgress`]
+///
+/// The discriminants are part of the D-Bus and C interfaces.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+#[repr(u8)]
+pub enum UpdateStage {
+    /// No update in progress
+    #[default]
+    Idle = 0,
+    /// Fetching the update archive and its metadata
+    Checking = 1,
+    /// Streaming the payload from the network through the decompressor
+    Downloading = 2,
+    /// Streaming the payload from a local file through the decompressor
+    Reading = 3,
+    /// The payload was read: the receiver is applying the rest of the stream
+    Receiving = 4,
+    /// Checking the received deployment and committing it
+    Verifying = 5,
+}
+
+impl UpdateStage {
+    pub fn from_u8(value: u8) -> Self {
+        match value {
+            1 => UpdateStage::Checking,
+            2 => UpdateStage::Downloading,
+            3 => UpdateStage::Reading,
+            4 => UpdateStage::Receiving,
+            5 => UpdateStage::Verifying,
+            _ => UpdateStage::Idle,
+        }
+    }
+
+    pub fn as_str(&self) -> &str {
+        match self {
+            UpdateStage::Idle => "Idle",
+            UpdateStage::Checking => "Checking",
+            UpdateStage::Downloading => "Downloading",
+            UpdateStage::Reading => "Reading",
+            UpdateStage::Receiving => "Receiving",
+            UpdateStage::Verifying => "Verifying",
+        }
+    }
+}
+
+/// Byte-accurate progress of the update pipeline
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct UpdateProgress {
+    pub stage: UpdateStage,
+    /// Bytes of the payload read so far
+    pub bytes_done: u64,
+    /// Size of the payload, 0 if unknown
+    pub bytes_total: u64,
+    /// Throughput over the last sampling interval, in bytes per second
+    pub rate: u64,
+    /// Throughput since the payload started streaming, in bytes per second
+    pub average_rate: u64,
+    /// Estimated seconds until the payload is read, -1 if unknown
+    pub eta_seconds: i64,
+}
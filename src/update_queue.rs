@@ -0,0 +1,541 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//! Queue of the update requests waiting for the update request loop
+//!
+//! Requests are processed one at a time. A request for a source already
+//! queued is merged into the queued one, and a request for the source being
+//! processed is attached to it: every requester is told the status the single
+//! operation ended with, and an update is never downloaded twice in a row.
+//! Requests of users are processed before the periodic checks queued earlier.
+//!
+//! Every request is identified by the id returned on submission: merged
+//! requests share the id of the request they were merged into.
+
+use std::collections::VecDeque;
+use std::sync::Mutex;
+
+use tokio::sync::{broadcast, oneshot, watch, Notify};
+use tokio_util::sync::CancellationToken;
+
+use crate::status::UpdateStatus;
+use crate::ServiceError;
+
+/// Requests waiting to be processed, not counting the one in progress
+pub const UPDATE_QUEUE_CAPACITY: usize = 10;
+
+/// Request events kept for the subscribers that have not received them yet
+const REQUEST_EVENTS_CAPACITY: usize = 16;
+
+/// Identifier of a submitted request, never reused by a queue
+pub type RequestId = u64;
+
+/// Represents the source of an update
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum UpdateSource {
+    /// Update from a URL
+    Url(String),
+    /// Update from a file path
+    File(std::path::PathBuf),
+}
+
+impl std::fmt::Display for UpdateSource {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            UpdateSource::Url(url) => write!(f, "{url}"),
+            UpdateSource::File(path) => write!(f, "{}", path.display()),
+        }
+    }
+}
+
+/// Who asked for an update, from the least to the most urgent
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum RequestPriority {
+    /// A check of the configured update URL
+    Periodic,
+    /// An explicit request from a user or an application
+    User,
+}
+
+/// A request to install an update
+#[derive(Debug)]
+pub struct UpdateRequest {
+    pub source: UpdateSource,
+    pub priority: RequestPriority,
+    /// Receives the status the request ended with, once it has been processed
+    pub outcome: Option<oneshot::Sender<UpdateStatus>>,
+}
+
+/// What became of a submitted request
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Submission {
+    /// Queued, with this many requests to be processed before it
+    Queued(usize),
+    /// Merged into the request queued for the same source
+    Coalesced,
+    /// Attached to the request of the same source being processed
+    InProgress,
+}
+
+/// What became of a cancelled request
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Cancellation {
+    /// Removed from the queue before being processed
+    Dequeued,
+    /// Being processed: it ends once its pipeline is stopped
+    InProgress,
+}
+
+/// A change of the state of a request
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum RequestEvent {
+    /// The request is being processed
+    Started(RequestId),
+    /// The request ended with this status, or was cancelled while queued
+    Finished(RequestId, UpdateStatus),
+}
+
+/// A request taken from the queue, with every requester waiting for it
+#[derive(Debug)]
+struct Entry {
+    id: RequestId,
+    source: UpdateSource,
+    priority: RequestPriority,
+    outcomes: Vec<oneshot::Sender<UpdateStatus>>,
+    /// Stops the request once it is in progress
+    cancel: CancellationToken,
+}
+
+#[derive(Debug, Default)]
+struct State {
+    queued: VecDeque<Entry>,
+    in_flight: Option<Entry>,
+    last_id: RequestId,
+    closed: bool,
+}
+
+/// Prioritized queue of update requests, merging the requests of a same source
+#[derive(Debug)]
+pub struct UpdateQueue {
+    state: Mutex<State>,
+    notify: Notify,
+    /// Number of requests waiting, sent whenever it changes
+    depth: watch::Sender<usize>,
+    events: broadcast::Sender<RequestEvent>,
+}
+
+impl Default for UpdateQueue {
+    fn default() -> Self {
+        Self {
+            state: Mutex::default(),
+            notify: Notify::new(),
+            depth: watch::Sender::new(0),
+            events: broadcast::Sender::new(REQUEST_EVENTS_CAPACITY),
+        }
+    }
+}
+
+impl UpdateQueue {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Queue `request`, unless a request for the same source is already
+    /// queued or in progress: the requester is then told its outcome.
+    ///
+    /// Returns the id of the request, shared with the request it was merged into.
+    pub fn submit(&self, request: UpdateRequest) -> Result<(RequestId, Submission), ServiceError> {
+        let UpdateRequest {
+            source,
+            priority,
+            outcome,
+        } = request;
+
+        let mut state = self.state.lock().unwrap();
+        if state.closed {
+            return Err(ServiceError::IOError(std::io::Error::other(
+                "The update request loop is stopped",
+            )));
+        }
+
+        if let Some(in_flight) = state.in_flight.as_mut().filter(|e| e.source == source) {
+            in_flight.outcomes.extend(outcome);
+            return Ok((in_flight.id, Submission::InProgress));
+        }
+
+        if let Some(index) = state.queued.iter().position(|e| e.source == source) {
+            let mut entry = state.queued.remove(index).unwrap();
+            let id = entry.id;
+            entry.outcomes.extend(outcome);
+            entry.priority = entry.priority.max(priority);
+            Self::insert(&mut state.queued, entry);
+            return Ok((id, Submission::Coalesced));
+        }
+
+        if state.queued.len() >= UPDATE_QUEUE_CAPACITY {
+            return Err(ServiceError::IOError(std::io::Error::other(format!(
+                "Too many update requests waiting ({UPDATE_QUEUE_CAPACITY})"
+            ))));
+        }
+
+        state.last_id += 1;
+        let id = state.last_id;
+        let position = Self::insert(
+            &mut state.queued,
+            Entry {
+                id,
+                source,
+                priority,
+                outcomes: outcome.into_iter().collect(),
+                cancel: CancellationToken::new(),
+            },
+        );
+        self.depth.send_replace(state.queued.len());
+        drop(state);
+
+        self.notify.notify_one();
+        Ok((id, Submission::Queued(position)))
+    }
+
+    /// Insert `entry` after every entry of the same or a higher priority,
+    /// returning its position
+    fn insert(queued: &mut VecDeque<Entry>, entry: Entry) -> usize {
+        let position = queued
+            .iter()
+            .position(|e| e.priority < entry.priority)
+            .unwrap_or(queued.len());
+        queued.insert(position, entry);
+        position
+    }
+
+    /// Wait for the most urgent request and mark it in progress, until the
+    /// queue is closed
+    ///
+    /// The request is returned with the token [`Self::cancel`] cancels it
+    /// with. The request in progress must be ended with [`Self::finish`] first.
+    pub async fn next(&self) -> Option<(UpdateSource, RequestPriority, CancellationToken)> {
+        loop {
+            let notified = self.notify.notified();
+            {
+                let mut state = self.state.lock().unwrap();
+                if state.closed {
+                    return None;
+                }
+
+                if let Some(entry) = state.queued.pop_front() {
+                    let request = (entry.source.clone(), entry.priority, entry.cancel.clone());
+                    // Nobody may be subscribed
+                    let _ = self.events.send(RequestEvent::Started(entry.id));
+                    state.in_flight = Some(entry);
+                    self.depth.send_replace(state.queued.len());
+                    return Some(request);
+                }
+            }
+            notified.await;
+        }
+    }
+
+    /// End the request in progress, telling `status` to all its requesters
+    pub fn finish(&self, status: &UpdateStatus) {
+        let in_flight = self.state.lock().unwrap().in_flight.take();
+        if let Some(entry) = in_flight {
+            self.end(entry, status);
+        }
+    }
+
+    /// Tell `status` to the requesters and the subscribers of `entry`
+    fn end(&self, entry: Entry, status: &UpdateStatus) {
+        for outcome in entry.outcomes {
+            // The requester may have stopped waiting
+            let _ = outcome.send(status.clone());
+        }
+        let _ = self
+            .events
+            .send(RequestEvent::Finished(entry.id, status.clone()));
+    }
+
+    /// Cancel the request `id`
+    ///
+    /// A queued request is removed and ends with a Failed status right away.
+    /// The token of a request in progress is cancelled: the update request
+    /// loop stops its pipeline, then ends it with [`Self::finish`].
+    pub fn cancel(&self, id: RequestId) -> Result<Cancellation, ServiceError> {
+        let mut state = self.state.lock().unwrap();
+        if let Some(in_flight) = state.in_flight.as_ref().filter(|e| e.id == id) {
+            in_flight.cancel.cancel();
+            return Ok(Cancellation::InProgress);
+        }
+
+        let Some(index) = state.queued.iter().position(|e| e.id == id) else {
+            return Err(ServiceError::IOError(std::io::Error::new(
+                std::io::ErrorKind::InvalidInput,
+                format!("No update request {id} is queued or in progress"),
+            )));
+        };
+        let entry = state.queued.remove(index).unwrap();
+        self.depth.send_replace(state.queued.len());
+        drop(state);
+
+        let status = UpdateStatus::Failed {
+            source: entry.source.to_string(),
+            error: ServiceError::UpdateCancelled.to_string(),
+        };
+        self.end(entry, &status);
+        Ok(Cancellation::Dequeued)
+    }
+
+    /// Subscribe to the start and the end of every request
+    pub fn subscribe_events(&self) -> broadcast::Receiver<RequestEvent> {
+        self.events.subscribe()
+    }
+
+    /// Number of requests waiting, not counting the one in progress
+    pub fn depth(&self) -> usize {
+        self.state.lock().unwrap().queued.len()
+    }
+
+    /// Subscribe to the changes of [`Self::depth`]
+    pub fn subscribe_depth(&self) -> watch::Receiver<usize> {
+        self.depth.subscribe()
+    }
+
+    /// Stop accepting requests and let [`Self::next`] return `None`
+    ///
+    /// The requesters of the queued requests are told nothing: their outcome
+    /// channel is closed.
+    pub fn close(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.closed = true;
+        state.queued.clear();
+        self.depth.send_replace(0);
+        drop(state);
+
+        self.notify.notify_waiters();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn request(url: &str, priority: RequestPriority) -> UpdateRequest {
+        UpdateRequest {
+            source: UpdateSource::Url(url.to_string()),
+            priority,
+            outcome: None,
+        }
+    }
+
+    fn url(url: &str) -> UpdateSource {
+        UpdateSource::Url(url.to_string())
+    }
+
+    async fn next(queue: &UpdateQueue) -> (UpdateSource, RequestPriority) {
+        let (source, priority, _) = queue.next().await.unwrap();
+        (source, priority)
+    }
+
+    #[tokio::test]
+    async fn test_user_requests_come_first() {
+        let queue = UpdateQueue::new();
+        assert_eq!(
+            queue
+                .submit(request("a", RequestPriority::Periodic))
+                .unwrap(),
+            (1, Submission::Queued(0))
+        );
+        assert_eq!(
+            queue.submit(request("b", RequestPriority::User)).unwrap(),
+            (2, Submission::Queued(0))
+        );
+        assert_eq!(
+            queue.submit(request("c", RequestPriority::User)).unwrap(),
+            (3, Submission::Queued(1))
+        );
+        assert_eq!(queue.depth(), 3);
+
+        for expected in ["b", "c", "a"] {
+            assert_eq!(queue.next().await.unwrap().0, url(expected));
+            queue.finish(&UpdateStatus::Idle);
+        }
+        assert_eq!(queue.depth(), 0);
+    }
+
+    #[tokio::test]
+    async fn test_coalesce_queued_requests() {
+        let queue = UpdateQueue::new();
+        let (first_tx, first_rx) = oneshot::channel();
+        let (second_tx, second_rx) = oneshot::channel();
+        queue.submit(request("b", RequestPriority::User)).unwrap();
+        queue
+            .submit(UpdateRequest {
+                outcome: Some(first_tx),
+                ..request("a", RequestPriority::Periodic)
+            })
+            .unwrap();
+
+        // The user request for the same source raises the queued one
+        assert_eq!(
+            queue
+                .submit(UpdateRequest {
+                    outcome: Some(second_tx),
+                    ..request("a", RequestPriority::User)
+                })
+                .unwrap(),
+            (2, Submission::Coalesced)
+        );
+        assert_eq!(queue.depth(), 2);
+
+        assert_eq!(next(&queue).await, (url("b"), RequestPriority::User));
+        queue.finish(&UpdateStatus::Idle);
+        assert_eq!(next(&queue).await, (url("a"), RequestPriority::User));
+        queue.finish(&UpdateStatus::Checking);
+
+        assert_eq!(first_rx.await.unwrap(), UpdateStatus::Checking);
+        assert_eq!(second_rx.await.unwrap(), UpdateStatus::Checking);
+    }
+
+    #[tokio::test]
+    async fn test_attach_to_request_in_progress() {
+        let queue = UpdateQueue::new();
+        queue
+            .submit(request("a", RequestPriority::Periodic))
+            .unwrap();
+        assert_eq!(queue.next().await.unwrap().0, url("a"));
+
+        let (outcome_tx, outcome_rx) = oneshot::channel();
+        assert_eq!(
+            queue
+                .submit(UpdateRequest {
+                    outcome: Some(outcome_tx),
+                    ..request("a", RequestPriority::User)
+                })
+                .unwrap(),
+            (1, Submission::InProgress)
+        );
+        assert_eq!(queue.depth(), 0);
+
+        queue.finish(&UpdateStatus::Clearing);
+        assert_eq!(outcome_rx.await.unwrap(), UpdateStatus::Clearing);
+
+        // Once over, the same source is downloaded again, as a new request
+        assert_eq!(
+            queue.submit(request("a", RequestPriority::User)).unwrap(),
+            (2, Submission::Queued(0))
+        );
+    }
+
+    #[tokio::test]
+    async fn test_cancel_by_id() {
+        let queue = UpdateQueue::new();
+        let mut events = queue.subscribe_events();
+        let (first, _) = queue.submit(request("a", RequestPriority::User)).unwrap();
+        let (outcome_tx, outcome_rx) = oneshot::channel();
+        let (second, _) = queue
+            .submit(UpdateRequest {
+                outcome: Some(outcome_tx),
+                ..request("b", RequestPriority::User)
+            })
+            .unwrap();
+
+        let (_, _, cancel) = queue.next().await.unwrap();
+        assert_eq!(events.recv().await.unwrap(), RequestEvent::Started(first));
+
+        // A queued request ends right away, the others are left alone
+        assert_eq!(queue.cancel(second).unwrap(), Cancellation::Dequeued);
+        let cancelled = UpdateStatus::Failed {
+            source: "b".to_string(),
+            error: ServiceError::UpdateCancelled.to_string(),
+        };
+        assert_eq!(outcome_rx.await.unwrap(), cancelled);
+        assert_eq!(
+            events.recv().await.unwrap(),
+            RequestEvent::Finished(second, cancelled)
+        );
+        assert_eq!(queue.depth(), 0);
+        assert!(!cancel.is_cancelled());
+        assert!(queue.cancel(second).is_err());
+
+        // The request in progress is only told to stop
+        assert_eq!(queue.cancel(first).unwrap(), Cancellation::InProgress);
+        assert!(cancel.is_cancelled());
+        queue.finish(&UpdateStatus::Idle);
+        assert_eq!(
+            events.recv().await.unwrap(),
+            RequestEvent::Finished(first, UpdateStatus::Idle)
+        );
+        assert!(queue.cancel(first).is_err());
+    }
+
+    #[tokio::test]
+    async fn test_depth_changes_are_sent() {
+        let queue = UpdateQueue::new();
+        let mut depth_rx = queue.subscribe_depth();
+
+        queue.submit(request("a", RequestPriority::User)).unwrap();
+        assert!(depth_rx.has_changed().unwrap());
+        assert_eq!(*depth_rx.borrow_and_update(), 1);
+
+        // A coalesced request does not change the depth
+        queue.submit(request("a", RequestPriority::User)).unwrap();
+        assert!(!depth_rx.has_changed().unwrap());
+
+        queue.next().await.unwrap();
+        assert_eq!(*depth_rx.borrow_and_update(), 0);
+
+        queue.submit(request("b", RequestPriority::User)).unwrap();
+        queue.close();
+        assert_eq!(*depth_rx.borrow_and_update(), 0);
+    }
+
+    #[tokio::test]
+    async fn test_capacity_and_close() {
+        let queue = std::sync::Arc::new(UpdateQueue::new());
+        for i in 0..UPDATE_QUEUE_CAPACITY {
+            queue
+                .submit(request(&i.to_string(), RequestPriority::Periodic))
+                .unwrap();
+        }
+        assert!(queue
+            .submit(request("full", RequestPriority::User))
+            .is_err());
+
+        let (outcome_tx, outcome_rx) = oneshot::channel();
+        queue.close();
+        assert!(queue
+            .submit(UpdateRequest {
+                outcome: Some(outcome_tx),
+                ..request("late", RequestPriority::User)
+            })
+            .is_err());
+        assert!(outcome_rx.await.is_err());
+        assert!(queue.next().await.is_none());
+        assert_eq!(queue.depth(), 0);
+
+        // A waiting loop is woken up by the close
+        let queue = std::sync::Arc::new(UpdateQueue::new());
+        let waiting = tokio::spawn({
+            let queue = queue.clone();
+            async move { queue.next().await }
+        });
+        tokio::task::yield_now().await;
+        queue.close();
+        assert!(waiting.await.unwrap().is_none());
+    }
+}
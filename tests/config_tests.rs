@@ -44,4 +44,147 @@ fn parse_config_no_updates() {
     let cfg = Config::new(json).expect("should parse config");
     assert!(cfg.update_url().is_none());
     assert!(!cfg.auto_install_updates());
+    assert!(!cfg.native_receiver());
+}
+
+#[test]
+fn parse_config_download_retries() {
+    let json = r#"{
+        "auto_install_updates": false
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert_eq!(
+        cfg.download_max_retries(),
+        embuer::download::DEFAULT_DOWNLOAD_MAX_RETRIES
+    );
+
+    let json = r#"{
+        "auto_install_updates": false,
+        "download_max_retries": 0
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert_eq!(cfg.download_max_retries(), 0);
+}
+
+#[test]
+fn parse_config_prestage_updates() {
+    let json = r#"{
+        "auto_install_updates": false
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert!(!cfg.prestage_updates());
+
+    let json = r#"{
+        "auto_install_updates": false,
+        "prestage_updates": true
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert!(cfg.prestage_updates());
+}
+
+#[test]
+fn parse_config_update_check_schedule() {
+    use std::time::Duration;
+
+    let json = r#"{
+        "auto_install_updates": false
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert_eq!(cfg.update_check_schedule().interval(), None);
+
+    let json = r#"{
+        "auto_install_updates": false,
+        "update_check_interval": 3600,
+        "update_check_jitter": 0
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    let schedule = cfg.update_check_schedule();
+    assert_eq!(schedule.interval(), Some(Duration::from_secs(3600)));
+    assert_eq!(schedule.next_delay(), Some(Duration::from_secs(3600)));
+
+    let json = r#"{
+        "auto_install_updates": false,
+        "update_check_interval": 0
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert_eq!(cfg.update_check_schedule().next_delay(), None);
+}
+
+#[test]
+fn parse_config_qos() {
+    let json = r#"{
+        "auto_install_updates": false
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert_eq!(cfg.qos().download_limit(), None);
+    assert_eq!(cfg.qos().process_priority(), Default::default());
+
+    let json = r#"{
+        "auto_install_updates": false,
+        "qos": {
+            "download_rate": 1048576,
+            "nice": 10,
+            "io_class": "idle",
+            "cgroup": "/sys/fs/cgroup/embuer.slice"
+        }
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert_eq!(cfg.qos().download_limit(), Some((1048576, 1048576)));
+    assert_ne!(cfg.qos().process_priority(), Default::default());
+
+    let json = r#"{
+        "auto_install_updates": false,
+        "qos": { "io_class": "lowest" }
+    }"#;
+
+    assert!(Config::new(json).is_err());
+}
+
+#[test]
+fn parse_config_peer_cache() {
+    use embuer::peer::{DEFAULT_PEER_GROUP, DEFAULT_PEER_PORT};
+    use std::time::Duration;
+
+    let json = r#"{
+        "auto_install_updates": false
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    assert!(!cfg.peer_cache().enabled());
+    assert_eq!(cfg.peer_cache().port(), DEFAULT_PEER_PORT);
+    assert_eq!(cfg.peer_cache().group(), DEFAULT_PEER_GROUP);
+    assert_eq!(cfg.peer_cache().address(), None);
+
+    let json = r#"{
+        "auto_install_updates": false,
+        "peer_cache": {
+            "enabled": true,
+            "port": 8000,
+            "group": "239.255.1.2",
+            "max_uploads": 0,
+            "discovery_timeout": 1000,
+            "address": "192.168.1.10"
+        }
+    }"#;
+
+    let cfg = Config::new(json).expect("should parse config");
+    let peers = cfg.peer_cache();
+    assert!(peers.enabled());
+    assert_eq!(peers.port(), 8000);
+    assert_eq!(peers.group(), std::net::Ipv4Addr::new(239, 255, 1, 2));
+    assert_eq!(peers.max_uploads(), 1);
+    assert_eq!(peers.discovery_timeout(), Duration::from_secs(1));
+    assert_eq!(
+        peers.address(),
+        Some(std::net::Ipv4Addr::new(192, 168, 1, 10))
+    );
 }
@@ -0,0 +1,208 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+use embuer::download::{ResumableDownload, SegmentedDownload};
+use reqwest::Client;
+use tokio::io::{AsyncBufReadExt, AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::net::{TcpListener, TcpStream};
+use tokio_util::io::StreamReader;
+
+/// Read an HTTP request head and return it lowercased
+async fn read_request(stream: &mut TcpStream) -> String {
+    let mut reader = BufReader::new(stream);
+    let mut request = String::new();
+    loop {
+        let mut line = String::new();
+        reader.read_line(&mut line).await.unwrap();
+        if line == "\r\n" || line.is_empty() {
+            break;
+        }
+        request.push_str(&line.to_lowercase());
+    }
+    request
+}
+
+/// Serve `data` with ETag "v1" dropping the connection after `cut` bytes,
+/// then answer the resume request as the resource tagged `etag`.
+///
+/// Returns the head of the resume request.
+async fn serve_flaky(listener: TcpListener, data: Vec<u8>, cut: usize, etag: &str) -> String {
+    let (mut conn, _) = listener.accept().await.unwrap();
+    read_request(&mut conn).await;
+    let head = format!(
+        "HTTP/1.1 200 OK\r\nContent-Length: {}\r\nETag: \"v1\"\r\nConnection: close\r\n\r\n",
+        data.len()
+    );
+    conn.write_all(head.as_bytes()).await.unwrap();
+    conn.write_all(&data[..cut]).await.unwrap();
+    drop(conn);
+
+    let (mut conn, _) = listener.accept().await.unwrap();
+    let request = read_request(&mut conn).await;
+    if etag == "\"v1\"" {
+        let head = format!(
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: {}\r\nContent-Range: bytes {}-{}/{}\r\nETag: {etag}\r\nConnection: close\r\n\r\n",
+            data.len() - cut,
+            cut,
+            data.len() - 1,
+            data.len()
+        );
+        conn.write_all(head.as_bytes()).await.unwrap();
+        conn.write_all(&data[cut..]).await.unwrap();
+    } else {
+        let head = format!(
+            "HTTP/1.1 200 OK\r\nContent-Length: {}\r\nETag: {etag}\r\nConnection: close\r\n\r\n",
+            data.len()
+        );
+        conn.write_all(head.as_bytes()).await.unwrap();
+        conn.write_all(&data).await.unwrap();
+    }
+
+    request
+}
+
+async fn download_all(url: String) -> std::io::Result<Vec<u8>> {
+    let client = Client::new();
+    let response = client.get(&url).send().await.unwrap();
+    let download = ResumableDownload::new(client, url, response, 3);
+
+    let mut reader = StreamReader::new(download.into_stream());
+    let mut received = Vec::new();
+    reader.read_to_end(&mut received).await?;
+    Ok(received)
+}
+
+#[tokio::test]
+async fn test_download_resumes_after_connection_drop() {
+    let data: Vec<u8> = (0..256 * 1024).map(|i| (i % 251) as u8).collect();
+    let cut = 100_000;
+
+    let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+    let url = format!("http://{}/update.tar", listener.local_addr().unwrap());
+    let server = tokio::spawn(serve_flaky(listener, data.clone(), cut, "\"v1\""));
+
+    let received = download_all(url).await.unwrap();
+    assert_eq!(
+        received, data,
+        "Reconnection should be invisible to the reader"
+    );
+
+    let resume_request = server.await.unwrap();
+    assert!(resume_request.contains(&format!("range: bytes={cut}-")));
+    assert!(resume_request.contains("if-range: \"v1\""));
+}
+
+#[tokio::test]
+async fn test_download_fails_if_resource_changed() {
+    let data: Vec<u8> = (0..64 * 1024).map(|i| (i % 251) as u8).collect();
+
+    let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+    let url = format!("http://{}/update.tar", listener.local_addr().unwrap());
+    tokio::spawn(serve_flaky(listener, data, 10_000, "\"v2\""));
+
+    assert!(
+        download_all(url).await.is_err(),
+        "A changed resource must not be spliced into the stream"
+    );
+}
+
+/// Serve `data` with range support, for as many connections as needed
+async fn serve_ranges(listener: TcpListener, data: Vec<u8>) {
+    let data = std::sync::Arc::new(data);
+    loop {
+        let (mut conn, _) = listener.accept().await.unwrap();
+        let data = data.clone();
+        tokio::spawn(async move {
+            let request = read_request(&mut conn).await;
+            let range = request
+                .lines()
+                .find_map(|line| line.strip_prefix("range: bytes="))
+                .and_then(|range| range.trim().split_once('-'))
+                .map(|(first, last)| {
+                    let first: usize = first.parse().unwrap();
+                    let last: usize = last.parse().unwrap_or(data.len() - 1);
+                    (first, last.min(data.len() - 1))
+                });
+
+            let (head, body) = match range {
+                Some((first, last)) => (
+                    format!(
+                        "HTTP/1.1 206 Partial Content\r\nContent-Length: {}\r\nContent-Range: bytes {first}-{last}/{}\r\nETag: \"v1\"\r\nConnection: close\r\n\r\n",
+                        last + 1 - first,
+                        data.len()
+                    ),
+                    &data[first..=last],
+                ),
+                None => (
+                    format!(
+                        "HTTP/1.1 200 OK\r\nContent-Length: {}\r\nAccept-Ranges: bytes\r\nETag: \"v1\"\r\nConnection: close\r\n\r\n",
+                        data.len()
+                    ),
+                    &data[..],
+                ),
+            };
+
+            // The client may drop the probe response without reading it
+            let _ = conn.write_all(head.as_bytes()).await;
+            let _ = conn.write_all(body).await;
+        });
+    }
+}
+
+#[tokio::test]
+async fn test_segmented_download_is_ordered() {
+    // Not a multiple of the segment size, to exercise the last short range
+    let data: Vec<u8> = (0..3 * 1024 * 1024 + 12345)
+        .map(|i| (i % 251) as u8)
+        .collect();
+
+    let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+    let url = format!("http://{}/update.tar", listener.local_addr().unwrap());
+    tokio::spawn(serve_ranges(listener, data.clone()));
+
+    let client = Client::new();
+    let response = client.get(&url).send().await.unwrap();
+    let Ok(download) = SegmentedDownload::from_response(client, url, response, 4, 1024 * 1024, 3)
+    else {
+        panic!("The server supports ranges");
+    };
+    assert_eq!(download.total_size(), data.len() as u64);
+
+    let mut reader = StreamReader::new(download.into_stream());
+    let mut received = Vec::new();
+    reader.read_to_end(&mut received).await.unwrap();
+    assert!(received == data, "Segments should be reassembled in order");
+}
+
+#[tokio::test]
+async fn test_segmented_download_requires_ranges() {
+    let data: Vec<u8> = vec![0u8; 1024];
+
+    let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+    let url = format!("http://{}/update.tar", listener.local_addr().unwrap());
+    // The first response of serve_flaky has no Accept-Ranges header
+    tokio::spawn(serve_flaky(listener, data, 1024, "\"v1\""));
+
+    let client = Client::new();
+    let response = client.get(&url).send().await.unwrap();
+    assert!(
+        SegmentedDownload::from_response(client, url, response, 4, 1024 * 1024, 3).is_err(),
+        "Servers without range support need the sequential download"
+    );
+}
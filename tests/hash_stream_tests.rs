@@ -256,3 +256,57 @@ async fn test_hashing_reader_different_data() {
         "Different data should produce different hashes"
     );
 }
+
+#[tokio::test]
+async fn test_hashing_reader_hash_thread() {
+    // Create 1MB of data
+    let data: Vec<u8> = (0..1024 * 1024).map(|i| (i % 251) as u8).collect();
+    let expected_hash = compute_hash_direct(&data);
+
+    let reader = std::io::Cursor::new(&data);
+    // A short queue makes reads wait for the hashing thread
+    let mut hashing_reader = HashingReader::with_hash_thread(reader, 2);
+    let hash_result = hashing_reader.hash_result();
+
+    // Read in small chunks to simulate streaming
+    let mut buffer = vec![0u8; 4096];
+    let mut total_read = 0;
+    loop {
+        let n = hashing_reader.read(&mut buffer).await.unwrap();
+        if n == 0 {
+            break;
+        }
+        total_read += n;
+    }
+
+    assert_eq!(total_read, data.len(), "Should read all data");
+
+    // The hash must be available as soon as EOF is observed
+    let hash = hash_result.read().await.clone();
+    assert!(hash.is_some(), "Hash should be computed");
+    assert_eq!(
+        hash.as_ref().unwrap(),
+        &expected_hash,
+        "Hash should match direct computation"
+    );
+}
+
+#[tokio::test]
+async fn test_hashing_reader_hash_thread_get_hash() {
+    let data = b"Test data hashed on a dedicated thread";
+    let expected_hash = compute_hash_direct(data);
+
+    let reader = std::io::Cursor::new(data);
+    let mut hashing_reader = HashingReader::with_hash_thread(reader, 16);
+
+    let mut buffer = Vec::new();
+    let mut async_reader = BufReader::new(&mut hashing_reader);
+    async_reader.read_to_end(&mut buffer).await.unwrap();
+
+    assert_eq!(buffer, data, "Data should pass through unchanged");
+    assert_eq!(
+        hashing_reader.get_hash().await.as_deref(),
+        Some(expected_hash.as_str()),
+        "Hash should match direct computation"
+    );
+}
@@ -0,0 +1,169 @@
+/*
+    embuer: an embedded software updater DBUS daemon and CLI interface
+    Copyright (C) 2025  Denis Benato
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+use std::os::unix::fs::PermissionsExt;
+use std::path::Path;
+use std::sync::Arc;
+use std::time::Duration;
+
+use async_compression::tokio::bufread::ZstdEncoder;
+use embuer::btrfs::Btrfs;
+use embuer::cancel_stream::CancellableReader;
+use embuer::core::{discard_staged_update, stage_update, Decompressor, ReceiveOptions, Receiver};
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio_util::sync::CancellationToken;
+
+/// Stand-in for the btrfs tool: receives by creating the subvolume directory
+/// and reading the whole stream, deletes by removing the directory
+const FAKE_BTRFS: &str = r#"#!/bin/sh
+case "$1" in
+    --version) echo "btrfs-progs v6.6" ;;
+    receive) mkdir "$2/deployment-2" && echo "At subvol deployment-2" >&2 && cat > /dev/null ;;
+    subvolume) [ "$2" = delete ] && rm -rf "$3" ;;
+esac
+"#;
+
+/// Raw crc32c, as used by the btrfs send stream
+fn crc32c(mut crc: u32, data: &[u8]) -> u32 {
+    for byte in data {
+        crc ^= *byte as u32;
+        for _ in 0..8 {
+            crc = match crc & 1 {
+                0 => crc >> 1,
+                _ => (crc >> 1) ^ 0x82F6_3B78,
+            };
+        }
+    }
+    crc
+}
+
+fn encode_command(cmd: u16, attrs: &[(u16, &[u8])]) -> Vec<u8> {
+    let mut payload = Vec::new();
+    for (ty, value) in attrs {
+        payload.extend_from_slice(&ty.to_le_bytes());
+        payload.extend_from_slice(&(value.len() as u16).to_le_bytes());
+        payload.extend_from_slice(value);
+    }
+
+    let mut command = Vec::new();
+    command.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+    command.extend_from_slice(&cmd.to_le_bytes());
+    command.extend_from_slice(&0u32.to_le_bytes());
+    let crc = crc32c(crc32c(0, &command), &payload);
+    command[6..].copy_from_slice(&crc.to_le_bytes());
+
+    command.extend_from_slice(&payload);
+    command
+}
+
+/// A zstd-compressed send stream creating `deployment-2`, followed by
+/// incompressible data read by the receiver
+async fn compressed_send_stream() -> Vec<u8> {
+    let mut stream = Vec::new();
+    stream.extend_from_slice(b"btrfs-stream\0");
+    stream.extend_from_slice(&1u32.to_le_bytes());
+    stream.extend(encode_command(
+        1, // SUBVOL
+        &[
+            (15, b"deployment-2"),
+            (1, &[0x22; 16]),
+            (2, &1u64.to_le_bytes()),
+        ],
+    ));
+
+    let mut state = 0x2545_f491_4f6c_dd1du64;
+    stream.extend((0..4 * 1024 * 1024).map(|_| {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        state as u8
+    }));
+
+    let mut compressed = Vec::new();
+    ZstdEncoder::new(stream.as_slice())
+        .read_to_end(&mut compressed)
+        .await
+        .unwrap();
+    compressed
+}
+
+fn install_fake_btrfs(dir: &Path) {
+    let path = dir.join("btrfs");
+    std::fs::write(&path, FAKE_BTRFS).unwrap();
+    std::fs::set_permissions(&path, std::fs::Permissions::from_mode(0o755)).unwrap();
+
+    let search_path = std::env::var("PATH").unwrap_or_default();
+    std::env::set_var("PATH", format!("{}:{search_path}", dir.display()));
+}
+
+#[tokio::test]
+async fn rejecting_mid_stage_deletes_the_btrfs_receive_subvolume() {
+    let tools = tempfile::tempdir().unwrap();
+    install_fake_btrfs(tools.path());
+    let deployments = tempfile::tempdir().unwrap();
+    let partial = deployments.path().join("deployment-2");
+
+    // Half of the payload arrives, the rest never does
+    let compressed = compressed_send_stream().await;
+    let (mut source, reader) = tokio::io::duplex(64 * 1024);
+    let feeder = tokio::spawn(async move {
+        source
+            .write_all(&compressed[..compressed.len() / 2])
+            .await
+            .unwrap();
+        std::future::pending::<()>().await;
+    });
+
+    let btrfs = Arc::new(Btrfs::lazy());
+    let cancel = CancellationToken::new();
+    let options = ReceiveOptions {
+        decompressor: Decompressor::Zstd(None),
+        receiver: Receiver::BtrfsCli,
+        ..Default::default()
+    };
+    let mut staging = Box::pin(stage_update(
+        None,
+        deployments.path().to_path_buf(),
+        &btrfs,
+        options,
+        CancellableReader::new(reader, cancel.clone()),
+    ));
+
+    // Reject once btrfs receive created the subvolume
+    tokio::time::timeout(Duration::from_secs(10), async {
+        while !partial.exists() {
+            tokio::select! {
+                result = &mut staging => panic!("staging ended before the rejection: {result:?}"),
+                _ = tokio::time::sleep(Duration::from_millis(10)) => {}
+            }
+        }
+    })
+    .await
+    .expect("btrfs receive should create the subvolume");
+
+    tokio::time::timeout(
+        Duration::from_secs(10),
+        discard_staged_update(&btrfs, &cancel, staging, None),
+    )
+    .await
+    .expect("the rejected staging should stop");
+
+    assert!(!partial.exists(), "the partial subvolume should be deleted");
+    feeder.abort();
+}